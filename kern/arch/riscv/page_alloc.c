@@ -28,6 +28,12 @@ void base_arena_init(struct multiboot_info *mbi)
 
 	base_arena = arena_builder(base_pg, "base", PGSIZE, NULL, NULL, NULL,
 	                           0);
+	base_arenas[0] = base_arena;
 	arena_add(base_arena, KADDR(first_free_page),
 	          first_invalid_page - first_free_page, MEM_WAIT);
 }
+
+/* No NUMA on riscv yet; base_arena_init() already added all of memory. */
+void numa_arenas_init(void)
+{
+}
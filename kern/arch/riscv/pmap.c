@@ -133,6 +133,17 @@ int arch_max_jumbo_page_shift(void)
 	return PGSHIFT;
 }
 
+/* No jumbos, so the mm code never asks for these. */
+int map_user_jumbo(pgdir_t pgdir, uintptr_t va, physaddr_t pa, int perm)
+{
+	return -ENOSYS;
+}
+
+int split_user_jumbo(pgdir_t pgdir, uintptr_t va)
+{
+	return 0;
+}
+
 #warning "Not sure where you do your PT destruction.  Be sure to not unmap any intermediate page tables for kernel mappings.  At least not the PML(n-1) maps"
 
 void arch_add_intermediate_pts(pgdir_t pgdir, uintptr_t va, size_t len)
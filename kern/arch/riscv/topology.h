@@ -8,3 +8,8 @@
  * riscv. */
 static void topology_init(void) {}
 static void print_cpu_topology(void) {}
+
+static inline int core_numa_id(int coreid)
+{
+	return 0;
+}
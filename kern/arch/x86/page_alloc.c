@@ -8,6 +8,43 @@
 #include <kmalloc.h>
 #include <multiboot.h>
 #include <arena.h>
+#include <acpi.h>
+#include <arch/topology.h>
+
+/* We don't know the NUMA layout until after acpiinit(), so during pmem_init()
+ * we only give base_arena enough memory to boot (BOOT_BASE_AMT), and stash the
+ * rest of the free regions until numa_arenas_init(). */
+#define BOOT_BASE_AMT		(256 * 1024 * 1024)
+#define NR_BOOT_REGIONS		64
+
+static struct boot_region {
+	physaddr_t					start;
+	size_t						len;
+} boot_regions[NR_BOOT_REGIONS];
+static int nr_boot_regions;
+static size_t boot_base_amt;
+
+/* Helper.  Adds [start, start + len) to base_arena, up to our boot budget, and
+ * saves anything beyond that for later. */
+static void add_free_region(physaddr_t start, size_t len)
+{
+	size_t amt = MIN(len, BOOT_BASE_AMT - boot_base_amt);
+
+	/* If we run out of slots, we just won't be NUMA-aware for the rest. */
+	if (nr_boot_regions == NR_BOOT_REGIONS)
+		amt = len;
+	if (amt) {
+		arena_add(base_arena, KADDR(start), amt, MEM_WAIT);
+		boot_base_amt += amt;
+		start += amt;
+		len -= amt;
+	}
+	if (!len)
+		return;
+	boot_regions[nr_boot_regions].start = start;
+	boot_regions[nr_boot_regions].len = len;
+	nr_boot_regions++;
+}
 
 /* Helper.  Adds free entries to the base arena.  Most entries are page aligned,
  * though on some machines below EXTPHYSMEM we may have some that aren't. */
@@ -53,7 +90,7 @@ static void parse_mboot_region(struct multiboot_mmap_entry *entry, void *data)
 	len = ROUNDDOWN(len, PGSIZE);
 	if (!len)
 		return;
-	arena_add(base_arena, KADDR(start), len, MEM_WAIT);
+	add_free_region(start, len);
 }
 
 /* Since we can't parse multiboot mmap entries, we need to just guess at what
@@ -90,8 +127,7 @@ static void account_for_pages(physaddr_t boot_freemem_paddr)
 	physaddr_t start_of_free_2;
 
 	printk("Warning: poor memory detection (qemu?).  May lose 1GB of RAM\n");
-	arena_add(base_arena, KADDR(top_of_busy), top_of_free_1 - top_of_busy,
-	          MEM_WAIT);
+	add_free_region(top_of_busy, top_of_free_1 - top_of_busy);
 	/* If max_paddr is less than the start of our potential second free mem
 	 * region, we can just leave.  We also don't want to poke around the pages
 	 * array either (and accidentally run off the end of the array).
@@ -100,8 +136,7 @@ static void account_for_pages(physaddr_t boot_freemem_paddr)
 	start_of_free_2 = 0x0000000100000000;
 	if (max_paddr < start_of_free_2)
 		return;
-	arena_add(base_arena, KADDR(start_of_free_2), max_paddr - start_of_free_2,
-	          MEM_WAIT);
+	add_free_region(start_of_free_2, max_paddr - start_of_free_2);
 }
 
 /* Initialize base arena based on available free memory.  After this, do not use
@@ -129,6 +164,7 @@ void base_arena_init(struct multiboot_info *mbi)
 	base_pg = boot_alloc(PGSIZE, PGSHIFT);
 	base_arena = arena_builder(base_pg, "base", PGSIZE, NULL, NULL, NULL,
 	                           0);
+	base_arenas[0] = base_arena;
 	boot_freemem_paddr = PADDR(ROUNDUP(boot_freemem, PGSIZE));
 	if (mboot_has_mmaps(mbi)) {
 		mboot_foreach_mmap(mbi, parse_mboot_region, (void*)boot_freemem_paddr);
@@ -137,3 +173,64 @@ void base_arena_init(struct multiboot_info *mbi)
 		account_for_pages(boot_freemem_paddr);
 	}
 }
+
+/* Helper.  Finds the SRAT memory affinity entry containing paddr.  If there is
+ * none, returns 0 and sets *next to the start of the next entry above paddr (or
+ * to the max physaddr, if there are no more). */
+static struct Srat *find_srat_mem(physaddr_t paddr, physaddr_t *next)
+{
+	struct Srat *sr;
+
+	*next = (physaddr_t)-1;
+	if (!srat)
+		return 0;
+	for (int i = 0; i < srat->nchildren; i++) {
+		sr = srat->children[i]->tbl;
+		if (!sr || sr->type != SRmem)
+			continue;
+		if (sr->mem.addr <= paddr && paddr < sr->mem.addr + sr->mem.len)
+			return sr;
+		if (paddr < sr->mem.addr)
+			*next = MIN(*next, sr->mem.addr);
+	}
+	return 0;
+}
+
+/* Gives the memory we held back in base_arena_init() to the base arenas of the
+ * NUMA nodes that own it, according to the SRAT.  Memory that the SRAT doesn't
+ * cover, or that belongs to a domain without cores, goes to node 0, as does
+ * all of it if there is no SRAT.  Call this after topology_init(). */
+void numa_arenas_init(void)
+{
+	physaddr_t start, end, piece_end, next;
+	struct Srat *sr;
+	int node;
+
+	for (int i = 0; i < nr_boot_regions; i++) {
+		start = boot_regions[i].start;
+		end = start + boot_regions[i].len;
+		while (start < end) {
+			sr = find_srat_mem(start, &next);
+			if (sr) {
+				piece_end = MIN(end, sr->mem.addr + sr->mem.len);
+				node = numa_domain_to_id(sr->mem.dom);
+			} else {
+				piece_end = MIN(end, next);
+				node = 0;
+			}
+			if (node < 0 || node >= ARENA_MAX_NODES)
+				node = 0;
+			/* SRAT entries should be page aligned, but just in case */
+			piece_end = MAX(ROUNDDOWN(piece_end, PGSIZE), start + PGSIZE);
+			piece_end = MIN(piece_end, end);
+			numa_add_memory(node, KADDR(start), piece_end - start);
+			start = piece_end;
+		}
+	}
+	nr_boot_regions = 0;
+	for (int i = 0; i < nr_arena_nodes; i++) {
+		if (base_arenas[i])
+			printk("NUMA node %d arena total mem: %lu\n", i,
+			       arena_amt_total(base_arenas[i]));
+	}
+}
@@ -397,6 +397,51 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Maps a user jumbo page (PML2) at va, which must be aligned.  We only map a
+ * jumbo where there is nothing at all, including an empty page table, since we
+ * can't free a page table that the TLB might still be caching. */
+int map_user_jumbo(pgdir_t pgdir, uintptr_t va, physaddr_t pa, int perm)
+{
+	kpte_t *kpte;
+
+	assert(!(va & (PML2_PTE_REACH - 1)) && !(pa & (PML2_PTE_REACH - 1)));
+	assert(va < ULIM);
+	kpte = pml_walk(pgdir_get_kpt(pgdir), va, PG_WALK_CREATE | PML2_SHIFT);
+	if (!kpte)
+		return -ENOMEM;
+	if (*kpte)
+		return -EEXIST;
+	pte_write(kpte, pa, perm | PTE_PS);
+	return 0;
+}
+
+/* Replaces the user jumbo page mapped at va, if any, with a PML1 page table
+ * that maps the same memory with the same settings.  Since the translations
+ * don't change, the caller can flush the TLB whenever it gets around to it. */
+int split_user_jumbo(pgdir_t pgdir, uintptr_t va)
+{
+	kpte_t *kpte, *pml1;
+	epte_t *epte;
+	physaddr_t pa;
+	int settings;
+
+	kpte = pml_walk(pgdir_get_kpt(pgdir), va, PML2_SHIFT);
+	if (!kpte || !kpte_is_jumbo(kpte))
+		return 0;
+	pml1 = kpages_zalloc(2 * PGSIZE, MEM_ATOMIC);
+	if (!pml1)
+		return -ENOMEM;
+	pa = kpte_get_paddr(kpte);
+	settings = pte_get_settings(kpte) & ~PTE_PS;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&pml1[i], pa + i * PGSIZE, settings);
+	/* Same as __pml_walk's intermediate PTEs. */
+	epte = kpte_to_epte(kpte);
+	*epte = (PADDR(pml1) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+	*kpte = PADDR(pml1) | PTE_P | PTE_U | PTE_W;
+	return 0;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -498,8 +543,10 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  The only jumbos the callback will
+ * see are user jumbo pages (PML2), and it will see them once, with the VA of
+ * the start of the jumbo.  Callers should make sure their range doesn't cover
+ * just part of a jumbo.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -516,8 +563,10 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates.  A jumbo might
+		 * be !P (e.g. during munmap), so check PS, not pte_is_final(). */
+		if (shift != PML1_SHIFT &&
+		    !(shift == PML2_SHIFT && kpte_is_jumbo(kpte)))
 			return 0;
 		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
 	}
@@ -365,6 +365,17 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Returns our numa_id for the raw SRAT proximity @domain, or -1 if no core is
+ * in that domain (e.g. a memory-only domain). */
+int numa_domain_to_id(int domain)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == domain)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
 void print_cpu_topology()
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
@@ -38,6 +38,7 @@ extern int *os_coreid_lookup;
 
 void topology_init();
 void print_cpu_topology();
+int numa_domain_to_id(int domain);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -60,6 +61,23 @@ static inline int numa_id(void)
 	return cpu_topology_info.core_list[os_coreid].numa_id;
 }
 
+static inline int core_numa_id(int coreid)
+{
+	return cpu_topology_info.core_list[coreid].numa_id;
+}
+
+/* Whether two cores are hyperthreads of the same physical core (cpu).  The flat
+ * topology lumps every core into one cpu, so it has no siblings. */
+static inline bool core_smt_siblings(uint32_t a, uint32_t b)
+{
+	struct core_info *ci_a = &cpu_topology_info.core_list[a];
+	struct core_info *ci_b = &cpu_topology_info.core_list[b];
+
+	if ((a == b) || (cpu_topology_info.cores_per_cpu >= num_cores))
+		return FALSE;
+	return ci_a->cpu_id == ci_b->cpu_id;
+}
+
 static inline int core_id(void)
 {
 	int coreid;
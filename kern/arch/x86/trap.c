@@ -292,9 +292,15 @@ static bool __handler_kernel_page_fault(struct hw_trapframe *hw_tf,
 	 * for now.  (We'll probably need to change this when we stop
 	 * MAP_POPULATE | MAP_LOCKED entire binaries).
 	 *
-	 * Note that we do not enable IRQs here, unlike in the user case.  Again,
-	 * this is to limit the locks we could be grabbing. */
+	 * We turn IRQs back on if the code we interrupted had them on, like in the
+	 * user case.  handle_page_fault_nofile() takes p->vmr_lock, and a core
+	 * holding it might be waiting on us to ack a TLB shootdown (see
+	 * tlb_batch_flush()).  Touching user memory with IRQs off is a bug, the
+	 * same as doing it with vmr_lock held. */
+	if (hw_tf->tf_rflags & FL_IF)
+		enable_irq();
 	err = handle_page_fault_nofile(pcpui->cur_proc, fault_va, prot);
+	disable_irq();
 	pcpui->__lock_checking_enabled++;
 	if (err) {
 		if (try_handle_exception_fixup(hw_tf))
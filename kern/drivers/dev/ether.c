@@ -54,6 +54,8 @@ enum {
 static struct ether *etherxx[MaxEther];	/* real controllers */
 static struct ether *vlanalloc(struct ether *, int);
 static void vlanoq(struct ether *, struct block *);
+static long etherrssread(struct ether *, void *, long, uint32_t);
+static void etherrsswrite(struct ether *, void *, long);
 
 struct chan *etherattach(char *spec)
 {
@@ -204,6 +206,11 @@ static long etherread(struct chan *chan, void *buf, long n, int64_t off)
 		runlock(&ether->rwlock);
 		nexterror();
 	}
+	if ((chan->qid.type & QTDIR) == 0 &&
+	    NETTYPE(chan->qid.path) == Nrssqid) {
+		r = etherrssread(ether, buf, n, offset);
+		goto out;
+	}
 	if ((chan->qid.type & QTDIR) == 0 && ether->ifstat) {
 		/*
 		 * With some controllers it is necessary to reach
@@ -302,13 +309,215 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
+static struct block *etherdeliver(struct ether *ether, struct block *bp,
+                                  int fromwire);
+static struct block *__etherdeliver(struct ether *ether, struct block *bp,
+                                    int fromwire, bool steered);
+
+/* Offsets into the v4 and tcp headers that GRO looks at */
+enum {
+	Gro_ip_len = 2,
+	Gro_ip_frag = 6,
+	Gro_ip_proto = 9,
+	Gro_ip_cksum = 10,
+	Gro_ip_src = 12,
+	Gro_tcp_seq = 4,
+	Gro_tcp_ackno = 8,
+	Gro_tcp_hlen = 12,
+	Gro_tcp_flags = 13,
+	Gro_tcp_win = 14,
+	Gro_tcp_cksum = 16,
+
+	Gro_tcpproto = 6,
+	Gro_tcp_psh = 0x08,
+	Gro_tcp_ack = 0x10,
+};
+
+/* Fix up the head segment's ip header to cover everything merged into it and
+ * send it up. */
+static void ethergro_flush(struct ether *ether, struct ethergro *g)
+{
+	struct block *bp = g->bp;
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+
+	if (g->nseg > 1) {
+		hnputs(ip + Gro_ip_len, BLEN(bp) - ETHERHDRSIZE);
+		ip[Gro_ip_cksum] = 0;
+		ip[Gro_ip_cksum + 1] = 0;
+		hnputs(ip + Gro_ip_cksum, ipcsum(ip));
+	}
+	g->bp = NULL;
+	etherdeliver(ether, bp, 1);
+}
+
+static void ethergro_remove(struct ether *ether, struct ethergro *g)
+{
+	ethergro_flush(ether, g);
+	*g = ether->groflow[--ether->ngro];
+	ether->groflow[ether->ngro].bp = NULL;
+}
+
+/*
+ * Flush every flow etheriq is holding.  Drivers that set ether->gro call this
+ * at the end of each batch of received packets.
+ */
+void etheriqflush(struct ether *ether)
+{
+	for (int i = 0; i < ether->ngro; i++)
+		ethergro_flush(ether, &ether->groflow[i]);
+	ether->ngro = 0;
+}
+
+/* Checks the tcp checksum of a v4 segment the nic didn't check for us. */
+static bool ethergro_cksum_ok(uint8_t *ip, uint8_t *tcp, int tcplen)
+{
+	uint32_t sum;
+
+	sum = ptclbsum(ip + Gro_ip_src, 2 * IPv4addrlen) + Gro_tcpproto + tcplen
+	      + ptclbsum(tcp, tcplen);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum == 0xffff;
+}
+
+/*
+ * A v4 tcp frame we won't merge is about to go up.  Flush whatever we hold of
+ * its flow first, so the stack sees the flow in order.  Without the ports
+ * (fragments, runts), flush every flow between the two hosts.
+ */
+static bool ethergro_pass(struct ether *ether, uint8_t *ip, uint8_t *tcp)
+{
+	struct ethergro *g;
+	uint8_t *gip;
+
+	for (int i = 0; i < ether->ngro; ) {
+		g = &ether->groflow[i];
+		gip = g->bp->rp + ETHERHDRSIZE;
+		if (!memcmp(gip + Gro_ip_src, ip + Gro_ip_src, 2 * IPv4addrlen) &&
+		    (!tcp || !memcmp(gip + IPV4HDR_LEN, tcp, 4)))
+			ethergro_remove(ether, g);
+		else
+			i++;
+	}
+	return FALSE;
+}
+
+/*
+ * Software GRO: try to merge a v4 tcp data segment into a flow we're already
+ * holding, so the protocol stack sees one big packet instead of many.  The
+ * merged payloads are referenced through the head's extra_data, not copied.
+ * Returns TRUE if we consumed bp.  Any tcp segment we don't like goes up as is,
+ * after flushing its flow so the stack sees it in order.
+ */
+static bool ethergro(struct ether *ether, struct block *bp)
+{
+	struct etherpkt *pkt = (struct etherpkt *)bp->rp;
+	struct ethergro *g;
+	uint8_t *ip, *tcp, *gtcp, *ports;
+	int iplen, ihl, hdrlen, paylen, i;
+	uint32_t seq;
+
+	if (pkt->type[0] != 0x08 || pkt->type[1] != 0x00)
+		return FALSE;
+	if (eaddrcmp(pkt->d, ether->ea) != 0)
+		return FALSE;
+	ip = bp->rp + ETHERHDRSIZE;
+	if (BHLEN(bp) < ETHERHDRSIZE + IPV4HDR_LEN ||
+	    (ip[0] & 0xf0) != IP_VER4 || ip[Gro_ip_proto] != Gro_tcpproto)
+		return FALSE;
+	/* from here on, bp is tcp, and might belong to a flow we're holding */
+	ihl = (ip[0] & 0xf) << 2;
+	tcp = ip + ihl;
+	ports = NULL;
+	if (!(nhgets(ip + Gro_ip_frag) & 0x1fff) &&
+	    BHLEN(bp) >= ETHERHDRSIZE + ihl + 4)
+		ports = tcp;
+	if (bp->next || bp->extra_len || bp->free)
+		return ethergro_pass(ether, ip, ports);
+	if (BHLEN(bp) < ETHERHDRSIZE + IPV4HDR_LEN + 20)
+		return ethergro_pass(ether, ip, ports);
+	/* no ip options, no fragments */
+	if (ihl != IPV4HDR_LEN || (nhgets(ip + Gro_ip_frag) & 0x3fff))
+		return ethergro_pass(ether, ip, ports);
+	iplen = nhgets(ip + Gro_ip_len);
+	if (iplen > BHLEN(bp) - ETHERHDRSIZE)
+		return ethergro_pass(ether, ip, ports);
+	hdrlen = IPV4HDR_LEN + ((tcp[Gro_tcp_hlen] >> 4) << 2);
+	paylen = iplen - hdrlen;
+	if (hdrlen < IPV4HDR_LEN + 20 || paylen < 0)
+		return ethergro_pass(ether, ip, ports);
+
+	for (i = 0, g = NULL; i < ether->ngro; i++) {
+		gtcp = ether->groflow[i].bp->rp + ETHERHDRSIZE + IPV4HDR_LEN;
+		if (!memcmp(ether->groflow[i].bp->rp + ETHERHDRSIZE + Gro_ip_src,
+		            ip + Gro_ip_src, 2 * IPv4addrlen) &&
+		    !memcmp(gtcp, tcp, 4)) {
+			g = &ether->groflow[i];
+			break;
+		}
+	}
+	/* only plain data segments: no SYN/FIN/RST/URG/ECN, and a bad checksum
+	 * is left for tcp to count and drop */
+	if (!paylen || (tcp[Gro_tcp_flags] & ~(Gro_tcp_ack | Gro_tcp_psh)) ||
+	    (!(bp->flag & Bipck) && ipcsum(ip)) ||
+	    (!(bp->flag & Btcpck) && !ethergro_cksum_ok(ip, tcp, iplen -
+	                                                IPV4HDR_LEN))) {
+		if (g)
+			ethergro_remove(ether, g);
+		return FALSE;
+	}
+	/* drop the ether padding on runts */
+	bp->wp = ip + iplen;
+	bp->flag |= Bipck | Btcpck;
+	bp->flag &= ~Bpktck;
+	seq = nhgetl(tcp + Gro_tcp_seq);
+
+	if (g) {
+		gtcp = g->bp->rp + ETHERHDRSIZE + IPV4HDR_LEN;
+		/* like Linux, a new ack ends the merge: tcp needs to see each ack
+		 * for its rtt and cwnd, and for fast retransmit */
+		if (seq == g->nextseq && paylen <= g->mss &&
+		    !memcmp(gtcp + Gro_tcp_ackno, tcp + Gro_tcp_ackno, 4) &&
+		    g->nseg < Ngroseg &&
+		    BLEN(g->bp) - ETHERHDRSIZE + paylen <= 0xffff &&
+		    hdrlen == IPV4HDR_LEN + ((gtcp[Gro_tcp_hlen] >> 4) << 2) &&
+		    !memcmp(gtcp + 20, tcp + 20, hdrlen - IPV4HDR_LEN - 20)) {
+			kmalloc_incref(bp);
+			if (block_append_extra(g->bp, (uintptr_t)bp,
+			                       ip + hdrlen - (uint8_t*)bp, paylen,
+			                       MEM_ATOMIC)) {
+				kfree(bp);
+				ethergro_remove(ether, g);
+				return FALSE;
+			}
+			/* the newest window wins */
+			memmove(gtcp + Gro_tcp_win, tcp + Gro_tcp_win, 2);
+			gtcp[Gro_tcp_flags] |= tcp[Gro_tcp_flags] & Gro_tcp_psh;
+			g->nextseq += paylen;
+			g->nseg++;
+			freeb(bp);
+			if (paylen < g->mss || (gtcp[Gro_tcp_flags] & Gro_tcp_psh))
+				ethergro_remove(ether, g);
+			return TRUE;
+		}
+		ethergro_flush(ether, g);
+	} else {
+		if (ether->ngro == Ngroflow)
+			etheriqflush(ether);
+		g = &ether->groflow[ether->ngro++];
+	}
+	g->bp = bp;
+	g->nextseq = seq + paylen;
+	g->mss = paylen;
+	g->nseg = 1;
+	return TRUE;
+}
+
 struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
-	int multi, tome, fromme, vlanid, i;
-	struct netfile **ep, *f, **fp, *fx;
-	struct block *xbp;
+	int vlanid, i;
 	struct ether *vlan;
 
 	ether->inpackets++;
@@ -335,6 +544,122 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 		}
 	}
 
+	if (fromwire && ether->gro && !(ether->feat & NETF_LRO) &&
+	    ethergro(ether, bp))
+		return 0;
+	return etherdeliver(ether, bp, fromwire);
+}
+
+/* Hashes a received frame's flow (addresses and, for unfragmented tcp/udp,
+ * ports) into the rss table.  Non-ip frames all land in bucket 0. */
+static unsigned int etherrssbucket(struct block *bp)
+{
+	struct etherpkt *pkt = (struct etherpkt *)bp->rp;
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+	uint8_t sa[IPaddrlen], da[IPaddrlen];
+	uint16_t sp = 0, dp = 0;
+	int hlen;
+
+	if (pkt->type[0] == 0x08 && pkt->type[1] == 0x00 &&
+	    BHLEN(bp) >= ETHERHDRSIZE + IPV4HDR_LEN) {
+		v4tov6(sa, ip + 12);
+		v4tov6(da, ip + 16);
+		hlen = (ip[0] & 0xf) << 2;
+		if ((ip[9] == 6 || ip[9] == 17) && !(nhgets(ip + 6) & 0x3fff) &&
+		    BHLEN(bp) >= ETHERHDRSIZE + hlen + 4) {
+			sp = nhgets(ip + hlen);
+			dp = nhgets(ip + hlen + 2);
+		}
+	} else if (pkt->type[0] == 0x86 && pkt->type[1] == 0xDD &&
+	           BHLEN(bp) >= ETHERHDRSIZE + IPV6HDR_LEN + 4) {
+		ipmove(sa, ip + 8);
+		ipmove(da, ip + 24);
+		if (ip[6] == 6 || ip[6] == 17) {
+			sp = nhgets(ip + IPV6HDR_LEN);
+			dp = nhgets(ip + IPV6HDR_LEN + 2);
+		}
+	} else {
+		return 0;
+	}
+	return iphash(sa, sp, da, dp) % Nrss;
+}
+
+static void __etherdeliver_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	__etherdeliver((struct ether *)a0, (struct block *)a1, 1, TRUE);
+}
+
+/*
+ * Multiplex the packet to all the connections which want it, on the core the
+ * rss table picks for its flow.  Steered frames always go through a routine
+ * kernel message, even to this core, since drivers might call us from IRQ
+ * context and the rcv hooks run protocol input.  A flow always lands on the
+ * same core, so its frames stay in order.
+ */
+static struct block *etherdeliver(struct ether *ether, struct block *bp,
+                                  int fromwire)
+{
+	uint16_t core;
+
+	if (fromwire && ether->rss_on) {
+		core = ether->rss[etherrssbucket(bp)];
+		if (core < num_cores) {
+			send_kernel_message(core, __etherdeliver_kmsg, (long)ether,
+			                    (long)bp, 0, KMSG_ROUTINE);
+			return 0;
+		}
+	}
+	return __etherdeliver(ether, bp, fromwire, FALSE);
+}
+
+/* Hands bp to f: straight to its rcv hook if bp was steered to this core, so
+ * protocol input runs here, otherwise to f's queue for its reader. */
+static void etherpass(struct ether *ether, struct netfile *f,
+                      struct block *bp, bool steered)
+{
+	if (steered && f->rcv) {
+		f->rcv(f->rcv_arg, bp);
+		return;
+	}
+	if (qpass(f->in, bp) < 0)
+		ether->soverflows++;
+}
+
+/*
+ * Lets an in-kernel reader of an ether data chan, like ethermedium's ip
+ * readers, take rss-steered frames directly.  rcv runs in a routine kernel
+ * message on the flow's core.  Returns -1 if c isn't a local ether data chan.
+ */
+int etherrcvhook(struct chan *c, void (*rcv)(void *, struct block *),
+                 void *arg)
+{
+	struct ether *ether;
+	struct netfile *f;
+
+	if (&devtab[c->type] != &etherdevtab || (c->qid.type & QTDIR) ||
+	    NETTYPE(c->qid.path) != Ndataqid)
+		return -1;
+	ether = c->aux;
+	f = ether->f[NETID(c->qid.path)];
+	if (!f)
+		return -1;
+	f->rcv_arg = arg;
+	wmb();	/* arg before the hook */
+	f->rcv = rcv;
+	return 0;
+}
+
+static struct block *__etherdeliver(struct ether *ether, struct block *bp,
+                                    int fromwire, bool steered)
+{
+	struct etherpkt *pkt;
+	uint16_t type;
+	int multi, tome, fromme;
+	struct netfile **ep, *f, **fp, *fx;
+	struct block *xbp;
+
+	pkt = (struct etherpkt *)bp->rp;
+	type = (pkt->type[0] << 8) | pkt->type[1];
 	fx = 0;
 	ep = &ether->f[Ntypes];
 
@@ -380,14 +705,12 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					ether->soverflows++;
 					continue;
 				}
-				if (qpass(f->in, xbp) < 0)
-					ether->soverflows++;
+				etherpass(ether, f, xbp, steered);
 			}
 	}
 
 	if (fx) {
-		if (qpass(fx->in, bp) < 0)
-			ether->soverflows++;
+		etherpass(ether, fx, bp, steered);
 		return 0;
 	}
 	if (fromwire) {
@@ -450,6 +773,84 @@ static int etheroq(struct ether *ether, struct block *bp)
 	return len;
 }
 
+static long etherrssread(struct ether *ether, void *buf, long n,
+                         uint32_t offset)
+{
+	char *p;
+	int j;
+
+	p = kzmalloc(READSTR, MEM_WAIT);
+	j = snprintf(p, READSTR, "%s", ether->rss_on ? "on" : "off");
+	for (int i = 0; i < Nrss; i++)
+		j += snprintf(p + j, READSTR - j, "%s%d", i % 16 ? " " : "\n",
+		              ether->rss[i]);
+	snprintf(p + j, READSTR - j, "\n");
+	n = readstr(offset, buf, n, p);
+	kfree(p);
+	return n;
+}
+
+/*
+ * #ether/etherN/rss:
+ *	on | off			steer received flows per the table, or not
+ *	set bucket core		point one bucket at a core
+ *	spread [first [n]]	round-robin the buckets over n cores from first
+ *	pin raddr rport laddr lport core
+ *				run a flow's input on core, e.g. the core its
+ *				consumer runs on.  This moves the whole bucket
+ *				the flow hashes into.
+ */
+static void etherrsswrite(struct ether *ether, void *buf, long n)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+	int bucket, core, first, nr;
+	uint8_t ra[IPaddrlen], la[IPaddrlen];
+
+	cb = parsecmd(buf, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if (cb->nf < 1)
+		error(EFAIL, "short rss request");
+	if (strcmp(cb->f[0], "on") == 0) {
+		ether->rss_on = TRUE;
+	} else if (strcmp(cb->f[0], "off") == 0) {
+		ether->rss_on = FALSE;
+	} else if (strcmp(cb->f[0], "set") == 0) {
+		if (cb->nf != 3)
+			error(EINVAL, "usage: set bucket core");
+		bucket = atoi(cb->f[1]);
+		core = atoi(cb->f[2]);
+		if (bucket < 0 || bucket >= Nrss || core < 0 || core >= num_cores)
+			error(EINVAL, "bad rss bucket or core");
+		ether->rss[bucket] = core;
+	} else if (strcmp(cb->f[0], "spread") == 0) {
+		first = cb->nf > 1 ? atoi(cb->f[1]) : 0;
+		nr = cb->nf > 2 ? atoi(cb->f[2]) : num_cores - first;
+		if (first < 0 || nr <= 0 || first + nr > num_cores)
+			error(EINVAL, "bad rss core range");
+		for (int i = 0; i < Nrss; i++)
+			ether->rss[i] = first + i % nr;
+	} else if (strcmp(cb->f[0], "pin") == 0) {
+		if (cb->nf != 6)
+			error(EINVAL, "usage: pin raddr rport laddr lport core");
+		if (parseip(ra, cb->f[1]) == -1 || parseip(la, cb->f[3]) == -1)
+			error(EINVAL, "bad rss pin address");
+		core = atoi(cb->f[5]);
+		if (core < 0 || core >= num_cores)
+			error(EINVAL, "bad rss core");
+		/* etherrssbucket hashes the rx frame's source first */
+		bucket = iphash(ra, atoi(cb->f[2]), la, atoi(cb->f[4])) % Nrss;
+		ether->rss[bucket] = core;
+	} else {
+		error(EINVAL, "unknown rss request %s", cb->f[0]);
+	}
+	poperror();
+	kfree(cb);
+}
+
 static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 {
 	ERRSTACK(2);
@@ -465,6 +866,11 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 		runlock(&ether->rwlock);
 		nexterror();
 	}
+	if (NETTYPE(chan->qid.path) == Nrssqid) {
+		etherrsswrite(ether, buf, n);
+		l = n;
+		goto out;
+	}
 	if (NETTYPE(chan->qid.path) != Ndataqid) {
 		l = netifwrite(ether, chan, buf, n);
 		if (l >= 0)
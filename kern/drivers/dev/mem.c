@@ -7,6 +7,7 @@
 
 #include <ns.h>
 #include <kmalloc.h>
+#include <page_alloc.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -27,6 +28,7 @@ enum {
 	Qslab_stats,
 	Qfree,
 	Qkmemstat,
+	Qslab_pcpu,
 };
 
 static struct dirtab mem_dir[] = {
@@ -35,6 +37,7 @@ static struct dirtab mem_dir[] = {
 	{"slab_stats", {Qslab_stats, 0, QTFILE}, 0, 0444},
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
+	{"slab_pcpu", {Qslab_pcpu, 0, QTFILE}, 0, 0444},
 };
 
 static struct chan *mem_attach(char *spec)
@@ -146,18 +149,69 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	return sofar;
 }
 
+/* Prints the per-NUMA-node summary: each node's base arena usage and how many
+ * kpages allocations it served for cores on other nodes. */
+static size_t fetch_numa_stats(struct sized_alloc *sza, size_t sofar)
+{
+	struct arena *base;
+	size_t refills, drains, steals;
+
+	for (int i = 0; i < nr_arena_nodes; i++) {
+		base = base_arenas[i];
+		if (!base)
+			continue;
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "NUMA node %d: %s, total %llu, alloc %llu, "
+		                  "remote allocs %llu\n",
+		                  i, base->name, base->amt_total_segs,
+		                  base->amt_alloc_segs, numa_nr_remote_allocs(i));
+	}
+	kpages_pcpu_stats(&refills, &drains, &steals);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Per-core pages: cached %lu, refills %lu, drains %lu, "
+	                  "steals %lu\n",
+	                  kpages_pcpu_nr_cached(), refills, drains, steals);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar, "\n");
+	return sofar;
+}
+
+/* Counts the arenas and slabs, so callers can size their buffers.  Don't
+ * allocate while holding arenas_and_slabs_lock: the arena reclaim ktask takes
+ * it, and a MEM_WAIT allocation might be waiting on that ktask.  Callers
+ * allocate after this with some slack, for arenas and caches created before
+ * they relock. */
+#define MEM_STATS_SLACK			10
+
+static void count_arenas_and_slabs(size_t *nr_arenas, size_t *nr_slabs)
+{
+	struct arena *a_i;
+	struct kmem_cache *kc_i;
+
+	*nr_arenas = MEM_STATS_SLACK;
+	*nr_slabs = MEM_STATS_SLACK;
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(a_i, &all_arenas, next)
+		(*nr_arenas)++;
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		(*nr_slabs)++;
+	qunlock(&arenas_and_slabs_lock);
+}
+
 static struct sized_alloc *build_arena_stats(void)
 {
 	struct sized_alloc *sza;
 	size_t sofar = 0;
 	size_t alloc_amt = 0;
+	size_t nr_arenas, nr_slabs;
 	struct arena *a_i;
 
-	qlock(&arenas_and_slabs_lock);
+	count_arenas_and_slabs(&nr_arenas, &nr_slabs);
 	/* Rough guess about how many chars per arena we'll need. */
-	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 1000;
+	alloc_amt += nr_arenas * 1000;
+	alloc_amt += nr_arena_nodes * 100 + 100 + 1;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	qlock(&arenas_and_slabs_lock);
+	sofar = fetch_numa_stats(sza, sofar);
 	TAILQ_FOREACH(a_i, &all_arenas, next)
 		sofar = fetch_arena_stats(a_i, sza, sofar);
 	qunlock(&arenas_and_slabs_lock);
@@ -211,6 +265,10 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	spin_lock_irqsave(&kc->depot.lock);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Depot magsize: %d\n", kc->depot.magsize);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Depot contended: %llu, grows: %u, shrinks: %u\n",
+	                  kc->depot.nr_contended, kc->depot.nr_grows,
+	                  kc->depot.nr_shrinks);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Nr empty mags: %d\n", kc->depot.nr_empty);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
@@ -224,12 +282,13 @@ static struct sized_alloc *build_slab_stats(void)
 	struct sized_alloc *sza;
 	size_t sofar = 0;
 	size_t alloc_amt = 0;
+	size_t nr_arenas, nr_slabs;
 	struct kmem_cache *kc_i;
 
-	qlock(&arenas_and_slabs_lock);
-	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 500;
+	count_arenas_and_slabs(&nr_arenas, &nr_slabs);
+	alloc_amt += nr_slabs * 500;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	qlock(&arenas_and_slabs_lock);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
 		sofar = fetch_slab_stats(kc_i, sza, sofar);
 	qunlock(&arenas_and_slabs_lock);
@@ -341,17 +400,15 @@ static size_t fetch_arena_and_kids(struct arena *arena, struct sized_alloc *sza,
 static struct sized_alloc *build_kmemstat(void)
 {
 	struct arena *a_i;
-	struct kmem_cache *kc_i;
 	struct sized_alloc *sza;
 	size_t sofar = 0;
 	size_t alloc_amt = 100;
+	size_t nr_arenas, nr_slabs;
 
-	qlock(&arenas_and_slabs_lock);
-	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 100;
-	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 100;
+	count_arenas_and_slabs(&nr_arenas, &nr_slabs);
+	alloc_amt += (nr_arenas + nr_slabs) * 100;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	qlock(&arenas_and_slabs_lock);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  kmemstat_hdr_fmt,
 					  KMEMSTAT_NAME, "Arena/Slab Name",
@@ -371,6 +428,95 @@ static struct sized_alloc *build_kmemstat(void)
 	return sza;
 }
 
+/* slab_pcpu: one line per cache with the totals (core "all"), followed by a
+ * line for each core that used the cache.  The columns are ':' separated, like
+ * kmemstat, so you can sort -t: -k on any of them.
+ *
+ * Mag: allocs served from the core's magazines
+ * Depot: full magazines fetched from the depot
+ * Slab: allocs that fell through to the slab layer
+ * Import: slabs grown from the source arena
+ * Contend: contended depot lock acquisitions */
+#define SLABPCPU_CORE			4
+#define SLABPCPU_CTR			12
+
+const char slabpcpu_fmt[]     = "%-*s:%*s:%*llu:%*llu:%*llu:%*llu:%*llu\n";
+const char slabpcpu_hdr_fmt[] = "%-*s:%*s:%*s:%*s:%*s:%*s:%*s\n";
+
+static size_t fetch_slab_pcpu_line(struct kmem_cache *kc, const char *core,
+                                   struct kmem_pcpu_cache *pcc,
+                                   struct sized_alloc *sza, size_t sofar)
+{
+	return sofar + snprintf(sza->buf + sofar, sza->size - sofar,
+	                        slabpcpu_fmt,
+	                        KMEMSTAT_NAME, kc->name,
+	                        SLABPCPU_CORE, core,
+	                        SLABPCPU_CTR, pcc->nr_allocs_ever,
+	                        SLABPCPU_CTR, pcc->nr_depot_allocs,
+	                        SLABPCPU_CTR, pcc->nr_slab_allocs,
+	                        SLABPCPU_CTR, pcc->nr_imports,
+	                        SLABPCPU_CTR, pcc->nr_depot_contended);
+}
+
+static size_t fetch_slab_pcpu(struct kmem_cache *kc, struct sized_alloc *sza,
+                              size_t sofar)
+{
+	struct kmem_pcpu_cache *pcc, sum = {0};
+	char core[SLABPCPU_CORE + 1];
+
+	/* Lockless peak at the pcpu state */
+	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		sum.nr_allocs_ever += pcc->nr_allocs_ever;
+		sum.nr_depot_allocs += pcc->nr_depot_allocs;
+		sum.nr_slab_allocs += pcc->nr_slab_allocs;
+		sum.nr_imports += pcc->nr_imports;
+		sum.nr_depot_contended += pcc->nr_depot_contended;
+	}
+	sofar = fetch_slab_pcpu_line(kc, "all", &sum, sza, sofar);
+	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		if (!pcc->nr_allocs_ever && !pcc->nr_depot_allocs &&
+		    !pcc->nr_slab_allocs && !pcc->nr_imports &&
+		    !pcc->nr_depot_contended)
+			continue;
+		snprintf(core, sizeof(core), "%d", i);
+		sofar = fetch_slab_pcpu_line(kc, core, pcc, sza, sofar);
+	}
+	return sofar;
+}
+
+static struct sized_alloc *build_slab_pcpu(void)
+{
+	struct kmem_cache *kc_i;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+	size_t alloc_amt = 200;
+	size_t line_ln = KMEMSTAT_NAME + SLABPCPU_CORE + 5 * SLABPCPU_CTR + 8;
+	size_t nr_arenas, nr_slabs;
+
+	count_arenas_and_slabs(&nr_arenas, &nr_slabs);
+	alloc_amt += nr_slabs * (kmc_nr_pcpu_caches() + 1) * line_ln;
+	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	qlock(&arenas_and_slabs_lock);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  slabpcpu_hdr_fmt,
+	                  KMEMSTAT_NAME, "Slab Name",
+	                  SLABPCPU_CORE, "Core",
+	                  SLABPCPU_CTR, "Mag",
+	                  SLABPCPU_CTR, "Depot",
+	                  SLABPCPU_CTR, "Slab",
+	                  SLABPCPU_CTR, "Import",
+	                  SLABPCPU_CTR, "Contend");
+	for (int i = 0; i < line_ln - 1; i++)
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar, "-");
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar, "\n");
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		sofar = fetch_slab_pcpu(kc_i, sza, sofar);
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
 static struct chan *mem_open(struct chan *c, int omode)
 {
 	if (c->qid.type & QTDIR) {
@@ -390,6 +536,9 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qslab_pcpu:
+		c->synth_buf = build_slab_pcpu();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -406,6 +555,7 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qslab_pcpu:
 		kfree(c->synth_buf);
 		break;
 	}
@@ -423,6 +573,7 @@ static long mem_read(struct chan *c, void *ubuf, long n, int64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qslab_pcpu:
 		sza = c->synth_buf;
 		return readmem(offset, ubuf, n, sza->buf, sza->size);
 	default:
@@ -121,6 +121,10 @@ int mntrpcread(struct mnt *, struct mntrpc *);
 void mountio(struct mnt *, struct mntrpc *);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
+static void mountrpc_start(struct mnt *, struct mntrpc *);
+static void mountrpc_finish(struct mnt *, struct mntrpc *);
+static void mntsend(struct mnt *, struct mntrpc *);
+static void __mountio(struct mnt *, struct mntrpc *, bool);
 int rpcattn(void *);
 struct chan *mntchan(void);
 
@@ -681,6 +685,30 @@ static int mntwstat(struct chan *c, uint8_t * dp, int n)
 	return n;
 }
 
+/* Reads ahead of a sequential reader on a cached chan, filling the cache.  The
+ * reader just read n bytes from the server, ending at off.  This is best
+ * effort: the reader already has its data, so we don't pass along errors. */
+static void mntreadahead(struct chan *c, int64_t off, long n)
+{
+	ERRSTACK(1);
+	void *buf;
+	long amt;
+
+	amt = creadahead(c, off, n);
+	if (!amt)
+		return;
+	buf = kmalloc(amt, MEM_WAIT);
+	if (waserror()) {
+		kfree(buf);
+		poperror();
+		return;
+	}
+	amt = mntrdwr(Tread, c, buf, amt, off);
+	cupdate(c, buf, amt, off);
+	poperror();
+	kfree(buf);
+}
+
 /* the servers should either return units of whole directory entries
  * OR support seeking to an arbitrary place. One or other.
  * Both are fine, but at least one is a minimum.
@@ -692,6 +720,7 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 	uint8_t *p, *e;
 	int nc, cache, isdir, dirlen;
 	int numdirent = 0;
+	long nr;
 
 	isdir = 0;
 	cache = c->flag & CCACHE;
@@ -710,8 +739,11 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 			p += nc;
 			off += nc;
 		}
+		nr = n;
 		n = mntrdwr(Tread, c, p, n, off);
 		cupdate(c, p, n, off);
+		if (n == nr)
+			mntreadahead(c, off + n, n);
 		return n + nc;
 	}
 
@@ -743,6 +775,101 @@ static long mntwrite(struct chan *c, void *buf, long n, int64_t off)
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
+/* Cancels an RPC that mntrdwr_window() sent but won't wait for.  Like
+ * __mountio()'s abort path, we Tflush it and wait for the Rflush, so r's tag
+ * isn't reused while the server might still answer it.  If even the flush
+ * fails, we give up on r, the same as __mountio() does. */
+static void mntflush_inflight(struct mnt *m, struct mntrpc *r)
+{
+	ERRSTACK(1);
+
+	if (r->done)
+		return;
+	if (waserror()) {
+		/* __mountio() already did mntflushfree() */
+		poperror();
+		return;
+	}
+	mountio(m, mntflushalloc(r, m->msize));
+	poperror();
+}
+
+/* Like mntrdwr, but keeps up to MNT_WINDOW RPCs in flight.  Only for cached
+ * chans: the mount promised us ordinary files, so requests at different
+ * offsets are independent and the server can answer them in any order.
+ *
+ * Replies are consumed in the order they were sent.  Once we get a short
+ * reply, we stop sending, and the count is what we got up to that reply.
+ * Later replies are still drained; their reads are tossed, but their writes
+ * happened, so they still invalidate the cache. */
+static long mntrdwr_window(int type, struct chan *c, char *uba, long n,
+                           int64_t off)
+{
+	ERRSTACK(2);
+	struct mnt *m;
+	struct mntrpc *r;
+	struct mntrpc *ring[CONFIG_MNT_WINDOW];
+	int head = 0, nr_inflight = 0;
+	uint32_t nr, nreq;
+	int64_t start = off;
+	long cnt = 0;
+	bool short_io = FALSE;
+
+	m = mntchk(c);
+	if (waserror()) {
+		for (int i = 0; i < nr_inflight; i++) {
+			r = ring[(head + i) % CONFIG_MNT_WINDOW];
+			mntflush_inflight(m, r);
+			mntfree(r);
+		}
+		nexterror();
+	}
+	while (n || nr_inflight) {
+		while (n && nr_inflight < CONFIG_MNT_WINDOW) {
+			r = mntralloc(c, m->msize);
+			ring[(head + nr_inflight) % CONFIG_MNT_WINDOW] = r;
+			nr_inflight++;
+			r->request.type = type;
+			r->request.fid = c->fid;
+			r->request.offset = off;
+			r->request.data = uba;
+			nr = MIN(n, m->msize - IOHDRSZ);
+			r->request.count = nr;
+			mountrpc_start(m, r);
+			off += nr;
+			uba += nr;
+			n -= nr;
+		}
+		/* Off the ring first: if finishing fails, __mountio() has dealt with
+		 * r, and only the rest need flushing. */
+		r = ring[head];
+		head = (head + 1) % CONFIG_MNT_WINDOW;
+		nr_inflight--;
+		if (waserror()) {
+			mntfree(r);
+			nexterror();
+		}
+		mountrpc_finish(m, r);
+		nreq = r->request.count;
+		nr = MIN(r->reply.count, nreq);
+		if (type == Twrite)
+			cwrite(c, (uint8_t *) r->request.data, nr, r->request.offset);
+		if (!short_io) {
+			if (type == Tread)
+				r->b = bl2mem((uint8_t *) r->request.data, r->b, nr);
+			cnt = r->request.offset + nr - start;
+			if (nr != nreq) {
+				short_io = TRUE;
+				n = 0;
+			}
+		}
+		poperror();
+		mntfree(r);
+	}
+	poperror();
+	return cnt;
+}
+
 long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 {
 	ERRSTACK(1);
@@ -758,6 +885,8 @@ long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 	cache = c->flag & CCACHE;
 	if (c->qid.type & QTDIR)
 		cache = 0;
+	if (cache && CONFIG_MNT_WINDOW > 1 && n > m->msize - IOHDRSZ)
+		return mntrdwr_window(type, c, uba, n, off);
 	for (;;) {
 		r = mntralloc(c, m->msize);
 		if (waserror()) {
@@ -795,17 +924,13 @@ long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 	return cnt;
 }
 
-void mountrpc(struct mnt *m, struct mntrpc *r)
+/* Checks the reply to r, throwing for Rerror and other failures. */
+static void mntrpccheck(struct mnt *m, struct mntrpc *r)
 {
 	char *sn, *cn;
 	int t;
 	char *e;
 
-	r->reply.tag = 0;
-	r->reply.type = Tmax;	/* can't ever be a valid message type */
-
-	mountio(m, r);
-
 	t = r->reply.type;
 	switch (t) {
 		case Rerror:
@@ -843,32 +968,35 @@ void mountrpc(struct mnt *m, struct mntrpc *r)
 	}
 }
 
-void mountio(struct mnt *m, struct mntrpc *r)
+void mountrpc(struct mnt *m, struct mntrpc *r)
 {
-	ERRSTACK(1);
-	int n;
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
 
-	while (waserror()) {
-		if (m->rip == current)
-			mntgate(m);
-		/* Syscall aborts are like Plan 9 Eintr.  For those, we need to change
-		 * the old request to a flsh (mntflushalloc) and try again.  We'll
-		 * always try to flush, and you can't get out until the flush either
-		 * succeeds or errors out with a non-abort/Eintr error.
-		 *
-		 * This all means that regular aborts cannot break us out of here!  We
-		 * can consider that policy in the future, if we need to.  Regardless,
-		 * if the process is dying, we really do need to abort. */
-		if ((get_errno() != EINTR) || proc_is_dying(current)) {
-			/* all other errors or dying, bail out! */
-			mntflushfree(m, r);
-			nexterror();
-		}
-		/* try again.  this is where you can get the "rpc tags" errstr. */
-		r = mntflushalloc(r, m->msize);
-		/* need one for every waserror call (so this plus one outside) */
-		poperror();
-	}
+	mountio(m, r);
+	mntrpccheck(m, r);
+}
+
+/* Split-phase mountrpc, so a caller can have several RPCs in flight at once.
+ * Every RPC started must be finished, or removed with mntflushfree(). */
+static void mountrpc_start(struct mnt *m, struct mntrpc *r)
+{
+	r->reply.tag = 0;
+	r->reply.type = Tmax;
+
+	mntsend(m, r);
+}
+
+static void mountrpc_finish(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, TRUE);
+	mntrpccheck(m, r);
+}
+
+/* Queues r on m and transmits it, without waiting for the reply. */
+static void mntsend(struct mnt *m, struct mntrpc *r)
+{
+	int n;
 
 	spin_lock(&m->lock);
 	r->m = m;
@@ -886,7 +1014,11 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		error(EIO, ERROR_FIXME);
 /*	r->stime = fastticks(NULL); */
 	r->reqlen = n;
+}
 
+/* Waits for r's reply, taking our turn as the mount's reader if needed. */
+static void mntwait(struct mnt *m, struct mntrpc *r)
+{
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
 		spin_lock(&m->lock);
@@ -894,11 +1026,8 @@ void mountio(struct mnt *m, struct mntrpc *r)
 			break;
 		spin_unlock(&m->lock);
 		rendez_sleep(&r->r, rpcattn, r);
-		if (r->done) {
-			poperror();
-			mntflushfree(m, r);
+		if (r->done)
 			return;
-		}
 	}
 	m->rip = current;
 	spin_unlock(&m->lock);
@@ -908,10 +1037,47 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		mountmux(m, r);
 	}
 	mntgate(m);
+}
+
+/* Sends r, unless it was already sent, and waits for the reply. */
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
+{
+	ERRSTACK(1);
+
+	while (waserror()) {
+		if (m->rip == current)
+			mntgate(m);
+		/* Syscall aborts are like Plan 9 Eintr.  For those, we need to change
+		 * the old request to a flsh (mntflushalloc) and try again.  We'll
+		 * always try to flush, and you can't get out until the flush either
+		 * succeeds or errors out with a non-abort/Eintr error.
+		 *
+		 * This all means that regular aborts cannot break us out of here!  We
+		 * can consider that policy in the future, if we need to.  Regardless,
+		 * if the process is dying, we really do need to abort. */
+		if ((get_errno() != EINTR) || proc_is_dying(current)) {
+			/* all other errors or dying, bail out! */
+			mntflushfree(m, r);
+			nexterror();
+		}
+		/* try again.  this is where you can get the "rpc tags" errstr. */
+		r = mntflushalloc(r, m->msize);
+		sent = FALSE;
+		/* need one for every waserror call (so this plus one outside) */
+		poperror();
+	}
+	if (!sent)
+		mntsend(m, r);
+	mntwait(m, r);
 	poperror();
 	mntflushfree(m, r);
 }
 
+void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, FALSE);
+}
+
 static int doread(struct mnt *m, int len)
 {
 	struct block *b;
@@ -69,6 +69,8 @@ enum {
 	Qprofile,
 	Qsyscall,
 	Qcore,
+	Qcores,
+	Qvcores,
 };
 
 enum {
@@ -78,6 +80,8 @@ enum {
 	CMstraceme,
 	CMstraceall,
 	CMstrace_drop,
+	CMavoid_smt,
+	CMqos,
 };
 
 enum {
@@ -117,6 +121,8 @@ struct dirtab procdir[] = {
 	{"profile", {Qprofile}, 0, 0400},
 	{"syscall", {Qsyscall}, 0, 0400},
 	{"core", {Qcore}, 0, 0444},
+	{"cores", {Qcores}, 0, 0444},
+	{"vcores", {Qvcores}, 0, 0444},
 };
 
 static
@@ -127,6 +133,8 @@ struct cmdtab proccmd[] = {
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstrace_drop, "strace_drop", 2},
+	{CMavoid_smt, "avoid_smt", 2},
+	{CMqos, "qos", 3},
 };
 
 /*
@@ -583,6 +591,8 @@ static struct chan *procopen(struct chan *c, int omode)
 		case Quser:
 		case Qstatus:
 		case Qvmstatus:
+		case Qcores:
+		case Qvcores:
 		case Qctl:
 			break;
 
@@ -969,6 +979,7 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 				         "%8d %-*s %-10s %6d", p->pid, PROC_PROGNAME_SZ,
 				         p->progname, procstate2str(p->state),
 				         p->ppid);
+				s = seprintf(s, e, " %lu jumbos", p->vm_nr_jumbos);
 				if (p->strace)
 					s = seprintf(s, e, " %d trace users %d traced procs",
 					             kref_refcnt(&p->strace->users),
@@ -979,6 +990,30 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 				return i;
 			}
 
+		case Qcores:{
+				char *buf = kmalloc(4096, MEM_WAIT);
+				int i;
+
+				sched_seprint_cores(p, buf, buf + 4096);
+				proc_decref(p);
+				i = readstr(off, va, n, buf);
+				kfree(buf);
+				return i;
+			}
+
+		case Qvcores:{
+				/* a summary line and a few histograms per vcore */
+				size_t buflen = 2048 + p->procinfo->max_vcores * 1024;
+				char *buf = kmalloc(buflen, MEM_WAIT);
+				int i;
+
+				proc_seprint_vcores(p, buf, buf + buflen);
+				proc_decref(p);
+				i = readstr(off, va, n, buf);
+				kfree(buf);
+				return i;
+			}
+
 		case Qvmstatus:
 			{
 				size_t buflen = 50 * 65 + 2;
@@ -1330,11 +1365,13 @@ static void procctlreq(struct proc *p, char *va, int n)
 	ERRSTACK(1);
 	int8_t irq_state = 0;
 	int npc, pri, core;
+	int ret = 0;
 	struct cmdbuf *cb;
 	struct cmdtab *ct;
 	int64_t time;
 	char *e;
 	struct strace *strace;
+	struct sched_qos qos;
 
 	cb = parsecmd(va, n);
 	if (waserror()) {
@@ -1407,6 +1444,41 @@ static void procctlreq(struct proc *p, char *va, int n)
 		else
 			error(EINVAL, "strace_drop takes on|off %s", cb->f[1]);
 		break;
+	case CMavoid_smt:
+		if (!strcmp(cb->f[1], "on"))
+			ret = sched_proc_avoid_smt(p, TRUE);
+		else if (!strcmp(cb->f[1], "off"))
+			ret = sched_proc_avoid_smt(p, FALSE);
+		else
+			error(EINVAL, "avoid_smt takes on|off %s", cb->f[1]);
+		if (ret)
+			error(get_errno(), "core allocation policy %s can't avoid SMT",
+			      corealloc_policy_name);
+		break;
+	case CMqos:
+		sched_proc_get_qos(p, &qos);
+		if (!strcmp(cb->f[1], "class")) {
+			if (!strcmp(cb->f[2], "batch"))
+				qos.class = SCHED_QOS_BATCH;
+			else if (!strcmp(cb->f[2], "normal"))
+				qos.class = SCHED_QOS_NORMAL;
+			else if (!strcmp(cb->f[2], "latency"))
+				qos.class = SCHED_QOS_LATENCY;
+			else
+				error(EINVAL, "qos class takes batch|normal|latency %s",
+				      cb->f[2]);
+		} else if (!strcmp(cb->f[1], "shares")) {
+			qos.shares = strtoul(cb->f[2], 0, 0);
+		} else if (!strcmp(cb->f[1], "min")) {
+			qos.min_cores = strtoul(cb->f[2], 0, 0);
+		} else if (!strcmp(cb->f[1], "max")) {
+			qos.max_cores = strtoul(cb->f[2], 0, 0);
+		} else {
+			error(EINVAL, "qos takes class|shares|min|max %s", cb->f[1]);
+		}
+		if (sched_proc_set_qos(p, &qos))
+			error(get_errno(), "can't set qos %s %s", cb->f[1], cb->f[2]);
+		break;
 	}
 	poperror();
 	kfree(cb);
@@ -1035,6 +1035,7 @@ rtl8169receive(struct ether* edev)
 			rtl8169replenish(ctlr);
 	}
 	ctlr->rdh = rdh;
+	etheriqflush(edev);
 }
 
 static void
@@ -1221,6 +1222,7 @@ rtl8169pnp(struct ether* edev)
 	edev->attach = rtl8169attach;
 	edev->transmit = rtl8169transmit;
 	edev->ifstat = rtl8169ifstat;
+	edev->gro = TRUE;
 
 	edev->arg = edev;
 	edev->promiscuous = rtl8169promiscuous;
@@ -1322,6 +1322,7 @@ static void i82563rproc(void *arg)
 			if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
 				i82563replenish(ctlr);
 		}
+		etheriqflush(edev);
 	}
 }
 
@@ -2221,6 +2222,7 @@ static int pnp(struct ether *edev, int type)
 	edev->transmit = i82563transmit;
 	edev->ifstat = i82563ifstat;
 	edev->ctl = i82563ctl;
+	edev->gro = TRUE;
 
 	edev->arg = edev;
 	edev->promiscuous = i82563promiscuous;
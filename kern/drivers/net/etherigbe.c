@@ -1204,6 +1204,7 @@ igberproc(void* arg)
 			rdh = NEXT_RING(rdh, ctlr->nrd);
 		}
 		ctlr->rdh = rdh;
+		etheriqflush(edev);
 
 		if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
 			igbereplenish(ctlr);
@@ -2065,6 +2066,7 @@ igbepnp(struct ether* edev)
 	edev->ifstat = igbeifstat;
 	edev->ctl = igbectl;
 	edev->shutdown = igbeshutdown;
+	edev->gro = TRUE;
 
 	edev->arg = edev;
 	edev->promiscuous = igbepromiscuous;
@@ -36,41 +36,36 @@
 #include <linux/mlx4/qp.h>
 #include "mlx4_en.h"
 
+/* Rx buffers are single pages from the ring's block page pool, so received
+ * payloads go up the stack in place (see recv_packet()) and the pages come back
+ * to the ring once the stack is done with them. */
 static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
+			    struct block_page_pool *pool,
 			    struct mlx4_en_rx_alloc *page_alloc,
 			    const struct mlx4_en_frag_info *frag_info,
-			    gfp_t _gfp)
+			    gfp_t gfp)
 {
-	int order;
-	struct refd_pages *page;
+	struct page *page;
 	dma_addr_t dma;
 
-	for (order = MLX4_EN_ALLOC_PREFER_ORDER; ;) {
-		gfp_t gfp = _gfp;
-
-		if (order)
-			gfp |= __GFP_COMP | __GFP_NOWARN;
-		page = get_refd_pages(get_cont_pages(order, gfp), order);
-		if (likely(page))
-			break;
-		if (--order < 0 ||
-		    ((PAGE_SIZE << order) < frag_info->frag_size))
-			return -ENOMEM;
-	}
-	dma = dma_map_page(priv->ddev, rp2page(page), 0, PAGE_SIZE << order,
-			   PCI_DMA_FROMDEVICE);
+	if (frag_info->frag_stride > PAGE_SIZE)
+		return -ENOMEM;
+	page = block_page_alloc(pool, gfp);
+	if (unlikely(!page))
+		return -ENOMEM;
+	dma = dma_map_page(priv->ddev, page, 0, PAGE_SIZE, PCI_DMA_FROMDEVICE);
 	if (dma_mapping_error(priv->ddev, dma)) {
-		refd_pages_decref(page);
+		block_page_decref(page);
 		return -ENOMEM;
 	}
-	page_alloc->page_size = PAGE_SIZE << order;
+	page_alloc->page_size = PAGE_SIZE;
 	page_alloc->page = page;
 	page_alloc->dma = dma;
 	page_alloc->page_offset = 0;
 	/* Not doing get_page() for each frag is a big win
 	 * on asymetric workloads. Note we can not use atomic_set().
 	 */
-	atomic_add(&page->rp_kref.refcount,
+	atomic_add(&page->pg_nr_refs,
 		   page_alloc->page_size / frag_info->frag_stride - 1);
 	return 0;
 }
@@ -79,11 +74,12 @@ static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
 			       struct mlx4_en_rx_desc *rx_desc,
 			       struct mlx4_en_rx_alloc *frags,
 			       struct mlx4_en_rx_alloc *ring_alloc,
+			       struct block_page_pool *pool,
 			       gfp_t gfp)
 {
 	struct mlx4_en_rx_alloc page_alloc[MLX4_EN_MAX_RX_FRAGS];
 	const struct mlx4_en_frag_info *frag_info;
-	struct refd_pages *page;
+	struct page *page;
 	dma_addr_t dma;
 	int i;
 
@@ -96,7 +92,8 @@ static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
 		    ring_alloc[i].page_size)
 			continue;
 
-		if (mlx4_alloc_pages(priv, &page_alloc[i], frag_info, gfp))
+		if (mlx4_alloc_pages(priv, pool, &page_alloc[i], frag_info,
+				     gfp))
 			goto out;
 	}
 
@@ -115,8 +112,8 @@ out:
 			dma_unmap_page(priv->ddev, page_alloc[i].dma,
 				page_alloc[i].page_size, PCI_DMA_FROMDEVICE);
 			page = page_alloc[i].page;
-			atomic_set(&page->rp_kref.refcount, 1);
-			refd_pages_decref(page);
+			atomic_set(&page->pg_nr_refs, 1);
+			block_page_decref(page);
 		}
 	}
 	return -ENOMEM;
@@ -135,7 +132,7 @@ static void mlx4_en_free_frag(struct mlx4_en_priv *priv,
 			       PCI_DMA_FROMDEVICE);
 
 	if (frags[i].page)
-		refd_pages_decref(frags[i].page);
+		block_page_decref(frags[i].page);
 }
 
 static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
@@ -147,26 +144,26 @@ static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
 	for (i = 0; i < priv->num_frags; i++) {
 		const struct mlx4_en_frag_info *frag_info = &priv->frag_info[i];
 
-		if (mlx4_alloc_pages(priv, &ring->page_alloc[i],
+		if (mlx4_alloc_pages(priv, &ring->page_pool, &ring->page_alloc[i],
 				     frag_info, MEM_WAIT | __GFP_COLD))
 			goto out;
 
 		en_dbg(DRV, priv, "  frag %d allocator: - size:%d frags:%d\n",
 		       i, ring->page_alloc[i].page_size,
-		       atomic_read(&ring->page_alloc[i].page->rp_kref.refcount));
+		       atomic_read(&ring->page_alloc[i].page->pg_nr_refs));
 	}
 	return 0;
 
 out:
 	while (i--) {
-		struct refd_pages *page;
+		struct page *page;
 
 		page_alloc = &ring->page_alloc[i];
 		dma_unmap_page(priv->ddev, page_alloc->dma,
 			       page_alloc->page_size, PCI_DMA_FROMDEVICE);
 		page = page_alloc->page;
-		atomic_set(&page->rp_kref.refcount, 1);
-		refd_pages_decref(page);
+		atomic_set(&page->pg_nr_refs, 1);
+		block_page_decref(page);
 		page_alloc->page = NULL;
 	}
 	return -ENOMEM;
@@ -232,7 +229,8 @@ static int mlx4_en_prepare_rx_desc(struct mlx4_en_priv *priv,
 	struct mlx4_en_rx_alloc *frags = ring->rx_info +
 					(index << priv->log_rx_info);
 
-	return mlx4_en_alloc_frags(priv, rx_desc, frags, ring->page_alloc, gfp);
+	return mlx4_en_alloc_frags(priv, rx_desc, frags, ring->page_alloc,
+				   &ring->page_pool, gfp);
 }
 
 static inline bool mlx4_en_is_ring_empty(struct mlx4_en_rx_ring *ring)
@@ -368,6 +366,7 @@ int mlx4_en_create_rx_ring(struct mlx4_en_priv *priv,
 	ring->stride = stride;
 	ring->log_stride = ffs(ring->stride) - 1;
 	ring->buf_size = ring->size * ring->stride + TXBB_SIZE;
+	block_page_pool_init(&ring->page_pool, size);
 
 	tmp = size * ROUNDUPPWR2(MLX4_EN_MAX_RX_FRAGS * sizeof(struct mlx4_en_rx_alloc));
 	ring->rx_info = vmalloc_node(tmp, node);
@@ -589,7 +588,7 @@ static void dump_packet(struct mlx4_en_priv *priv,
 {
 	void *va;
 
-	va = page_address(rp2page(frags[0].page)) + frags[0].page_offset;
+	va = page2kva(frags[0].page) + frags[0].page_offset;
 
 	if (length <= SMALL_PACKET_SIZE) {
 		hexdump(va, length);
@@ -605,21 +604,22 @@ static void recv_packet(struct mlx4_en_priv *priv,
 			unsigned int length)
 {
 	struct block *block;
-	void *va;
 
 	assert(priv->num_frags == 1);
 
-	block = block_alloc(length, MEM_ATOMIC);
+	/* Small packets are copied whole, so their frag goes straight back to
+	 * the ring.  Otherwise only the headers are copied and the payload goes
+	 * up in the pool page. */
+	block = block_from_page(frags[0].page, frags[0].page_offset, length,
+				length <= SMALL_PACKET_SIZE ? length
+							    : HEADER_COPY_SIZE,
+				MEM_ATOMIC);
 	if (!block) {
 		en_dbg(RX_ERR, priv, "Failed allocating block\n");
 		priv->stats.rx_dropped++;
 		return;
 	}
 
-	va = page_address(rp2page(frags[0].page)) + frags[0].page_offset;
-	memcpy(block->wp, va, length);
-	block->wp += length;
-
 	etheriq(priv->dev, block, 1 /* fromwire */);
 }
 
@@ -234,7 +234,7 @@ struct mlx4_en_tx_desc {
 #define MLX4_EN_CX3_HIGH_ID	0x1005
 
 struct mlx4_en_rx_alloc {
-	struct refd_pages	*page;
+	struct page	*page;		/* from the ring's page_pool */
 	dma_addr_t	dma;
 	uint32_t		page_offset;
 	uint32_t		page_size;
@@ -299,6 +299,7 @@ struct mlx4_en_rx_desc {
 struct mlx4_en_rx_ring {
 	struct mlx4_hwq_resources wqres;
 	struct mlx4_en_rx_alloc page_alloc[MLX4_EN_MAX_RX_FRAGS];
+	struct block_page_pool page_pool;
 	uint32_t size ;	/* number of Rx descs*/
 	uint32_t actual_size;
 	uint32_t size_mask;
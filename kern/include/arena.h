@@ -89,6 +89,9 @@ extern struct arena_tailq all_arenas;
 #define ARENA_INSTANTFIT		0x200
 #define ARENA_NEXTFIT			0x400
 #define ARENA_ALLOC_STYLES (ARENA_BESTFIT | ARENA_INSTANTFIT | ARENA_NEXTFIT)
+/* Fail (or block) rather than dip into a base arena's low-memory reserve.  Set
+ * automatically for callers that can block. */
+#define ARENA_NO_RESERVE		0x800
 
 /* Creates an area, with initial segment [@base, @base + @size).  Allocs are in
  * units of @quantum.  If @source is provided, the arena will alloc new segments
@@ -124,10 +127,24 @@ void del_importing_slab(struct arena *source, struct kmem_cache *importer);
 /* Low-level memory allocator intefaces */
 extern struct arena *base_arena;
 extern struct arena *kpages_arena;
+/* NUMA: each memory node has its own self-sufficient base arena and a kpages
+ * arena sourced from it.  Node 0's are base_arena and kpages_arena.  Nodes
+ * without memory have NULL entries.  nr_arena_nodes is 1 until the arch code
+ * adds memory for another node, after the SRAT is parsed. */
+#define ARENA_MAX_NODES			8
+extern struct arena *base_arenas[ARENA_MAX_NODES];
+extern struct arena *kpages_arenas[ARENA_MAX_NODES];
+extern int nr_arena_nodes;
 struct arena *arena_builder(void *pgaddr, char *name, size_t quantum,
                             void *(*afunc)(struct arena *, size_t, int),
                             void (*ffunc)(struct arena *, void *, size_t),
                             struct arena *source, size_t qcache_max);
+/* Low-memory reclaim.  See arena.c. */
+bool arena_can_block(int flags);
+bool arena_wait_for_memory(size_t size);
+void arena_kick_reclaim(void);
+void arena_reclaim_init(void);
+
 /* Allocate directly from the nearest base allocator.  Used by other mm code.
  * Pass in your closest arena (such as your source) to help us find a base. */
 void *base_alloc(struct arena *guess, size_t size, int flags);
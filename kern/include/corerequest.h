@@ -11,6 +11,8 @@
 #include <arch/topology.h>
 #if defined(CONFIG_COREALLOC_FCFS)
   #include <corealloc_fcfs.h>
+#elif defined(CONFIG_COREALLOC_PACKED)
+  #include <corealloc_packed.h>
 #endif
 
 /* Initialize any data assocaited with doing core allocation. */
@@ -62,6 +64,17 @@ void __provision_core(struct proc *p, uint32_t pcoreid);
  * that uses * it holds a lock for the duration of the call. */
 void __unprovision_all_cores(struct proc *p);
 
+/* Ask the policy to keep p's cores off of hyperthreads whose sibling is busy,
+ * and to keep other procs off of p's siblings.  This is a preference, not a
+ * guarantee.  Returns 0 on success, -1 if the policy doesn't use topology.  This
+ * code assumes that the scheduler that uses it holds a lock for the duration of
+ * the call. */
+int __corealloc_proc_avoid_smt(struct proc *p, bool avoid);
+bool __corealloc_proc_avoids_smt(struct proc *p);
+
+/* The name of the core allocation policy, for reporting. */
+extern const char corealloc_policy_name[];
+
 /* Print the map of idle cores that are still allocatable through our core
  * allocation algorithm. */
 void print_idle_core_map(void);
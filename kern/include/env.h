@@ -16,6 +16,7 @@
 #include <arch/arch.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <bitmask.h>
 #include <mm.h>
 #include <vfs.h>
 #include <schedule.h>
@@ -33,6 +34,18 @@ struct username {
 void __set_username(struct username *u, char *name);
 void set_username(struct username *u, char *name);
 
+/* Preemption and notification accounting for an MCP's vcores, exported via
+ * #proc/PID/vcores.  The warn fields are under the proc_lock.  The notif fields
+ * are racy (proc_notify() doesn't lock), which is fine for stats. */
+struct vcore_stats {
+	uint64_t					nr_warns;
+	uint64_t					warn_tsc;		/* pending warning sent */
+	struct lat_hist				warn_to_yield;
+	uint64_t					nr_notifs;		/* IPIs that got through */
+	uint64_t					notif_tsc;		/* oldest unhandled IPI */
+	struct lat_hist				notif_lat;
+};
+
 #define PROC_PROGNAME_SZ 20
 // TODO: clean this up.
 struct proc {
@@ -70,6 +83,7 @@ struct proc {
 	struct vcore_tailq inactive_vcs;
 	/* Scheduler mgmt (info, data, whatever) */
 	struct sched_proc_data ksched_data;
+	struct vcore_stats *vc_stats;	/* max_vcores of them, once we're an MCP */
 
 	/* The args_base pointer is a user pointer which points to the base of
 	 * the executable boot block (where args, environment, aux vectors, ...)
@@ -80,10 +94,13 @@ struct proc {
 	// Address space
 	pgdir_t env_pgdir;			// Kernel virtual address of page dir
 	physaddr_t env_cr3;			// Physical address of page dir
-	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
+	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt), IRQs on */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
 	int vmr_history;
+	unsigned long vm_nr_jumbos;	/* PML2 user mappings, under pte_lock */
+	/* Cores that might have our cr3 loaded; see proc_load_cr3() */
+	DECL_BITMASK(tlb_cores, MAX_NUM_CORES);
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
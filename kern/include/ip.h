@@ -105,6 +105,7 @@ struct conv {
 	/* udp specific */
 	int headers;				/* data src/dst headers in udp */
 	int reliable;				/* true if reliable udp */
+	bool batch;					/* data reads/writes are framed vectors */
 
 	struct conv *incall;		/* calls waiting to be listened for */
 	struct conv *next;
@@ -142,9 +143,12 @@ struct medium {
 	int mintu;					/* default min mtu */
 	int maxtu;					/* default max mtu */
 	int maclen;					/* mac address length  */
+	bool gso;					/* can segment Btso blocks in software */
 	void (*bind) (struct Ipifc * unused_Ipifc, int unused_int,
 				  char **unused_char_pp_t);
 	void (*unbind) (struct Ipifc * unused_Ipifc);
+	/* medium specific ctl messages, called with the ifc rlocked */
+	void (*ctl) (struct Ipifc *ifc, char **argv, int argc);
 	void (*bwrite) (struct Ipifc * ifc,
 					struct block * b, int version, uint8_t * ip);
 
@@ -265,7 +269,9 @@ struct Ipmulti {
  *  hash table for 2 ip addresses + 2 ports
  */
 enum {
-	Nipht = 521,				/* convenient prime */
+	Nipht = 512,				/* initial buckets, power of 2 */
+	Lipht_max = 13,				/* log2 of the most buckets we'll grow to,
+								 * enough for tcp/udp's 4096 convs */
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -277,17 +283,38 @@ struct Iphash {
 	struct Iphash *next;
 	struct conv *c;
 	int match;
+	uint32_t hv;				/* full hash, for rehashing */
+};
+
+/* Readers walk a bucket without locking and retry if its seq changed under
+ * them; writers take the bucket's lock.  Iphash nodes are never freed, only
+ * recycled through the table's cache, so a reader racing with a removal can
+ * always follow its pointers. */
+struct Iphbucket {
+	seqlock_t lock;
+	struct Iphash *head;
+};
+
+struct Iphtab {
+	unsigned int nr_hash_bits;
+	struct Iphtab *retired;		/* older tables, readers may be in them */
+	struct Iphbucket b[];
 };
 
-struct Iphash;
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct Iphtab *tab;
+	atomic_t nr;				/* conversations hashed */
+	spinlock_t lock;			/* serializes resizes */
+	spinlock_t free_lock;
+	struct Iphash *free;		/* recycled nodes */
 };
+void iphtinit(struct Ipht *);
+void iphtdestroy(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
+uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp);
 void dump_ipht(struct Ipht *ht);
 
 /*
@@ -359,6 +386,8 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;		/* used as temp when reinjecting routes */
+	struct rtable *v4rt;		/* lookup snapshot of v4root */
+	struct rtable *v6rt;		/* lookup snapshot of v6root */
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -671,6 +700,8 @@ extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_scalar(uint8_t *addr, int len);
+extern uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
@@ -924,6 +955,7 @@ enum {
 	Nstatqid,
 	Ntypeqid,
 	Nifstatqid,
+	Nrssqid,
 };
 
 /*
@@ -954,6 +986,10 @@ struct netfile {
 	int nmaddr;					/* number of multicast addresses */
 
 	struct queue *in;			/* input buffer */
+	/* In-kernel reader that takes rss-steered frames directly, on the core
+	 * they were steered to, instead of through 'in' */
+	void (*rcv)(void *arg, struct block *bp);
+	void *rcv_arg;
 };
 
 /*
@@ -1063,6 +1099,22 @@ enum {
 	Ntypes = 8,
 };
 
+enum {
+	Nrss = 128,					/* rx steering indirection table entries */
+	Ngroflow = 8,				/* tcp flows coalesced at once per ether */
+	Ngroseg = 44,				/* max segments merged into one packet */
+};
+
+/* A v4 tcp flow being coalesced by etheriq (software GRO).  The head
+ * segment's headers describe the whole packet, later payloads hang off its
+ * extra_data. */
+struct ethergro {
+	struct block *bp;
+	uint32_t nextseq;			/* seq of the next in-order segment */
+	uint16_t mss;				/* payload size of the head segment */
+	uint16_t nseg;
+};
+
 struct ether {
 	rwlock_t rwlock;
 	int ctlrno;
@@ -1094,10 +1146,25 @@ struct ether {
 	int nvlan;
 	struct ether *vlans[MaxFID];
 
+	/* Set by drivers that call etheriqflush() at the end of each rx batch.
+	 * Only touched from the driver's (single) rx context. */
+	bool gro;
+	int ngro;
+	struct ethergro groflow[Ngroflow];
+
+	/* Software RSS: received flows hash into rss[], which names the core
+	 * that demuxes them, and that runs the protocol input for netfiles with
+	 * an rcv hook. */
+	bool rss_on;
+	uint16_t rss[Nrss];
+
 	struct netif;
 };
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern void etheriqflush(struct ether *);
+extern int etherrcvhook(struct chan *, void (*)(void *, struct block *),
+                        void *);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -0,0 +1,23 @@
+/* Copyright (c) 2015 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Cheap latency histograms, with power-of-two usec buckets.  Bucket 0 is
+ * anything under 1 usec, bucket i is [2^(i-1), 2^i) usec, and the last bucket
+ * takes everything bigger.  Callers provide whatever locking they need. */
+
+#pragma once
+
+#include <common.h>
+
+#define LAT_HIST_BUCKETS		20
+
+struct lat_hist {
+	uint64_t					nr;
+	uint64_t					sum_ticks;
+	uint64_t					max_ticks;
+	uint32_t					buckets[LAT_HIST_BUCKETS];
+};
+
+void lat_hist_add(struct lat_hist *h, uint64_t ticks);
+void lat_hist_merge(struct lat_hist *to, struct lat_hist *from);
+char *seprint_lat_hist(char *s, char *e, const char *name, struct lat_hist *h);
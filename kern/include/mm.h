@@ -14,6 +14,7 @@
 #include <slab.h>
 
 struct file;
+struct page;
 struct proc;								/* preprocessor games */
 
 /* Basic structure defining a region of a process's virtual memory.  Note we
@@ -68,6 +69,7 @@ int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
+int map_netbuf_page(struct proc *p, struct page *page, uintptr_t va);
 
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
@@ -372,8 +372,17 @@ struct extra_bdata {
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	/* ptclbsum() of the first sum_len bytes at base, if nonzero.  Only good
+	 * while the entry still covers exactly those bytes; see ebd_sum_ok(). */
+	uint32_t sum_len;
+	uint16_t sum;
 };
 
+static inline bool ebd_sum_ok(struct extra_bdata *ebd)
+{
+	return ebd->sum_len && !ebd->off && ebd->len == ebd->sum_len;
+}
+
 struct block {
 	struct block *next;
 	struct block *list;
@@ -394,6 +403,19 @@ struct block {
 	struct extra_bdata *extra_data;
 };
 #define BLEN(s)	((s)->wp - (s)->rp + (s)->extra_len)
+
+/* A driver's pool of page-sized rx payload buffers.  Blocks reference them
+ * through extra_data like any other buffer, but a zero-copy read can map a
+ * whole page into the reader instead of copying it.  When the last block or
+ * user mapping lets go of a page, it goes back on the pool's free list for the
+ * driver to reuse. */
+struct block_page_pool {
+	spinlock_t lock;
+	BSD_LIST_HEAD(, page) free;
+	unsigned int nr_free;
+	unsigned int max_free;		/* beyond this, pages go back to the kernel */
+};
+
 #define BHLEN(s) ((s)->wp - (s)->rp)
 #define BALLOC(s) ((s)->lim - (s)->base + (s)->extra_len)
 
@@ -638,6 +660,8 @@ enum {
 	Qcoalesce		= (1 << 3),	/* coalesce empty packets on read */
 	Qkick			= (1 << 4),	/* always call the kick routine after qwrite */
 	Qdropoverflow	= (1 << 5),	/* writes that would block will be dropped */
+	Qzerocopy		= (1 << 6),	/* map whole payload pages on read */
+	Qcsum			= (1 << 7),	/* checksum writes while copying them in */
 };
 
 #define DEVDOTDOT -1
@@ -657,6 +681,16 @@ struct block *block_alloc(size_t, int);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+void block_page_pool_init(struct block_page_pool *pool, unsigned int max_free);
+void block_page_pool_drain(struct block_page_pool *pool);
+struct page *block_page_alloc(struct block_page_pool *pool, int mem_flags);
+int block_append_page(struct block *b, struct page *page, uint32_t off,
+                      uint32_t len, int mem_flags);
+struct block *block_from_page(struct page *page, uint32_t off, uint32_t len,
+                              uint32_t hdr_len, int mem_flags);
+struct page *block_extra_page(uintptr_t base);
+void block_extra_incref(uintptr_t base);
+void block_extra_decref(uintptr_t base);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
@@ -690,6 +724,7 @@ void cons_add_char(char c);
 void copen(struct chan *);
 struct block *copyblock(struct block *b, int mem_flags);
 int cread(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t);
+long creadahead(struct chan *, int64_t, long);
 struct chan *cunique(struct chan *);
 struct chan *createdir(struct chan *, struct mhead *);
 void cunmount(struct chan *, struct chan *);
@@ -842,18 +877,24 @@ size_t q_bytes_read(struct queue *q);
 void qdropoverflow(struct queue *, bool);
 void q_toggle_qmsg(struct queue *q, bool onoff);
 void q_toggle_qcoalesce(struct queue *q, bool onoff);
+void q_toggle_zerocopy(struct queue *q, bool onoff);
+void q_toggle_csum(struct queue *q, bool onoff);
 struct queue *qopen(int unused_int, int, void (*)(void *), void *);
 ssize_t qpass(struct queue *, struct block *);
 ssize_t qpassnolim(struct queue *, struct block *);
 void qputback(struct queue *, struct block *);
 size_t qread(struct queue *q, void *va, size_t len);
 size_t qread_nonblock(struct queue *q, void *va, size_t len);
+size_t qread_msgs(struct queue *q, void *va, size_t len);
+size_t qread_msgs_nonblock(struct queue *q, void *va, size_t len);
 void qreopen(struct queue *);
 void qsetlimit(struct queue *, size_t);
 size_t qgetlimit(struct queue *);
 int qwindow(struct queue *);
 ssize_t qwrite(struct queue *, void *, int);
 ssize_t qwrite_nonblock(struct queue *, void *, int);
+ssize_t qwrite_msgs(struct queue *q, void *va, size_t len);
+ssize_t qwrite_msgs_nonblock(struct queue *q, void *va, size_t len);
 typedef void (*qio_wake_cb_t)(struct queue *q, void *data, int filter);
 void qio_set_wake_cb(struct queue *q, qio_wake_cb_t func, void *data);
 bool qreadable(struct queue *q);
@@ -978,6 +1019,7 @@ int sysstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *);
 long syswrite(int fd, void *va, long n);
 long syspwrite(int fd, void *va, long n, int64_t off);
+long syssendpm(int fd, struct page_map *pm, int64_t off, long n);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
 struct dir *sysdirstat(char *name);
@@ -32,6 +32,8 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_JUMBO		0x040	/* part of a user jumbo page */
+#define PG_NETBUF		0x080	/* block payload page, see block_page_alloc() */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -47,6 +49,7 @@ struct page {
 	void						*pg_private;	/* type depends on page usage */
 	struct semaphore 			pg_sem;		/* for blocking on IO */
 	uint64_t				gpa;		/* physical address in guest */
+	atomic_t					pg_nr_refs;	/* PG_NETBUF: block and PTE refs */
 
 	bool						pg_is_free;	/* TODO: will remove */
 };
@@ -57,6 +60,9 @@ extern page_list_t page_free_list;
 
 /*************** Functional Interface *******************/
 void base_arena_init(struct multiboot_info *mbi);
+void numa_arenas_init(void);
+void numa_add_memory(int node, void *base, size_t len);
+size_t numa_nr_remote_allocs(int node);
 
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
 error_t kpage_alloc(page_t **page);
@@ -68,11 +74,22 @@ void *kpage_zalloc_addr(void);
 void *kpages_alloc(size_t size, int flags);
 void *kpages_zalloc(size_t size, int flags);
 void kpages_free(void *addr, size_t size);
+void kpages_pcpu_init(void);
+void kpages_pcpu_drain(void);
+size_t kpages_pcpu_nr_cached(void);
+void kpages_pcpu_stats(size_t *refills, size_t *drains, size_t *steals);
 
 void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
+void jumbo_arena_init(void);
+void *jumbo_page_alloc(size_t nr, int flags);
+void jumbo_page_free(void *buf, size_t nr);
+struct page *jumbo_upage_alloc(bool zero);
+void jumbo_upage_decref(struct page *page, unsigned long nr_pgs);
+
 void page_decref(page_t *page);
+void block_page_decref(struct page *page);
 
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
@@ -32,7 +32,7 @@ struct page_map {
 	struct radix_tree			pm_tree;		/* tracks present pages */
 	unsigned long				pm_num_pages;	/* how many pages are present */
 	struct page_map_operations	*pm_op;
-	spinlock_t					pm_lock;
+	spinlock_t					pm_lock;		/* take with IRQs on */
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
 };
@@ -62,6 +62,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+void pm_incref_page(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
@@ -147,12 +147,14 @@ void __unmap_vcore(struct proc *p, uint32_t vcoreid);
 void vcore_account_online(struct proc *p, uint32_t vcoreid);
 void vcore_account_offline(struct proc *p, uint32_t vcoreid);
 uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid);
+char *proc_seprint_vcores(struct proc *p, char *s, char *e);
 
 /* Preemption management.  Some of these will change */
 void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when);
 void __proc_preempt_warnall(struct proc *p, uint64_t when);
 void __proc_preempt_core(struct proc *p, uint32_t pcoreid);
 uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr);
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t when);
 bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
 void proc_preempt_all(struct proc *p, uint64_t usec);
 
@@ -161,8 +163,34 @@ uintptr_t switch_to(struct proc *new_p);
 void switch_back(struct proc *new_p, uintptr_t old_ret);
 void abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
+void proc_load_cr3(struct proc *p);
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
 
+/* Batched TLB shootdowns.  Add the ranges of every PTE you changed, then flush
+ * once when you're done.  Adjacent and overlapping ranges are coalesced.  Past
+ * TLB_FLUSH_ALL_PGS pages or TLB_BATCH_MAX_RANGES ranges, we just flush the
+ * whole TLB. */
+#define TLB_BATCH_MAX_RANGES	8
+#define TLB_FLUSH_ALL_PGS		32
+
+struct tlb_range {
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+struct tlb_batch {
+	struct proc					*p;
+	bool						flush_all;
+	unsigned int				nr_ranges;
+	unsigned long				nr_pgs;
+	atomic_t					nr_pending;
+	struct tlb_range			ranges[TLB_BATCH_MAX_RANGES];
+};
+
+void tlb_batch_init(struct tlb_batch *tb, struct proc *p);
+void tlb_batch_add(struct tlb_batch *tb, uintptr_t start, uintptr_t end);
+void tlb_batch_flush(struct tlb_batch *tb);
+
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
 void __set_curctx(uint32_t srcid, long a0, long a1, long a2);
@@ -10,16 +10,76 @@
 
 #include <ros/common.h>
 #include <sys/queue.h>
+#include <rbtree.h>
 #include <corerequest.h>
+#include <lat_hist.h>
 
 struct proc;	/* process.h includes us, but we need pointers now */
+struct scp_runq;
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
 
+/* QoS classes, lowest first.  MCPs only preempt MCPs of a lower class, other
+ * than to get their guaranteed minimum. */
+enum {
+	SCHED_QOS_BATCH,
+	SCHED_QOS_NORMAL,
+	SCHED_QOS_LATENCY,
+	NR_SCHED_QOS,
+};
+
+/* What an MCP is entitled to.  Shares are weights relative to the other MCPs.
+ * Latency MCPs may preempt lower classes until they have their weighted share
+ * of the cores.  Anyone may preempt anyone to get min_cores; the ksched won't
+ * promise more minimums than it has cores.  max_cores caps what an MCP gets,
+ * even if it wants more, and 0 means no cap. */
+struct sched_qos {
+	int							class;
+	unsigned int				shares;
+	unsigned int				min_cores;
+	unsigned int				max_cores;
+};
+
+/* Core reclaims, from the point of view of the victim: warnings sent, cores
+ * given back before the deadline, cores taken at the deadline, and reclaims
+ * called off (the victim died, or something else took the core first). */
+struct sched_qos_stats {
+	uint64_t					warned;
+	uint64_t					honoured;
+	uint64_t					forced;
+	uint64_t					cancelled;
+};
+
+/* Where an MCP that wants more cores sorts among the others that do.  Lower
+ * sorts first. */
+struct mcp_needy_key {
+	bool						prov;				/* has prov'd cores to claim */
+	bool						claim;				/* QoS says it's owed cores */
+	int							class;				/* QoS class, higher first */
+	uint32_t					usage;				/* granted per share */
+	uint32_t					granted;			/* cores it had when queued */
+	uint64_t					seq;				/* FIFO among equals */
+};
+
 /* One of these embedded in every struct proc */
 struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
+	struct scp_runq				*runq;				/* SCP runq we're on */
+	int							scp_core;			/* where the SCP last ran */
+	TAILQ_ENTRY(proc)			demand_link;		/* on the demand queue */
+	bool						demand_posted;
+	struct rb_node				needy_node;			/* in the needy tree */
+	bool						needy;
+	struct mcp_needy_key		needy_key;
+	uint64_t					needy_gen;			/* ksched run that served us */
 	struct core_request_data	crd;				/* prov/alloc cores */
+	struct sched_qos			qos;
+	struct sched_qos_stats		qos_stats;			/* as a victim */
+	unsigned int				qos_gaining;		/* reclaims for us */
+	unsigned int				qos_losing;			/* reclaims from us */
+	uint64_t					need_tsc;			/* when we got needy */
+	struct lat_hist				grant_lat;			/* needy to granted */
+	struct sched_mcp_ops		*mcp_ops;			/* NULL: the proc code */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -82,9 +142,45 @@ void put_idle_core(int coreid);
  * schedulers. */
 int provision_core(struct proc *p, uint32_t pcoreid);
 
+/* Asks the core allocation policy to keep p's cores off of hyperthreads whose
+ * sibling is busy.  Returns 0 on success, -1 and sets errno o/w (ENOTSUP if the
+ * policy doesn't use topology). */
+int sched_proc_avoid_smt(struct proc *p, bool avoid);
+
+/************** QoS *************/
+/* Gets and sets p's QoS.  Setting returns 0 on success, -1 and sets errno o/w
+ * (EBUSY if the minimums would add up to more cores than MCPs can have).
+ * Preemptions for QoS warn the victim usec ahead of time. */
+void sched_proc_get_qos(struct proc *p, struct sched_qos *qos);
+int sched_proc_set_qos(struct proc *p, struct sched_qos *qos);
+void sched_set_qos_warn_usec(uint64_t usec);
+
+/* How the ksched gives an MCP cores and, for QoS, warns and preempts it.  Procs
+ * use the proc code unless their ksched_data.mcp_ops says otherwise, which only
+ * the ktests' fake MCPs (that never run) do, between registering and
+ * change_to_m.  give_cores returns 0 on success; the others return TRUE if p
+ * had pcoreid. */
+struct sched_mcp_ops {
+	int (*give_cores)(struct proc *p, uint32_t *pc_arr, uint32_t num);
+	bool (*warn_core)(struct proc *p, uint32_t pcoreid, uint64_t when);
+	bool (*preempt_core)(struct proc *p, uint32_t pcoreid);
+};
+
+/************** SCP cores *************/
+/* SCPs run on the LL core plus any cores added here.  Added cores come out of
+ * the CG idle pool, so MCPs can neither be allocated nor provisioned them until
+ * they are removed.  Both return 0 on success, -1 and set errno o/w. */
+int sched_add_scp_core(uint32_t pcoreid);
+int sched_del_scp_core(uint32_t pcoreid);
+bool is_scp_core(uint32_t pcoreid);
+
 /************** Debugging **************/
 void sched_diag(void);
 void print_resources(struct proc *p);
 void print_all_resources(void);
 void next_core_to_alloc(uint32_t pcoreid);
 void sort_idle_cores(void);
+/* Returns the core the ksched would allocate to p next, or -1.  Allocates
+ * nothing. */
+int sched_peek_core(struct proc *p);
+char *sched_seprint_cores(struct proc *p, char *s, char *e);
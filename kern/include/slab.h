@@ -59,7 +59,12 @@ struct kmem_pcpu_cache {
 	unsigned int				magsize;
 	struct kmem_magazine		*loaded;
 	struct kmem_magazine		*prev;
-	size_t						nr_allocs_ever;
+	size_t						nr_allocs_ever;	/* served by a magazine */
+	/* Stats, only touched by this core with IRQs disabled */
+	size_t						nr_depot_allocs;	/* mag from the depot */
+	size_t						nr_slab_allocs;		/* fell to the slabs */
+	size_t						nr_imports;			/* grew from source */
+	size_t						nr_depot_contended;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct kmem_depot {
@@ -71,6 +76,11 @@ struct kmem_depot {
 	unsigned int				nr_not_empty;
 	unsigned int				busy_count;
 	uint64_t					busy_start;
+	uint64_t					last_contended;
+	/* Stats */
+	uint64_t					nr_contended;
+	unsigned int				nr_grows;
+	unsigned int				nr_shrinks;
 };
 
 struct kmem_slab;
@@ -21,19 +21,20 @@
  * the base arena using an aligned allocation helper for its afunc.  I think,
  * without a lot of thought, that the fragmentation would be equivalent.
  *
- * In the future, we can set up N base_arenas, one for each NUMA domain, each of
- * which is a source for other NUMA allocators, e.g. kpages_i_arena.  Higher
- * level allocators (kmalloc()) will need to choose a NUMA domain and call into
- * the correct allocator.  Each NUMA base arena is self-sufficient: they have no
- * qcaches and their BTs come from their own free page list.  This just
- * replicates the default memory allocator across each NUMA node, and at some
- * point, some generic allocator software needs to pick which node to pull from.
+ * We set up N base_arenas, one for each NUMA domain, each of which is a source
+ * for other NUMA allocators, e.g. kpages_i_arena.  Higher level allocators
+ * (kpages_alloc(), and thus kmalloc() and the slabs) choose a NUMA domain and
+ * call into the correct allocator.  Each NUMA base arena is self-sufficient:
+ * they have no qcaches and their BTs come from their own free page list.  This
+ * just replicates the default memory allocator across each NUMA node, and at
+ * some point, some generic allocator software needs to pick which node to pull
+ * from.
  * I tried to keep assumptions about a single base_arena to a minimum, but
  * you'll see some places where the arena code needs to find some base arena for
  * its BT allocations.  Also note that the base setup happens before we know
- * about NUMA domains.  The plan is to do a small part of domain 0 during
- * pmem_init(), then once we know the full memory layout, add in the rest of
- * domain 0's memory and bootstrap the other domains.
+ * about NUMA domains.  We do a small part of domain 0 during pmem_init(), then
+ * once we know the full memory layout (the SRAT), add in the rest of domain 0's
+ * memory and bootstrap the other domains.  See numa_arenas_init().
  *
  * When it comes to importing spans, it's not clear whether or not we should
  * import exactly the current allocation request or to bring in more.  If we
@@ -44,13 +45,18 @@
  * for a *while*, and possibly require a reclaim callback.  In the meantime, I
  * added a per-arena scaling factor where we can adjust how much we import.
  *
- * TODO:
- * - Blocking.  We'll probably want to reserve some memory for emergencies to
- *   help us get out of OOM.  So we might block when we're at low-mem, not at 0.
- *   We probably should have a sorted list of desired amounts, and unblockers
- *   poke the CV if the first waiter is likely to succeed.
- * - Reclaim: have a ktask that sleeps on a rendez.  We poke it, even from IRQ
- *   context.  It qlocks arenas_and_slabs_lock, then does the reclaim.
+ * Low memory: each base arena keeps a reserve (1/ARENA_MIN_RESERVE_DIV of its
+ * memory) for callers that can't block.  Callers that can block and would dip
+ * into the reserve instead wait on a list sorted by size.  Frees to a base
+ * arena wake the waiters, smallest first, while it looks like there's enough
+ * memory.  When an arena drops below its low watermark
+ * (1/ARENA_LOW_WATERMARK_DIV free), or someone blocks, we poke the reclaim
+ * ktask, even from IRQ context.  It qlocks arenas_and_slabs_lock and walks each
+ * base arena's importers, reaping the slab caches: depot magazines and empty
+ * slabs go back to their sources, and spans that become entirely free go back
+ * to theirs.  Waiters that were already waiting when a reclaim pass started and
+ * still don't fit after it are woken with failure; they get one try at the
+ * reserve before we give up.
  *
  * FAQ:
  * - Does allocating memory from an arena require it to take a btag?  Yes -
@@ -78,12 +84,19 @@
 #include <hash.h>
 #include <slab.h>
 #include <kthread.h>
+#include <rendez.h>
+#include <smp.h>
+#include <trap.h>
+#include <page_alloc.h>
 
 struct arena_tailq all_arenas = TAILQ_HEAD_INITIALIZER(all_arenas);
 qlock_t arenas_and_slabs_lock = QLOCK_INITIALIZER(arenas_and_slabs_lock);
 
 struct arena *base_arena;
 struct arena *kpages_arena;
+struct arena *base_arenas[ARENA_MAX_NODES];
+struct arena *kpages_arenas[ARENA_MAX_NODES];
+int nr_arena_nodes = 1;
 
 /* Misc helpers and forward declarations */
 static struct btag *__get_from_freelists(struct arena *arena, int list_idx);
@@ -95,15 +108,48 @@ static void __try_hash_resize(struct arena *arena, int flags,
                               void **to_free_addr, size_t *to_free_sz);
 static void __arena_asserter(struct arena *arena);
 void print_arena_stats(struct arena *arena, bool verbose);
+static void wake_arena_waiters(bool fail_stale);
+
+/* Low memory watermarks for base arenas, as fractions of their total memory. */
+#define ARENA_LOW_WATERMARK_DIV		32
+#define ARENA_MIN_RESERVE_DIV		128
+/* Minimum time between reclaim passes, unless someone is blocked.  Passes that
+ * don't get back 1/ARENA_RECLAIM_GAIN_DIV of the base arenas' memory double
+ * the time, up to the max. */
+#define ARENA_RECLAIM_PERIOD_US		100000
+#define ARENA_RECLAIM_MAX_PERIOD_US	(64 * ARENA_RECLAIM_PERIOD_US)
+#define ARENA_RECLAIM_GAIN_DIV		256
+
+struct arena_waiter {
+	TAILQ_ENTRY(arena_waiter)	link;
+	size_t						size;
+	unsigned long				gen;
+	bool						ok;
+	struct semaphore			sem;
+};
+TAILQ_HEAD(arena_waiter_tailq, arena_waiter);
+
+static spinlock_t reclaim_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct arena_waiter_tailq reclaim_waiters =
+                                 TAILQ_HEAD_INITIALIZER(reclaim_waiters);
+static unsigned int nr_reclaim_waiters;
+static unsigned long reclaim_gen;
+static struct rendez reclaim_rv;
+static bool reclaim_kicked;
+static bool reclaim_ready;
 
 /* For NUMA situations, where there are multiple base arenas, we'll need a way
- * to find *some* base arena.  Ideally, it'll be in the same NUMA domain as
- * arena. */
+ * to find *some* base arena.  We walk down the sources until we find a base, so
+ * that an arena's BTs, hash tables, and qcaches come from its own NUMA node.
+ * Callers that pass NULL get base_arena; they must pass NULL for the free too,
+ * so we can't pick based on the calling core. */
 static struct arena *find_my_base(struct arena *arena)
 {
-	/* TODO: could walk down sources until is_base is set.  But barring that,
-	 * we'd still need a way to find a base arena for some other allocator that
-	 * just wants a page.  arena may be NULL, so handle that. */
+	while (arena) {
+		if (arena->is_base)
+			return arena;
+		arena = arena->source;
+	}
 	return base_arena;
 }
 
@@ -136,6 +182,7 @@ static void arena_init(struct arena *arena, char *name, size_t quantum,
                        struct arena *source, size_t qcache_max)
 {
 	static_assert((ARENA_ALLOC_STYLES & MEM_FLAGS) == 0);
+	static_assert(((ARENA_ALLOC_STYLES | MEM_FLAGS) & ARENA_NO_RESERVE) == 0);
 
 	spinlock_init_irqsave(&arena->lock);
 	arena->import_scale = 0;
@@ -574,6 +621,26 @@ static void *__alloc_instantfit(struct arena *arena, size_t size)
 	return (void*)ret->start;
 }
 
+/* Base arenas keep a reserve of free memory for callers that can't block.
+ * Returns FALSE if allocating @size would dip into it and @flags says not to.
+ * Hold the lock. */
+static bool __base_has_room(struct arena *arena, size_t size, int flags)
+{
+	if (!arena->is_base || !(flags & ARENA_NO_RESERVE))
+		return TRUE;
+	return arena_amt_free(arena) >= size + arena->amt_total_segs /
+	                                       ARENA_MIN_RESERVE_DIV;
+}
+
+/* Hold the lock. */
+static bool __base_below_low(struct arena *arena)
+{
+	if (!arena->is_base)
+		return FALSE;
+	return arena_amt_free(arena) < arena->amt_total_segs /
+	                               ARENA_LOW_WATERMARK_DIV;
+}
+
 /* Non-qcache allocation.  Hold the arena's lock.  Note that all allocations are
  * done in multiples of the quantum. */
 static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
@@ -581,12 +648,18 @@ static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
 	void *ret;
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
+	bool low;
 
 	spin_lock_irqsave(&arena->lock);
 	if (!__get_enough_btags(arena, 1, flags & MEM_FLAGS)) {
 		spin_unlock_irqsave(&arena->lock);
 		return NULL;
 	}
+	if (!__base_has_room(arena, size, flags)) {
+		spin_unlock_irqsave(&arena->lock);
+		arena_kick_reclaim();
+		return NULL;
+	}
 	if (flags & ARENA_BESTFIT)
 		ret = __alloc_bestfit(arena, size);
 	else if (flags & ARENA_NEXTFIT)
@@ -595,9 +668,12 @@ static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
 		ret = __alloc_instantfit(arena, size);
 	/* Careful, this will unlock and relock.  It's OK right before an unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
+	low = __base_below_low(arena);
 	spin_unlock_irqsave(&arena->lock);
 	if (to_free_addr)
 		base_free(arena, to_free_addr, to_free_sz);
+	if (low)
+		arena_kick_reclaim();
 	return ret;
 }
 
@@ -662,8 +738,9 @@ void *arena_add(struct arena *arena, void *base, size_t size, int flags)
 }
 
 /* Attempt to get more resources, either from a source or by blocking.  Returns
- * TRUE if we got something.  FALSE on failure (e.g. MEM_ATOMIC). */
-static bool get_more_resources(struct arena *arena, size_t size, int flags)
+ * TRUE if we got something, or if the caller should try again.  FALSE on
+ * failure (e.g. MEM_ATOMIC).  We may clear ARENA_NO_RESERVE in @flags. */
+static bool get_more_resources(struct arena *arena, size_t size, int *flags)
 {
 	void *span;
 	size_t import_size;
@@ -671,18 +748,26 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 	/* MAX check, in case size << scale overflows */
 	import_size = MAX(size, size << arena->import_scale);
 	if (arena->source) {
-		span = arena->afunc(arena->source, import_size, flags);
+		span = arena->afunc(arena->source, import_size, *flags);
 		if (!span)
 			return FALSE;
-		if (!__arena_add(arena, span, import_size, flags)) {
+		if (!__arena_add(arena, span, import_size, *flags)) {
 			/* We could fail if MEM_ATOMIC and we couldn't get a BT */
 			warn("Excessively rare failure, tell brho");
 			arena->ffunc(arena->source, span, import_size);
 			return FALSE;
 		}
 	} else {
-		/* TODO: allow blocking */
-		if (!(flags & MEM_ATOMIC))
+		/* Only base arenas have reserves, and only the reclaimer can give
+		 * them more memory. */
+		if (arena->is_base && (*flags & ARENA_NO_RESERVE) &&
+		    !(*flags & MEM_ATOMIC)) {
+			/* If the reclaimer couldn't help, try the reserve. */
+			if (!arena_wait_for_memory(size))
+				*flags &= ~ARENA_NO_RESERVE;
+			return TRUE;
+		}
+		if (!(*flags & MEM_ATOMIC))
 			panic("OOM!");
 		return FALSE;
 	}
@@ -705,6 +790,8 @@ void *arena_alloc(struct arena *arena, size_t size, int flags)
 	size = ROUNDUP(size, arena->quantum);
 	if (!size)
 		panic("Arena %s, request for zero", arena->name);
+	if (arena_can_block(flags))
+		flags |= ARENA_NO_RESERVE;
 	if (size <= arena->qcache_max) {
 		/* NEXTFIT is an error, since free won't know to skip the qcache and
 		 * then we'd be handing an item to the qcache that it didn't alloc. */
@@ -733,7 +820,7 @@ void *arena_alloc(struct arena *arena, size_t size, int flags)
 		 * the BESTFIT list is likely ours, downgrading makes sense. */
 		flags &= ~ARENA_ALLOC_STYLES;
 		flags |= ARENA_BESTFIT;
-		if (!get_more_resources(arena, size, flags))
+		if (!get_more_resources(arena, size, &flags))
 			return NULL;
 	}
 }
@@ -921,6 +1008,7 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 	void *ret;
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
+	bool low;
 
 	spin_lock_irqsave(&arena->lock);
 	/* Need two, since we might split a BT into 3 BTs. */
@@ -928,6 +1016,11 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 		spin_unlock_irqsave(&arena->lock);
 		return NULL;
 	}
+	if (!__base_has_room(arena, size, flags)) {
+		spin_unlock_irqsave(&arena->lock);
+		arena_kick_reclaim();
+		return NULL;
+	}
 	if (minaddr || maxaddr) {
 		ret = __xalloc_min_max(arena, size, align, phase, nocross,
 		                       (uintptr_t)minaddr, (uintptr_t)maxaddr);
@@ -944,9 +1037,12 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 	}
 	/* Careful, this will unlock and relock.  It's OK right before an unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
+	low = __base_below_low(arena);
 	spin_unlock_irqsave(&arena->lock);
 	if (to_free_addr)
 		base_free(arena, to_free_addr, to_free_sz);
+	if (low)
+		arena_kick_reclaim();
 	return ret;
 }
 
@@ -978,6 +1074,8 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 	if (align + phase < align)
 		panic("Arena %s, align %p + phase %p overflow%p", arena->name, align,
 		      phase);
+	if (arena_can_block(flags))
+		flags |= ARENA_NO_RESERVE;
 	/* Ok, it's a pain to import resources from a source such that we'll be able
 	 * to guarantee we make progress without stranding resources if we have
 	 * nocross or min/maxaddr.  For min/maxaddr, when we ask the source, we
@@ -1017,7 +1115,7 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 		if (req_size < size)
 			panic("Arena %s, size %p + align %p + phase %p overflow",
 			      arena->name, size, align, phase);
-		if (!get_more_resources(arena, req_size, flags))
+		if (!get_more_resources(arena, req_size, &flags))
 			return NULL;
 		/* Our source may have given us a segment that is on the BESTFIT list,
 		 * same as with arena_alloc. */
@@ -1111,6 +1209,8 @@ static void free_from_arena(struct arena *arena, void *addr, size_t size)
 	spin_unlock_irqsave(&arena->lock);
 	if (to_free_addr)
 		arena->ffunc(arena->source, to_free_addr, to_free_sz);
+	if (arena->is_base && nr_reclaim_waiters)
+		wake_arena_waiters(FALSE);
 }
 
 void arena_free(struct arena *arena, void *addr, size_t size)
@@ -1240,3 +1340,185 @@ void base_free(struct arena *guess, void *addr, size_t size)
 {
 	return arena_free(find_my_base(guess), addr, size);
 }
+
+/* Returns TRUE if a caller passing @flags could block for memory.  Those
+ * callers stay out of the base arenas' reserves. */
+bool arena_can_block(int flags)
+{
+	if (flags & MEM_ATOMIC)
+		return FALSE;
+	if (!reclaim_ready || !irq_is_enabled())
+		return FALSE;
+	return can_block(&per_cpu_info[core_id()]);
+}
+
+/* Helper: how much memory the base arenas have above their reserves.  This is
+ * racy and ignores fragmentation; it's just a guess at who should wake. */
+static size_t base_amt_avail(void)
+{
+	struct arena *base;
+	size_t avail = 0, free, reserve;
+
+	for (int i = 0; i < nr_arena_nodes; i++) {
+		base = base_arenas[i];
+		if (!base)
+			continue;
+		free = arena_amt_free(base);
+		reserve = base->amt_total_segs / ARENA_MIN_RESERVE_DIV;
+		if (free > reserve)
+			avail += free - reserve;
+	}
+	return avail;
+}
+
+/* Helper: the total memory in the base arenas. */
+static size_t base_amt_total(void)
+{
+	size_t total = 0;
+
+	for (int i = 0; i < nr_arena_nodes; i++) {
+		if (base_arenas[i])
+			total += base_arenas[i]->amt_total_segs;
+	}
+	return total;
+}
+
+/* Wakes blocked allocators, smallest first, while it looks like there's enough
+ * memory for them.  If @fail_stale, we also wake, with failure, anyone who was
+ * waiting before the current reclaim pass started. */
+static void wake_arena_waiters(bool fail_stale)
+{
+	struct arena_waiter *w_i, *temp;
+	size_t avail = base_amt_avail();
+
+	spin_lock_irqsave(&reclaim_lock);
+	TAILQ_FOREACH_SAFE(w_i, &reclaim_waiters, link, temp) {
+		if (w_i->size <= avail) {
+			avail -= w_i->size;
+			w_i->ok = TRUE;
+		} else if (fail_stale && w_i->gen != reclaim_gen) {
+			w_i->ok = FALSE;
+		} else {
+			/* The list is sorted, so no one else fits either. */
+			if (!fail_stale)
+				break;
+			continue;
+		}
+		TAILQ_REMOVE(&reclaim_waiters, w_i, link);
+		nr_reclaim_waiters--;
+		/* IRQs are disabled, so this is the same as sem_up_irqsave(). */
+		sem_up(&w_i->sem);
+	}
+	spin_unlock_irqsave(&reclaim_lock);
+}
+
+/* Blocks until it looks like the base arenas can give us @size without dipping
+ * into their reserves.  Returns FALSE if the reclaimer couldn't find enough, or
+ * if we can't block yet. */
+bool arena_wait_for_memory(size_t size)
+{
+	struct arena_waiter w, *w_i;
+	int8_t irq_state = 0;
+
+	if (!reclaim_ready)
+		return FALSE;
+	w.size = size;
+	w.ok = FALSE;
+	sem_init_irqsave(&w.sem, 0);
+	spin_lock_irqsave(&reclaim_lock);
+	w.gen = reclaim_gen;
+	TAILQ_FOREACH(w_i, &reclaim_waiters, link) {
+		if (w_i->size > size)
+			break;
+	}
+	if (w_i)
+		TAILQ_INSERT_BEFORE(w_i, &w, link);
+	else
+		TAILQ_INSERT_TAIL(&reclaim_waiters, &w, link);
+	nr_reclaim_waiters++;
+	spin_unlock_irqsave(&reclaim_lock);
+	arena_kick_reclaim();
+	sem_down_irqsave(&w.sem, &irq_state);
+	return w.ok;
+}
+
+/* Pokes the reclaim ktask.  Safe to call from IRQ context. */
+void arena_kick_reclaim(void)
+{
+	if (!reclaim_ready || reclaim_kicked)
+		return;
+	reclaim_kicked = TRUE;
+	rendez_wakeup(&reclaim_rv);
+}
+
+/* Reaps everything that imports from @arena, depth first, so that memory freed
+ * by an importer can make it all the way back to the base arena.  The qcaches
+ * go after the other slabs, since those slabs may have freed into them.  Hold
+ * arenas_and_slabs_lock. */
+static void __arena_reclaim(struct arena *arena)
+{
+	struct arena *a_i;
+	struct kmem_cache *kc_i;
+
+	TAILQ_FOREACH(a_i, &arena->__importing_arenas, import_link)
+		__arena_reclaim(a_i);
+	TAILQ_FOREACH(kc_i, &arena->__importing_slabs, import_link) {
+		if (!(kc_i->flags & KMC_QCACHE))
+			kmem_cache_reap(kc_i);
+	}
+	TAILQ_FOREACH(kc_i, &arena->__importing_slabs, import_link) {
+		if (kc_i->flags & KMC_QCACHE)
+			kmem_cache_reap(kc_i);
+	}
+}
+
+static int reclaim_kicked_cond(void *arg)
+{
+	return reclaim_kicked;
+}
+
+static void arena_reclaim_ktask(void *arg)
+{
+	uint64_t period = ARENA_RECLAIM_PERIOD_US;
+	size_t before, after;
+
+	while (1) {
+		rendez_sleep(&reclaim_rv, reclaim_kicked_cond, NULL);
+		reclaim_kicked = FALSE;
+		spin_lock_irqsave(&reclaim_lock);
+		reclaim_gen++;
+		spin_unlock_irqsave(&reclaim_lock);
+		before = base_amt_avail();
+		/* The per-core page caches sit in front of the kpages arenas, so
+		 * empty them first; the pages might let the slabs below free whole
+		 * spans back to the base arenas. */
+		kpages_pcpu_drain();
+		qlock(&arenas_and_slabs_lock);
+		/* Slabs that import from kpages_arena pull from every node's kpages,
+		 * so node 0 goes first, then the other nodes' qcaches. */
+		for (int i = 0; i < nr_arena_nodes; i++) {
+			if (base_arenas[i])
+				__arena_reclaim(base_arenas[i]);
+		}
+		qunlock(&arenas_and_slabs_lock);
+		wake_arena_waiters(TRUE);
+		/* Don't thrash the caches if we're just using most of our memory.
+		 * Under steady pressure, the passes don't find much, so we back off
+		 * until one does. */
+		after = base_amt_avail();
+		if (after > before &&
+		    after - before >= base_amt_total() / ARENA_RECLAIM_GAIN_DIV)
+			period = ARENA_RECLAIM_PERIOD_US;
+		else
+			period = MIN(period * 2, ARENA_RECLAIM_MAX_PERIOD_US);
+		if (!nr_reclaim_waiters)
+			kthread_usleep(period);
+	}
+}
+
+void arena_reclaim_init(void)
+{
+	rendez_init(&reclaim_rv);
+	ktask("arena_reclaim", arena_reclaim_ktask, NULL);
+	reclaim_ready = TRUE;
+}
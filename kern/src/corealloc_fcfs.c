@@ -11,6 +11,8 @@
 #include <corerequest.h>
 #include <kmalloc.h>
 
+const char corealloc_policy_name[] = "fcfs";
+
 /* The pcores in the system. (array gets alloced in init()).  */
 struct sched_pcore *all_pcores;
 
@@ -121,7 +123,7 @@ int __get_any_idle_core(void)
 	struct sched_pcore *spc;
 	int ret = -1;
 
-	while ((spc = TAILQ_FIRST(&idlecores))) {
+	TAILQ_FOREACH(spc, &idlecores, alloc_next) {
 		/* Don't take cores that are provisioned to a process */
 		if (spc->prov_proc)
 			continue;
@@ -222,6 +224,17 @@ void __sort_idle_cores(void)
 	}
 }
 
+/* FCFS doesn't know about topology, so it can't keep anyone off of siblings. */
+int __corealloc_proc_avoid_smt(struct proc *p, bool avoid)
+{
+	return -1;
+}
+
+bool __corealloc_proc_avoids_smt(struct proc *p)
+{
+	return FALSE;
+}
+
 /* Print the map of idle cores that are still allocatable through our core
  * allocation algorithm. */
 void print_idle_core_map(void)
@@ -0,0 +1,377 @@
+/* Copyright (c) 2015 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Provisioned cores still go first.  Beyond
+ * those, we pack a process's cores into as few sockets (LLCs) and NUMA nodes as
+ * we can, preferring cores the process had before (their caches may still be
+ * warm), and keeping hyperthreads whose sibling is busy for last.  A process
+ * can ask that none of its cores share a physical core with anyone, itself
+ * included; others then stay off of its siblings too, if they can.
+ *
+ * Picking a core is a scan of all of the cores, not the O(1) of FCFS.  That is
+ * a few hundred cache lines at most, and it happens once per core grant. */
+
+#include <arch/topology.h>
+#include <sys/queue.h>
+#include <env.h>
+#include <corerequest.h>
+#include <kmalloc.h>
+#include <string.h>
+
+const char corealloc_policy_name[] = "packed";
+
+/* The pcores in the system. (array gets alloced in init()).  */
+struct sched_pcore *all_pcores;
+
+/* TAILQ of all unallocated, idle (CG) cores */
+struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
+
+/* Set by __next_core_to_alloc(), cleared once it is allocated. */
+static struct sched_pcore *next_spc;
+
+/* Scratch for __find_best_core_to_alloc(), protected by the ksched's lock:
+ * per socket and NUMA node, how many cores the proc has, and how many are idle
+ * on each socket. */
+static int nr_socket_ids, nr_numa_ids;
+static unsigned int *socket_mine, *socket_idle, *numa_mine;
+
+/* Links each core into a ring with its SMT siblings.  A core with no siblings
+ * points at itself. */
+static void link_siblings(void)
+{
+	uint32_t prev;
+
+	for (int i = 0; i < num_cores; i++) {
+		all_pcores[i].next_sibling = i;
+		for (prev = i; prev-- > 0; ) {
+			if (core_smt_siblings(i, prev)) {
+				all_pcores[i].next_sibling = all_pcores[prev].next_sibling;
+				all_pcores[prev].next_sibling = i;
+				break;
+			}
+		}
+	}
+}
+
+#define for_each_sibling(i, pcoreid)                                           \
+	for ((i) = all_pcores[(pcoreid)].next_sibling; (i) != (pcoreid);           \
+	     (i) = all_pcores[(i)].next_sibling)
+
+/* Initialize any data assocaited with doing core allocation. */
+void corealloc_init(void)
+{
+	struct core_info *ci;
+
+	/* Allocate all of our pcores. */
+	all_pcores = kzmalloc(sizeof(struct sched_pcore) * num_cores, 0);
+	for (int i = 0; i < num_cores; i++) {
+		ci = &cpu_topology_info.core_list[i];
+		nr_socket_ids = MAX(nr_socket_ids, ci->socket_id + 1);
+		nr_numa_ids = MAX(nr_numa_ids, ci->numa_id + 1);
+	}
+	socket_mine = kzmalloc(sizeof(unsigned int) * nr_socket_ids, 0);
+	socket_idle = kzmalloc(sizeof(unsigned int) * nr_socket_ids, 0);
+	numa_mine = kzmalloc(sizeof(unsigned int) * nr_numa_ids, 0);
+	link_siblings();
+	/* init the idlecore list.  if they turned off hyperthreading, give them the
+	 * odds from 1..max-1.  otherwise, give them everything by 0 (default mgmt
+	 * core).  TODO: (CG/LL) better LL/CG mgmt */
+#ifndef CONFIG_DISABLE_SMT
+	for (int i = 0; i < num_cores; i++) {
+		if (!is_ll_core(i)) {
+			TAILQ_INSERT_TAIL(&idlecores, pcoreid2spc(i), alloc_next);
+			pcoreid2spc(i)->idle = TRUE;
+		}
+	}
+#else
+	assert(!(num_cores % 2));
+	for (int i = 1; i < num_cores; i += 2) {
+		if (!is_ll_core(i)) {
+			TAILQ_INSERT_TAIL(&idlecores, pcoreid2spc(i), alloc_next);
+			pcoreid2spc(i)->idle = TRUE;
+		}
+	}
+#endif /* CONFIG_DISABLE_SMT */
+}
+
+/* Initialize any data associated with allocating cores to a process. */
+void corealloc_proc_init(struct proc *p)
+{
+	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+	p->ksched_data.crd.avoid_smt = FALSE;
+}
+
+/* Fills in the scratch counts for p.  Returns how many cores p has. */
+static unsigned int __count_cores(struct proc *p)
+{
+	struct core_info *ci;
+	unsigned int nr_mine = 0;
+
+	memset(socket_mine, 0, sizeof(unsigned int) * nr_socket_ids);
+	memset(socket_idle, 0, sizeof(unsigned int) * nr_socket_ids);
+	memset(numa_mine, 0, sizeof(unsigned int) * nr_numa_ids);
+	for (int i = 0; i < num_cores; i++) {
+		ci = &cpu_topology_info.core_list[i];
+		if (all_pcores[i].alloc_proc == p) {
+			socket_mine[ci->socket_id]++;
+			numa_mine[ci->numa_id]++;
+			nr_mine++;
+		} else if (all_pcores[i].idle) {
+			socket_idle[ci->socket_id]++;
+		}
+	}
+	return nr_mine;
+}
+
+/* Returns TRUE if p may not have pcoreid: it has a busy sibling, and either p
+ * or the sibling's owner asked to avoid SMT. */
+static bool __smt_conflict(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *sib;
+	uint32_t i;
+
+	for_each_sibling(i, pcoreid) {
+		sib = pcoreid2spc(i);
+		if (sib->idle)
+			continue;
+		if (p->ksched_data.crd.avoid_smt)
+			return TRUE;
+		if (sib->alloc_proc && sib->alloc_proc != p &&
+		    sib->alloc_proc->ksched_data.crd.avoid_smt)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Scores an idle pcore for p; lower is better.  In order of importance:
+ * - provisioned to someone else, who may take it back
+ * - how far it is from p's other cores: same socket, same NUMA node, or not
+ * - its sibling is idle, is p's, or is someone else's
+ * - whether p had it last
+ * - which socket: the one with most of p's cores, or with the most idle cores
+ *   if p has none yet, so it has room to grow
+ * - the core id, to keep ties stable */
+static uint64_t __score_core(struct proc *p, uint32_t pcoreid,
+                             unsigned int nr_mine)
+{
+	struct sched_pcore *spc = pcoreid2spc(pcoreid);
+	struct core_info *ci = &cpu_topology_info.core_list[pcoreid];
+	struct sched_pcore *sib;
+	uint64_t smt_busy = 0, dist = 0, room;
+	uint32_t i;
+
+	for_each_sibling(i, pcoreid) {
+		sib = pcoreid2spc(i);
+		if (sib->idle)
+			continue;
+		/* !alloc_proc is a core the kernel took, e.g. for SCPs */
+		smt_busy = sib->alloc_proc == p ? MAX(smt_busy, 1) : 2;
+	}
+	if (nr_mine) {
+		if (!socket_mine[ci->socket_id])
+			dist = numa_mine[ci->numa_id] ? 1 : 2;
+		room = num_cores - socket_mine[ci->socket_id];
+	} else {
+		room = num_cores - socket_idle[ci->socket_id];
+	}
+	return (uint64_t)(spc->prov_proc ? 1 : 0) << 56 |
+	       dist << 52 |
+	       smt_busy << 48 |
+	       (uint64_t)(spc->last_pid == p->pid ? 0 : 1) << 44 |
+	       room << 16 |
+	       pcoreid;
+}
+
+/* Find the best core to allocate to a process as dictated by the core
+ * allocation algorithm.  Cores with an SMT conflict (see __smt_conflict()) are
+ * never picked, even if that leaves p's request unserved; p's own provisioned
+ * cores are the exception.  This code assumes that the scheduler that uses it
+ * holds a lock for the duration of the call. */
+uint32_t __find_best_core_to_alloc(struct proc *p)
+{
+	struct sched_pcore *spc_i, *best = NULL;
+	uint64_t score, best_score = 0;
+	unsigned int nr_mine;
+
+	spc_i = TAILQ_FIRST(&p->ksched_data.crd.prov_not_alloc_me);
+	if (spc_i)
+		return spc2pcoreid(spc_i);
+	if (next_spc && next_spc->idle && !next_spc->prov_proc &&
+	    !__smt_conflict(p, spc2pcoreid(next_spc)))
+		return spc2pcoreid(next_spc);
+	if (TAILQ_EMPTY(&idlecores))
+		return -1;
+	nr_mine = __count_cores(p);
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
+		if (__smt_conflict(p, spc2pcoreid(spc_i)))
+			continue;
+		score = __score_core(p, spc2pcoreid(spc_i), nr_mine);
+		if (!best || (score < best_score)) {
+			best = spc_i;
+			best_score = score;
+		}
+	}
+	return best ? spc2pcoreid(best) : -1;
+}
+
+/* Track the pcore properly when it is allocated to p. This code assumes that
+ * the scheduler that uses it holds a lock for the duration of the call. */
+void __track_core_alloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc != p);	/* corruption or double-alloc */
+	spc->alloc_proc = p;
+	/* if the pcore is prov to them and now allocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_not_alloc_me, spc, prov_next);
+		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+	}
+	/* Actually allocate the core, removing it from the idle core list. */
+	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	spc->idle = FALSE;
+	if (spc == next_spc)
+		next_spc = NULL;
+}
+
+/* Track the pcore properly when it is deallocated from p. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * */
+void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	spc->alloc_proc = 0;
+	spc->last_pid = p->pid;
+	/* if the pcore is prov to them and now deallocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+		/* this is the victim list, which can be sorted so that we pick the
+		 * right victim (sort by alloc_proc reverse priority, etc).  In this
+		 * case, the core isn't alloc'd by anyone, so it should be the first
+		 * victim. */
+		TAILQ_INSERT_HEAD(&p->ksched_data.crd.prov_not_alloc_me, spc,
+		                  prov_next);
+	}
+	/* Actually dealloc the core, putting it back on the idle core list. */
+	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	spc->idle = TRUE;
+}
+
+/* Bulk interface for __track_core_dealloc */
+void __track_core_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
+                               uint32_t nr_cores)
+{
+	for (int i = 0; i < nr_cores; i++)
+		__track_core_dealloc(p, pc_arr[i]);
+}
+
+/* Get an idle core from our pcore list and return its core_id. Don't
+ * consider the chosen core in the future when handing out cores to a
+ * process. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. This will not give out provisioned cores. */
+int __get_any_idle_core(void)
+{
+	struct sched_pcore *spc;
+	int ret = -1;
+
+	TAILQ_FOREACH(spc, &idlecores, alloc_next) {
+		/* Don't take cores that are provisioned to a process */
+		if (spc->prov_proc)
+			continue;
+		assert(!spc->alloc_proc);
+		TAILQ_REMOVE(&idlecores, spc, alloc_next);
+		spc->idle = FALSE;
+		ret = spc2pcoreid(spc);
+		break;
+	}
+	return ret;
+}
+
+/* Same as __get_any_idle_core() except for a specific core id. */
+int __get_specific_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+	int ret = -1;
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	if (spc->idle && !spc->prov_proc) {
+		assert(!spc->alloc_proc);
+		TAILQ_REMOVE(&idlecores, spc, alloc_next);
+		spc->idle = FALSE;
+		ret = coreid;
+	}
+	return ret;
+}
+
+/* Reinsert a core obtained via __get_any_idle_core() or
+ * __get_specific_idle_core() back into the idlecore map. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * This will not give out provisioned cores. */
+void __put_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	spc->idle = TRUE;
+}
+
+/* One off function to make 'pcoreid' the next core chosen by the core
+ * allocation algorithm (so long as no provisioned cores are still idle).
+ * This code assumes that the scheduler that uses it holds a lock for the
+ * duration of the call. */
+void __next_core_to_alloc(uint32_t pcoreid)
+{
+	if (!(pcoreid < num_cores) || !pcoreid2spc(pcoreid)->idle)
+		return;
+	next_spc = pcoreid2spc(pcoreid);
+	printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+}
+
+/* One off function to sort the idle core list for debugging in the kernel
+ * monitor.  The order doesn't matter to the policy, only to the printout.  This
+ * code assumes that the scheduler that uses it holds a lock for the duration of
+ * the call. */
+void __sort_idle_cores(void)
+{
+	TAILQ_INIT(&idlecores);
+	for (int i = 0; i < num_cores; i++) {
+		if (all_pcores[i].idle)
+			TAILQ_INSERT_TAIL(&idlecores, &all_pcores[i], alloc_next);
+	}
+}
+
+int __corealloc_proc_avoid_smt(struct proc *p, bool avoid)
+{
+	p->ksched_data.crd.avoid_smt = avoid;
+	return 0;
+}
+
+bool __corealloc_proc_avoids_smt(struct proc *p)
+{
+	return p->ksched_data.crd.avoid_smt;
+}
+
+/* Print the map of idle cores that are still allocatable through our core
+ * allocation algorithm. */
+void print_idle_core_map(void)
+{
+	struct sched_pcore *spc_i;
+	struct core_info *ci;
+
+	/* not locking, so we can look at this without deadlocking. */
+	printk("Idle cores (unlocked!):\n");
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
+		ci = &cpu_topology_info.core_list[spc2pcoreid(spc_i)];
+		printk("Core %d (numa %d socket %d cpu %d), prov to %d (%p), last %d\n",
+		       spc2pcoreid(spc_i), ci->numa_id, ci->socket_id, ci->cpu_id,
+		       spc_i->prov_proc ? spc_i->prov_proc->pid : 0, spc_i->prov_proc,
+		       spc_i->last_pid);
+	}
+}
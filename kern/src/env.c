@@ -100,6 +100,12 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 		if (!pte_is_mapped(pte))
 			return 0;
 		page_t *page = pa2page(pte_get_paddr(pte));
+		if (pte_is_jumbo(pte)) {
+			pte_clear(pte);
+			jumbo_upage_decref(page, PML2_PTE_REACH >> PGSHIFT);
+			e->vm_nr_jumbos--;
+			return 0;
+		}
 		pte_clear(pte);
 		page_decref(page);
 		/* TODO: consider other states here (like !P, yet still tracking a page,
@@ -33,6 +33,7 @@
 #include <arch/init.h>
 #include <bitmask.h>
 #include <slab.h>
+#include <arena.h>
 #include <kfs.h>
 #include <vfs.h>
 #include <devfs.h>
@@ -145,6 +146,8 @@ void kernel_init(multiboot_info_t *mboot_info)
 	radix_init();
 	acpiinit();
 	topology_init();
+	numa_arenas_init();
+	jumbo_arena_init();
 	percpu_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
@@ -158,6 +161,7 @@ static void __kernel_init_part_deux(void *arg)
 {
 	kernel_msg_init();
 	timer_init();
+	arena_reclaim_init();
 	vfs_init();
 	devfs_init();
 	time_init();
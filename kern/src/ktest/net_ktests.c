@@ -39,6 +39,7 @@ bool test_ptclbsum(void)
 					   i, j, len, csum, expected);
 				return false;
 			}
+			KT_ASSERT(ptclbsum_scalar(buf + i, len) == expected);
 		}
 	}
 	return true;
@@ -63,6 +64,42 @@ bool test_simplesum_bench(void)
 	return true;
 }
 
+bool test_ptclbsum_copy(void)
+{
+	uint8_t src[300], dst[300];
+	int i, len;
+
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = (i * 7) & 0xff;
+	for (i = 0; i < 16; i++) {
+		for (len = 0; len < sizeof(src) - 16; len++) {
+			memset(dst, 0, sizeof(dst));
+			KT_ASSERT(ptclbsum_copy(dst + (i ^ 5), src + i, len) ==
+			          simplesum(src + i, len));
+			KT_ASSERT(!memcmp(dst + (i ^ 5), src + i, len));
+			KT_ASSERT(dst[(i ^ 5) + len] == 0);
+		}
+	}
+	return true;
+}
+
+bool test_ptclbsum_scalar_bench(void)
+{
+	uint8_t buf[CSUM_BENCH_BUFSIZE];
+	uint16_t csum = 0;
+	int i, j, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i & 0xff;
+	for (i = 0; i < sizeof(buf); i++) {
+		for (j = i; j < sizeof(buf); j++) {
+			len = j - i + 1;
+			csum += ptclbsum_scalar(buf + i, len);
+		}
+	}
+	return true;
+}
+
 bool test_ptclbsum_bench(void)
 {
 	uint8_t buf[CSUM_BENCH_BUFSIZE];
@@ -80,10 +117,89 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+#define DEMUX_NR_CONVS		4096	/* tcp's nc */
+#define DEMUX_NR_LOOKUPS	1000000
+
+static void demux_raddr(uint8_t *raddr, uint32_t i)
+{
+	memmove(raddr, v4prefix, IPv4off);
+	hnputl(raddr + IPv4off, 0x0a000000 | i);
+}
+
+/* Demux cost with a full protocol's worth of established conversations behind
+ * one listener: hits find their conversation, misses fall through to the
+ * listener. */
+bool test_iphtlook_bench(void)
+{
+	struct Ipht ht;
+	struct conv *convs, *lc, *c;
+	uint8_t laddr[IPaddrlen], raddr[IPaddrlen];
+	uint64_t start, hit_ns, miss_ns;
+	uint32_t i, nr_added, nr_left, nr_bad_hits = 0, nr_bad_misses = 0;
+	bool listener_found;
+
+	convs = kzmalloc((DEMUX_NR_CONVS + 1) * sizeof(struct conv), MEM_WAIT);
+	iphtinit(&ht);
+	memmove(laddr, v4prefix, IPv4off);
+	hnputl(laddr + IPv4off, 0xc0a80001);
+	for (i = 0; i < DEMUX_NR_CONVS; i++) {
+		c = &convs[i];
+		ipmove(c->laddr, laddr);
+		c->lport = 80;
+		demux_raddr(c->raddr, i);
+		c->rport = 1024 + i % 50000;
+		iphtadd(&ht, c);
+	}
+	/* announced *!80 */
+	lc = &convs[DEMUX_NR_CONVS];
+	lc->lport = 80;
+	iphtadd(&ht, lc);
+	nr_added = atomic_read(&ht.nr);
+
+	start = read_tsc();
+	for (i = 0; i < DEMUX_NR_LOOKUPS; i++) {
+		c = &convs[(i * 7919) % DEMUX_NR_CONVS];
+		if (iphtlook(&ht, c->raddr, c->rport, laddr, 80) != c)
+			nr_bad_hits++;
+	}
+	hit_ns = tsc2nsec(read_tsc() - start) / DEMUX_NR_LOOKUPS;
+
+	start = read_tsc();
+	for (i = 0; i < DEMUX_NR_LOOKUPS; i++) {
+		demux_raddr(raddr, DEMUX_NR_CONVS + i);
+		if (iphtlook(&ht, raddr, 1024, laddr, 80) != lc)
+			nr_bad_misses++;
+	}
+	miss_ns = tsc2nsec(read_tsc() - start) / DEMUX_NR_LOOKUPS;
+
+	printk("iphtlook: %d convs, %d buckets, hit %llu ns, miss %llu ns\n",
+	       DEMUX_NR_CONVS, 1 << ht.tab->nr_hash_bits, hit_ns, miss_ns);
+
+	for (i = 0; i < DEMUX_NR_CONVS; i++)
+		iphtrem(&ht, &convs[i]);
+	nr_left = atomic_read(&ht.nr);
+	listener_found = iphtlook(&ht, convs[0].raddr, convs[0].rport, laddr,
+	                          80) == lc;
+
+	iphtdestroy(&ht);
+	kfree(convs);
+
+	KT_ASSERT(nr_added == DEMUX_NR_CONVS + 1);
+	KT_ASSERT_M("Every lookup should find its conversation", !nr_bad_hits);
+	KT_ASSERT_M("Every miss should find the listener", !nr_bad_misses);
+	KT_ASSERT(nr_left == 1);
+	KT_ASSERT_M("The listener should outlive the conversations",
+	            listener_found);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
+	KTEST_REG(ptclbsum_copy,			CONFIG_TEST_ptclbsum_copy),
+	KTEST_REG(ptclbsum_scalar_bench,	CONFIG_TEST_ptclbsum_scalar_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(iphtlook_bench,		CONFIG_TEST_iphtlook_bench),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -38,6 +38,7 @@
 #include <monitor.h>
 #include <kthread.h>
 #include <schedule.h>
+#include <lat_hist.h>
 #include <umem.h>
 #include <init.h>
 #include <ucq.h>
@@ -1879,6 +1880,128 @@ bool test_kmalloc_incref(void)
 	return TRUE;
 }
 
+bool test_block_page_pool(void)
+{
+	struct block_page_pool pool;
+	struct page *page, *other;
+	struct block *b, *clone;
+
+	block_page_pool_init(&pool, 1);
+	page = block_page_alloc(&pool, MEM_WAIT);
+	KT_ASSERT(page);
+	KT_ASSERT(atomic_read(&page->pg_nr_refs) == 1);
+	memset(page2kva(page), 0x5a, PGSIZE);
+
+	b = block_alloc(64, MEM_WAIT);
+	KT_ASSERT(!block_append_page(b, page, 0, PGSIZE, MEM_WAIT));
+	KT_ASSERT(block_extra_page(b->extra_data[0].base) == page);
+	KT_ASSERT(BLEN(b) == PGSIZE);
+
+	/* clones share the page, not copy it */
+	clone = blist_clone(b, 0, PGSIZE, 0);
+	KT_ASSERT(atomic_read(&page->pg_nr_refs) == 2);
+	KT_ASSERT(BLEN(clone) == PGSIZE);
+	freeb(b);
+	KT_ASSERT(atomic_read(&page->pg_nr_refs) == 1);
+	KT_ASSERT(pool.nr_free == 0);
+	freeb(clone);
+	KT_ASSERT_M("Page should be back in the pool", pool.nr_free == 1);
+
+	/* the pool hands the recycled page back out */
+	KT_ASSERT(block_page_alloc(&pool, MEM_WAIT) == page);
+	KT_ASSERT(pool.nr_free == 0);
+	/* past max_free, pages go back to the kernel */
+	other = block_page_alloc(&pool, MEM_WAIT);
+	KT_ASSERT(other != page);
+	block_page_decref(page);
+	block_page_decref(other);
+	KT_ASSERT(pool.nr_free == 1);
+	block_page_pool_drain(&pool);
+	KT_ASSERT(pool.nr_free == 0);
+	return TRUE;
+}
+
+/* Mimics a driver's rx ring (e.g. mlx4): a pool page carved into two frags,
+ * each holding a ring ref, with received frames going up via
+ * block_from_page(). */
+bool test_block_page_rx(void)
+{
+	struct block_page_pool pool;
+	struct page *page;
+	struct block *small, *big;
+	struct queue *q;
+	uint8_t *kva, *buf;
+	size_t half = PGSIZE / 2;
+
+	block_page_pool_init(&pool, 1);
+	page = block_page_alloc(&pool, MEM_WAIT);
+	KT_ASSERT(page);
+	atomic_add(&page->pg_nr_refs, 1);	/* second frag's ring ref */
+	kva = page2kva(page);
+	for (int i = 0; i < PGSIZE; i++)
+		kva[i] = i;
+
+	/* copied whole: no page ref, nothing in extra_data */
+	small = block_from_page(page, 0, 60, 60, MEM_WAIT);
+	KT_ASSERT(small);
+	KT_ASSERT(BHLEN(small) == 60 && !small->extra_len);
+	KT_ASSERT(atomic_read(&page->pg_nr_refs) == 2);
+
+	big = block_from_page(page, half, half, 128, MEM_WAIT);
+	KT_ASSERT(big);
+	KT_ASSERT(BHLEN(big) == 128);
+	KT_ASSERT(big->extra_len == half - 128);
+	KT_ASSERT(block_extra_page(big->extra_data[0].base) == page);
+	KT_ASSERT(atomic_read(&page->pg_nr_refs) == 3);
+
+	/* the ring moves on, dropping both frags */
+	block_page_decref(page);
+	block_page_decref(page);
+	KT_ASSERT_M("Block should keep the page", pool.nr_free == 0);
+	freeb(small);
+
+	q = qopen(PGSIZE, Qmsg, 0, 0);
+	KT_ASSERT(q);
+	buf = kmalloc(half, MEM_WAIT);
+	qbwrite(q, big);
+	KT_ASSERT(qread(q, buf, half) == half);
+	for (int i = 0; i < half; i++)
+		KT_ASSERT_M("Payload mismatch", buf[i] == (uint8_t)(half + i));
+	kfree(buf);
+	qfree(q);
+	KT_ASSERT_M("Page should be back in the pool", pool.nr_free == 1);
+	block_page_pool_drain(&pool);
+	return TRUE;
+}
+
+bool test_qio_msgs(void)
+{
+	struct queue *q = qopen(1024, Qmsg, 0, 0);
+	uint8_t buf[32];
+	uint8_t in[] = {0, 0, 0, 3, 'a', 'b', 'c', 0, 0, 0, 0,
+	                0, 0, 0, 2, 'd', 'e'};
+
+	KT_ASSERT(q);
+	qiwrite(q, "abc", 3);
+	qiwrite(q, "defgh", 5);
+	qiwrite(q, "ij", 2);
+	/* 4 + 3 + 4 + 5 fits, the third message doesn't */
+	KT_ASSERT(qread_msgs(q, buf, 20) == 16);
+	KT_ASSERT(nhgetl(buf) == 3 && !memcmp(buf + 4, "abc", 3));
+	KT_ASSERT(nhgetl(buf + 7) == 5 && !memcmp(buf + 11, "defgh", 5));
+	/* the first message is always returned, truncated if need be */
+	KT_ASSERT(qread_msgs(q, buf, 5) == 5);
+	KT_ASSERT(nhgetl(buf) == 1 && buf[4] == 'i');
+	KT_ASSERT(qlen(q) == 0);
+
+	/* zero-length messages are messages too */
+	KT_ASSERT(qwrite_msgs(q, in, sizeof(in)) == sizeof(in));
+	KT_ASSERT(qread_msgs(q, buf, sizeof(buf)) == sizeof(in));
+	KT_ASSERT(!memcmp(buf, in, sizeof(in)));
+	qfree(q);
+	return TRUE;
+}
+
 /* Some ghetto things:
  * - ASSERT_M only lets you have a string, not a format string.
  * - put doesn't return, so we have a "loud" test for that.  alternatively, we
@@ -2087,6 +2210,469 @@ out:
 	return passed;
 }
 
+/* Helper: pokes the ksched on behalf of each of nr MCPs, and returns the
+ * fastest poke, in ticks.  The minimum is what the ksched's algorithm costs,
+ * without whatever interrupts we took. */
+static uint64_t time_mcp_pokes(struct proc **mcps, int nr)
+{
+	uint64_t start, ticks, min = (uint64_t)-1;
+
+	for (int i = 0; i < nr; i++) {
+		start = read_tsc();
+		poke_ksched(mcps[i], RES_CORES);
+		ticks = read_tsc() - start;
+		if (ticks < min)
+			min = ticks;
+	}
+	return min;
+}
+
+/* Fake MCPs' cores, for the ones a test lets the ksched give cores to */
+static struct proc *fake_mcp_cores[MAX_NUM_CORES];
+
+/* Stand-ins for the proc code, so the ksched can hand fakes cores and take them
+ * back without running them.  A core stays the fake's until it's taken, yielded
+ * or the fake is freed. */
+static int fake_mcp_give_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
+{
+	for (int i = 0; i < num; i++)
+		fake_mcp_cores[pc_arr[i]] = p;
+	p->procinfo->res_grant[RES_CORES] += num;
+	return 0;
+}
+
+static bool fake_mcp_warn_core(struct proc *p, uint32_t pcoreid, uint64_t when)
+{
+	return fake_mcp_cores[pcoreid] == p;
+}
+
+static bool fake_mcp_preempt_core(struct proc *p, uint32_t pcoreid)
+{
+	if (fake_mcp_cores[pcoreid] != p)
+		return FALSE;
+	fake_mcp_cores[pcoreid] = NULL;
+	p->procinfo->res_grant[RES_CORES]--;
+	return TRUE;
+}
+
+static struct sched_mcp_ops fake_mcp_ops = {
+	.give_cores = fake_mcp_give_cores,
+	.warn_core = fake_mcp_warn_core,
+	.preempt_core = fake_mcp_preempt_core,
+};
+
+static void fake_mcp_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct proc, p_kref));
+}
+
+/* Helper: makes a fake MCP that shares tmpl's procinfo/procdata, which is all
+ * the ksched looks at.  Fakes never run; the ksched gives them cores and takes
+ * them back through fake_mcp_ops.  Callers that don't want that need to hold on
+ * to every idle core while the fakes exist. */
+static struct proc *alloc_fake_mcp(struct proc *tmpl)
+{
+	struct proc *p = kzmalloc(sizeof(struct proc), MEM_WAIT);
+
+	kref_init(&p->p_kref, fake_mcp_release, 1);
+	spinlock_init(&p->proc_lock);
+	p->pid = tmpl->pid;
+	p->procinfo = tmpl->procinfo;
+	p->procdata = tmpl->procdata;
+	p->state = PROC_RUNNABLE_M;
+	__sched_proc_register(p);
+	p->ksched_data.mcp_ops = &fake_mcp_ops;
+	__sched_proc_change_to_m(p);
+	return p;
+}
+
+static void free_fake_mcp(struct proc *p)
+{
+	uint32_t pc_arr[MAX_NUM_CORES];
+	uint32_t nr = 0;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (fake_mcp_cores[i] == p) {
+			fake_mcp_cores[i] = NULL;
+			pc_arr[nr++] = i;
+		}
+	}
+	p->state = PROC_DYING;
+	__sched_proc_destroy(p, pc_arr, nr);
+	proc_decref(p);
+}
+
+/* Helper: a real proc for fake MCPs to share, wanting one core.  Fakes that
+ * need their own grant counts need their own template. */
+static struct proc *alloc_fake_tmpl(void)
+{
+	struct proc *tmpl;
+
+	if (proc_alloc(&tmpl, 0, 0))
+		return NULL;
+	tmpl->procinfo->is_mcp = TRUE;
+	tmpl->procinfo->max_vcores = 1;
+	tmpl->procdata->res_req[RES_CORES].amt_wanted = 1;
+	return tmpl;
+}
+
+static void free_fake_tmpl(struct proc *tmpl)
+{
+	tmpl->procinfo->is_mcp = FALSE;
+	tmpl->procinfo->res_grant[RES_CORES] = 0;
+	tmpl->procdata->res_req[RES_CORES].amt_wanted = 0;
+	proc_decref(tmpl);
+}
+
+/* Helper: takes every idle core away from the ksched, so it has nothing to give
+ * fake MCPs.  Returns how many it took. */
+static int hold_idle_cores(int *cores)
+{
+	int nr = 0, coreid;
+
+	while ((coreid = get_any_idle_core()) >= 0)
+		cores[nr++] = coreid;
+	return nr;
+}
+
+static void put_idle_cores(int *cores, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		put_idle_core(cores[i]);
+}
+
+/* Helper: p gives back one of its fake cores, like a yield would. */
+static void fake_mcp_yield_core(struct proc *p)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (fake_mcp_cores[i] == p) {
+			fake_mcp_cores[i] = NULL;
+			p->procinfo->res_grant[RES_CORES]--;
+			__sched_put_idle_core(p, i);
+			return;
+		}
+	}
+}
+
+/* Helper: pokes the ksched for p until cond holds, since another core might be
+ * running the ksched (e.g. for the QoS alarm) when we poke.  Evaluates to TRUE
+ * if cond came true within a second or so. */
+#define fake_mcp_poke_until(p, cond)                                           \
+({                                                                             \
+	bool __done = FALSE;                                                       \
+	                                                                           \
+	for (int __i = 0; (__i < 1000) && !__done; __i++) {                        \
+		poke_ksched((p), RES_CORES);                                           \
+		cmb();                                                                 \
+		__done = (cond);                                                       \
+		if (!__done)                                                           \
+			kthread_usleep(1000);                                              \
+	}                                                                          \
+	__done;                                                                    \
+})
+
+/* Stresses the MCP ksched with 1000 MCPs that all want a core while there are
+ * none to give.  A poke should cost the same with 100 or 1000 of them around,
+ * instead of walking every MCP.  The MCPs are fakes that share a real proc's
+ * procinfo/procdata, which is all the ksched looks at.  They never run, so we
+ * hold on to every idle core for the duration. */
+bool test_mcp_ksched_scale(void)
+{
+	#define NR_FAKE_MCPS 1000
+	#define NR_FAKE_MCPS_SMALL 100
+	struct proc *tmpl, **mcps;
+	int *cores, nr_cores, nr_needy = 0, nr_posted = 0;
+	uint64_t small_ticks = 0, big_ticks;
+
+	tmpl = alloc_fake_tmpl();
+	KT_ASSERT_M("Failed to alloc a template proc", tmpl);
+	mcps = kzmalloc(sizeof(struct proc*) * NR_FAKE_MCPS, MEM_WAIT);
+	cores = kzmalloc(sizeof(int) * num_cores, MEM_WAIT);
+	nr_cores = hold_idle_cores(cores);
+	for (int i = 0; i < NR_FAKE_MCPS; i++) {
+		mcps[i] = alloc_fake_mcp(tmpl);
+		/* the first poke sorts out everyone posted by change_to_m */
+		if (i == NR_FAKE_MCPS_SMALL - 1) {
+			poke_ksched(mcps[i], RES_CORES);
+			small_ticks = time_mcp_pokes(mcps, NR_FAKE_MCPS_SMALL);
+		}
+	}
+	poke_ksched(mcps[0], RES_CORES);
+	big_ticks = time_mcp_pokes(mcps, NR_FAKE_MCPS);
+	for (int i = 0; i < NR_FAKE_MCPS; i++) {
+		nr_needy += mcps[i]->ksched_data.needy;
+		nr_posted += mcps[i]->ksched_data.demand_posted;
+	}
+	printk("MCP ksched poke: %llu nsec with %d MCPs, %llu nsec with %d\n",
+	       tsc2nsec(small_ticks), NR_FAKE_MCPS_SMALL, tsc2nsec(big_ticks),
+	       NR_FAKE_MCPS);
+	/* Tear down the fakes before giving back the cores, so the ksched doesn't
+	 * try to run them. */
+	for (int i = 0; i < NR_FAKE_MCPS; i++)
+		free_fake_mcp(mcps[i]);
+	put_idle_cores(cores, nr_cores);
+	free_fake_tmpl(tmpl);
+	kfree(cores);
+	kfree(mcps);
+
+	KT_ASSERT_M("Every MCP should be waiting for a core",
+	            nr_needy == NR_FAKE_MCPS);
+	KT_ASSERT_M("The ksched should have drained the demand queue",
+	            nr_posted == 0);
+	/* A sweep of every MCP would be 10x slower.  Leave room for noise. */
+	KT_ASSERT_M("Pokes should not scale with the number of MCPs",
+	            big_ticks <= 3 * small_ticks + usec2tsc(1));
+	return TRUE;
+}
+
+/* Checks the QoS bookkeeping with fake MCPs: bad settings and overpromised
+ * minimums are refused, and an MCP that is owed cores goes ahead of the others
+ * in line for them. */
+bool test_mcp_qos(void)
+{
+	struct proc *tmpl, *mcps[3];
+	struct sched_qos qos;
+	int *cores, nr_cores, set_min, set_bad, set_huge;
+	int bad_errno, huge_errno;
+	bool batch_owed, latency_owed;
+	int first_class;
+
+	tmpl = alloc_fake_tmpl();
+	KT_ASSERT_M("Failed to alloc a template proc", tmpl);
+	cores = kzmalloc(sizeof(int) * num_cores, MEM_WAIT);
+	nr_cores = hold_idle_cores(cores);
+	for (int i = 0; i < ARRAY_SIZE(mcps); i++)
+		mcps[i] = alloc_fake_mcp(tmpl);
+
+	sched_proc_get_qos(mcps[0], &qos);
+	qos.shares = 0;
+	set_bad = sched_proc_set_qos(mcps[0], &qos);
+	bad_errno = get_errno();
+	sched_proc_get_qos(mcps[0], &qos);
+	qos.min_cores = num_cores;
+	set_huge = sched_proc_set_qos(mcps[0], &qos);
+	huge_errno = get_errno();
+	sched_proc_get_qos(mcps[0], &qos);
+	qos.class = SCHED_QOS_BATCH;
+	sched_proc_set_qos(mcps[0], &qos);
+	sched_proc_get_qos(mcps[2], &qos);
+	qos.class = SCHED_QOS_LATENCY;
+	qos.min_cores = 1;
+	set_min = sched_proc_set_qos(mcps[2], &qos);
+	/* No one has cores for the ksched to take, so it can only sort them */
+	for (int i = 0; i < ARRAY_SIZE(mcps); i++)
+		poke_ksched(mcps[i], RES_CORES);
+	batch_owed = mcps[0]->ksched_data.needy_key.claim;
+	latency_owed = mcps[2]->ksched_data.needy_key.claim;
+	first_class = mcps[2]->ksched_data.needy_key.class;
+
+	for (int i = 0; i < ARRAY_SIZE(mcps); i++)
+		free_fake_mcp(mcps[i]);
+	put_idle_cores(cores, nr_cores);
+	free_fake_tmpl(tmpl);
+	kfree(cores);
+
+	KT_ASSERT_M("Zero shares should be refused",
+	            set_bad == -1 && bad_errno == EINVAL);
+	KT_ASSERT_M("A minimum bigger than the machine should be refused",
+	            set_huge == -1 && huge_errno == EBUSY);
+	KT_ASSERT_M("A one core minimum should fit", set_min == 0);
+	KT_ASSERT_M("The latency MCP is owed its minimum", latency_owed);
+	KT_ASSERT_M("The batch MCP is owed nothing", !batch_owed);
+	KT_ASSERT_M("The needy tree should know the latency MCP's class",
+	            first_class == SCHED_QOS_LATENCY);
+	return TRUE;
+}
+
+/* Runs QoS reclaims to both ends with two fake MCPs, each with its own
+ * template so they have their own grants.  The victim gets two cores, then an
+ * MCP with a minimum shows up.  The victim yields the first core it is warned
+ * about, and sits on the second until the ksched takes it. */
+bool test_mcp_qos_reclaim(void)
+{
+	struct proc *tmpl_v, *tmpl_c, *victim, *claimant;
+	struct sched_qos_stats *vstats;
+	struct sched_qos qos;
+	int *cores, nr_cores, set_min1, set_min2;
+	bool got_cores, warned1, honoured, warned2, forced;
+	uint64_t nr_warned, nr_honoured, nr_forced;
+	uint32_t claimant_grant;
+
+	tmpl_v = alloc_fake_tmpl();
+	tmpl_c = alloc_fake_tmpl();
+	KT_ASSERT_M("Failed to alloc template procs", tmpl_v && tmpl_c);
+	cores = kzmalloc(sizeof(int) * num_cores, MEM_WAIT);
+	nr_cores = hold_idle_cores(cores);
+	if (nr_cores < 2) {
+		put_idle_cores(cores, nr_cores);
+		free_fake_tmpl(tmpl_v);
+		free_fake_tmpl(tmpl_c);
+		kfree(cores);
+		printk("Need two idle cores for QoS reclaims, skipping\n");
+		return TRUE;
+	}
+	/* Long enough that the first reclaim can't expire before we yield */
+	sched_set_qos_warn_usec(1000000);
+
+	tmpl_v->procinfo->max_vcores = 2;
+	tmpl_v->procdata->res_req[RES_CORES].amt_wanted = 2;
+	victim = alloc_fake_mcp(tmpl_v);
+	vstats = &victim->ksched_data.qos_stats;
+	put_idle_cores(cores, 2);
+	poke_ksched(victim, RES_CORES);
+	got_cores = tmpl_v->procinfo->res_grant[RES_CORES] == 2;
+
+	claimant = alloc_fake_mcp(tmpl_c);
+	sched_proc_get_qos(claimant, &qos);
+	qos.min_cores = 1;
+	set_min1 = sched_proc_set_qos(claimant, &qos);
+	warned1 = fake_mcp_poke_until(claimant, vstats->warned == 1);
+	fake_mcp_yield_core(victim);
+	honoured = vstats->honoured == 1;
+	fake_mcp_poke_until(claimant,
+	                    tmpl_c->procinfo->res_grant[RES_CORES] == 1);
+
+	/* Now one that expires right away */
+	sched_set_qos_warn_usec(0);
+	tmpl_c->procinfo->max_vcores = 2;
+	tmpl_c->procdata->res_req[RES_CORES].amt_wanted = 2;
+	qos.min_cores = 2;
+	set_min2 = sched_proc_set_qos(claimant, &qos);
+	warned2 = fake_mcp_poke_until(claimant, vstats->warned == 2);
+	forced = fake_mcp_poke_until(claimant, vstats->forced == 1);
+	fake_mcp_poke_until(claimant,
+	                    tmpl_c->procinfo->res_grant[RES_CORES] == 2);
+	nr_warned = vstats->warned;
+	nr_honoured = vstats->honoured;
+	nr_forced = vstats->forced;
+	claimant_grant = tmpl_c->procinfo->res_grant[RES_CORES];
+
+	tmpl_v->procdata->res_req[RES_CORES].amt_wanted = 0;
+	tmpl_c->procdata->res_req[RES_CORES].amt_wanted = 0;
+	free_fake_mcp(victim);
+	free_fake_mcp(claimant);
+	sched_set_qos_warn_usec(CONFIG_KSCHED_QOS_WARN_USEC);
+	put_idle_cores(cores + 2, nr_cores - 2);
+	free_fake_tmpl(tmpl_v);
+	free_fake_tmpl(tmpl_c);
+	kfree(cores);
+
+	KT_ASSERT_M("The victim should have gotten both cores", got_cores);
+	KT_ASSERT_M("Minimums of one and two cores should fit",
+	            set_min1 == 0 && set_min2 == 0);
+	KT_ASSERT_M("The victim should be warned for the minimum", warned1);
+	KT_ASSERT_M("A yield before the deadline is honoured", honoured);
+	KT_ASSERT_M("The victim should be warned again", warned2);
+	KT_ASSERT_M("A core kept past the deadline is forced", forced);
+	KT_ASSERT_M("Two warnings, one honoured, one forced",
+	            nr_warned == 2 && nr_honoured == 1 && nr_forced == 1);
+	KT_ASSERT_M("The claimant should end up with its minimum",
+	            claimant_grant == 2);
+	return TRUE;
+}
+
+#ifdef CONFIG_COREALLOC_PACKED
+/* Checks the packed allocator's SMT policy with a fake MCP and two physical
+ * cores: a core whose sibling is busy loses to one whose siblings are idle, is
+ * still handed out as a last resort, and is never handed out once the MCP asks
+ * to avoid SMT.  The test holds every other core, which counts as busy. */
+bool test_corealloc_smt(void)
+{
+	struct proc *tmpl, *p;
+	int *cores, nr_cores;
+	int lone = -1, pair = -1;
+	int got_mixed, got_lone, got_avoid, set_avoid;
+
+	tmpl = alloc_fake_tmpl();
+	KT_ASSERT_M("Failed to alloc a template proc", tmpl);
+	cores = kzmalloc(sizeof(int) * num_cores, MEM_WAIT);
+	nr_cores = hold_idle_cores(cores);
+	/* lone and pair: idle cores on different physical cores, both with an
+	 * SMT sibling in the idle pool */
+	for (int i = 0; i < nr_cores && pair < 0; i++) {
+		for (int j = 0; j < nr_cores; j++) {
+			if (i == j || !core_smt_siblings(cores[i], cores[j]))
+				continue;
+			if (lone < 0)
+				lone = cores[i];
+			else if (!core_smt_siblings(cores[i], lone) && cores[i] != lone)
+				pair = cores[i];
+			break;
+		}
+	}
+	if (pair < 0) {
+		put_idle_cores(cores, nr_cores);
+		free_fake_tmpl(tmpl);
+		kfree(cores);
+		printk("No SMT siblings to test, skipping\n");
+		return TRUE;
+	}
+	p = alloc_fake_mcp(tmpl);
+
+	/* lone's siblings stay busy, pair's whole core is idle */
+	put_idle_core(lone);
+	for (int i = 0; i < nr_cores; i++) {
+		if (cores[i] == pair || core_smt_siblings(cores[i], pair))
+			put_idle_core(cores[i]);
+	}
+	got_mixed = sched_peek_core(p);
+	for (int i = 0; i < nr_cores; i++) {
+		if (cores[i] == pair || core_smt_siblings(cores[i], pair))
+			get_specific_idle_core(cores[i]);
+	}
+	got_lone = sched_peek_core(p);
+	set_avoid = sched_proc_avoid_smt(p, TRUE);
+	got_avoid = sched_peek_core(p);
+	sched_proc_avoid_smt(p, FALSE);
+
+	free_fake_mcp(p);
+	for (int i = 0; i < nr_cores; i++) {
+		if (cores[i] != lone)
+			put_idle_core(cores[i]);
+	}
+	free_fake_tmpl(tmpl);
+	kfree(cores);
+
+	KT_ASSERT_M("A core with idle siblings should beat a busy sibling",
+	            got_mixed == pair || core_smt_siblings(got_mixed, pair));
+	KT_ASSERT_M("A busy sibling should be the last resort", got_lone == lone);
+	KT_ASSERT_M("avoid_smt should be supported", set_avoid == 0);
+	KT_ASSERT_M("avoid_smt should leave the request unserved",
+	            got_avoid == -1);
+	return TRUE;
+}
+#endif /* CONFIG_COREALLOC_PACKED */
+
+bool test_lat_hist(void)
+{
+	struct lat_hist h = {0}, sum = {0};
+	char buf[256];
+
+	/* Mid-bucket samples, so tsc conversion rounding doesn't matter */
+	lat_hist_add(&h, nsec2tsc(500));
+	lat_hist_add(&h, nsec2tsc(1500));
+	lat_hist_add(&h, nsec2tsc(3500));
+	lat_hist_add(&h, nsec2tsc(1000 * NSEC_PER_SEC));
+	KT_ASSERT(h.nr == 4);
+	KT_ASSERT_M("sub-usec goes in bucket 0", h.buckets[0] == 1);
+	KT_ASSERT_M("[1, 2) usec goes in bucket 1", h.buckets[1] == 1);
+	KT_ASSERT_M("[2, 4) usec goes in bucket 2", h.buckets[2] == 1);
+	KT_ASSERT_M("Huge goes in the last bucket",
+	            h.buckets[LAT_HIST_BUCKETS - 1] == 1);
+	KT_ASSERT(h.max_ticks == nsec2tsc(1000 * NSEC_PER_SEC));
+
+	lat_hist_merge(&sum, &h);
+	lat_hist_merge(&sum, &h);
+	KT_ASSERT(sum.nr == 8);
+	KT_ASSERT(sum.buckets[2] == 2);
+	KT_ASSERT(sum.max_ticks == h.max_ticks);
+
+	seprint_lat_hist(buf, buf + sizeof(buf), "t", &h);
+	KT_ASSERT_M("Should start with the count", !strncmp(buf, "t: nr 4 ", 8));
+	KT_ASSERT_M("Should list bucket 2 as 2:1", strstr(buf, " 2:1"));
+	return TRUE;
+}
+
 bool test_sort(void)
 {
 	int cmp_longs_asc(const void *p1, const void *p2)
@@ -2226,8 +2812,18 @@ static struct ktest ktests[] = {
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
+	KTEST_REG(block_page_pool,    CONFIG_TEST_block_page_pool),
+	KTEST_REG(block_page_rx,      CONFIG_TEST_block_page_rx),
+	KTEST_REG(qio_msgs,           CONFIG_TEST_qio_msgs),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
+	KTEST_REG(mcp_ksched_scale,   CONFIG_TEST_mcp_ksched_scale),
+	KTEST_REG(mcp_qos,            CONFIG_TEST_mcp_qos),
+	KTEST_REG(mcp_qos_reclaim,    CONFIG_TEST_mcp_qos_reclaim),
+#ifdef CONFIG_COREALLOC_PACKED
+	KTEST_REG(corealloc_smt,      CONFIG_TEST_corealloc_smt),
+#endif
+	KTEST_REG(lat_hist,           CONFIG_TEST_lat_hist),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
 };
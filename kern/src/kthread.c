@@ -161,7 +161,7 @@ void restart_kthread(struct kthread *kthread)
 			 * thus *need* a different EPT) without first removing the old GPC,
 			 * which ultimately will result in a flushed EPT (on x86, this
 			 * actually happens when we clear_owning_proc()). */
-			lcr3(kthread->proc->env_cr3);
+			proc_load_cr3(kthread->proc);
 			/* Might have to clear out an existing current.  If they need to be
 			 * set later (like in restartcore), it'll be done on demand. */
 			if (pcpui->cur_proc)
@@ -0,0 +1,45 @@
+/* Copyright (c) 2015 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Latency histograms, see lat_hist.h. */
+
+#include <arch/arch.h>
+#include <lat_hist.h>
+#include <stdio.h>
+#include <time.h>
+
+void lat_hist_add(struct lat_hist *h, uint64_t ticks)
+{
+	uint64_t usec = tsc2usec(ticks);
+	unsigned int bkt = usec ? LOG2_DOWN(usec) + 1 : 0;
+
+	h->buckets[MIN(bkt, LAT_HIST_BUCKETS - 1)]++;
+	h->nr++;
+	h->sum_ticks += ticks;
+	h->max_ticks = MAX(h->max_ticks, ticks);
+}
+
+void lat_hist_merge(struct lat_hist *to, struct lat_hist *from)
+{
+	for (int i = 0; i < LAT_HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->nr += from->nr;
+	to->sum_ticks += from->sum_ticks;
+	to->max_ticks = MAX(to->max_ticks, from->max_ticks);
+}
+
+/* Prints one line: the summary, then the non-empty buckets as "lo:count", where
+ * lo is the bucket's lower bound in usec. */
+char *seprint_lat_hist(char *s, char *e, const char *name, struct lat_hist *h)
+{
+	s = seprintf(s, e, "%s: nr %llu avg %llu max %llu usec", name, h->nr,
+	             h->nr ? tsc2usec(h->sum_ticks / h->nr) : 0,
+	             tsc2usec(h->max_ticks));
+	for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		s = seprintf(s, e, " %llu:%u", i ? 1ULL << (i - 1) : 0ULL,
+		             h->buckets[i]);
+	}
+	return seprintf(s, e, "\n");
+}
@@ -28,7 +28,10 @@
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+                                 MAP_HUGETLB)
+
+#define JUMBO_NR_PGS			(PML2_PTE_REACH >> PGSHIFT)
 
 struct kmem_cache *vmr_kcache;
 
@@ -276,9 +279,40 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
+/* Helper: copies a jumbo page from p to new_p.  If we can't get a jumbo for
+ * new_p, we copy it into regular pages. */
+static int copy_jumbo(struct proc *new_p, pte_t pte, uintptr_t va)
+{
+	int settings = pte_get_settings(pte) & ~PTE_PS;
+	void *src = KADDR(pte_get_paddr(pte));
+	struct page *pp;
+
+	pp = jumbo_upage_alloc(FALSE);
+	if (pp) {
+		memcpy(page2kva(pp), src, PML2_PTE_REACH);
+		if (map_user_jumbo(new_p->env_pgdir, va, page2pa(pp), settings)) {
+			jumbo_upage_decref(pp, JUMBO_NR_PGS);
+			return -ENOMEM;
+		}
+		new_p->vm_nr_jumbos++;
+		return 0;
+	}
+	for (int i = 0; i < JUMBO_NR_PGS; i++) {
+		if (upage_alloc(new_p, &pp, 0))
+			return -ENOMEM;
+		memcpy(page2kva(pp), src + i * PGSIZE, PGSIZE);
+		if (page_insert(new_p->env_pgdir, pp, (void*)(va + i * PGSIZE),
+		                settings)) {
+			page_decref(pp);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /* Helper: copies the contents of pages from p to new p.  For pages that aren't
  * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+ * intelligent.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -300,7 +334,8 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
+			if (pte_is_jumbo(pte))
+				return copy_jumbo(new_p, pte, (uintptr_t)va);
 			if (upage_alloc(new_p, &pp, 0))
 				return -ENOMEM;
 			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
@@ -397,7 +432,8 @@ void print_vmrs(struct proc *p)
 {
 	int count = 0;
 	struct vm_region *vmr;
-	printk("VM Regions for proc %d\n", p->pid);
+	printk("VM Regions for proc %d, %lu jumbo pages mapped\n", p->pid,
+	       p->vm_nr_jumbos);
 	printk("NR:"
 	       "                                     Range:"
 	       "       Prot,"
@@ -584,6 +620,37 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	return 0;
 }
 
+/* Zero-copy receive: maps @page, a block pool page (PG_NETBUF) the caller holds
+ * a ref on, at user @va instead of copying its contents there.  Only done for
+ * private, writable anonymous memory that has nothing mapped at va yet;
+ * otherwise the caller should copy.  On success the caller's ref belongs to the
+ * PTE, and the page goes back to its pool when it is unmapped. */
+int map_netbuf_page(struct proc *p, struct page *page, uintptr_t va)
+{
+	struct vm_region *vmr;
+	pte_t pte;
+	int ret;
+
+	/* Holding the vmr lock keeps page faults from filling va behind our back,
+	 * which map_page_at_addr() would treat as success. */
+	spin_lock(&p->vmr_lock);
+	vmr = find_vmr(p, va);
+	if (!vmr || vmr->vm_file || !(vmr->vm_prot & PROT_WRITE) ||
+	    !(vmr->vm_flags & MAP_PRIVATE)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	ret = pte_walk_okay(pte) && pte_is_mapped(pte) ? -EEXIST : 0;
+	spin_unlock(&p->pte_lock);
+	if (!ret)
+		ret = map_page_at_addr(p, page, va, PTE_USER_RW, FALSE);
+out:
+	spin_unlock(&p->vmr_lock);
+	return ret;
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -597,14 +664,103 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Anonymous VMRs can be backed by jumbo pages, either when they ask for it
+ * (MAP_HUGETLB) or for all of them (CONFIG_TRANSPARENT_HUGEPAGE).  We map a
+ * jumbo when we fault on or populate an aligned, jumbo-sized chunk of the VMR
+ * that has nothing mapped yet.  A jumbo never straddles a VMR boundary: before
+ * a munmap or mprotect changes part of a jumbo, we split it into regular PTEs
+ * (see split_jumbos_at()). */
+static bool vmr_wants_jumbos(struct vm_region *vmr)
+{
+	if (vmr->vm_file)
+		return FALSE;
+	if (arch_max_jumbo_page_shift() < PML2_SHIFT)
+		return FALSE;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	return TRUE;
+#else
+	return vmr->vm_flags & MAP_HUGETLB ? TRUE : FALSE;
+#endif
+}
+
+/* Helper, tries to map a zeroed jumbo page at va.  Returns 0 on success, in
+ * which case va's entire jumbo is mapped.  On failure, the caller should use
+ * regular pages. */
+static int map_jumbo_at_addr(struct proc *p, struct vm_region *vmr,
+                             uintptr_t va, int prot)
+{
+	struct page *page;
+	pte_t pte;
+	int ret;
+
+	if (!vmr_wants_jumbos(vmr))
+		return -EINVAL;
+	va = ROUNDDOWN(va, PML2_PTE_REACH);
+	if (va < vmr->vm_base || va + PML2_PTE_REACH > vmr->vm_end)
+		return -EINVAL;
+	/* Don't bother zeroing a jumbo if there are already pages here. */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	spin_unlock(&p->pte_lock);
+	if (pte_walk_okay(pte))
+		return -EEXIST;
+	page = jumbo_upage_alloc(TRUE);
+	if (!page)
+		return -ENOMEM;
+	spin_lock(&p->pte_lock);
+	ret = map_user_jumbo(p->env_pgdir, va, page2pa(page), prot);
+	if (!ret)
+		p->vm_nr_jumbos++;
+	spin_unlock(&p->pte_lock);
+	if (ret)
+		jumbo_upage_decref(page, JUMBO_NR_PGS);
+	return ret;
+}
+
+/* Helper, splits the jumbo containing va, if va is in the middle of one. */
+static int __split_jumbo_at(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+
+	if (!(va & (PML2_PTE_REACH - 1)))
+		return 0;
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_jumbo(pte))
+		return 0;
+	if (split_user_jumbo(p->env_pgdir, va))
+		return -ENOMEM;
+	p->vm_nr_jumbos--;
+	return 0;
+}
+
+/* Splits any jumbo pages that [addr, addr + len) covers only part of.  Hold the
+ * VMR lock. */
+static int split_jumbos_at(struct proc *p, uintptr_t addr, size_t len)
+{
+	int ret;
+
+	spin_lock(&p->pte_lock);
+	ret = __split_jumbo_at(p, addr);
+	if (!ret)
+		ret = __split_jumbo_at(p, addr + len);
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
  * mappable, which isn't true if there are concurrent changes to the VMRs. */
-static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+static int populate_anon_va(struct proc *p, struct vm_region *vmr,
+                            uintptr_t va, unsigned long nr_pgs, int pte_prot)
 {
 	struct page *page;
 	int ret;
 	for (long i = 0; i < nr_pgs; i++) {
+		if (!((va + i * PGSIZE) & (PML2_PTE_REACH - 1)) &&
+		    (nr_pgs - i >= JUMBO_NR_PGS) &&
+		    !map_jumbo_at_addr(p, vmr, va + i * PGSIZE, pte_prot)) {
+			i += JUMBO_NR_PGS - 1;
+			continue;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
@@ -750,7 +906,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, vmr, addr, nr_pgs, pte_prot);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on the file
 			 * keeps the pm alive when we unlock */
@@ -802,11 +958,16 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
 	pte_t pte;
-	bool shootdown_needed = FALSE;
+	struct tlb_batch tb;
 	bool file_access_failure = FALSE;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
 
+	if (split_jumbos_at(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	tlb_batch_init(&tb, p);
 	/* TODO: this is aggressively splitting, when we might not need to if the
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans. */
@@ -830,7 +991,13 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
 				pte_replace_perm(pte, pte_prot);
-				shootdown_needed = TRUE;
+				/* jumbos are aligned and never straddle a VMR */
+				if (pte_is_jumbo(pte)) {
+					tlb_batch_add(&tb, va, va + PML2_PTE_REACH);
+					va += PML2_PTE_REACH - PGSIZE;
+				} else {
+					tlb_batch_add(&tb, va, va + PGSIZE);
+				}
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -844,8 +1011,7 @@ next_vmr:
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_batch_flush(&tb);
 	if (file_access_failure) {
 		set_errno(EACCES);
 		return -1;
@@ -880,12 +1046,13 @@ int munmap(struct proc *p, uintptr_t addr, size_t len)
 static int __munmap_mark_not_present(struct proc *p, pte_t pte, void *va,
                                      void *arg)
 {
-	bool *shootdown_needed = (bool*)arg;
+	struct tlb_batch *tb = (struct tlb_batch*)arg;
 	/* could put in some checks here for !P and also !0 */
 	if (!pte_is_present(pte))	/* unmapped (== 0) *ptes are also not PTE_P */
 		return 0;
 	pte_clear_present(pte);
-	*shootdown_needed = TRUE;
+	tlb_batch_add(tb, (uintptr_t)va, (uintptr_t)va +
+	              (pte_is_jumbo(pte) ? PML2_PTE_REACH : PGSIZE));
 	return 0;
 }
 
@@ -908,6 +1075,12 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 	if (pte_is_unmapped(pte))
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
+	if (pte_is_jumbo(pte)) {
+		pte_clear(pte);
+		jumbo_upage_decref(page, JUMBO_NR_PGS);
+		p->vm_nr_jumbos--;
+		return 0;
+	}
 	pte_clear(pte);
 	if (!page_is_pagemap(page))
 		page_decref(page);
@@ -917,25 +1090,29 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
-	bool shootdown_needed = FALSE;
+	struct tlb_batch tb;
 
+	if (split_jumbos_at(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
+	tlb_batch_init(&tb, p);
 	spin_lock(&p->pte_lock);	/* changing PTEs */
 	while (vmr && vmr->vm_base < addr + len) {
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
-		                  __munmap_mark_not_present, &shootdown_needed);
+		                  __munmap_mark_not_present, &tb);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
 	/* we haven't freed the pages yet; still using the PTEs to store the them.
 	 * There should be no races with inserts/faults, since we still hold the mm
 	 * lock since the previous CB. */
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_batch_flush(&tb);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll need to
@@ -1028,6 +1205,7 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	struct page *a_page;
 	unsigned int f_idx;	/* index of the missing page in the file */
 	int ret = 0;
+	int pte_prot;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
 
@@ -1045,8 +1223,12 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (!vmr->vm_file) {
 		/* No file - just want anonymous memory */
+		if (!map_jumbo_at_addr(p, vmr, va, pte_prot))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1109,8 +1291,6 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do this
 	 * separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot, page_is_pagemap(a_page));
 	/* fall through, even for errors */
 out_put_pg:
@@ -1159,7 +1339,7 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr->vm_file) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot)) {
+			if (populate_anon_va(p, vmr, va, nr_pgs_this_vmr, pte_prot)) {
 				/* on any error, we can just bail.  we might be underestimating
 				 * nr_filled. */
 				break;
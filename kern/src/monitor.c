@@ -1241,6 +1241,8 @@ usage:
 		printk("\tresources: show resources wanted/granted for all procs\n");
 		printk("\tsort: sorts the idlecoremap, 1..n\n");
 		printk("\tnc PCOREID: sets the next CG core allocated\n");
+		printk("\tscp add|del PCOREID: start/stop running SCPs on a core\n");
+		printk("\tqoswarn USEC: lead time for QoS preemption warnings\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "idles")) {
@@ -1257,6 +1259,27 @@ usage:
 			return 1;
 		}
 		next_core_to_alloc(strtol(argv[2], 0, 0));
+	} else if (!strcmp(argv[1], "scp")) {
+		if (argc != 4) {
+			printk("Need add or del and a pcore number.\n");
+			return 1;
+		}
+		if (!strcmp(argv[2], "add")) {
+			if (sched_add_scp_core(strtol(argv[3], 0, 0)))
+				printk("Failed: errno %d\n", get_errno());
+		} else if (!strcmp(argv[2], "del")) {
+			if (sched_del_scp_core(strtol(argv[3], 0, 0)))
+				printk("Failed: errno %d\n", get_errno());
+		} else {
+			printk("Bad scp option %s\n", argv[2]);
+			return 1;
+		}
+	} else if (!strcmp(argv[1], "qoswarn")) {
+		if (argc != 3) {
+			printk("Need a number of usec.\n");
+			return 1;
+		}
+		sched_set_qos_warn_usec(strtol(argv[2], 0, 0));
 	} else {
 		printk("Bad option %s\n", argv[1]);
 		goto usage;
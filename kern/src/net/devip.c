@@ -833,6 +833,10 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 			return rv;
 		case Qdata:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			if (c->batch)
+				return ch->flag & O_NONBLOCK ?
+				       qread_msgs_nonblock(c->rq, a, n) :
+				       qread_msgs(c->rq, a, n);
 			if (ch->flag & O_NONBLOCK)
 				return qread_nonblock(c->rq, a, n);
 			else
@@ -1379,6 +1383,10 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 			 * binding. */
 			if (c->lport == 0)
 				autobind(c);
+			if (c->batch)
+				return ch->flag & O_NONBLOCK ?
+				       qwrite_msgs_nonblock(c->wq, a, n) :
+				       qwrite_msgs(c->wq, a, n);
 			if (ch->flag & O_NONBLOCK)
 				qwrite_nonblock(c->wq, a, n);
 			else
@@ -1422,6 +1430,8 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 				tosctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
+			else if (strcmp(cb->f[0], "zerocopy") == 0)
+				q_toggle_zerocopy(c->rq, cb->nf < 2 || atoi(cb->f[1]));
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
 				if (cb->nf < 2)
 					error(EFAIL, "addmulti needs interface address");
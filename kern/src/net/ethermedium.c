@@ -58,8 +58,14 @@ static uint8_t etherbroadcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 static void etherread4(void *a);
 static void etherread6(void *a);
+static void etherrcv4(void *a, struct block *bp);
+static void etherrcv6(void *a, struct block *bp);
 static void etherbind(struct Ipifc *ifc, int argc, char **argv);
 static void etherunbind(struct Ipifc *ifc);
+static void etherbwrite_one(struct Ipifc *ifc, struct block *bp, int version,
+                            uint8_t *mac);
+static void etherbwrite_gso(struct Ipifc *ifc, struct block *bp, int version,
+                            uint8_t *mac);
 static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
 						uint8_t * ip);
 static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * ia);
@@ -79,6 +85,7 @@ struct medium ethermedium = {
 	.mintu = 60,
 	.maxtu = 1514,
 	.maclen = 6,
+	.gso = TRUE,
 	.bind = etherbind,
 	.unbind = etherunbind,
 	.bwrite = etherbwrite,
@@ -95,6 +102,7 @@ struct medium trexmedium = {
 	.mintu = 60,
 	.maxtu = 1514,
 	.maclen = 6,
+	.gso = TRUE,
 	.bind = etherbind,
 	.unbind = etherunbind,
 	.bwrite = etherbwrite,
@@ -304,6 +312,11 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
+	/* Frames #ether steers by rss run input on their flow's core.  The
+	 * readers still get anything that isn't steered. */
+	etherrcvhook(mchan4, etherrcv4, ifc);
+	etherrcvhook(mchan6, etherrcv6, ifc);
+
 	ktask("etherread4", etherread4, ifc);
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
@@ -365,7 +378,6 @@ static inline void etherfilladdr(uint16_t *pkt, uint16_t *dst, uint16_t *src)
 static void
 etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 {
-	Etherhdr *eh;
 	struct arpent *a;
 	uint8_t mac[6];
 	Etherrock *er = ifc->arg;
@@ -396,6 +408,22 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 		}
 	}
 
+	if ((bp->flag & Btso) && !(ifc->feat & NETF_TSO)) {
+		etherbwrite_gso(ifc, bp, version, mac);
+		return;
+	}
+	etherbwrite_one(ifc, bp, version, mac);
+}
+
+/*
+ *  put the ether header on a single packet and hand it to the device
+ */
+static void etherbwrite_one(struct Ipifc *ifc, struct block *bp, int version,
+                            uint8_t *mac)
+{
+	Etherhdr *eh;
+	Etherrock *er = ifc->arg;
+
 	/* make it a single block with space for the ether header */
 	bp = padblock(bp, ifc->m->hsize);
 	if (bp->next)
@@ -422,12 +450,136 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 	ifc->out++;
 }
 
+/* Offsets into the v4 and tcp headers that segmentation has to fix up */
+enum {
+	GSO_IP_LEN = 2,
+	GSO_IP_ID = 4,
+	GSO_IP_PROTO = 9,
+	GSO_IP_CKSUM = 10,
+	GSO_TCP_SEQ = 4,
+	GSO_TCP_HLEN = 12,
+	GSO_TCP_FLAGS = 13,
+	GSO_TCP_CKSUM = 16,
+	GSO_TCP_MINHDR = 20,
+
+	GSO_TCPPROTO = 6,
+
+	GSO_TCP_FIN = 0x01,
+	GSO_TCP_PSH = 0x08,
+	GSO_TCP_CWR = 0x80,
+};
+
+/*
+ *  software TSO: tcp handed us one v4 super-segment (Btso) for a device that
+ *  can't split it, so cut it into bp->mss sized frames here, after route and
+ *  arp were done once for all of them.  Each frame gets a copy of the ip and
+ *  tcp headers; the payload is shared with the original through extra_data
+ *  references, not copied.
+ */
+static void etherbwrite_gso(struct Ipifc *ifc, struct block *bp, int version,
+                            uint8_t *mac)
+{
+	struct block *nb;
+	uint8_t *ip, *tcp;
+	int iphlen, hdrlen, paylen, off, len;
+	uint16_t id, mss = bp->mss;
+	uint32_t seq, csum;
+
+	bp = pullupblock(bp, IPV4HDR_LEN);
+	if (!bp)
+		return;
+	iphlen = (bp->rp[0] & 0xf) << 2;
+	bp = pullupblock(bp, iphlen + GSO_TCP_MINHDR);
+	if (!bp)
+		return;
+	hdrlen = iphlen + ((bp->rp[iphlen + GSO_TCP_HLEN] >> 4) << 2);
+	bp = pullupblock(bp, hdrlen);
+	if (!bp)
+		return;
+	ip = bp->rp;
+	tcp = ip + iphlen;
+	paylen = blocklen(bp) - hdrlen;
+	if (version != V4 || ip[GSO_IP_PROTO] != GSO_TCPPROTO || !mss) {
+		freeblist(bp);
+		return;
+	}
+	id = nhgets(ip + GSO_IP_ID);
+	seq = nhgetl(tcp + GSO_TCP_SEQ);
+
+	for (off = 0; off < paylen; off += len) {
+		len = MIN(mss, paylen - off);
+		nb = blist_clone(bp, hdrlen, len, hdrlen + off);
+		memmove(nb->wp, ip, hdrlen);
+		nb->wp += hdrlen;
+		nb->flag = bp->flag & ~Btso;
+		nb->checksum_start = bp->checksum_start;
+		nb->checksum_offset = bp->checksum_offset;
+		nb->transport_header_end = bp->transport_header_end;
+
+		hnputs(nb->rp + GSO_IP_LEN, hdrlen + len);
+		hnputs(nb->rp + GSO_IP_ID, id++);
+		nb->rp[GSO_IP_CKSUM] = 0;
+		nb->rp[GSO_IP_CKSUM + 1] = 0;
+		hnputs(nb->rp + GSO_IP_CKSUM, ipcsum(nb->rp));
+
+		tcp = nb->rp + iphlen;
+		hnputl(tcp + GSO_TCP_SEQ, seq + off);
+		if (off)
+			tcp[GSO_TCP_FLAGS] &= ~GSO_TCP_CWR;
+		if (off + len < paylen)
+			tcp[GSO_TCP_FLAGS] &= ~(GSO_TCP_FIN | GSO_TCP_PSH);
+		/* The pseudo-header sum tcp left in the checksum field covers the
+		 * whole payload's length.  Swap in ours (RFC 1624, eqn 3). */
+		if (bp->flag & Btcpck) {
+			csum = nhgets(tcp + GSO_TCP_CKSUM);
+			csum += (uint16_t)~(hdrlen + paylen - iphlen);
+			csum += hdrlen - iphlen + len;
+			while (csum >> 16)
+				csum = (csum & 0xffff) + (csum >> 16);
+			hnputs(tcp + GSO_TCP_CKSUM, csum);
+		}
+		etherbwrite_one(ifc, nb, version, mac);
+	}
+	freeblist(bp);
+}
+
+/*
+ *  hand one received frame to ip
+ */
+static void etherinput(struct Ipifc *ifc, struct block *bp, int version)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
+	}
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	ifc->in++;
+	bp->rp += ifc->m->hsize;
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		if (version == V4)
+			ipiput4(er->f, ifc, bp);
+		else
+			ipiput6(er->f, ifc, bp);
+	}
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
 /*
  *  process to read from the ethernet
  */
 static void etherread4(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
@@ -443,24 +595,7 @@ static void etherread4(void *a)
 	}
 	for (;;) {
 		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+		etherinput(ifc, bp, V4);
 	}
 	poperror();
 }
@@ -470,7 +605,7 @@ static void etherread4(void *a)
  */
 static void etherread6(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
@@ -486,25 +621,37 @@ static void etherread6(void *a)
 	}
 	for (;;) {
 		bp = devtab[er->mchan6->type].bread(er->mchan6, ifc->maxtu, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput6(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
+		etherinput(ifc, bp, V6);
+	}
+	poperror();
+}
+
+/*
+ *  rss hooks: #ether calls these from a routine kernel message on the core a
+ *  frame's flow is steered to.  There's no reader to unwind, so errors just
+ *  drop the frame.
+ */
+static void etherrcv4(void *a, struct block *bp)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		poperror();
+		return;
+	}
+	etherinput(a, bp, V4);
+	poperror();
+}
+
+static void etherrcv6(void *a, struct block *bp)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
 		poperror();
+		return;
 	}
+	etherinput(a, bp, V6);
 	poperror();
 }
 
@@ -40,6 +40,8 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <hash.h>
+#include <hash_helper.h>
 
 /*
  *  well known IP addresses
@@ -288,11 +290,14 @@ uint16_t ptclcsum_one(struct block *bp, int offset, int len)
 				continue;
 		}
 		x = MIN(len, ebd->len - boff);
-		addr = (void *)(ebd->base + ebd->off);
+		addr = (void *)(ebd->base + ebd->off + boff);
+		/* qwrite may have summed the whole buffer while copying it in */
+		csum = x == ebd->len && ebd_sum_ok(ebd) ? ebd->sum
+		                                        : ptclbsum(addr, x);
 		if (odd)
-			hisum += ptclbsum(addr, x);
+			hisum += csum;
 		else
-			losum += ptclbsum(addr, x);
+			losum += csum;
 		odd = (odd + x) & 1;
 		len -= x;
 	}
@@ -596,24 +601,154 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
  */
 uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
 {
-	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
+	uint32_t ret = ((uint32_t)sp << 16) | dp;
+
+	for (int i = 0; i < IPaddrlen; i += 4) {
+		ret = (ret ^ nhgetl(sa + i)) * GOLDEN_RATIO_32;
+		ret = (ret ^ nhgetl(da + i)) * GOLDEN_RATIO_32;
+	}
 	return ret;
 }
 
+static struct Iphtab *iphtab_alloc(unsigned int nr_hash_bits, int flags)
+{
+	struct Iphtab *t;
+	unsigned int nr = 1 << nr_hash_bits;
+
+	t = kzmalloc(sizeof(struct Iphtab) + nr * sizeof(struct Iphbucket),
+	             flags);
+	if (!t)
+		return NULL;
+	t->nr_hash_bits = nr_hash_bits;
+	for (int i = 0; i < nr; i++)
+		spinlock_init(&t->b[i].lock.w_lock);
+	return t;
+}
+
+static struct Iphbucket *iphtbucket(struct Iphtab *t, uint32_t hv)
+{
+	return &t->b[hv >> (32 - t->nr_hash_bits)];
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	ht->tab = iphtab_alloc(LOG2_UP(Nipht), MEM_WAIT);
+	atomic_init(&ht->nr, 0);
+	spinlock_init(&ht->lock);
+	spinlock_init(&ht->free_lock);
+	ht->free = NULL;
+}
+
+/* Only safe once nothing can look at the table anymore. */
+void iphtdestroy(struct Ipht *ht)
+{
+	struct Iphtab *t, *next_t;
+	struct Iphash *h, *next_h;
+
+	for (t = ht->tab; t; t = next_t) {
+		next_t = t->retired;
+		if (t == ht->tab) {
+			for (int i = 0; i < 1 << t->nr_hash_bits; i++) {
+				for (h = t->b[i].head; h; h = next_h) {
+					next_h = h->next;
+					kfree(h);
+				}
+			}
+		}
+		kfree(t);
+	}
+	for (h = ht->free; h; h = next_h) {
+		next_h = h->next;
+		kfree(h);
+	}
+	ht->tab = NULL;
+	ht->free = NULL;
+}
+
+/*
+ *  double the number of buckets.  Every bucket of the old table is locked
+ *  while we move the nodes over, so writers wait and readers retry; both then
+ *  notice ht->tab changed.  The old table stays around, since a reader could
+ *  still be peeking at it, and all the retired ones together are smaller than
+ *  the live one.
+ */
+static void iphtgrow(struct Ipht *ht)
+{
+	struct Iphtab *old, *new;
+	struct Iphash *h;
+	struct Iphbucket *b;
+	unsigned int nr_old;
+
+	old = ht->tab;
+	if (old->nr_hash_bits >= Lipht_max)
+		return;
+	if (atomic_read(&ht->nr) <= HASH_MAX_LOAD_FACTOR(1 << old->nr_hash_bits))
+		return;
+	if (!spin_trylock(&ht->lock))
+		return;
+	if (old != ht->tab) {
+		spin_unlock(&ht->lock);
+		return;
+	}
+	new = iphtab_alloc(old->nr_hash_bits + 1, MEM_ATOMIC);
+	if (!new) {
+		spin_unlock(&ht->lock);
+		return;
+	}
+	nr_old = 1 << old->nr_hash_bits;
+	for (int i = 0; i < nr_old; i++)
+		write_seqlock(&old->b[i].lock);
+	for (int i = 0; i < nr_old; i++) {
+		while ((h = old->b[i].head)) {
+			old->b[i].head = h->next;
+			b = iphtbucket(new, h->hv);
+			h->next = b->head;
+			b->head = h;
+		}
+	}
+	new->retired = old;
+	wmb();	/* new table is set up before anyone can find it */
+	ht->tab = new;
+	for (int i = 0; i < nr_old; i++)
+		write_sequnlock(&old->b[i].lock);
+	spin_unlock(&ht->lock);
+}
+
+/*
+ *  lock the bucket hv lands in, following the table across resizes
+ */
+static struct Iphbucket *iphtlockbucket(struct Ipht *ht, uint32_t hv)
+{
+	struct Iphtab *t;
+	struct Iphbucket *b;
+
+	for (;;) {
+		t = ACCESS_ONCE(ht->tab);
+		b = iphtbucket(t, hv);
+		write_seqlock(&b->lock);
+		if (t == ACCESS_ONCE(ht->tab))
+			return b;
+		write_sequnlock(&b->lock);
+	}
+}
+
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
 	struct Iphash *h;
+	struct Iphbucket *b;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
+	spin_lock(&ht->free_lock);
+	h = ht->free;
+	if (h)
+		ht->free = h->next;
+	spin_unlock(&ht->free_lock);
+	if (!h)
+		h = kzmalloc(sizeof(*h), 0);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
 	else {
@@ -630,28 +765,95 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 		}
 	}
 	h->c = c;
+	h->hv = hv;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	b = iphtlockbucket(ht, hv);
+	h->next = b->head;
+	b->head = h;
+	write_sequnlock(&b->lock);
+
+	atomic_inc(&ht->nr);
+	iphtgrow(ht);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
-	struct Iphash **l, *h;
+	struct Iphash **l, *h = NULL;
+	struct Iphbucket *b;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	b = iphtlockbucket(ht, hv);
+	for (l = &b->head; (*l) != NULL; l = &(*l)->next)
 		if ((*l)->c == c) {
 			h = *l;
 			(*l) = h->next;
-			kfree(h);
 			break;
 		}
-	spin_unlock(&ht->lock);
+	write_sequnlock(&b->lock);
+	if (!h)
+		return;
+	atomic_dec(&ht->nr);
+	spin_lock(&ht->free_lock);
+	h->next = ht->free;
+	ht->free = h;
+	spin_unlock(&ht->free_lock);
+}
+
+static bool iphtmatch(struct Iphash *h, int match, uint8_t * sa, uint16_t sp,
+                      uint8_t * da, uint16_t dp)
+{
+	struct conv *c = h->c;
+
+	if (h->match != match)
+		return FALSE;
+	switch (match) {
+	case IPmatchexact:
+		return sp == c->rport && dp == c->lport &&
+		       ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0;
+	case IPmatchpa:
+		return dp == c->lport && ipcmp(da, c->laddr) == 0;
+	case IPmatchport:
+		return dp == c->lport;
+	case IPmatchaddr:
+		return ipcmp(da, c->laddr) == 0;
+	}
+	return TRUE;
+}
+
+/*
+ *  lockless walk of the bucket for hv.  Anything we find is only trusted if
+ *  nobody touched the bucket (or resized the table) while we were in it.  Long
+ *  walks recheck as they go, in case recycled nodes send us around in circles.
+ */
+static struct conv *iphtwalk(struct Ipht *ht, uint32_t hv, int match,
+                             uint8_t * sa, uint16_t sp, uint8_t * da,
+                             uint16_t dp)
+{
+	struct Iphtab *t;
+	struct Iphbucket *b;
+	struct Iphash *h;
+	struct conv *c;
+	seq_ctr_t seq;
+	unsigned int steps;
+
+retry:
+	t = ACCESS_ONCE(ht->tab);
+	b = iphtbucket(t, hv);
+	seq = read_seqbegin(&b->lock);
+	c = NULL;
+	steps = 0;
+	for (h = ACCESS_ONCE(b->head); h != NULL; h = ACCESS_ONCE(h->next)) {
+		if (++steps % 64 == 0 && read_seqretry(&b->lock, seq))
+			goto retry;
+		if (iphtmatch(h, match, sa, sp, da, dp)) {
+			c = h->c;
+			break;
+		}
+	}
+	if (read_seqretry(&b->lock, seq) || t != ACCESS_ONCE(ht->tab))
+		goto retry;
+	return c;
 }
 
 /* look for a matching conversation with the following precedence
@@ -664,85 +866,50 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
-	struct Iphash *h;
 	struct conv *c;
 
 	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	c = iphtwalk(ht, iphash(sa, sp, da, dp), IPmatchexact, sa, sp, da, dp);
+	if (c)
+		return c;
 
 	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	c = iphtwalk(ht, iphash(IPnoaddr, 0, da, dp), IPmatchpa, sa, sp, da, dp);
+	if (c)
+		return c;
 
 	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
-			continue;
-		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	c = iphtwalk(ht, iphash(IPnoaddr, 0, IPnoaddr, dp), IPmatchport, sa, sp,
+	             da, dp);
+	if (c)
+		return c;
 
 	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
-			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	c = iphtwalk(ht, iphash(IPnoaddr, 0, da, 0), IPmatchaddr, sa, sp, da, dp);
+	if (c)
+		return c;
 
 	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
-	}
-	spin_unlock(&ht->lock);
-	return NULL;
+	return iphtwalk(ht, iphash(IPnoaddr, 0, IPnoaddr, 0), IPmatchany, sa, sp,
+	                da, dp);
 }
 
 void dump_ipht(struct Ipht *ht)
 {
+	struct Iphtab *t;
+	struct Iphbucket *b;
 	struct Iphash *h;
 	struct conv *c;
 
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
+	t = ht->tab;
+	for (int i = 0; i < 1 << t->nr_hash_bits; i++) {
+		b = &t->b[i];
+		write_seqlock(&b->lock);
+		for (h = b->head; h != NULL; h = h->next) {
 			c = h->c;
 			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
 			       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
 		}
+		write_sequnlock(&b->lock);
 	}
-	spin_unlock(&ht->lock);
 }
@@ -801,6 +801,23 @@ static void ipifc_iprouting(struct Fs *f, char **argv, int argc)
 	iprouting(f, i);
 }
 
+/* Passes anything we don't know about to the medium */
+static void ipifcmediumctl(struct Ipifc *ifc, char **argv, int argc)
+{
+	ERRSTACK(1);
+
+	rlock(&ifc->rwlock);
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	if (!ifc->m || !ifc->m->ctl)
+		error(EINVAL, "unknown command to ipifcctl: %s", argv[0]);
+	ifc->m->ctl(ifc, argv, argc);
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
 /*
  *  non-standard control messages.
  *  called with c locked.
@@ -838,7 +855,7 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 	else if (strcmp(argv[0], "recvra6") == 0)
 		ipifcrecvra6(ifc, argv, argc);
 	else
-		error(EINVAL, "unknown command to %s", __func__);
+		ipifcmediumctl(ifc, argv, argc);
 }
 
 int ipifcstats(struct Proto *ipifc, char *buf, int len)
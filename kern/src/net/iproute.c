@@ -38,6 +38,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <sort.h>
 #include <ip.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
@@ -323,6 +324,391 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 	balancetree(cur);
 }
 
+/*
+ *  Lookup tables.  The trees above are only walked by writers and by the
+ *  route file code, both under routelock.  Packet lookups go through a
+ *  flattened snapshot instead: the address space cut into disjoint intervals,
+ *  each tagged with its most specific route, sorted and indexed by the top
+ *  RTDIR_BITS of the address.  Every change to a forest rebuilds the snapshot
+ *  and swaps it in.  Readers don't lock; they publish the table they are
+ *  probing in a per-core hazard slot (with irqs off), and the writer waits for
+ *  the slots to move on before freeing the old table.
+ */
+#define RTDIR_BITS	12
+#define RTDIR_SIZE	(1 << RTDIR_BITS)
+
+struct v4rtent {
+	uint32_t address;
+	uint32_t endaddress;
+	struct route *r;
+};
+
+struct v6rtent {
+	uint32_t address[IPllen];
+	uint32_t endaddress[IPllen];
+	struct route *r;
+};
+
+struct rtable {
+	unsigned int nr;
+	unsigned int dir[RTDIR_SIZE + 1];	/* first entry ending in bucket */
+	union {
+		struct v4rtent v4[0];
+		struct v6rtent v6[0];
+	};
+};
+
+/* 128 bit keys, so v4 and v6 share the flattening code */
+struct rtkey {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+struct rtspan {
+	struct rtkey sa;
+	struct rtkey ea;
+	struct route *r;
+};
+
+struct rt_hazard {
+	struct rtable *rt;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct rt_hazard rt_hazards[MAX_NUM_CORES];
+
+static void rtkey_set(struct rtkey *k, struct route *r, bool end)
+{
+	uint32_t *a;
+
+	if (r->rt.type & Rv4) {
+		k->hi = 0;
+		k->lo = end ? r->v4.endaddress : r->v4.address;
+		return;
+	}
+	a = end ? r->v6.endaddress : r->v6.address;
+	k->hi = ((uint64_t)a[0] << 32) | a[1];
+	k->lo = ((uint64_t)a[2] << 32) | a[3];
+}
+
+static int rtkey_cmp(const struct rtkey *a, const struct rtkey *b)
+{
+	if (a->hi != b->hi)
+		return a->hi < b->hi ? -1 : 1;
+	if (a->lo != b->lo)
+		return a->lo < b->lo ? -1 : 1;
+	return 0;
+}
+
+static bool rtkey_ismax(const struct rtkey *k, bool v4)
+{
+	if (v4)
+		return k->lo == 0xffffffff;
+	return k->hi == ~0ULL && k->lo == ~0ULL;
+}
+
+static void rtkey_inc(struct rtkey *k)
+{
+	if (++k->lo == 0)
+		k->hi++;
+}
+
+static void rtkey_dec(struct rtkey *k)
+{
+	if (k->lo-- == 0)
+		k->hi--;
+}
+
+static unsigned int rtkey_dir(const struct rtkey *k, bool v4)
+{
+	if (v4)
+		return k->lo >> (32 - RTDIR_BITS);
+	return k->hi >> (64 - RTDIR_BITS);
+}
+
+static int rtspan_cmp(const void *x, const void *y)
+{
+	const struct rtspan *a = x, *b = y;
+	int ret;
+
+	/* by start, enclosing ranges before the ones they contain */
+	ret = rtkey_cmp(&a->sa, &b->sa);
+	if (ret)
+		return ret;
+	return rtkey_cmp(&b->ea, &a->ea);
+}
+
+static unsigned int rtcount(struct route *r)
+{
+	if (r == NULL)
+		return 0;
+	return 1 + rtcount(r->rt.left) + rtcount(r->rt.mid) +
+	       rtcount(r->rt.right);
+}
+
+static struct rtspan *rtcollect(struct route *r, struct rtspan *s)
+{
+	if (r == NULL)
+		return s;
+	rtkey_set(&s->sa, r, FALSE);
+	rtkey_set(&s->ea, r, TRUE);
+	s->r = r;
+	s++;
+	s = rtcollect(r->rt.left, s);
+	s = rtcollect(r->rt.mid, s);
+	return rtcollect(r->rt.right, s);
+}
+
+static void rtemit(struct rtspan *out, unsigned int *nout, struct rtkey *pos,
+                   struct rtkey *end, struct route *r)
+{
+	if (rtkey_cmp(pos, end) > 0)
+		return;
+	out[*nout].sa = *pos;
+	out[*nout].ea = *end;
+	out[*nout].r = r;
+	(*nout)++;
+}
+
+/*
+ *  turn sorted, possibly nested ranges into disjoint intervals, each owned by
+ *  the innermost range covering it.  Routes only nest or are disjoint, so a
+ *  stack of the currently open ranges is enough.
+ */
+static unsigned int rtflatten(struct rtspan *in, unsigned int n,
+                              struct rtspan *out, struct rtspan **stack,
+                              bool v4)
+{
+	struct rtkey pos, end;
+	struct rtspan *top;
+	unsigned int i, nout = 0, sp = 0;
+	bool done = FALSE;
+
+	for (i = 0; i < n; i++) {
+		/* ranges spanning several root trees are in each of them */
+		if (i && !rtkey_cmp(&in[i].sa, &in[i - 1].sa) &&
+		    !rtkey_cmp(&in[i].ea, &in[i - 1].ea))
+			continue;
+		while (sp && rtkey_cmp(&stack[sp - 1]->ea, &in[i].sa) < 0) {
+			top = stack[--sp];
+			rtemit(out, &nout, &pos, &top->ea, top->r);
+			pos = top->ea;
+			rtkey_inc(&pos);
+		}
+		if (sp && rtkey_cmp(&pos, &in[i].sa) < 0) {
+			end = in[i].sa;
+			rtkey_dec(&end);
+			rtemit(out, &nout, &pos, &end, stack[sp - 1]->r);
+		}
+		pos = in[i].sa;
+		stack[sp++] = &in[i];
+	}
+	while (sp) {
+		top = stack[--sp];
+		if (done)
+			continue;
+		rtemit(out, &nout, &pos, &top->ea, top->r);
+		if (rtkey_ismax(&top->ea, v4))
+			done = TRUE;
+		pos = top->ea;
+		rtkey_inc(&pos);
+	}
+	return nout;
+}
+
+static struct rtable *rtbuild(struct route **roots, bool v4)
+{
+	struct rtspan *in, *out, **stack;
+	struct rtable *t;
+	unsigned int n = 0, nout, i, j, b;
+	size_t entsz = v4 ? sizeof(struct v4rtent) : sizeof(struct v6rtent);
+
+	for (i = 0; i < 1 << Lroot; i++)
+		n += rtcount(roots[i]);
+	if (n == 0)
+		return NULL;
+	in = kmalloc(n * sizeof(struct rtspan), MEM_WAIT);
+	out = kmalloc((2 * n + 1) * sizeof(struct rtspan), MEM_WAIT);
+	stack = kmalloc(n * sizeof(struct rtspan *), MEM_WAIT);
+
+	j = 0;
+	for (i = 0; i < 1 << Lroot; i++)
+		j = rtcollect(roots[i], &in[j]) - in;
+	sort(in, n, sizeof(struct rtspan), rtspan_cmp);
+	nout = rtflatten(in, n, out, stack, v4);
+
+	t = kzmalloc(sizeof(struct rtable) + nout * entsz, MEM_WAIT);
+	t->nr = nout;
+	for (i = 0; i < nout; i++) {
+		if (v4) {
+			t->v4[i].address = out[i].sa.lo;
+			t->v4[i].endaddress = out[i].ea.lo;
+			t->v4[i].r = out[i].r;
+		} else {
+			t->v6[i].address[0] = out[i].sa.hi >> 32;
+			t->v6[i].address[1] = out[i].sa.hi;
+			t->v6[i].address[2] = out[i].sa.lo >> 32;
+			t->v6[i].address[3] = out[i].sa.lo;
+			t->v6[i].endaddress[0] = out[i].ea.hi >> 32;
+			t->v6[i].endaddress[1] = out[i].ea.hi;
+			t->v6[i].endaddress[2] = out[i].ea.lo >> 32;
+			t->v6[i].endaddress[3] = out[i].ea.lo;
+			t->v6[i].r = out[i].r;
+		}
+	}
+	j = 0;
+	for (b = 0; b < RTDIR_SIZE; b++) {
+		while (j < nout && rtkey_dir(&out[j].ea, v4) < b)
+			j++;
+		t->dir[b] = j;
+	}
+	t->dir[RTDIR_SIZE] = nout;
+
+	kfree(stack);
+	kfree(out);
+	kfree(in);
+	return t;
+}
+
+/*
+ *  publish a new table; routelock must be held for writing
+ */
+static void rtswap(struct rtable **tp, struct rtable *new)
+{
+	struct rtable *old = *tp;
+
+	wmb();	/* table contents before the pointer */
+	ACCESS_ONCE(*tp) = new;
+	mb();	/* pointer before checking the hazards */
+	if (old == NULL)
+		return;
+	for (int i = 0; i < num_cores; i++)
+		while (ACCESS_ONCE(rt_hazards[i].rt) == old)
+			cpu_relax();
+	kfree(old);
+}
+
+/*
+ *  routes deleted from the trees might still be in the published table, and
+ *  allocroute would scribble on them.  hold them until rtswap has waited out
+ *  the lookups in the old table.
+ */
+static void rtdefer(struct route **dead, struct route *r)
+{
+	r->rt.mid = *dead;
+	*dead = r;
+}
+
+static void rtfreedead(struct route *dead)
+{
+	struct route *r;
+
+	while ((r = dead)) {
+		dead = r->rt.mid;
+		freeroute(r);
+	}
+}
+
+static void v4rebuild(struct Fs *f)
+{
+	rtswap(&f->v4rt, rtbuild(f->v4root, TRUE));
+}
+
+static void v6rebuild(struct Fs *f)
+{
+	rtswap(&f->v6rt, rtbuild(f->v6root, FALSE));
+}
+
+/*
+ *  pin the current table for a lookup.  irqs must be off, so that nothing
+ *  else on this core reuses the slot while we're in the table.
+ */
+static struct rtable *rtget(struct rtable **tp)
+{
+	struct rt_hazard *hz = &rt_hazards[core_id()];
+	struct rtable *t;
+
+	do {
+		t = ACCESS_ONCE(*tp);
+		hz->rt = t;
+		mb();
+	} while (t != ACCESS_ONCE(*tp));
+	return t;
+}
+
+static void rtput(void)
+{
+	mb();	/* finish reading the table before letting it go */
+	rt_hazards[core_id()].rt = NULL;
+}
+
+/*
+ *  entries in t that can hold an address in directory bucket b
+ */
+static void rtdir_bounds(struct rtable *t, unsigned int b, unsigned int *lo,
+                         unsigned int *hi)
+{
+	*lo = t->dir[b];
+	*hi = MIN(t->dir[b + 1], t->nr - 1);
+}
+
+static struct route *v4probe(struct Fs *f, uint32_t la)
+{
+	struct rtable *t;
+	struct v4rtent *e;
+	struct route *q = NULL;
+	unsigned int lo, hi, mid;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	t = rtget(&f->v4rt);
+	if (t) {
+		rtdir_bounds(t, la >> (32 - RTDIR_BITS), &lo, &hi);
+		/* last entry starting at or below la */
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (t->v4[mid].address <= la)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		e = &t->v4[lo];
+		if (lo < t->nr && e->address <= la && la <= e->endaddress)
+			q = e->r;
+	}
+	rtput();
+	enable_irqsave(&irq_state);
+	return q;
+}
+
+static struct route *v6probe(struct Fs *f, uint32_t *la)
+{
+	struct rtable *t;
+	struct v6rtent *e;
+	struct route *q = NULL;
+	unsigned int lo, hi, mid;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	t = rtget(&f->v6rt);
+	if (t) {
+		rtdir_bounds(t, la[0] >> (32 - RTDIR_BITS), &lo, &hi);
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (lcmp(t->v6[mid].address, la) <= 0)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		e = &t->v6[lo];
+		if (lo < t->nr && lcmp(e->address, la) <= 0 &&
+		    lcmp(la, e->endaddress) <= 0)
+			q = e->r;
+	}
+	rtput();
+	enable_irqsave(&irq_state);
+	return q;
+}
+
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
 
 void
@@ -339,6 +725,7 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 	sa = nhgetl(a) & m;
 	ea = sa | ~m;
 
+	wlock(&routelock);
 	eh = V4H(ea);
 	for (h = V4H(sa); h <= eh; h++) {
 		p = allocroute(Rv4 | type);
@@ -347,15 +734,15 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		memmove(p->v4.gate, gate, sizeof(p->v4.gate));
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
 
-		wlock(&routelock);
 		addnode(f, &f->v4root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v4root[h], p->rt.left);
 			freeroute(p);
 		}
-		wunlock(&routelock);
 	}
+	v4rebuild(f);
+	wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
@@ -385,6 +772,7 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		ea[h] = x | ~y;
 	}
 
+	wlock(&routelock);
 	eh = V6H(ea);
 	for (h = V6H(sa); h <= eh; h++) {
 		p = allocroute(type);
@@ -393,15 +781,15 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		memmove(p->v6.gate, gate, IPaddrlen);
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
 
-		wlock(&routelock);
 		addnode(f, &f->v6root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v6root[h], p->rt.left);
 			freeroute(p);
 		}
-		wunlock(&routelock);
 	}
+	v6rebuild(f);
+	wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
@@ -437,6 +825,7 @@ struct route **looknode(struct route **cur, struct route *r)
 void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 {
 	struct route **r, *p;
+	struct route *dead = NULL;
 	struct route rt;
 	int h, eh;
 	uint32_t m;
@@ -447,9 +836,9 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 	rt.rt.type = Rv4;
 
 	eh = V4H(rt.v4.endaddress);
+	if (dolock)
+		wlock(&routelock);
 	for (h = V4H(rt.v4.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v4root[h], &rt);
 		if (r) {
 			p = *r;
@@ -461,7 +850,7 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
 				addqueue(&f->queue, p->rt.right);
-				freeroute(p);
+				rtdefer(&dead, p);
 				while ((p = f->queue)) {
 					f->queue = p->rt.mid;
 					walkadd(f, &f->v4root[h], p->rt.left);
@@ -469,9 +858,11 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
+	v4rebuild(f);
+	rtfreedead(dead);
+	if (dolock)
+		wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcremroute(f, Rv4, a, mask);
@@ -480,6 +871,7 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 {
 	struct route **r, *p;
+	struct route *dead = NULL;
 	struct route rt;
 	int h, eh;
 	uint32_t x, y;
@@ -493,9 +885,9 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 	rt.rt.type = 0;
 
 	eh = V6H(rt.v6.endaddress);
+	if (dolock)
+		wlock(&routelock);
 	for (h = V6H(rt.v6.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v6root[h], &rt);
 		if (r) {
 			p = *r;
@@ -507,7 +899,7 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
 				addqueue(&f->queue, p->rt.right);
-				freeroute(p);
+				rtdefer(&dead, p);
 				while ((p = f->queue)) {
 					f->queue = p->rt.mid;
 					walkadd(f, &f->v6root[h], p->rt.left);
@@ -515,9 +907,11 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
+	v6rebuild(f);
+	rtfreedead(dead);
+	if (dolock)
+		wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcremroute(f, 0, a, mask);
@@ -525,7 +919,7 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 
 struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
+	struct route *q;
 	uint32_t la;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
@@ -535,16 +929,7 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 		return c->r;
 
 	la = nhgetl(a);
-	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
-			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+	q = v4probe(f, la);
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -569,10 +954,9 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
+	struct route *q;
 	uint32_t la[IPllen];
 	int h;
-	uint32_t x, y;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
 
@@ -589,34 +973,7 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 	for (h = 0; h < IPllen; h++)
 		la[h] = nhgetl(a + 4 * h);
 
-	q = 0;
-	for (p = f->v6root[V6H(la)]; p;) {
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.address[h];
-			if (x == y)
-				continue;
-			if (x < y) {
-				p = p->rt.left;
-				goto next;
-			}
-			break;
-		}
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.endaddress[h];
-			if (x == y)
-				continue;
-			if (x > y) {
-				p = p->rt.right;
-				goto next;
-			}
-			break;
-		}
-		q = p;
-		p = p->rt.mid;
-next:	;
-	}
+	q = v6probe(f, la);
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
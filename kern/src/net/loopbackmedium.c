@@ -42,13 +42,31 @@
 
 enum {
 	Maxtu = 16 * 1024,
+	Nstamps = 4096,		/* more than the min-sized packets q can hold */
 };
 
+/* Loopback can also emulate a slow, lossy path (a la netem) for testing
+ * transports, set with these on the ifc's ctl file (0 turns each off):
+ * - delay USEC: latency added to every packet
+ * - rate MBPS: bottleneck bandwidth, queueing (and dropping) at q
+ * - loss N: drop every Nth packet
+ *
+ * Every packet gets a departure time, kept in the stamps ring in the same order
+ * as q, and the reader holds each packet until then. */
 typedef struct LB LB;
 struct LB {
 	struct proc *readp;
 	struct queue *q;
 	struct Fs *f;
+	spinlock_t lock;
+	uint64_t delay;				/* usec */
+	uint64_t rate;				/* bits per usec, 0 for no limit */
+	uint32_t loss;
+	uint32_t nr_out;
+	uint64_t link_free;			/* usec, when the bottleneck goes idle */
+	uint64_t *stamps;			/* usec, departure times */
+	unsigned int stamp_prod;
+	unsigned int stamp_cons;
 };
 
 static void loopbackread(void *a);
@@ -60,6 +78,8 @@ loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 
 	lb = kzmalloc(sizeof(*lb), 0);
 	lb->f = ifc->conv->p->f;
+	spinlock_init(&lb->lock);
+	lb->stamps = kzmalloc(Nstamps * sizeof(uint64_t), MEM_WAIT);
 	/* TO DO: make queue size a function of kernel memory */
 	lb->q = qopen(128 * 1024, Qmsg, NULL, NULL);
 	ifc->arg = lb;
@@ -85,6 +105,7 @@ static void loopbackunbind(struct Ipifc *ifc)
 
 	/* clean up */
 	qfree(lb->q);
+	kfree(lb->stamps);
 	kfree(lb);
 }
 
@@ -93,12 +114,68 @@ loopbackbwrite(struct Ipifc *ifc, struct block *bp, int unused_int,
 			   uint8_t * unused_uint8_p_t)
 {
 	LB *lb;
+	uint64_t now, depart;
 
 	ptclcsum_finalize(bp, 0);
 	lb = ifc->arg;
-	if (qpass(lb->q, bp) < 0)
-		ifc->outerr++;
 	ifc->out++;
+	spin_lock(&lb->lock);
+	if ((lb->loss && ++lb->nr_out % lb->loss == 0) ||
+	    (lb->stamp_prod - lb->stamp_cons == Nstamps)) {
+		spin_unlock(&lb->lock);
+		freeb(bp);
+		ifc->outerr++;
+		return;
+	}
+	now = tsc2usec(read_tsc());
+	depart = now;
+	if (lb->rate) {
+		lb->link_free = MAX(lb->link_free, now) + BLEN(bp) * 8 / lb->rate;
+		depart = lb->link_free;
+	}
+	/* The reader can't get to this stamp until we qpass, and no other writer
+	 * can get in until we unlock, so we can take it back if qpass fails. */
+	lb->stamps[lb->stamp_prod++ % Nstamps] = depart + lb->delay;
+	if (qpass(lb->q, bp) < 0) {
+		lb->stamp_prod--;
+		ifc->outerr++;
+	}
+	spin_unlock(&lb->lock);
+}
+
+static void loopbackctl(struct Ipifc *ifc, char **argv, int argc)
+{
+	LB *lb = ifc->arg;
+	uint64_t val;
+
+	if (argc != 2)
+		error(EINVAL, "usage: delay USEC | rate MBPS | loss N");
+	val = strtoul(argv[1], 0, 0);
+	spin_lock(&lb->lock);
+	if (strcmp(argv[0], "delay") == 0) {
+		lb->delay = val;
+	} else if (strcmp(argv[0], "rate") == 0) {
+		lb->rate = val;
+	} else if (strcmp(argv[0], "loss") == 0) {
+		lb->loss = val;
+		lb->nr_out = 0;
+	} else {
+		spin_unlock(&lb->lock);
+		error(EINVAL, "unknown command to %s", __func__);
+	}
+	spin_unlock(&lb->lock);
+}
+
+/* Returns the departure time of the packet we just pulled off q. */
+static uint64_t loopback_depart_time(LB *lb)
+{
+	uint64_t depart;
+
+	spin_lock(&lb->lock);
+	assert(lb->stamp_prod != lb->stamp_cons);
+	depart = lb->stamps[lb->stamp_cons++ % Nstamps];
+	spin_unlock(&lb->lock);
+	return depart;
 }
 
 static void loopbackread(void *a)
@@ -107,6 +184,7 @@ static void loopbackread(void *a)
 	struct Ipifc *ifc;
 	struct block *bp;
 	LB *lb;
+	uint64_t depart, now;
 
 	ifc = a;
 	lb = ifc->arg;
@@ -121,6 +199,10 @@ static void loopbackread(void *a)
 		bp = qbread(lb->q, Maxtu);
 		if (bp == NULL)
 			continue;
+		depart = loopback_depart_time(lb);
+		now = tsc2usec(read_tsc());
+		if (depart > now)
+			kthread_usleep(depart - now);
 		ifc->in++;
 		if (!canrlock(&ifc->rwlock)) {
 			freeb(bp);
@@ -151,6 +233,7 @@ struct medium loopbackmedium = {
 	.bind = loopbackbind,
 	.unbind = loopbackunbind,
 	.bwrite = loopbackbwrite,
+	.ctl = loopbackctl,
 };
 
 linker_func_4(loopbackmediumlink)
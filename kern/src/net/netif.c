@@ -157,8 +157,12 @@ netifgen(struct chan *c, char *unused_char_p_t, struct dirtab *vp,
 				q.path = Nifstatqid;
 				devdir(c, q, "ifstats", 0, eve.name, 0444, dp);
 				break;
+			case 4:
+				q.path = Nrssqid;
+				devdir(c, q, "rss", 0, eve.name, 0664, dp);
+				break;
 			default:
-				i -= 4;
+				i -= 5;
 				if (i >= nif->nfile)
 					return -1;
 				if (nif->f[i] == 0)
@@ -242,6 +246,10 @@ struct chan *netifopen(struct ether *nif, struct chan *c, int omode)
 				id = openfile(nif, -1);
 				c->qid.path = NETQID(id, Nctlqid);
 				break;
+			case Nrssqid:
+				if ((omode & O_WRITE) && !iseve())
+					error(EPERM, ERROR_FIXME);
+				break;
 			default:
 				if (omode & O_WRITE)
 					error(EINVAL, ERROR_FIXME);
@@ -498,6 +506,7 @@ void netifclose(struct ether *nif, struct chan *c)
 	f = nif->f[NETID(c->qid.path)];
 	qlock(&f->qlock);
 	if (--(f->inuse) == 0) {
+		f->rcv = NULL;
 		if (f->prom) {
 			qlock(&nif->qlock);
 			if (--(nif->prom) == 0 && nif->promiscuous != NULL)
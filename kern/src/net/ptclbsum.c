@@ -40,185 +40,16 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <cpu_feat.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *) & endian;
 #define	LITTLE	*aendian
 
 
-#ifdef CONFIG_X86
-
-/* $NetBSD: in_cksum.c,v 1.7 1997/09/02 13:18:15 thorpej Exp $ */
-
-/*-
- * Copyright (c) 1988, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- * Copyright (c) 1996
- *	Matt Thomas <matt@3am-software.com>
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *	This product includes software developed by the University of
- *	California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- *	@(#)in_cksum.c	8.1 (Berkeley) 6/10/93
- */
-
-/*
- * Checksum routine for Internet Protocol family headers
- *    (Portable Alpha version).
- *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
- */
-
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE32							  \
-    {									  \
-	q_util.q = sum;							  \
-	sum = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3];	  \
-    }
-#define REDUCE16							  \
-    {									  \
-	q_util.q = sum;							  \
-	l_util.l = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3]; \
-	sum = l_util.s[0] + l_util.s[1];				  \
-	ADDCARRY(sum);							  \
-    }
-
-static const uint32_t in_masks[] = {
-	/*0 bytes*/ /*1 byte*/	/*2 bytes*/ /*3 bytes*/
-	0x00000000, 0x000000FF, 0x0000FFFF, 0x00FFFFFF,	/* offset 0 */
-	0x00000000, 0x0000FF00, 0x00FFFF00, 0xFFFFFF00,	/* offset 1 */
-	0x00000000, 0x00FF0000, 0xFFFF0000, 0xFFFF0000,	/* offset 2 */
-	0x00000000, 0xFF000000, 0xFF000000, 0xFF000000,	/* offset 3 */
-};
-
-union l_util {
-	uint16_t s[2];
-	uint32_t l;
-};
-union q_util {
-	uint16_t s[4];
-	uint32_t l[2];
-	uint64_t q;
-};
-
-static uint64_t
-in_cksumdata(const void *buf, int len)
-{
-	const uint32_t *lw = (const uint32_t *) buf;
-	uint64_t sum = 0;
-	uint64_t prefilled;
-	int offset;
-	union q_util q_util;
-
-	if ((3 & (long) lw) == 0 && len == 20) {
-	     sum = (uint64_t) lw[0] + lw[1] + lw[2] + lw[3] + lw[4];
-	     REDUCE32;
-	     return sum;
-	}
-
-	if ((offset = 3 & (long) lw) != 0) {
-		const uint32_t *masks = in_masks + (offset << 2);
-		lw = (uint32_t *) (((long) lw) - offset);
-		sum = *lw++ & masks[len >= 3 ? 3 : len];
-		len -= 4 - offset;
-		if (len <= 0) {
-			REDUCE32;
-			return sum;
-		}
-	}
-#if 0
-	/*
-	 * Force to cache line boundary.
-	 */
-	offset = 32 - (0x1f & (long) lw);
-	if (offset < 32 && len > offset) {
-		len -= offset;
-		if (4 & offset) {
-			sum += (uint64_t) lw[0];
-			lw += 1;
-		}
-		if (8 & offset) {
-			sum += (uint64_t) lw[0] + lw[1];
-			lw += 2;
-		}
-		if (16 & offset) {
-			sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-			lw += 4;
-		}
-	}
-#endif
-	/*
-	 * access prefilling to start load of next cache line.
-	 * then add current cache line
-	 * save result of prefilling for loop iteration.
-	 */
-	prefilled = lw[0];
-	while ((len -= 32) >= 4) {
-		uint64_t prefilling = lw[8];
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-		prefilled = prefilling;
-	}
-	if (len >= 0) {
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-	} else {
-		len += 32;
-	}
-	while ((len -= 16) >= 0) {
-		sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-		lw += 4;
-	}
-	len += 16;
-	while ((len -= 4) >= 0) {
-		sum += (uint64_t) *lw++;
-	}
-	len += 4;
-	if (len > 0)
-		sum += (uint64_t) (in_masks[len] & *lw);
-	REDUCE32;
-	return sum;
-}
-uint16_t ptclbsum(uint8_t * addr, int len)
-{
-	uint64_t sum = in_cksumdata(addr, len);
-	union q_util q_util;
-	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
-	REDUCE16;
-	return cpu_to_be16(sum);
-}
-#else
-uint16_t ptclbsum(uint8_t * addr, int len)
+/* Portable version, and the reference the arch-specific ones are checked and
+ * benchmarked against. */
+uint16_t ptclbsum_scalar(uint8_t * addr, int len)
 {
 	uint32_t losum, hisum, mdsum, x;
 	uint32_t t1, t2;
@@ -284,4 +115,138 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+#ifdef CONFIG_X86
+
+/* 64 bit ones' complement sums.  Carries out of bit 63 wrap around into bit 0,
+ * which keeps the 16 bit sum of every lane intact until we fold at the end. */
+
+/* Sums len & ~63 bytes with a single add-with-carry chain. */
+static uint64_t csum64_adc(const uint8_t *p, size_t len, uint64_t sum)
+{
+	for (; len >= 64; len -= 64, p += 64)
+		asm ("addq 0(%[p]), %[s]\n\t"
+		     "adcq 8(%[p]), %[s]\n\t"
+		     "adcq 16(%[p]), %[s]\n\t"
+		     "adcq 24(%[p]), %[s]\n\t"
+		     "adcq 32(%[p]), %[s]\n\t"
+		     "adcq 40(%[p]), %[s]\n\t"
+		     "adcq 48(%[p]), %[s]\n\t"
+		     "adcq 56(%[p]), %[s]\n\t"
+		     "adcq $0, %[s]"
+		     : [s] "+r" (sum)
+		     : [p] "r" (p), "m" (*(const uint8_t (*)[64])p)
+		     : "cc");
+	return sum;
+}
+
+/* Same, but with two independent carry chains (CF through adcx, OF through
+ * adox), so the adds don't all serialize on one flag. */
+static uint64_t csum64_adx(const uint8_t *p, size_t len, uint64_t sum)
+{
+	uint64_t sum2 = 0, zero;
+
+	for (; len >= 64; len -= 64, p += 64)
+		asm ("xorl %k[z], %k[z]\n\t"	/* clears CF and OF too */
+		     "adcxq 0(%[p]), %[s]\n\t"
+		     "adoxq 8(%[p]), %[t]\n\t"
+		     "adcxq 16(%[p]), %[s]\n\t"
+		     "adoxq 24(%[p]), %[t]\n\t"
+		     "adcxq 32(%[p]), %[s]\n\t"
+		     "adoxq 40(%[p]), %[t]\n\t"
+		     "adcxq 48(%[p]), %[s]\n\t"
+		     "adoxq 56(%[p]), %[t]\n\t"
+		     "adcxq %[z], %[s]\n\t"
+		     "adoxq %[z], %[t]"
+		     : [s] "+r" (sum), [t] "+r" (sum2), [z] "=&r" (zero)
+		     : [p] "r" (p), "m" (*(const uint8_t (*)[64])p)
+		     : "cc");
+	sum += sum2;
+	return sum + (sum < sum2);
+}
+
+static uint64_t csum64_add(uint64_t sum, uint64_t x)
+{
+	sum += x;
+	return sum + (sum < x);
+}
+
+/* The leftover < 64 bytes, with the last partial word zero padded. */
+static uint64_t csum64_tail(const uint8_t *p, size_t len, uint64_t sum)
+{
+	uint64_t x;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&x, p, 8);
+		sum = csum64_add(sum, x);
+	}
+	if (len) {
+		x = 0;
+		memcpy(&x, p, len);
+		sum = csum64_add(sum, x);
+	}
+	return sum;
+}
+
+static uint16_t csum64_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* The kernel doesn't get to touch the vector registers without saving the
+ * user's FPU state, which costs more than a packet's worth of summing.  So the
+ * fast path is 64 bit add-with-carry, and ADX's second carry chain when the CPU
+ * has it. */
+static uint64_t csum64(const uint8_t *p, size_t len)
+{
+	uint64_t sum;
+
+	if (cpu_has_feat(CPU_FEAT_X86_ADX))
+		sum = csum64_adx(p, len, 0);
+	else
+		sum = csum64_adc(p, len, 0);
+	return csum64_tail(p + (len & ~63), len & 63, sum);
+}
+
+uint16_t ptclbsum(uint8_t * addr, int len)
+{
+	if (len <= 0)
+		return 0;
+	return cpu_to_be16(csum64_fold(csum64(addr, len)));
+}
+
+uint16_t ptclbsum_copy(uint8_t * dst, uint8_t * src, int len)
+{
+	uint64_t sum = 0, x;
+
+	if (len <= 0)
+		return 0;
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		memcpy(&x, src, 8);
+		memcpy(dst, &x, 8);
+		sum = csum64_add(sum, x);
+	}
+	if (len) {
+		x = 0;
+		memcpy(&x, src, len);
+		memcpy(dst, &x, len);
+		sum = csum64_add(sum, x);
+	}
+	return cpu_to_be16(csum64_fold(sum));
+}
+#else
+uint16_t ptclbsum(uint8_t * addr, int len)
+{
+	return ptclbsum_scalar(addr, len);
+}
+
+uint16_t ptclbsum_copy(uint8_t * dst, uint8_t * src, int len)
+{
+	memmove(dst, src, len);
+	return ptclbsum_scalar(src, len);
+}
 #endif
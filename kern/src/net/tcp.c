@@ -98,7 +98,9 @@ enum {
 	SACK_OK_LENGTH = 2,
 	SACK_OPT = 5,
 	MSL2 = 10,
-	MSPTICK = 50,	/* Milliseconds per timer tick */
+	MSPTICK = 10,	/* Milliseconds per timer tick */
+	NR_WHEEL_SLOTS = 512,	/* Timer wheel slots, power of two */
+	LIMBO_TICKS = 50 / MSPTICK,	/* Ticks between limbo rexmit scans */
 	DEF_MSS = 1460,	/* Default mean segment */
 	DEF_MSS6 = 1280,	/* Default mean segment (min) for v6 */
 	SACK_SUPPORTED = TRUE,	/* SACK is on by default */
@@ -138,8 +140,8 @@ enum {
 	Time_wait,
 
 	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
-	NLHT = 256,	/* hash table size, must be a power of 2 */
-	LHTMASK = NLHT - 1,
+	LHTBITS = 12,
+	NLHT = 1 << LHTBITS,	/* hash table size, must be a power of 2 */
 
 	HaveWS = 1 << 8,
 };
@@ -157,12 +159,22 @@ struct Tcptimer {
 	Tcptimer *prev;
 	Tcptimer *readynext;
 	int state;
+	int wheel;				/* which per-core wheel we're hashed on */
 	uint64_t start;
-	uint64_t count;
+	uint64_t when;				/* tick at which we expire */
 	void (*func) (void *);
 	void *arg;
 };
 
+/* Hashed timing wheel: a timer lives in slot (when % NR_WHEEL_SLOTS) and only
+ * fires once the tick count has caught up with it, so long timers just get
+ * skipped over on each lap.  One wheel per core, so arming and cancelling
+ * timers on different cores doesn't fight over a lock. */
+struct tcp_wheel {
+	spinlock_t lock;
+	Tcptimer *slots[NR_WHEEL_SLOTS];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /*
  *  v4 and v6 pseudo headers used for
  *  checksuming tcp
@@ -253,6 +265,54 @@ struct Reseq {
 	uint16_t length;
 };
 
+enum {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+
+	BBR_UNIT = 1000,			/* gains are in thousandths */
+	BBR_HIGH_GAIN = 2885,		/* 2/ln(2), doubles the rate every round */
+	BBR_DRAIN_GAIN = 347,		/* 1 / BBR_HIGH_GAIN */
+	BBR_CWND_GAIN = 2000,
+	BBR_BW_ROUNDS = 10,			/* rounds in the max bw filter */
+	BBR_MIN_RTT_MS = 10000,		/* how long a min_rtt sample is good for */
+	BBR_PROBE_RTT_MS = 200,
+	BBR_MIN_CWND_SEGS = 4,
+	BBR_CYCLE_LEN = 8,
+};
+
+/* CUBIC congestion control state.  Windows are in bytes, times in ms. */
+struct cubic {
+	uint32_t w_max;				/* cwind before the last loss */
+	uint32_t w_origin;			/* plateau of the current curve */
+	uint64_t w_est;				/* what Reno would have by now */
+	uint64_t epoch_start;		/* start of the current curve, 0 for none */
+	uint64_t k;					/* time from epoch_start to w_origin */
+};
+
+/* BBR congestion control state.  We estimate the delivery rate once per round
+ * trip, from the bytes acked during that round. */
+struct bbr {
+	uint8_t mode;
+	uint8_t cycle_idx;
+	uint8_t full_bw_cnt;
+	bool full_bw_reached;
+	uint32_t round_end;			/* round ends when this seq is acked */
+	uint32_t round_count;
+	uint32_t round_acked;		/* bytes acked this round */
+	uint64_t round_stamp;		/* usec, start of this round */
+	uint64_t bw[BBR_BW_ROUNDS];	/* delivery rate per round, bytes/sec */
+	uint64_t full_bw;
+	uint32_t min_rtt;			/* ms */
+	uint64_t min_rtt_stamp;		/* ms */
+	uint64_t probe_rtt_done;	/* ms, 0 until PROBE_RTT drained in_flight */
+	uint32_t pacing_gain;
+	uint32_t cwnd_gain;
+};
+
+struct tcp_cc_ops;
+
 /*
  *  the qlock in the Conv locks this structure
  */
@@ -317,6 +377,15 @@ struct Tcpctl {
 	uint32_t ts_recent;			/* timestamp received around last_ack_sent */
 	uint32_t last_ack_sent;		/* to determine when to update timestamp */
 	bool sack_ok;				/* Can use SACK for this connection */
+	struct tcp_cc_ops *cc;		/* Congestion control algorithm */
+	union {
+		struct cubic cubic;
+		struct bbr bbr;
+	} ccs;						/* Congestion control state */
+	uint64_t pacing_rate;		/* bytes/sec, 0 if we don't pace */
+	uint64_t pace_next;			/* usec, when we may send again */
+	int pace_core;				/* core whose tchain has the pace_waiter */
+	struct alarm_waiter pace_waiter;
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -324,6 +393,17 @@ struct Tcpctl {
 	} protohdr;					/* prototype header */
 };
 
+/* Congestion control algorithms own cwind, ssthresh and pacing_rate.  All ops
+ * are called with the conv qlocked. */
+struct tcp_cc_ops {
+	char *name;
+	void (*init)(struct conv *s, Tcpctl *tcb);
+	/* New data was acked.  rtt is the sample from this ack in ms, or 0. */
+	void (*ack)(struct conv *s, Tcpctl *tcb, uint32_t acked, int rtt);
+	/* We saw a loss, from dupacks/SACKs or a retransmit timeout */
+	void (*loss)(struct conv *s, Tcpctl *tcb, bool rto);
+};
+
 /*
  *  New calls are put in limbo rather than having a conversation structure
  *  allocated.  Thus, a SYN attack results in lots of limbo'd calls but not
@@ -334,8 +414,9 @@ struct Tcpctl {
  *  in the input queue limit.
  *
  *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue
- *  of 70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  of 70000 limbo'd calls, so they're hashed on the caller's address and port
+ *  with the same mixer as the conversation table.  All limbo operations run
+ *  with the proto locked, which is what serializes them.
  */
 typedef struct Limbo Limbo;
 struct Limbo {
@@ -403,9 +484,9 @@ static char *statnames[] = {
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* Per-core timer wheels, advanced by tcpackproc */
+	struct tcp_wheel *wheels;
+	uint64_t ticks;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -450,7 +531,10 @@ void tcprxmit(struct conv *);
 void tcpsettimer(Tcpctl *);
 void tcpsynackrtt(struct conv *);
 void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto);
+static struct tcp_cc_ops tcp_reno;
+static void tcp_pace_init(struct conv *s, Tcpctl *tcb);
+static bool tcp_pace(Tcpctl *tcb, uint32_t ssize);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static int seq_within(uint32_t x, uint32_t low, uint32_t high);
 static int seq_lt(uint32_t x, uint32_t y);
@@ -462,6 +546,7 @@ static uint32_t seq_min(uint32_t x, uint32_t y);
 static void set_in_flight(Tcpctl *tcb);
 
 static void limborexmit(struct Proto *);
+static uint64_t tcptimer_left(struct tcppriv *priv, Tcptimer * t);
 static void limbo(struct conv *, uint8_t * unused_uint8_p_t, uint8_t *, Tcp *,
 				  int);
 
@@ -520,14 +605,16 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %llu katimer.count %llu cc %s\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start,
+					tcptimer_left(c->p->priv, &s->timer), s->rerecv,
+					s->katimer.start,
+					tcptimer_left(c->p->priv, &s->katimer), s->cc->name);
 }
 
 static int tcpinuse(struct conv *c)
@@ -704,47 +791,60 @@ static void tcpcreate(struct conv *c)
 	/* We don't use qio limits.  Instead, TCP manages flow control on its own.
 	 * We only use qpassnolim().  Note for qio that 0 doesn't mean no limit. */
 	c->rq = qopen(0, Qcoalesce, 0, 0);
-	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
+	c->wq = qopen(8 * QMAX, Qkick | Qcsum, tcpkick, c);
+	((Tcpctl *) c->ptcl)->cc = &tcp_reno;
 }
 
+/* Called with t's wheel locked */
 static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
+	struct tcp_wheel *w = &priv->wheels[t->wheel];
+	Tcptimer **slot;
+
+	if (t->state == TcptimerON) {
+		// unchain
+		slot = &w->slots[t->when & (NR_WHEEL_SLOTS - 1)];
+		if (*slot == t) {
+			*slot = t->next;
+			if (t->prev != NULL)
+				panic("timerstate1");
 		}
+		if (t->next)
+			t->next->prev = t->prev;
+		if (t->prev)
+			t->prev->next = t->next;
+		t->next = t->prev = NULL;
+	}
+	if (newstate == TcptimerON) {
+		// chain
+		if (t->prev != NULL || t->next != NULL)
+			panic("timerstate2");
+		slot = &w->slots[t->when & (NR_WHEEL_SLOTS - 1)];
+		t->prev = NULL;
+		t->next = *slot;
+		if (t->next)
+			t->next->prev = t;
+		*slot = t;
 	}
 	t->state = newstate;
 }
 
+/* Ticks left before t fires; still meaningful once t has been halted. */
+static uint64_t tcptimer_left(struct tcppriv *priv, Tcptimer * t)
+{
+	uint64_t now = ACCESS_ONCE(priv->ticks);
+
+	return t->when > now ? t->when - now : 0;
+}
+
 void tcpackproc(void *a)
 {
 	ERRSTACK(1);
 	Tcptimer *t, *tp, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	struct tcp_wheel *w;
+	uint64_t now;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -752,28 +852,24 @@ void tcpackproc(void *a)
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
-		qlock(&priv->tl);
+		now = priv->ticks + 1;
+		ACCESS_ONCE(priv->ticks) = now;
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
+		for (int i = 0; i < num_cores; i++) {
+			w = &priv->wheels[i];
+			spin_lock(&w->lock);
+			for (t = w->slots[now & (NR_WHEEL_SLOTS - 1)]; t; t = tp) {
+				tp = t->next;
+				if (t->when <= now) {
 					timerstate(priv, t, TcptimerDONE);
 					t->readynext = timeo;
 					timeo = t;
 				}
 			}
+			spin_unlock(&w->lock);
 		}
-		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -782,29 +878,40 @@ void tcpackproc(void *a)
 			}
 		}
 
-		limborexmit(tcp);
+		if (now % LIMBO_TICKS == 0)
+			limborexmit(tcp);
 	}
 }
 
+/* Timers stay on the wheel of the core that set up the tcb; the tcb's owner
+ * serializes tcpgo and tcphalt on a given timer. */
 void tcpgo(struct tcppriv *priv, Tcptimer * t)
 {
+	struct tcp_wheel *w;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
+	w = &priv->wheels[t->wheel];
+	spin_lock(&w->lock);
+	/* unchain from the old slot before moving when */
+	timerstate(priv, t, TcptimerOFF);
+	t->when = priv->ticks + t->start;
 	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	spin_unlock(&w->lock);
 }
 
 void tcphalt(struct tcppriv *priv, Tcptimer * t)
 {
+	struct tcp_wheel *w;
+
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
+	w = &priv->wheels[t->wheel];
+	spin_lock(&w->lock);
 	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	spin_unlock(&w->lock);
 }
 
 int backoff(int n)
@@ -843,6 +950,9 @@ void localclose(struct conv *s, char *reason)
 	qhangup(s->wq, reason);
 
 	tcpsetstate(s, Closed);
+	/* the next user of this conv starts with the default */
+	tcb->cc = &tcp_reno;
+	tcb->pacing_rate = 0;
 
 	/* listener will check the rq state */
 	if (s->state == Announced)
@@ -871,7 +981,8 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 			break;
 	}
 	*flags &= ~TSO;
-	if (ifc && (ifc->feat & NETF_TSO))
+	/* ethermedium segments v4 super-packets itself if the nic can't */
+	if (ifc && ((ifc->feat & NETF_TSO) || (version == V4 && ifc->m->gso)))
 		*flags |= TSO;
 	*scale = HaveWS | 7;
 
@@ -881,19 +992,31 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 void inittcpctl(struct conv *s, int mode)
 {
 	Tcpctl *tcb;
+	struct tcp_cc_ops *cc;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* A pacing alarm could still be armed from this conv's last connection.
+	 * The congestion control algorithm might have been picked already, before
+	 * the connect or announce. */
+	if (tcb->pace_waiter.irq_ok)
+		unset_alarm(&per_cpu_info[tcb->pace_core].tchain, &tcb->pace_waiter);
+	cc = tcb->cc;
 	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->cc = cc;
 
 	tcb->ssthresh = UINT32_MAX;
 	tcb->srtt = tcp_irtt;
 	tcb->mdev = 0;
 
 	/* setup timers */
+	tcb->timer.wheel = core_id();
+	tcb->rtt_timer.wheel = core_id();
+	tcb->acktimer.wheel = core_id();
+	tcb->katimer.wheel = core_id();
 	tcb->timer.start = tcp_irtt / MSPTICK;
 	tcb->timer.func = tcptimeout;
 	tcb->timer.arg = s;
@@ -946,6 +1069,9 @@ void inittcpctl(struct conv *s, int mode)
 	tcb->rcv.wnd = QMAX;
 	tcb->rcv.scale = 0;
 	tcb->snd.scale = 0;
+
+	tcp_pace_init(s, tcb);
+	tcb->cc->init(s, tcb);
 }
 
 /*
@@ -1593,7 +1719,7 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 	return 0;
 }
 
-#define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
+#define hashipa(a, p) (iphash(a, p, IPnoaddr, 0) >> (32 - LHTBITS))
 
 /*
  *  put a call into limbo and respond with a SYN ACK
@@ -1814,8 +1940,11 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	if (new == NULL)
 		return NULL;
 
-	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
+	/* new might be a reused conv, with its last pacing alarm still armed */
+	if (tcb->pace_waiter.irq_ok)
+		unset_alarm(&per_cpu_info[tcb->pace_core].tchain, &tcb->pace_waiter);
+	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb->flags &= ~CLONE;
 	tcb->timer.arg = new;
 	tcb->timer.state = TcptimerOFF;
@@ -1856,6 +1985,9 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	/* we inherit the listener's algorithm, but not its state */
+	tcp_pace_init(new, tcb);
+	tcb->cc->init(new, tcb);
 
 	/* set initial round trip time */
 	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
@@ -2080,7 +2212,7 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 			       tcb->snd.rtx, tcb_sack->left, tcb_sack->right, tcb->snd.una,
 			       tcb->snd.recovery_pt);
 			/* Redo retrans, but keep the sacks and recovery point */
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.rtx = tcb->snd.una;
 			tcb->snd.sack_loss_hint = 0;
 			/* Act like an RTO.  We just detected it earlier.  This prevents us
@@ -2339,7 +2471,7 @@ void update(struct conv *s, Tcp * seg)
 {
 	int rtt;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -2366,7 +2498,7 @@ void update(struct conv *s, Tcp * seg)
 			       "%I.%d -> %I.%d: loss hint thresh, nr sacks %u, nxt %u, una %u, cwnd %u\n",
 			       s->laddr, s->lport, s->raddr, s->rport,
 			       tcb->snd.nr_sacks, tcb->snd.nxt, tcb->snd.una, tcb->cwind);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			if (tcb->snd.nr_sacks) {
 				tcb->snd.recovery = SACK_RETRANS_RECOVERY;
@@ -2414,43 +2546,17 @@ void update(struct conv *s, Tcp * seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We want to
-			 * increase the cwind by one MSS for every MSS that gets ACKed.
-			 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
-			 * a remainder of acked / MSS, we'd add just that remainder - not 0
-			 * or 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're supposed to expand
-			 * by MSS bytes.  The classic algorithm was
-			 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead, for every
-			 * 'acked' bytes, we increase the window by acked / CWND (in units
-			 * of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-	adjust_tx_qio_limit(s);
-
+	rtt = 0;
 	if (tcb->ts_recent) {
-		update_rtt(tcb, abs(milliseconds() - seg->ts_ecr),
-		           expected_samples_ts(tcb, acked));
+		rtt = abs(milliseconds() - seg->ts_ecr);
+		update_rtt(tcb, rtt, expected_samples_ts(tcb, acked));
 	} else if (tcb->rtt_timer.state == TcptimerON &&
 	           seq_ge(seg->ack, tcb->rttseq)) {
 		/* Adjust the timers according to the round trip time */
 		tcphalt(tpriv, &tcb->rtt_timer);
 		if (!tcb->snd.recovery) {
-			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
+			rtt = tcb->rtt_timer.start - tcptimer_left(tpriv,
+			                                           &tcb->rtt_timer);
 			if (rtt == 0)
 				rtt = 1;	/* o/w all close systems will rexmit in 0 time */
 			rtt *= MSPTICK;
@@ -2458,6 +2564,9 @@ void update(struct conv *s, Tcp * seg)
 		}
 	}
 
+	tcb->cc->ack(s, tcb, acked, rtt);
+	adjust_tx_qio_limit(s);
+
 done:
 	if (qdiscard(s->wq, acked) < acked) {
 		tcb->flgcnt--;
@@ -3141,6 +3250,13 @@ static bool throttle_ssize(struct conv *s, Tcpctl *tcb, uint32_t *ssize_p,
 
 	ssize = throttle_for_mss(tcb, ssize, payload_mss, retrans);
 
+	/* If we're forced (e.g. to ACK), we can always send headers */
+	if (ssize && tcb->pacing_rate && !tcp_pace(tcb, ssize)) {
+		if (!(tcb->flags & FORCE))
+			return FALSE;
+		ssize = 0;
+	}
+
 	*ssize_p = ssize;
 	return TRUE;
 }
@@ -3604,19 +3720,429 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	tcb->cc->loss(s, tcb, rto);
 	netlog(s->p->f, Logtcprxmt,
-	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
-	       s->laddr, s->lport, s->raddr, s->rport,
+	       "%I.%d -> %I.%d: %s loss event, cwnd was %d, now %d\n",
+	       s->laddr, s->lport, s->raddr, s->rport, tcb->cc->name,
 	       old_cwnd, tcb->cwind);
 }
 
+/* Grows cwind by expand, without passing the send window. */
+static void tcp_cc_grow(Tcpctl *tcb, uint32_t expand)
+{
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+static void reno_init(struct conv *s, Tcpctl *tcb)
+{
+	tcb->pacing_rate = 0;
+}
+
+static void reno_ack(struct conv *s, Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	uint32_t expand;
+
+	/* slow start as long as we're not recovering from lost packets */
+	if (tcb->cwind >= tcb->snd.wnd || tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to
+		 * increase the cwind by one MSS for every MSS that gets ACKed.
+		 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
+		 * a remainder of acked / MSS, we'd add just that remainder - not 0
+		 * or 1 MSS. */
+		expand = acked;
+	} else {
+		/* Every RTT, which consists of CWND bytes, we're supposed to expand
+		 * by MSS bytes.  The classic algorithm was
+		 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
+		 * which assumes the ACK was for MSS bytes.  Instead, for every
+		 * 'acked' bytes, we increase the window by acked / CWND (in units
+		 * of MSS). */
+		expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
+		         / tcb->cwind;
+	}
+	tcp_cc_grow(tcb, expand);
+}
+
+static void reno_loss(struct conv *s, Tcpctl *tcb, bool rto)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+static struct tcp_cc_ops tcp_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.ack = reno_ack,
+	.loss = reno_loss,
+};
+
+/* CUBIC, from RFC 8312.  After a loss, cwind follows
+ *
+ * 		W(t) = C * (t - K)^3 + W_max
+ *
+ * which flattens out around the window we lost at (W_max) and then probes
+ * beyond it, independently of the RTT.  C = 0.4 (segments and seconds) and
+ * beta, the multiplicative decrease, is 0.7. */
+#define CUBIC_BETA_X10		7
+#define CUBIC_MAX_T_MS		100000ULL	/* keeps the cube in 64 bits */
+
+/* Integer cube root, from Hacker's Delight. */
+static uint64_t cubic_cbrt(uint64_t x)
+{
+	uint64_t y = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+static void cubic_init(struct conv *s, Tcpctl *tcb)
+{
+	memset(&tcb->ccs.cubic, 0, sizeof(struct cubic));
+	tcb->pacing_rate = 0;
+}
+
+static void cubic_ack(struct conv *s, Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct cubic *cu = &tcb->ccs.cubic;
+	uint64_t now = milliseconds();
+	uint64_t mss = tcb->typical_mss;
+	uint64_t t, d, off, target;
+
+	if (tcb->cwind >= tcb->snd.wnd || tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		tcp_cc_grow(tcb, acked);
+		return;
+	}
+	if (!cu->epoch_start) {
+		cu->epoch_start = now;
+		cu->w_est = tcb->cwind;
+		if (tcb->cwind < cu->w_max) {
+			/* K = cbrt((W_max - cwind) / C), in ms */
+			cu->k = cubic_cbrt((uint64_t)(cu->w_max - tcb->cwind) * 2500
+			                   / mss * 1000000);
+			cu->w_origin = cu->w_max;
+		} else {
+			cu->k = 0;
+			cu->w_origin = tcb->cwind;
+		}
+	}
+	/* Aim for where the curve will be one RTT from now */
+	t = MIN(now - cu->epoch_start + tcb->srtt, CUBIC_MAX_T_MS);
+	d = t > cu->k ? t - cu->k : cu->k - t;
+	off = d * d * d / 1000 * 4 * mss / 10000000;
+	if (t > cu->k)
+		target = cu->w_origin + off;
+	else
+		target = cu->w_origin > off ? cu->w_origin - off : 0;
+	/* TCP-friendly region: never grow slower than Reno would, which gets
+	 * 3 * (1 - beta) / (1 + beta) MSS per RTT with our beta. */
+	cu->w_est += (uint64_t)acked * mss * 529 / 1000 / tcb->cwind;
+	target = MAX(target, cu->w_est);
+	if (target <= tcb->cwind)
+		return;
+	/* Spread the growth over the next RTT's worth of acks, and don't grow
+	 * faster than 1.5x per RTT. */
+	target = MIN(target, (uint64_t)tcb->cwind * 3 / 2);
+	tcp_cc_grow(tcb, (target - tcb->cwind) * acked / tcb->cwind);
+}
+
+static void cubic_loss(struct conv *s, Tcpctl *tcb, bool rto)
+{
+	struct cubic *cu = &tcb->ccs.cubic;
+
+	/* Fast convergence: if we didn't make it back to the last W_max, someone
+	 * else is probably taking bandwidth, so release some more. */
+	if (tcb->cwind < cu->w_max)
+		cu->w_max = (uint64_t)tcb->cwind * (10 + CUBIC_BETA_X10) / 20;
+	else
+		cu->w_max = tcb->cwind;
+	cu->epoch_start = 0;
+	tcb->ssthresh = MAX((uint64_t)tcb->cwind * CUBIC_BETA_X10 / 10,
+	                    2 * tcb->typical_mss);
+	tcb->cwind = tcb->ssthresh;
+}
+
+static struct tcp_cc_ops tcp_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.ack = cubic_ack,
+	.loss = cubic_loss,
+};
+
+/* BBR (v1).  Instead of reacting to loss, BBR models the path by its
+ * bottleneck bandwidth (max delivery rate over the last BBR_BW_ROUNDS rounds)
+ * and its min RTT (over BBR_MIN_RTT_MS).  It paces at gain * bw and caps
+ * cwind at gain * bw * min_rtt.  The gains depend on the mode:
+ * - STARTUP: doubles the rate every round until bw stops growing
+ * - DRAIN: drains the queue STARTUP built
+ * - PROBE_BW: cycles the pacing gain around 1 to find more bw
+ * - PROBE_RTT: briefly shrinks cwind to find the min RTT again */
+static const uint32_t bbr_pacing_gains[BBR_CYCLE_LEN] = {
+	1250, 750, 1000, 1000, 1000, 1000, 1000, 1000
+};
+
+static uint64_t bbr_max_bw(struct bbr *bbr)
+{
+	uint64_t bw = 0;
+
+	for (int i = 0; i < BBR_BW_ROUNDS; i++)
+		bw = MAX(bw, bbr->bw[i]);
+	return bw;
+}
+
+/* Returns gain * BDP in bytes, or 0 if we don't know the BDP yet. */
+static uint64_t bbr_bdp(struct bbr *bbr, uint32_t gain)
+{
+	if (bbr->min_rtt == UINT32_MAX)
+		return 0;
+	return bbr_max_bw(bbr) * bbr->min_rtt / 1000 * gain / BBR_UNIT;
+}
+
+static void bbr_set_mode(struct bbr *bbr, uint8_t mode)
+{
+	bbr->mode = mode;
+	switch (mode) {
+	case BBR_STARTUP:
+		bbr->pacing_gain = BBR_HIGH_GAIN;
+		bbr->cwnd_gain = BBR_HIGH_GAIN;
+		break;
+	case BBR_DRAIN:
+		bbr->pacing_gain = BBR_DRAIN_GAIN;
+		bbr->cwnd_gain = BBR_HIGH_GAIN;
+		break;
+	case BBR_PROBE_BW:
+		/* skip the 0.75 phase, which would drain what we just drained */
+		bbr->cycle_idx = 2;
+		bbr->pacing_gain = bbr_pacing_gains[bbr->cycle_idx];
+		bbr->cwnd_gain = BBR_CWND_GAIN;
+		break;
+	case BBR_PROBE_RTT:
+		bbr->pacing_gain = BBR_UNIT;
+		bbr->cwnd_gain = BBR_UNIT;
+		bbr->probe_rtt_done = 0;
+		break;
+	}
+}
+
+static void bbr_init(struct conv *s, Tcpctl *tcb)
+{
+	struct bbr *bbr = &tcb->ccs.bbr;
+
+	memset(bbr, 0, sizeof(struct bbr));
+	bbr->min_rtt = UINT32_MAX;
+	bbr->min_rtt_stamp = milliseconds();
+	bbr->round_end = tcb->snd.nxt;
+	bbr->round_stamp = tsc2usec(read_tsc());
+	bbr_set_mode(bbr, BBR_STARTUP);
+	/* Until we have a bw sample, pace at high gain * cwind / srtt */
+	tcb->pacing_rate = (uint64_t)tcb->cwind * 1000 / MAX(tcb->srtt, 1)
+	                   * BBR_HIGH_GAIN / BBR_UNIT;
+}
+
+/* Accounts for acked bytes.  Returns TRUE if a round trip just ended, in which
+ * case we have a new bw sample. */
+static bool bbr_update_round(Tcpctl *tcb, uint32_t acked)
+{
+	struct bbr *bbr = &tcb->ccs.bbr;
+	uint64_t now = tsc2usec(read_tsc());
+	uint64_t elapsed;
+
+	bbr->round_acked += acked;
+	if (seq_lt(tcb->snd.una, bbr->round_end))
+		return FALSE;
+	elapsed = now - bbr->round_stamp;
+	if (elapsed)
+		bbr->bw[bbr->round_count % BBR_BW_ROUNDS] =
+			(uint64_t)bbr->round_acked * 1000000 / elapsed;
+	bbr->round_count++;
+	bbr->round_end = tcb->snd.nxt;
+	bbr->round_stamp = now;
+	bbr->round_acked = 0;
+	return TRUE;
+}
+
+/* STARTUP is done when three rounds in a row failed to grow bw by 25% */
+static void bbr_check_full_bw(struct bbr *bbr)
+{
+	uint64_t bw = bbr_max_bw(bbr);
+
+	if (bw >= bbr->full_bw * 5 / 4) {
+		bbr->full_bw = bw;
+		bbr->full_bw_cnt = 0;
+		return;
+	}
+	if (++bbr->full_bw_cnt >= 3)
+		bbr->full_bw_reached = TRUE;
+}
+
+static void bbr_ack(struct conv *s, Tcpctl *tcb, uint32_t acked, int rtt)
+{
+	struct bbr *bbr = &tcb->ccs.bbr;
+	uint64_t now = milliseconds();
+	uint64_t min_cwnd = BBR_MIN_CWND_SEGS * tcb->typical_mss;
+	uint64_t bw, target, cwnd;
+	bool round_end;
+
+	if (rtt > 0 && (rtt <= bbr->min_rtt ||
+	                now - bbr->min_rtt_stamp > BBR_MIN_RTT_MS)) {
+		bbr->min_rtt = rtt;
+		bbr->min_rtt_stamp = now;
+	}
+	round_end = bbr_update_round(tcb, acked);
+
+	switch (bbr->mode) {
+	case BBR_STARTUP:
+		if (round_end)
+			bbr_check_full_bw(bbr);
+		if (bbr->full_bw_reached)
+			bbr_set_mode(bbr, BBR_DRAIN);
+		break;
+	case BBR_DRAIN:
+		if (tcb->snd.in_flight <= bbr_bdp(bbr, BBR_UNIT))
+			bbr_set_mode(bbr, BBR_PROBE_BW);
+		break;
+	case BBR_PROBE_BW:
+		if (round_end) {
+			bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+			bbr->pacing_gain = bbr_pacing_gains[bbr->cycle_idx];
+		}
+		break;
+	case BBR_PROBE_RTT:
+		if (!bbr->probe_rtt_done && tcb->snd.in_flight <= min_cwnd) {
+			bbr->probe_rtt_done = now + BBR_PROBE_RTT_MS;
+		} else if (bbr->probe_rtt_done && now >= bbr->probe_rtt_done) {
+			bbr->min_rtt_stamp = now;
+			bbr_set_mode(bbr, bbr->full_bw_reached ? BBR_PROBE_BW
+			                                       : BBR_STARTUP);
+		}
+		break;
+	}
+	if (bbr->mode != BBR_PROBE_RTT &&
+	    now - bbr->min_rtt_stamp > BBR_MIN_RTT_MS)
+		bbr_set_mode(bbr, BBR_PROBE_RTT);
+
+	bw = bbr_max_bw(bbr);
+	if (bw)
+		tcb->pacing_rate = bw * bbr->pacing_gain / BBR_UNIT;
+	target = MAX(bbr_bdp(bbr, bbr->cwnd_gain), min_cwnd);
+	cwnd = (uint64_t)tcb->cwind + acked;
+	if (bbr->mode == BBR_PROBE_RTT)
+		cwnd = min_cwnd;
+	else if (bbr->full_bw_reached || (bw && tcb->cwind >= target))
+		cwnd = MIN(cwnd, target);
+	tcb->cwind = MIN(MAX(cwnd, min_cwnd), UINT32_MAX / 2);
+}
+
+static void bbr_loss(struct conv *s, Tcpctl *tcb, bool rto)
+{
+	/* BBR doesn't back off on loss; the model already accounts for it.  An RTO
+	 * means the model is stale, so we restart from a small window. */
+	if (rto)
+		tcb->cwind = BBR_MIN_CWND_SEGS * tcb->typical_mss;
+}
+
+static struct tcp_cc_ops tcp_bbr = {
+	.name = "bbr",
+	.init = bbr_init,
+	.ack = bbr_ack,
+	.loss = bbr_loss,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_reno,
+	&tcp_cubic,
+	&tcp_bbr,
+};
+
+static void tcpsetcc(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (n < 2)
+		error(EINVAL, "usage: cc reno|cubic|bbr");
+	for (int i = 0; i < COUNT_OF(tcp_ccs); i++) {
+		if (!strcmp(f[1], tcp_ccs[i]->name)) {
+			tcb->cc = tcp_ccs[i];
+			tcb->cc->init(s, tcb);
+			return;
+		}
+	}
+	error(EINVAL, "unknown congestion control %s", f[1]);
+}
+
+/* Pacing.  When an algorithm sets pacing_rate, we spread our sends out in time
+ * instead of sending a cwind's worth back to back.  The pace_waiter is an IRQ
+ * alarm, so we can cancel it without blocking on its handler; the handler
+ * kicks tcpoutput from a routine kernel message. */
+static void tcp_pace_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct conv *s = (struct conv *)a0;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		poperror();
+		return;
+	}
+	/* tcpoutput ignores closed convs */
+	tcpoutput(s);
+	qunlock(&s->qlock);
+	poperror();
+}
+
+static void tcp_pace_alarm(struct alarm_waiter *waiter,
+                           struct hw_trapframe *hw_tf)
+{
+	send_kernel_message(core_id(), tcp_pace_kmsg, (long)waiter->data, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+static void tcp_pace_init(struct conv *s, Tcpctl *tcb)
+{
+	init_awaiter_irq(&tcb->pace_waiter, tcp_pace_alarm);
+	tcb->pace_waiter.data = s;
+	tcb->pace_next = 0;
+}
+
+/* Returns TRUE if we can send ssize now, and charges it to the pacing budget.
+ * o/w, makes sure the alarm will kick us when we can. */
+static bool tcp_pace(Tcpctl *tcb, uint32_t ssize)
+{
+	uint64_t now = tsc2usec(read_tsc());
+
+	if (now < tcb->pace_next) {
+		/* A stale alarm just fires early and we come back here. */
+		if (!tcb->pace_waiter.on_tchain) {
+			tcb->pace_core = core_id();
+			set_awaiter_abs(&tcb->pace_waiter, usec2tsc(tcb->pace_next));
+			set_alarm(&per_cpu_info[tcb->pace_core].tchain,
+			          &tcb->pace_waiter);
+		}
+		return FALSE;
+	}
+	tcb->pace_next = now + (uint64_t)ssize * 1000000 / tcb->pacing_rate;
+	return TRUE;
+}
+
 /* Called when we need to retrans the entire outstanding window (everything
  * previously sent, but unacknowledged). */
 void tcprxmit(struct conv *s)
@@ -3700,7 +4226,7 @@ void tcptimeout(void *arg)
 			       tcb->snd.una, tcb->snd.rtx, tcb->snd.nxt, tcb->snd.in_flight,
 			       tcb->timer.start);
 			tcpsettimer(tcb);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, TRUE);
 			/* Advance the recovery point.  Any dupacks/sacks below this won't
 			 * trigger a new loss, since we won't reset_recovery() until we ack
 			 * past recovery_pt. */
@@ -3971,6 +4497,8 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpstartka(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "checksum") == 0)
 		tcpsetchecksum(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
 	else
@@ -4061,7 +4589,11 @@ void tcpinit(struct Fs *fs)
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	debug_priv = tpriv;
-	qlock_init(&tpriv->tl);
+	iphtinit(&tpriv->ht);
+	tpriv->wheels = kzmalloc_align(num_cores * sizeof(struct tcp_wheel),
+	                               MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < num_cores; i++)
+		spinlock_init(&tpriv->wheels[i].lock);
 	qlock_init(&tpriv->apl);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
@@ -194,6 +194,7 @@ static void udpcreate(struct conv *c)
 {
 	c->rq = qopen(128 * 1024, Qmsg, 0, 0);
 	c->wq = qbypass(udpkick, c);
+	q_toggle_csum(c->wq, TRUE);
 }
 
 static void udpclose(struct conv *c)
@@ -215,6 +216,7 @@ static void udpclose(struct conv *c)
 
 	ucb = (Udpcb *) c->ptcl;
 	ucb->headers = 0;
+	c->batch = FALSE;
 
 	qunlock(&c->qlock);
 }
@@ -602,6 +604,8 @@ static void udpctl(struct conv *c, char **f, int n)
 		ucb->headers = 6;
 	else if ((n == 1) && strcmp(f[0], "headers") == 0)
 		ucb->headers = 7;
+	else if (strcmp(f[0], "batch") == 0)
+		c->batch = n < 2 || atoi(f[1]);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -678,6 +682,7 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&((Udppriv *)udp->priv)->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -169,20 +169,189 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->sum_len = 0;
 	b->extra_len += ebd->len;
 	return 0;
 }
 
+void block_page_pool_init(struct block_page_pool *pool, unsigned int max_free)
+{
+	spinlock_init_irqsave(&pool->lock);
+	BSD_LIST_INIT(&pool->free);
+	pool->nr_free = 0;
+	pool->max_free = max_free;
+}
+
+/* Gives @pool's free pages back to the kernel, as will every page still in use
+ * once it is freed.  The pool itself has to stay around until then. */
+void block_page_pool_drain(struct block_page_pool *pool)
+{
+	struct page *page;
+
+	spin_lock_irqsave(&pool->lock);
+	pool->max_free = 0;
+	while ((page = BSD_LIST_FIRST(&pool->free))) {
+		BSD_LIST_REMOVE(page, pg_link);
+		pool->nr_free--;
+		atomic_and(&page->pg_flags, ~PG_NETBUF);
+		page->pg_private = NULL;
+		kpages_free(page2kva(page), PGSIZE);
+	}
+	spin_unlock_irqsave(&pool->lock);
+}
+
+/* Gets a payload page from @pool, with one ref for the caller.  Hand it to a
+ * block with block_append_page(). */
+struct page *block_page_alloc(struct block_page_pool *pool, int mem_flags)
+{
+	struct page *page;
+	void *kva;
+
+	spin_lock_irqsave(&pool->lock);
+	page = BSD_LIST_FIRST(&pool->free);
+	if (page) {
+		BSD_LIST_REMOVE(page, pg_link);
+		pool->nr_free--;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	if (!page) {
+		kva = kpages_alloc(PGSIZE, mem_flags);
+		if (!kva)
+			return NULL;
+		page = kva2page(kva);
+		page->pg_private = pool;
+		atomic_or(&page->pg_flags, PG_NETBUF);
+	}
+	atomic_set(&page->pg_nr_refs, 1);
+	return page;
+}
+
+/* Attaches [off, off + len) of a pool page to @b, passing the caller's page ref
+ * to the block. */
+int block_append_page(struct block *b, struct page *page, uint32_t off,
+                      uint32_t len, int mem_flags)
+{
+	return block_append_extra(b, (uintptr_t)page2kva(page), off, len,
+	                          mem_flags);
+}
+
+/* Builds a block for @len bytes received into @page at @off.  The first
+ * @hdr_len bytes are copied into the block's main buffer, where protocols
+ * expect to find their headers, and the rest stays in the page, attached with
+ * a ref of the block's own.  The caller keeps its ref. */
+struct block *block_from_page(struct page *page, uint32_t off, uint32_t len,
+                              uint32_t hdr_len, int mem_flags)
+{
+	struct block *b;
+
+	hdr_len = MIN(hdr_len, len);
+	b = block_alloc(hdr_len, mem_flags);
+	if (!b)
+		return NULL;
+	memcpy(b->wp, page2kva(page) + off, hdr_len);
+	b->wp += hdr_len;
+	if (len == hdr_len)
+		return b;
+	atomic_inc(&page->pg_nr_refs);
+	if (block_append_page(b, page, off + hdr_len, len - hdr_len,
+	                      mem_flags)) {
+		block_page_decref(page);
+		freeb(b);
+		return NULL;
+	}
+	return b;
+}
+
+void block_page_decref(struct page *page)
+{
+	struct block_page_pool *pool = page->pg_private;
+
+	if (!atomic_sub_and_test(&page->pg_nr_refs, 1))
+		return;
+	spin_lock_irqsave(&pool->lock);
+	if (pool->nr_free < pool->max_free) {
+		BSD_LIST_INSERT_HEAD(&pool->free, page, pg_link);
+		pool->nr_free++;
+		page = NULL;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	if (page) {
+		atomic_and(&page->pg_flags, ~PG_NETBUF);
+		page->pg_private = NULL;
+		kpages_free(page2kva(page), PGSIZE);
+	}
+}
+
+/* Returns the pool page behind an extra_data base, or NULL if it's a plain
+ * kmalloc buffer.  Pool pages are page aligned and keep PG_NETBUF until they go
+ * back to the kernel, so other bases never match. */
+struct page *block_extra_page(uintptr_t base)
+{
+	struct page *page;
+
+	if (PGOFF(base))
+		return NULL;
+	page = kva2page((void*)base);
+	if (!(atomic_read(&page->pg_flags) & PG_NETBUF))
+		return NULL;
+	return page;
+}
+
+/* Returns the page cache page behind an extra_data base, or NULL.  These are
+ * attached by the sendfile path, and the block holds a PM slot ref, which keeps
+ * the page (and PG_PAGEMAP) in the page map until the block lets go. */
+static struct page *block_extra_pm_page(uintptr_t base)
+{
+	struct page *page;
+
+	if (PGOFF(base))
+		return NULL;
+	page = kva2page((void*)base);
+	if (!(atomic_read(&page->pg_flags) & PG_PAGEMAP))
+		return NULL;
+	return page;
+}
+
+/* Extra data buffers are kmalloc buffers, pool pages, or page cache pages;
+ * these take and drop refs on any of them. */
+void block_extra_incref(uintptr_t base)
+{
+	struct page *page = block_extra_page(base);
+
+	if (page) {
+		atomic_inc(&page->pg_nr_refs);
+		return;
+	}
+	page = block_extra_pm_page(base);
+	if (page)
+		pm_incref_page(page);
+	else
+		kmalloc_incref((void*)base);
+}
+
+void block_extra_decref(uintptr_t base)
+{
+	struct page *page = block_extra_page(base);
+
+	if (page) {
+		block_page_decref(page);
+		return;
+	}
+	page = block_extra_pm_page(base);
+	if (page)
+		pm_put_page(page);
+	else
+		kfree((void*)base);
+}
+
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -232,6 +401,18 @@ size_t freeblist(struct block *b)
 	return ret;
 }
 
+/* PM slot refcnts are private to the page map, so we only check the others. */
+static bool block_extra_has_ref(uintptr_t base)
+{
+	struct page *page = block_extra_page(base);
+
+	if (page)
+		return atomic_read(&page->pg_nr_refs) != 0;
+	if (block_extra_pm_page(base))
+		return TRUE;
+	return kmalloc_refcnt((void*)base) != 0;
+}
+
 void checkb(struct block *b, char *msg)
 {
 	void *dead = (void *)Bdead;
@@ -267,7 +448,7 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!block_extra_has_ref(ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
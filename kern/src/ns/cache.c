@@ -39,28 +39,414 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <pagemap.h>
+
+/* Client-side data cache for devmnt.
+ *
+ * Chans from mounts with MCACHE set (CCACHE) keep the data they read from the
+ * file server in a per-file page map.  Files are identified by their mount
+ * (c->type, c->dev) and qid.path, and the cached data is only valid for a
+ * particular qid.vers.  copen() revalidates the entry against the qid the
+ * server returned for the open; a different version throws out all of the
+ * file's pages.  Local writes throw out the pages they touch.
+ *
+ * The pages live in a struct page_map, and we use the PM's radix tree for the
+ * index -> page lookup.  Pages enter the map empty (mc_readpage), and cupdate()
+ * fills them in.  Each page tracks how many bytes, from the start of the page,
+ * contain file data, which is kept in pg_private.  A short page is usually the
+ * end of the file, but we don't know that for sure, so cread() will only
+ * return the valid part and let mntread() ask the server for the rest.
+ *
+ * Locking: mcache.lock (spinlock) protects the hash chains, the LRU list, and
+ * the identity (qid, type, dev) of every entry.  Each entry's qlock protects
+ * its page map and pages.  Entries are never freed, only recycled, so it is
+ * safe to qlock an entry found in the hash and then recheck its identity.
+ *
+ * Stats are exported in #vars, e.g. cat '#vars/mcache_hits!ug'. */
+
+enum {
+	MC_NHASH = 128,
+	MC_NFILE = 4096,
+	MC_MAX_PAGES = 16384,	/* 64 MB of cached file data */
+	MC_RECLAIM_BATCH = 64,	/* pages mc_reclaim() drops at a time */
+	MC_RA_MIN = 16 * 1024,
+	MC_RA_MAX = 512 * 1024,
+};
+
+struct mntcache {
+	struct mntcache				*hash;
+	TAILQ_ENTRY(mntcache)		lru;
+	struct qid					qid;
+	uint32_t					dev;
+	uint16_t					type;
+	qlock_t						qlock;
+	struct page_map				pm;
+	unsigned long				nr_idx;		/* one past highest idx cached */
+	int64_t						ra_next;	/* where a sequential miss lands */
+	long						ra_len;		/* last read-ahead amount */
+};
+TAILQ_HEAD(mntcache_tailq, mntcache);
+
+static struct {
+	spinlock_t					lock;
+	struct mntcache				*hash[MC_NHASH];
+	struct mntcache_tailq		lru;	/* head is most recently used */
+	int							nr_files;
+} mcache;
+
+atomic_t mcache_hits;			/* page lookups satisfied by the cache */
+atomic_t mcache_misses;			/* page lookups that went to the server */
+atomic_t mcache_bytes_saved;	/* bytes returned without an RPC */
+atomic_t mcache_invals;			/* pages tossed for a new vers or a write */
+atomic_t mcache_nr_pages;		/* pages currently in the cache */
+atomic_t mcache_ra_bytes;		/* bytes requested by read-ahead */
+
+DEVVARS_ENTRY(mcache_hits, "ug");
+DEVVARS_ENTRY(mcache_misses, "ug");
+DEVVARS_ENTRY(mcache_bytes_saved, "ug");
+DEVVARS_ENTRY(mcache_invals, "ug");
+DEVVARS_ENTRY(mcache_nr_pages, "ug");
+DEVVARS_ENTRY(mcache_ra_bytes, "ug");
+
+static int mc_readpage(struct page_map *pm, struct page *page)
+{
+	/* New cache pages are empty; cupdate() fills them in. */
+	memset(page2kva(page), 0, PGSIZE);
+	page->pg_private = 0;
+	atomic_or(&page->pg_flags, PG_UPTODATE);
+	return 0;
+}
+
+static int mc_writepage(struct page_map *pm, struct page *page)
+{
+	/* We never dirty pages, so removal should never try to write back. */
+	panic("mcache page %p was dirty", page);
+	return -1;
+}
+
+static struct page_map_operations mc_pm_op = {
+	.readpage = mc_readpage,
+	.writepage = mc_writepage,
+};
+
+static size_t mc_page_valid(struct page *page)
+{
+	return (uintptr_t)page->pg_private;
+}
+
+static bool mc_matches(struct mntcache *m, struct chan *c)
+{
+	return m->qid.path == c->qid.path && m->type == c->type &&
+	       m->dev == c->dev;
+}
+
+/* Drops nr_idx pages starting at idx.  Caller holds m's qlock, so no one else
+ * holds refs on the pages, and we are the only remover. */
+static void mc_drop_pages(struct mntcache *m, unsigned long idx,
+                          unsigned long nr_idx)
+{
+	int nr_removed;
+
+	if (idx >= m->nr_idx)
+		return;
+	nr_idx = MIN(nr_idx, m->nr_idx - idx);
+	nr_removed = pm_remove_contig(&m->pm, idx, nr_idx);
+	atomic_add(&mcache_nr_pages, -nr_removed);
+	atomic_add(&mcache_invals, nr_removed);
+	if (idx + nr_idx == m->nr_idx)
+		m->nr_idx = idx;
+}
+
+static void mc_drop_all(struct mntcache *m)
+{
+	mc_drop_pages(m, 0, m->nr_idx);
+	m->nr_idx = 0;
+}
+
+/* Looks up c's file, returning its entry qlocked, or 0.  The entry will be at
+ * c's version, if vers_ok is set.  Moves the entry to the front of the LRU.
+ *
+ * c->mcp is a hint, set by copen(); the entry could have been recycled. */
+static struct mntcache *mc_lookup(struct chan *c, bool vers_ok)
+{
+	struct mntcache *m;
+
+	spin_lock(&mcache.lock);
+	m = c->mcp;
+	if (!m || !mc_matches(m, c)) {
+		for (m = mcache.hash[c->qid.path % MC_NHASH]; m; m = m->hash) {
+			if (mc_matches(m, c))
+				break;
+		}
+	}
+	if (m) {
+		TAILQ_REMOVE(&mcache.lru, m, lru);
+		TAILQ_INSERT_HEAD(&mcache.lru, m, lru);
+	}
+	spin_unlock(&mcache.lock);
+	if (!m)
+		return 0;
+	qlock(&m->qlock);
+	/* Could have been recycled while we were blocked on the qlock */
+	if (!mc_matches(m, c) || (vers_ok && m->qid.vers != c->qid.vers)) {
+		qunlock(&m->qlock);
+		return 0;
+	}
+	return m;
+}
+
+static void mc_unhash(struct mntcache *m)
+{
+	struct mntcache **l;
+
+	for (l = &mcache.hash[m->qid.path % MC_NHASH]; *l; l = &(*l)->hash) {
+		if (*l == m) {
+			*l = m->hash;
+			break;
+		}
+	}
+	m->hash = 0;
+}
+
+/* Returns a qlocked entry for c, recycling the least recently used entry if we
+ * are at our limit.  Returns 0 if every entry was busy. */
+static struct mntcache *mc_alloc(struct chan *c)
+{
+	struct mntcache *m, *new = 0;
+
+	if (ACCESS_ONCE(mcache.nr_files) < MC_NFILE) {
+		new = kzmalloc(sizeof(struct mntcache), MEM_WAIT);
+		qlock_init(&new->qlock);
+		pm_init(&new->pm, &mc_pm_op, 0);
+		qlock(&new->qlock);
+	}
+	spin_lock(&mcache.lock);
+	/* Someone could have added the file while we were allocating */
+	for (m = mcache.hash[c->qid.path % MC_NHASH]; m; m = m->hash) {
+		if (mc_matches(m, c)) {
+			spin_unlock(&mcache.lock);
+			if (new)
+				kfree(new);
+			return 0;
+		}
+	}
+	if (new && mcache.nr_files < MC_NFILE) {
+		m = new;
+		new = 0;
+		mcache.nr_files++;
+	} else {
+		TAILQ_FOREACH_REVERSE(m, &mcache.lru, mntcache_tailq, lru) {
+			if (canqlock(&m->qlock))
+				break;
+		}
+		if (!m) {
+			spin_unlock(&mcache.lock);
+			if (new)
+				kfree(new);
+			return 0;
+		}
+		TAILQ_REMOVE(&mcache.lru, m, lru);
+		mc_unhash(m);
+	}
+	m->qid = c->qid;
+	m->type = c->type;
+	m->dev = c->dev;
+	m->ra_next = 0;
+	m->ra_len = 0;
+	m->hash = mcache.hash[c->qid.path % MC_NHASH];
+	mcache.hash[c->qid.path % MC_NHASH] = m;
+	TAILQ_INSERT_HEAD(&mcache.lru, m, lru);
+	spin_unlock(&mcache.lock);
+	if (new)
+		kfree(new);
+	/* Recycled entries still have the old file's pages */
+	mc_drop_all(m);
+	return m;
+}
+
+/* Gives back pages from other files, starting with the least recently used,
+ * until we are under our limit.  Caller holds self's qlock.
+ *
+ * We only hold mcache.lock to pick a victim.  Its qlock keeps it from being
+ * recycled, and we take its pages from the end of the file a batch at a time,
+ * so we stop once we are under the limit. */
+static void mc_reclaim(struct mntcache *self)
+{
+	struct mntcache *m;
+	unsigned long idx;
+
+	while (atomic_read(&mcache_nr_pages) > MC_MAX_PAGES) {
+		spin_lock(&mcache.lock);
+		TAILQ_FOREACH_REVERSE(m, &mcache.lru, mntcache_tailq, lru) {
+			if (m == self || !m->nr_idx)
+				continue;
+			if (canqlock(&m->qlock))
+				break;
+		}
+		spin_unlock(&mcache.lock);
+		if (!m)
+			return;
+		while (m->nr_idx && atomic_read(&mcache_nr_pages) > MC_MAX_PAGES) {
+			idx = m->nr_idx - MIN(m->nr_idx, MC_RECLAIM_BATCH);
+			mc_drop_pages(m, idx, m->nr_idx - idx);
+		}
+		qunlock(&m->qlock);
+	}
+}
 
-/*
- * no cache in hosted mode
- */
 void cinit(void)
 {
+	spinlock_init(&mcache.lock);
+	TAILQ_INIT(&mcache.lru);
 }
 
 void copen(struct chan *c)
 {
-	c->flag &= ~CCACHE;
+	struct mntcache *m;
+
+	if (c->qid.type & QTDIR) {
+		c->flag &= ~CCACHE;
+		return;
+	}
+	m = mc_lookup(c, FALSE);
+	if (!m) {
+		m = mc_alloc(c);
+		if (!m)
+			return;
+	}
+	if (m->qid.vers != c->qid.vers) {
+		mc_drop_all(m);
+		m->qid = c->qid;
+	}
+	c->mcp = m;
+	qunlock(&m->qlock);
 }
 
-int cread(struct chan *c, uint8_t * b, int n, int64_t off)
+int cread(struct chan *c, uint8_t * buf, int n, int64_t off)
 {
-	return 0;
+	struct mntcache *m;
+	struct page *page;
+	unsigned long idx;
+	size_t pgoff, valid, amt;
+	int total = 0;
+
+	if (off < 0 || n <= 0)
+		return 0;
+	m = mc_lookup(c, TRUE);
+	if (!m) {
+		atomic_inc(&mcache_misses);
+		return 0;
+	}
+	while (n > 0) {
+		idx = off >> PGSHIFT;
+		pgoff = PGOFF(off);
+		if (pm_load_page_nowait(&m->pm, idx, &page)) {
+			atomic_inc(&mcache_misses);
+			break;
+		}
+		valid = mc_page_valid(page);
+		if (pgoff >= valid) {
+			pm_put_page(page);
+			atomic_inc(&mcache_misses);
+			break;
+		}
+		amt = MIN(valid - pgoff, n);
+		memcpy(buf, page2kva(page) + pgoff, amt);
+		pm_put_page(page);
+		atomic_inc(&mcache_hits);
+		buf += amt;
+		off += amt;
+		n -= amt;
+		total += amt;
+		/* A short page might be EOF; the server knows. */
+		if (valid < PGSIZE)
+			break;
+	}
+	qunlock(&m->qlock);
+	atomic_add(&mcache_bytes_saved, total);
+	return total;
 }
 
+/* Adds [off, off + n) of c's file to the cache.  We only keep data that
+ * extends the valid part of a page, so every page's data is contiguous. */
+void cupdate(struct chan *c, uint8_t * buf, int n, int64_t off)
+{
+	struct mntcache *m;
+	struct page *page;
+	unsigned long idx;
+	size_t pgoff, valid, amt;
+	unsigned long nr_pages;
+
+	if (off < 0 || n <= 0)
+		return;
+	m = mc_lookup(c, TRUE);
+	if (!m)
+		return;
+	while (n > 0) {
+		idx = off >> PGSHIFT;
+		pgoff = PGOFF(off);
+		amt = MIN(PGSIZE - pgoff, n);
+		/* We hold the qlock, so only we add pages to the PM */
+		nr_pages = m->pm.pm_num_pages;
+		if (pm_load_page(&m->pm, idx, &page))
+			break;
+		if (m->pm.pm_num_pages != nr_pages)
+			atomic_inc(&mcache_nr_pages);
+		m->nr_idx = MAX(m->nr_idx, idx + 1);
+		valid = mc_page_valid(page);
+		if (pgoff <= valid && pgoff + amt > valid) {
+			memcpy(page2kva(page) + pgoff, buf, amt);
+			page->pg_private = (void*)(uintptr_t)(pgoff + amt);
+		}
+		pm_put_page(page);
+		buf += amt;
+		off += amt;
+		n -= amt;
+	}
+	if (atomic_read(&mcache_nr_pages) > MC_MAX_PAGES)
+		mc_reclaim(m);
+	qunlock(&m->qlock);
+}
+
+/* Our own writes change the file out from under the cache; toss the pages. */
 void cwrite(struct chan *c, uint8_t * buf, int n, int64_t off)
 {
+	struct mntcache *m;
+
+	if (off < 0 || n <= 0)
+		return;
+	m = mc_lookup(c, FALSE);
+	if (!m)
+		return;
+	mc_drop_pages(m, off >> PGSHIFT,
+	              ROUNDUP(off + n, PGSIZE) / PGSIZE - (off >> PGSHIFT));
+	qunlock(&m->qlock);
 }
 
-void cupdate(struct chan *c, uint8_t * buf, int n, int64_t off)
+/* Returns how much the caller should read ahead, starting at off, after
+ * reading [off - n, off) of c's file from the server.
+ *
+ * Sequential readers miss in the cache right where the last read-ahead ended.
+ * Each such miss doubles the read-ahead, up to MC_RA_MAX.  Any other miss
+ * turns read-ahead off until the reader looks sequential again. */
+long creadahead(struct chan *c, int64_t off, long n)
 {
+	struct mntcache *m;
+	long ret;
+
+	if (off < 0 || n <= 0)
+		return 0;
+	m = mc_lookup(c, TRUE);
+	if (!m)
+		return 0;
+	if (off - n == m->ra_next) {
+		ret = m->ra_len ? MIN(m->ra_len * 2, MC_RA_MAX) : MC_RA_MIN;
+	} else {
+		ret = 0;
+	}
+	m->ra_len = ret;
+	m->ra_next = off + ret;
+	qunlock(&m->qlock);
+	atomic_add(&mcache_ra_bytes, ret);
+	return ret;
 }
@@ -476,6 +476,8 @@ long devbwrite(struct chan *c, struct block *bp, uint32_t offset)
 		freeb(bp);
 		nexterror();
 	}
+	/* write() only sees the main body; sendfile blocks are all extra data */
+	bp = linearizeblock(bp);
 	n = devtab[c->type].write(c, bp->rp, BLEN(bp), offset);
 	poperror();
 	freeb(bp);
@@ -39,6 +39,8 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <mm.h>
+#include <umem.h>
 
 #define PANIC_EXTRA(b)							\
 {									\
@@ -92,6 +94,7 @@ struct queue {
 
 enum {
 	Maxatomic = 64 * 1024,
+	Qmsghdrlen = 4,					/* length framing of batched messages */
 	QIO_CAN_ERR_SLEEP = (1 << 0),	/* can throw errors or block/sleep */
 	QIO_LIMIT = (1 << 1),			/* respect q->limit */
 	QIO_DROP_OVERFLOW = (1 << 2),	/* alternative to setting qdropoverflow */
@@ -104,6 +107,8 @@ unsigned int qiomaxatomic = Maxatomic;
 
 static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt);
 static ssize_t __qbwrite(struct queue *q, struct block *b, int flags);
+static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
+                        int qio_flags);
 static struct block *__qbread(struct queue *q, size_t len, int qio_flags,
                               int mem_flags);
 static bool qwait_and_ilock(struct queue *q, int qio_flags);
@@ -339,7 +344,7 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
 			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
+				block_extra_decref(ebd->base);
 				ebd->off = 0;
 				ebd->base = 0;
 			}
@@ -427,7 +432,7 @@ static int pullext(struct block *bp, int count)
 		ed->off += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			block_extra_decref(ed->base);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -453,7 +458,7 @@ static int dropext(struct block *bp, int count)
 		bytes += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			block_extra_decref(ed->base);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -602,7 +607,7 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 		ebd->base = ebd->off = ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
@@ -979,6 +984,7 @@ static size_t point_to_body(struct block *b, uint8_t *body_rp,
 	ebd->base = (uintptr_t)b;
 	ebd->off = (uint32_t)(body_rp - (uint8_t*)b);
 	ebd->len = MIN(b->wp - body_rp, len);	/* think of body_rp as b->rp */
+	ebd->sum_len = 0;
 	assert((int)ebd->len >= 0);
 	newb->extra_len += ebd->len;
 	return ebd->len;
@@ -999,10 +1005,13 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	block_extra_incref(b_ebd->base);
 	n_ebd->base = b_ebd->base;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
+	/* Only still good if we took all of b's buffer */
+	n_ebd->sum_len = b_ebd->sum_len;
+	n_ebd->sum = b_ebd->sum;
 	newb->extra_len += n_ebd->len;
 	return n_ebd->len;
 }
@@ -1288,7 +1297,26 @@ void qaddlist(struct queue *q, struct block *b)
 	q->blast = b;
 }
 
-static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
+/* Zero-copy: rather than copy a whole pool page to a page-aligned spot in the
+ * reader's memory, map the page there.  Only done when we hold the page's only
+ * ref, so nothing in the kernel sees it once the user has it.  Returns TRUE if
+ * the ebd's page ref went to the reader's page table. */
+static bool map_extra_page(struct extra_bdata *ebd, uint8_t *to, size_t amt)
+{
+	struct page *page;
+
+	if (!current || PGOFF(to) || amt < PGSIZE || !is_user_rwaddr(to, PGSIZE))
+		return FALSE;
+	if (ebd->off || ebd->len != PGSIZE)
+		return FALSE;
+	page = block_extra_page(ebd->base);
+	if (!page || atomic_read(&page->pg_nr_refs) != 1)
+		return FALSE;
+	return map_netbuf_page(current, page, (uintptr_t)to) == 0;
+}
+
+static size_t read_from_block(struct block *b, uint8_t *to, size_t amt,
+                              bool zerocopy)
 {
 	size_t copy_amt, retval = 0;
 	struct extra_bdata *ebd;
@@ -1307,6 +1335,14 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		 * just start the for loop early */
 		if (!ebd->base || !ebd->len)
 			continue;
+		if (zerocopy && map_extra_page(ebd, to, amt)) {
+			b->extra_len -= ebd->len;
+			to += ebd->len;
+			amt -= ebd->len;
+			retval += ebd->len;
+			ebd->base = ebd->off = ebd->len = 0;
+			continue;
+		}
 		copy_amt = MIN(ebd->len, amt);
 		memcpy(to, (void*)(ebd->base + ebd->off), copy_amt);
 		/* we're actually consuming the entries, just like how we advance rp up
@@ -1317,7 +1353,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 			ebd->base = ebd->off = 0;
 		}
 		to += copy_amt;
@@ -1342,11 +1378,11 @@ struct block *bl2mem(uint8_t * p, struct block *b, int n)
 		i = BLEN(b);
 		if (i > n) {
 			/* partial block, consume some */
-			read_from_block(b, p, n);
+			read_from_block(b, p, n, FALSE);
 			return b;
 		}
 		/* full block, consume all and move on */
-		i = read_from_block(b, p, i);
+		i = read_from_block(b, p, i, FALSE);
 		n -= i;
 		p += i;
 		next = b->next;
@@ -1357,7 +1393,8 @@ struct block *bl2mem(uint8_t * p, struct block *b, int n)
 
 /* Extract the contents of all blocks and copy to va, up to len.  Returns the
  * actual amount copied. */
-static size_t read_all_blocks(struct block *b, void *va, size_t len)
+static size_t read_all_blocks(struct block *b, void *va, size_t len,
+                              bool zerocopy)
 {
 	size_t sofar = 0;
 	struct block *next;
@@ -1368,7 +1405,7 @@ static size_t read_all_blocks(struct block *b, void *va, size_t len)
 		assert(va);
 		assert(va + sofar);
 		assert(b->rp);
-		sofar += read_from_block(b, va + sofar, len - sofar);
+		sofar += read_from_block(b, va + sofar, len - sofar, zerocopy);
 		next = b->next;
 		freeb(b);
 		b = next;
@@ -1447,7 +1484,7 @@ size_t qread(struct queue *q, void *va, size_t len)
 
 	if (!blist)
 		return 0;
-	return read_all_blocks(blist, va, len);
+	return read_all_blocks(blist, va, len, q->state & Qzerocopy);
 }
 
 size_t qread_nonblock(struct queue *q, void *va, size_t len)
@@ -1457,7 +1494,124 @@ size_t qread_nonblock(struct queue *q, void *va, size_t len)
 
 	if (!blist)
 		return 0;
-	return read_all_blocks(blist, va, len);
+	return read_all_blocks(blist, va, len, q->state & Qzerocopy);
+}
+
+/* Batched message I/O, for Qmsg queues.  Each message is framed by its length
+ * (four bytes, network order), followed by the message.  Reads return as many
+ * whole messages as fit in len, but always at least one (truncated if need be,
+ * like a regular Qmsg read).  Writes take a series of framed messages. */
+
+/* Pops whole messages off q while they fit in len, framing included. */
+static struct block *qget_msgs(struct queue *q, size_t len)
+{
+	struct block *ret = NULL, **tail = &ret;
+	bool was_unwritable;
+	size_t blen;
+
+	spin_lock_irqsave(&q->lock);
+	was_unwritable = !qwritable(q);
+	while (q->bfirst) {
+		blen = BLEN(q->bfirst) + Qmsghdrlen;
+		if (blen > len)
+			break;
+		*tail = pop_first_block(q);
+		tail = &(*tail)->next;
+		len -= blen;
+	}
+	if (!qwritable(q))
+		was_unwritable = FALSE;
+	spin_unlock_irqsave(&q->lock);
+	if (was_unwritable) {
+		if (q->kick)
+			q->kick(q->arg);
+		rendez_wakeup(&q->wr);
+		qwake_cb(q, FDTAP_FILT_WRITABLE);
+	}
+	return ret;
+}
+
+static size_t __qread_msgs(struct queue *q, uint8_t *va, size_t len,
+                           int qio_flags)
+{
+	struct block *blist, *b;
+	size_t sofar = 0, amt;
+
+	if (!(q->state & Qmsg))
+		error(EINVAL, "batched reads need a message queue");
+	if (len < Qmsghdrlen)
+		error(EINVAL, "batched reads need at least %d bytes", Qmsghdrlen);
+	/* Block (or not) for the first one, then take whatever else is there. */
+	blist = __qbread(q, len - Qmsghdrlen, qio_flags | QIO_JUST_ONE_BLOCK,
+	                 MEM_WAIT);
+	if (!blist)
+		return 0;
+	blist->next = qget_msgs(q, len - MIN(len, BLEN(blist) + Qmsghdrlen));
+	while ((b = blist)) {
+		blist = b->next;
+		amt = MIN(BLEN(b), len - sofar - Qmsghdrlen);
+		hnputl(va + sofar, amt);
+		sofar += Qmsghdrlen;
+		sofar += read_from_block(b, va + sofar, amt, FALSE);
+		freeb(b);
+	}
+	return sofar;
+}
+
+size_t qread_msgs(struct queue *q, void *va, size_t len)
+{
+	return __qread_msgs(q, va, len, QIO_CAN_ERR_SLEEP);
+}
+
+size_t qread_msgs_nonblock(struct queue *q, void *va, size_t len)
+{
+	return __qread_msgs(q, va, len, QIO_CAN_ERR_SLEEP | QIO_NON_BLOCK);
+}
+
+/* Returns the amount consumed, framing included.  Like __qwrite, an error after
+ * some messages went out is a partial write. */
+static ssize_t __qwrite_msgs(struct queue *q, uint8_t *va, size_t len,
+                             int qio_flags)
+{
+	ERRSTACK(1);
+	volatile size_t sofar = 0;	/* volatile for the waserror */
+	size_t mlen;
+
+	if (waserror()) {
+		if (sofar) {
+			poperror();
+			return sofar;
+		}
+		nexterror();
+	}
+	while (sofar < len) {
+		if (len - sofar < Qmsghdrlen)
+			error(EINVAL, "short message header at %lu", sofar);
+		mlen = nhgetl(va + sofar);
+		if (mlen > len - sofar - Qmsghdrlen)
+			error(EINVAL, "message at %lu overruns the write", sofar);
+		/* __qwrite() would quietly cut it down to one block */
+		if (mlen > Maxatomic)
+			error(EMSGSIZE, "message at %lu is over %d bytes", sofar,
+			      Maxatomic);
+		if (__qwrite(q, va + sofar + Qmsghdrlen, mlen, MEM_WAIT,
+		             qio_flags) < mlen)
+			break;
+		sofar += Qmsghdrlen + mlen;
+	}
+	poperror();
+	return sofar;
+}
+
+ssize_t qwrite_msgs(struct queue *q, void *va, size_t len)
+{
+	return __qwrite_msgs(q, va, len, QIO_CAN_ERR_SLEEP | QIO_LIMIT);
+}
+
+ssize_t qwrite_msgs_nonblock(struct queue *q, void *va, size_t len)
+{
+	return __qwrite_msgs(q, va, len, QIO_CAN_ERR_SLEEP | QIO_LIMIT |
+	                                 QIO_NON_BLOCK);
 }
 
 /* This is the rendez wake condition for writers. */
@@ -1603,7 +1757,11 @@ ssize_t qibwrite(struct queue *q, struct block *b)
 
 /* Helper, allocs a block and copies [from, from + len) into it.  Returns the
  * block on success, 0 on failure. */
-static struct block *build_block(void *from, size_t len, int mem_flags)
+/* Copies @from into a new block.  If @csum, the copy also sums the data, and
+ * the sum rides along with the buffer for ptclcsum(), so the protocol doesn't
+ * have to read the payload again when the NIC can't checksum for us. */
+static struct block *build_block(void *from, size_t len, int mem_flags,
+                                 bool csum)
 {
 	struct block *b;
 	void *ext_buf;
@@ -1624,12 +1782,17 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 		kfree(b);
 		return 0;
 	}
-	memcpy(ext_buf, from, len);
 	if (block_add_extd(b, 1, mem_flags)) {
 		kfree(ext_buf);
 		kfree(b);
 		return 0;
 	}
+	if (csum && len) {
+		b->extra_data[0].sum = ptclbsum_copy(ext_buf, from, len);
+		b->extra_data[0].sum_len = len;
+	} else {
+		memcpy(ext_buf, from, len);
+	}
 	b->extra_data[0].base = (uintptr_t)ext_buf;
 	b->extra_data[0].off = 0;
 	b->extra_data[0].len = len;
@@ -1668,7 +1831,7 @@ static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
 		/* This is 64K, the max amount per single block.  Still a good value? */
 		if (n > Maxatomic)
 			n = Maxatomic;
-		b = build_block(p + sofar, n, mem_flags);
+		b = build_block(p + sofar, n, mem_flags, q->state & Qcsum);
 		if (!b)
 			break;
 		if (__qbwrite(q, b, qio_flags) < 0)
@@ -1882,6 +2045,30 @@ void q_toggle_qcoalesce(struct queue *q, bool onoff)
 	spin_unlock_irqsave(&q->lock);
 }
 
+/* Zero-copy reads: whole pool pages are mapped into the reader's buffer when
+ * it is page aligned and not yet backed by memory.  See map_netbuf_page(). */
+void q_toggle_zerocopy(struct queue *q, bool onoff)
+{
+	spin_lock_irqsave(&q->lock);
+	if (onoff)
+		q->state |= Qzerocopy;
+	else
+		q->state &= ~Qzerocopy;
+	spin_unlock_irqsave(&q->lock);
+}
+
+/* Writes to a Qcsum queue sum their payload as they copy it in.  See
+ * build_block(). */
+void q_toggle_csum(struct queue *q, bool onoff)
+{
+	spin_lock_irqsave(&q->lock);
+	if (onoff)
+		q->state |= Qcsum;
+	else
+		q->state &= ~Qcsum;
+	spin_unlock_irqsave(&q->lock);
+}
+
 /*
  *  flush the output queue
  */
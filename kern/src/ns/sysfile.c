@@ -1033,6 +1033,78 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+#define SENDPM_BLOCK_PGS	16
+
+/* Builds one block of up to SENDPM_BLOCK_PGS page cache pages, starting at
+ * byte off in pm.  The block takes the PM slot refs, which get put when the
+ * block (or its last clone) is freed. */
+static struct block *pm_to_block(struct page_map *pm, int64_t off, long n)
+{
+	ERRSTACK(1);
+	struct block *b;
+	struct page *page;
+	unsigned long pgoff;
+	long amt;
+	int ret;
+
+	b = block_alloc(0, MEM_WAIT);
+	if (waserror()) {
+		freeb(b);
+		nexterror();
+	}
+	block_add_extd(b, SENDPM_BLOCK_PGS, MEM_WAIT);
+	while (n && BLEN(b) < SENDPM_BLOCK_PGS * PGSIZE) {
+		pgoff = PGOFF(off);
+		amt = MIN(n, PGSIZE - pgoff);
+		ret = pm_load_page(pm, off >> PGSHIFT, &page);
+		if (ret)
+			error(-ret, "sendfile: failed to load page %lld",
+			      off >> PGSHIFT);
+		block_append_extra(b, (uintptr_t)page2kva(page), pgoff, amt, MEM_WAIT);
+		off += amt;
+		n -= amt;
+	}
+	poperror();
+	return b;
+}
+
+/* Writes n bytes of pm, starting at off, to fd without copying: the page cache
+ * pages are handed to the device as extra data of the blocks we bwrite.
+ * Returns the number of bytes written, or -1 if nothing was written. */
+long syssendpm(int fd, struct page_map *pm, int64_t off, long n)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	struct block *b;
+	long sent = 0, len;
+
+	if (waserror()) {
+		poperror();
+		return sent ? sent : -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	if (n < 0 || off < 0)
+		error(EINVAL, ERROR_FIXME);
+	while (sent < n) {
+		b = pm_to_block(pm, off + sent, n - sent);
+		len = devtab[c->type].bwrite(c, b, c->offset);
+		spin_lock(&c->lock);
+		c->offset += len;
+		spin_unlock(&c->lock);
+		sent += len;
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	return sent;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
@@ -9,6 +9,7 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <arch/topology.h>
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -73,16 +74,341 @@ void *kpage_zalloc_addr(void)
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* NUMA nodes.  Node 0's arenas are base_arena and kpages_arena, which have all
+ * of the memory we know about during pmem_init().  Later, the arch code hands
+ * us the memory of the other nodes with numa_add_memory().  We track which node
+ * owns each range so that frees go back to the arena that allocated them. */
+#define NR_NODE_RANGES 64
+
+struct node_range {
+	uintptr_t					start;
+	uintptr_t					end;
+	int							node;
+};
+
+static struct node_range node_ranges[NR_NODE_RANGES];
+static int nr_node_ranges;
+/* Allocations each node satisfied for cores on some other node. */
+static atomic_t nr_remote_allocs[ARENA_MAX_NODES];
+
+/* Adds [@base, @base + @len) to @node's base arena, building the node's base
+ * and kpages arenas on first use.  Call this during boot, before we start the
+ * other cores.  @base and @len must be page aligned. */
+void numa_add_memory(int node, void *base, size_t len)
+{
+	char name[ARENA_NAME_SZ];
+	struct arena *base_a;
+
+	assert(node < ARENA_MAX_NODES);
+	if (!len)
+		return;
+	/* A new node needs a page for its base arena and one for its kpages. */
+	if (!node || (!base_arenas[node] && len < 2 * PGSIZE)) {
+		arena_add(base_arena, base, len, MEM_WAIT);
+		return;
+	}
+	if (nr_node_ranges == NR_NODE_RANGES) {
+		warn("Out of NUMA node ranges, giving %p to node 0", base);
+		arena_add(base_arena, base, len, MEM_WAIT);
+		return;
+	}
+	node_ranges[nr_node_ranges].start = (uintptr_t)base;
+	node_ranges[nr_node_ranges].end = (uintptr_t)base + len;
+	node_ranges[nr_node_ranges].node = node;
+	nr_node_ranges++;
+	base_a = base_arenas[node];
+	if (!base_a) {
+		/* The node's base arena lives in the first page of its memory. */
+		snprintf(name, ARENA_NAME_SZ, "base_%d", node);
+		base_a = arena_builder(base, name, PGSIZE, NULL, NULL, NULL, 0);
+		base += PGSIZE;
+		len -= PGSIZE;
+		if (len)
+			arena_add(base_a, base, len, MEM_WAIT);
+		base_arenas[node] = base_a;
+		snprintf(name, ARENA_NAME_SZ, "kpages_%d", node);
+		kpages_arenas[node] = arena_builder(arena_alloc(base_a, PGSIZE,
+		                                                MEM_WAIT),
+		                                    name, PGSIZE, arena_alloc,
+		                                    arena_free, base_a, 8 * PGSIZE);
+		nr_arena_nodes = MAX(nr_arena_nodes, node + 1);
+		return;
+	}
+	arena_add(base_a, base, len, MEM_WAIT);
+}
+
+size_t numa_nr_remote_allocs(int node)
+{
+	return atomic_read(&nr_remote_allocs[node]);
+}
+
+static int kpages_local_node(void)
+{
+	int node;
+
+	if (nr_arena_nodes == 1)
+		return 0;
+	node = core_numa_id(core_id_early());
+	if (node < 0 || node >= nr_arena_nodes)
+		return 0;
+	return node;
+}
+
+/* Returns the kpages arena that owns @addr. */
+static struct arena *kpages_arena_of(void *addr)
+{
+	uintptr_t a = (uintptr_t)addr;
+
+	if (nr_arena_nodes == 1)
+		return kpages_arena;
+	for (int i = 0; i < nr_node_ranges; i++) {
+		if (node_ranges[i].start <= a && a < node_ranges[i].end)
+			return kpages_arenas[node_ranges[i].node];
+	}
+	return kpages_arena;
+}
+
+static void *__kpages_node_alloc(struct arena *arena, size_t size, size_t align,
+                                 int flags)
+{
+	if (!align)
+		return arena_alloc(arena, size, flags);
+	return arena_xalloc(arena, size, align, 0, 0, NULL, NULL, flags);
+}
+
+/* Allocates from the kpages arena of the calling core's node.  If that node is
+ * out of memory, we try the other nodes in increasing node order, wrapping
+ * around, without blocking.  Only the final attempt, back on the local node,
+ * honors MEM_WAIT. */
+static void *__kpages_alloc(size_t size, size_t align, int flags)
+{
+	int local = kpages_local_node();
+	int try_flags = (flags & ~MEM_FLAGS) | MEM_ATOMIC;
+	struct arena *arena;
+	void *ret;
+
+	if (nr_arena_nodes == 1)
+		return __kpages_node_alloc(kpages_arena, size, align, flags);
+	/* Callers that could block shouldn't take a node's reserve just because
+	 * we're trying not to block. */
+	if (arena_can_block(flags))
+		try_flags |= ARENA_NO_RESERVE;
+	for (int i = 0; i < nr_arena_nodes; i++) {
+		int node = (local + i) % nr_arena_nodes;
+
+		arena = kpages_arenas[node];
+		if (!arena)
+			continue;
+		ret = __kpages_node_alloc(arena, size, align, try_flags);
+		if (ret) {
+			if (node != local)
+				atomic_inc(&nr_remote_allocs[node]);
+			return ret;
+		}
+	}
+	arena = kpages_arenas[local] ? kpages_arenas[local] : kpages_arena;
+	return __kpages_node_alloc(arena, size, align, flags);
+}
+
+/* Per-core page caches.  Single-page allocations are the most common kpages
+ * operation (upages, slab imports, blocks), and each one goes through the
+ * kpages qcache and its shared locks.  Each core keeps a small stack of free
+ * pages from its own node, behind a lock only it and the occasional thief
+ * touch.  Refills and drains move PCPU_PAGES_BATCH pages at a time, but the
+ * arena has no batch interface, so that's still one qcache operation per page;
+ * the win is that most allocs and frees never leave the core.
+ *
+ * The caches only hold pages of the core's node's kpages arena.  When a core
+ * runs dry and its node can't give it a batch without dipping into the reserve,
+ * it steals from another core on the same node before going back to the arena.
+ * The reclaimer drains all of the caches with kpages_pcpu_drain(). */
+#define PCPU_PAGES_MAX			32
+#define PCPU_PAGES_BATCH		8
+
+struct pcpu_pages {
+	spinlock_t					lock;
+	unsigned int				nr;
+	void						*pages[PCPU_PAGES_MAX];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pcpu_pages pcpu_pages[MAX_NUM_CORES];
+static bool pcpu_pages_ready;
+static atomic_t nr_pcpu_refills;
+static atomic_t nr_pcpu_drains;
+static atomic_t nr_pcpu_steals;
+
+/* Call after kpages_arena exists. */
+void kpages_pcpu_init(void)
+{
+	for (int i = 0; i < MAX_NUM_CORES; i++)
+		spinlock_init_irqsave(&pcpu_pages[i].lock);
+	pcpu_pages_ready = TRUE;
+}
+
+static struct arena *kpages_local_arena(void)
+{
+	struct arena *arena = kpages_arenas[kpages_local_node()];
+
+	return arena ? arena : kpages_arena;
+}
+
+/* Pushes up to @nr pages onto @pp.  Returns how many it took. */
+static int __pcpu_pages_push(struct pcpu_pages *pp, void **pages, int nr)
+{
+	int i;
+
+	spin_lock_irqsave(&pp->lock);
+	for (i = 0; i < nr && pp->nr < PCPU_PAGES_MAX; i++)
+		pp->pages[pp->nr++] = pages[i];
+	spin_unlock_irqsave(&pp->lock);
+	return i;
+}
+
+/* Pops up to @nr pages from @pp into @pages.  Returns how many it got. */
+static int __pcpu_pages_pop(struct pcpu_pages *pp, void **pages, int nr)
+{
+	int i;
+
+	spin_lock_irqsave(&pp->lock);
+	for (i = 0; i < nr && pp->nr; i++)
+		pages[i] = pp->pages[--pp->nr];
+	spin_unlock_irqsave(&pp->lock);
+	return i;
+}
+
+static void __pcpu_pages_free(struct arena *arena, void **pages, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		arena_free(arena, pages[i], PGSIZE);
+}
+
+/* Takes up to half of another core's pages, preferring cores on our node.
+ * Returns how many we got. */
+static int pcpu_pages_steal(int coreid, void **pages)
+{
+	int node = nr_arena_nodes > 1 ? core_numa_id(coreid) : 0;
+	struct pcpu_pages *victim;
+	int victim_id, nr;
+
+	for (int i = 1; i < num_cores; i++) {
+		victim_id = (coreid + i) % num_cores;
+		if (nr_arena_nodes > 1 && core_numa_id(victim_id) != node)
+			continue;
+		victim = &pcpu_pages[victim_id];
+		/* Racy peek, so we don't bounce every core's lock. */
+		if (READ_ONCE(victim->nr) < 2)
+			continue;
+		nr = __pcpu_pages_pop(victim, pages,
+		                      MIN(READ_ONCE(victim->nr) / 2,
+		                          PCPU_PAGES_BATCH));
+		if (nr) {
+			atomic_inc(&nr_pcpu_steals);
+			return nr;
+		}
+	}
+	return 0;
+}
+
+static void *pcpu_page_alloc(int flags)
+{
+	int coreid = core_id_early();
+	struct pcpu_pages *pp = &pcpu_pages[coreid];
+	struct arena *arena = kpages_local_arena();
+	void *batch[PCPU_PAGES_BATCH];
+	int nr, pushed;
+
+	if (__pcpu_pages_pop(pp, batch, 1))
+		return batch[0];
+	/* Refill without blocking or taking the reserve; the cache isn't worth
+	 * sleeping for, and the reserve is for the caller's page, not ours. */
+	for (nr = 0; nr < PCPU_PAGES_BATCH; nr++) {
+		batch[nr] = arena_alloc(arena, PGSIZE, MEM_ATOMIC | ARENA_NO_RESERVE);
+		if (!batch[nr])
+			break;
+	}
+	if (nr)
+		atomic_inc(&nr_pcpu_refills);
+	else
+		nr = pcpu_pages_steal(coreid, batch);
+	if (!nr)
+		return __kpages_alloc(PGSIZE, 0, flags);
+	/* We could have been interrupted by a free that filled the cache. */
+	pushed = __pcpu_pages_push(pp, batch + 1, nr - 1);
+	__pcpu_pages_free(arena, batch + 1 + pushed, nr - 1 - pushed);
+	return batch[0];
+}
+
+/* Returns TRUE if the page went into the local core's cache. */
+static bool pcpu_page_free(void *addr)
+{
+	struct pcpu_pages *pp = &pcpu_pages[core_id_early()];
+	struct arena *arena = kpages_local_arena();
+	void *batch[PCPU_PAGES_BATCH];
+	int nr = 0;
+
+	if (kpages_arena_of(addr) != arena)
+		return FALSE;
+	spin_lock_irqsave(&pp->lock);
+	if (pp->nr == PCPU_PAGES_MAX) {
+		for (; nr < PCPU_PAGES_BATCH; nr++)
+			batch[nr] = pp->pages[--pp->nr];
+	}
+	pp->pages[pp->nr++] = addr;
+	spin_unlock_irqsave(&pp->lock);
+	if (nr) {
+		atomic_inc(&nr_pcpu_drains);
+		__pcpu_pages_free(arena, batch, nr);
+	}
+	return TRUE;
+}
+
+/* Returns every core's cached pages to their arenas.  Called by the arena
+ * reclaimer; safe from any context that can take a spinlock. */
+void kpages_pcpu_drain(void)
+{
+	void *batch[PCPU_PAGES_BATCH];
+	int nr;
+
+	if (!pcpu_pages_ready)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		while ((nr = __pcpu_pages_pop(&pcpu_pages[i], batch,
+		                              PCPU_PAGES_BATCH))) {
+			for (int j = 0; j < nr; j++)
+				arena_free(kpages_arena_of(batch[j]), batch[j], PGSIZE);
+		}
+	}
+}
+
+size_t kpages_pcpu_nr_cached(void)
+{
+	size_t ret = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		ret += READ_ONCE(pcpu_pages[i].nr);
+	return ret;
+}
+
+void kpages_pcpu_stats(size_t *refills, size_t *drains, size_t *steals)
+{
+	*refills = atomic_read(&nr_pcpu_refills);
+	*drains = atomic_read(&nr_pcpu_drains);
+	*steals = atomic_read(&nr_pcpu_steals);
+}
+
+/* Helper function for allocating from the kpages arenas.  This sends the caller
+ * to its own NUMA domain, if it has memory.  Single pages come from the
+ * per-core caches. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	if (size == PGSIZE && pcpu_pages_ready)
+		return pcpu_page_alloc(flags);
+	return __kpages_alloc(size, 0, flags);
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -92,7 +418,9 @@ void *kpages_zalloc(size_t size, int flags)
 
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	if (size == PGSIZE && pcpu_pages_ready && pcpu_page_free(addr))
+		return;
+	arena_free(kpages_arena_of(addr), addr, size);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
@@ -100,18 +428,26 @@ void kpages_free(void *addr, size_t size)
  * bnx2x). */
 void *get_cont_pages(size_t order, int flags)
 {
-	return arena_xalloc(kpages_arena, PGSIZE << order, PGSIZE << order,
-	                    0, 0, NULL, NULL, flags);
+	return __kpages_alloc(PGSIZE << order, PGSIZE << order, flags);
 }
 
 void free_cont_pages(void *buf, size_t order)
 {
-	arena_xfree(kpages_arena, buf, PGSIZE << order);
+	arena_xfree(kpages_arena_of(buf), buf, PGSIZE << order);
 }
 
-/* Frees the page */
+/* Frees the page.  Pieces of a split user jumbo page go back to their jumbo. */
 void page_decref(page_t *page)
 {
+	if (atomic_read(&page->pg_flags) & PG_JUMBO) {
+		jumbo_upage_decref(page, 1);
+		return;
+	}
+	/* A zero-copy read mapped a net payload page, it goes back to its pool */
+	if (atomic_read(&page->pg_flags) & PG_NETBUF) {
+		block_page_decref(page);
+		return;
+	}
 	kpages_free(page2kva(page), PGSIZE);
 }
 
@@ -159,3 +495,50 @@ void jumbo_page_free(void *buf, size_t nr)
 {
 	arena_free(jumbo_pml2_arena, buf, nr * PML2_PTE_REACH);
 }
+
+/* Jumbo pages for user mappings.  A jumbo starts out mapped by a single PML2
+ * PTE, but the mm code can split that into PML1 PTEs that each point at one
+ * PGSIZE piece (e.g. for a partial munmap).  We can only give the jumbo back to
+ * its arena as a whole, so every page struct of the jumbo is marked PG_JUMBO,
+ * and the first one's pg_index counts the pieces still mapped.  A PML2 mapping
+ * holds all of them.
+ *
+ * User jumbos are never in a page map, so pg_index is otherwise unused.  The
+ * count is dropped atomically: the mm code drops pieces under the owning
+ * process's pte_lock, but page_decref() callers (e.g. the compat put_page() of
+ * a pinned user page) do not hold it. */
+#define JUMBO_NR_PGS			(PML2_PTE_REACH >> PGSHIFT)
+
+struct page *jumbo_upage_alloc(bool zero)
+{
+	struct page *page;
+	void *kva;
+
+	kva = jumbo_page_alloc(1, MEM_ATOMIC | ARENA_NO_RESERVE);
+	if (!kva)
+		return NULL;
+	if (zero)
+		memset(kva, 0, PML2_PTE_REACH);
+	page = kva2page(kva);
+	for (int i = 0; i < JUMBO_NR_PGS; i++)
+		atomic_or(&page[i].pg_flags, PG_JUMBO);
+	page->pg_index = JUMBO_NR_PGS;
+	return page;
+}
+
+/* Drops @nr_pgs pieces of the jumbo that @page is a part of. */
+void jumbo_upage_decref(struct page *page, unsigned long nr_pgs)
+{
+	struct page *head = pa2page(ROUNDDOWN(page2pa(page), PML2_PTE_REACH));
+	unsigned long left;
+
+	assert(atomic_read(&head->pg_flags) & PG_JUMBO);
+	left = __sync_sub_and_fetch(&head->pg_index, nr_pgs);
+	/* An underflow wraps to a huge count */
+	assert(left < JUMBO_NR_PGS);
+	if (left)
+		return;
+	for (int i = 0; i < JUMBO_NR_PGS; i++)
+		atomic_and(&head[i].pg_flags, ~PG_JUMBO);
+	jumbo_page_free(page2kva(head), 1);
+}
@@ -186,6 +186,15 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* Increfs the PM slot ref of a page we already hold a slot ref on, e.g. when a
+ * block holding a page cache page gets cloned. */
+void pm_incref_page(struct page *page)
+{
+	void **tree_slot = page->pg_tree_slot;
+	assert(tree_slot);
+	atomic_add((atomic_t*)tree_slot, 1UL << PM_REFCNT_SHIFT);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -210,11 +219,14 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 				break;
 			case -EEXIST:
 				/* the page was mapped already (benign race), just get rid of
-				 * our page and try again (the only case that uses the while) */
+				 * our page and try again (the only case that uses the while).
+				 * Clear the flags so no one mistakes it for a PM page later. */
+				atomic_set(&page->pg_flags, 0);
 				page_decref(page);
 				page = pm_find_page(pm, index);
 				break;
 			default:
+				atomic_set(&page->pg_flags, 0);
 				page_decref(page);
 				return error;
 		}
@@ -282,13 +294,14 @@ static unsigned long vmr_get_end_idx(struct vm_region *vmr)
 }
 
 static void vmr_for_each(struct vm_region *vmr, unsigned long pg_idx,
-                         unsigned long max_nr_pgs, mem_walk_callback_t callback)
+                         unsigned long max_nr_pgs, mem_walk_callback_t callback,
+                         void *arg)
 {
 	void *start_va = vmr_idx_to_va(vmr, pg_idx);
 	size_t len = vmr->vm_end - (uintptr_t)start_va;
 	len = MIN(len, max_nr_pgs << PGSHIFT);
 	/* TODO: start using pml_for_each, across all arches */
-	env_user_mem_walk(vmr->vm_proc, start_va, len, callback, 0);
+	env_user_mem_walk(vmr->vm_proc, start_va, len, callback, arg);
 }
 
 /* These next two helpers are called on a VMR's range of VAs corresponding to a
@@ -305,6 +318,7 @@ static void vmr_for_each(struct vm_region *vmr, unsigned long pg_idx,
  * dirty bit for this reason. */
 static int __pm_mark_not_present(struct proc *p, pte_t pte, void *va, void *arg)
 {
+	struct tlb_batch *tb = (struct tlb_batch*)arg;
 	struct page *page;
 	/* mapped includes present.  Any PTE pointing to a page (mapped) will get
 	 * flagged for removal and have its access prots revoked.  We need to deal
@@ -313,8 +327,10 @@ static int __pm_mark_not_present(struct proc *p, pte_t pte, void *va, void *arg)
 	if (pte_is_unmapped(pte))
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
-	if (atomic_read(&page->pg_flags) & PG_REMOVAL)
+	if (atomic_read(&page->pg_flags) & PG_REMOVAL) {
 		pte_clear_present(pte);
+		tlb_batch_add(tb, (uintptr_t)va, (uintptr_t)va + PGSIZE);
+	}
 	return 0;
 }
 
@@ -349,11 +365,28 @@ static int __pm_mark_unmap(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
-static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
+/* Procs whose shootdowns pm_remove_contig() batches at a time. */
+#define PM_NR_TLB_BATCHES 4
+
+static void shootdown_and_reset_tlbs(struct tlb_batch *tlbs, int *nr_tlbs)
+{
+	for (int i = 0; i < *nr_tlbs; i++)
+		tlb_batch_flush(&tlbs[i]);
+	*nr_tlbs = 0;
+}
+
+/* Returns the batch for p, starting a new one if we need to. */
+static struct tlb_batch *get_proc_tlbs(struct tlb_batch *tlbs, int *nr_tlbs,
+                                       struct proc *p)
 {
-	for (int i = 0; i < *arr_idx; i++)
-		proc_tlbshootdown((struct proc*)proc_ptrs[i], 0, 0);
-	*arr_idx = 0;
+	for (int i = 0; i < *nr_tlbs; i++) {
+		if (tlbs[i].p == p)
+			return &tlbs[i];
+	}
+	if (*nr_tlbs == PM_NR_TLB_BATCHES)
+		shootdown_and_reset_tlbs(tlbs, nr_tlbs);
+	tlb_batch_init(&tlbs[*nr_tlbs], p);
+	return &tlbs[(*nr_tlbs)++];
 }
 
 /* Attempts to remove pages from the pm, from [index, index + nr_pgs).  Returns
@@ -368,10 +401,13 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
 	void *old_slot_val, *slot_val;
 	struct vm_region *vmr_i;
 	bool pm_has_pinned_vmrs = FALSE;
-	/* using this for both procs and later WBs */
+	/* for WBs */
 	#define PTR_ARR_LEN 10
 	void *ptr_store[PTR_ARR_LEN];
 	int ptr_free_idx = 0;
+	struct tlb_batch tlbs[PM_NR_TLB_BATCHES];
+	int nr_tlbs = 0;
+	struct tlb_batch *tb;
 	struct page *page;
 	/* could also call a simpler remove if nr_pgs == 1 */
 	if (!nr_pgs)
@@ -459,30 +495,21 @@ next_loop_mark_rm:
 		 * won't need a shootdown.  mem_walk can't handle this yet though. */
 		if (!vmr_has_page_idx(vmr_i, index))
 			continue;
+		/* batching TLB shootdowns for a given proc, gathering the ranges we
+		 * mark !P.  the proc stays alive while we hold a read lock on the PM
+		 * tree, since the VMR can't get yanked out yet. */
+		tb = get_proc_tlbs(tlbs, &nr_tlbs, vmr_i->vm_proc);
 		spin_lock(&vmr_i->vm_proc->pte_lock);
 		/* all PTEs for pages marked for removal are marked !P for the entire
 		 * range.  it's possible we'll remove some extra PTEs (races with
 		 * loaders, etc), but those pages will remain in the PM and should get
 		 * soft-faulted back in. */
-		vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_not_present);
+		vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_not_present, tb);
 		spin_unlock(&vmr_i->vm_proc->pte_lock);
-		/* batching TLB shootdowns for a given proc (continue if found).
-		 * the proc stays alive while we hold a read lock on the PM tree,
-		 * since the VMR can't get yanked out yet. */
-		for (i = 0; i < ptr_free_idx; i++) {
-			if (ptr_store[i] == vmr_i->vm_proc)
-				break;
-		}
-		if (i != ptr_free_idx)
-			continue;
-		if (ptr_free_idx == PTR_ARR_LEN)
-			shootdown_and_reset_ptrstore(ptr_store, &ptr_free_idx);
-		ptr_store[ptr_free_idx++] = vmr_i->vm_proc;
 	}
 	/* Need to shootdown so that all TLBs have the page marked absent.  Then we
-	 * can check the dirty bit, now that concurrent accesses will fault.  btw,
-	 * we have a lock ordering: pm (RCU) -> proc lock (state, vcmap, etc) */
-	shootdown_and_reset_ptrstore(ptr_store, &ptr_free_idx);
+	 * can check the dirty bit, now that concurrent accesses will fault. */
+	shootdown_and_reset_tlbs(tlbs, &nr_tlbs);
 	/* Now that we've shotdown, we can check for dirtiness.  One downside to
 	 * this approach is we check every VMR for a page, even once we know the
 	 * page is dirty.  We also need to unmap the pages (set ptes to 0) for any
@@ -495,9 +522,10 @@ next_loop_mark_rm:
 			continue;
 		spin_lock(&vmr_i->vm_proc->pte_lock);
 		if (vmr_i->vm_prot & PROT_WRITE)
-			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_dirty_pgs_unmap);
+			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_dirty_pgs_unmap,
+			             NULL);
 		else
-			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_unmap);
+			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_unmap, NULL);
 		spin_unlock(&vmr_i->vm_proc->pte_lock);
 	}
 	/* Now we'll go through from the PM again and deal with pages are dirty. */
@@ -52,6 +52,7 @@ static void kpages_arena_init(void)
 	kpages_pg = arena_alloc(base_arena, PGSIZE, MEM_WAIT);
 	kpages_arena = arena_builder(kpages_pg, "kpages", PGSIZE, arena_alloc,
 	                             arena_free, base_arena, 8 * PGSIZE);
+	kpages_arenas[0] = kpages_arena;
 }
 
 /**
@@ -89,6 +90,7 @@ void pmem_init(struct multiboot_info *mbi)
 	 * not do memory allocations (which it doesn't, and it can base_alloc()). */
 	kmem_cache_init();
 	kpages_arena_init();
+	kpages_pcpu_init();
 	printk("Base arena total mem: %lu\n", arena_amt_total(base_arena));
 	vm_init();
 
@@ -243,7 +245,7 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For user jumbos, this returns the Page* of the PGSIZE piece containing va.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -259,6 +261,9 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	if (pte_is_jumbo(pte) && (uintptr_t)va < ULIM)
+		return pa2page(pte_get_paddr(pte) +
+		               ((uintptr_t)va & (PML2_PTE_REACH - 1) & ~(PGSIZE - 1)));
 	return pa2page(pte_get_paddr(pte));
 }
 
@@ -104,6 +104,61 @@ uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid)
 	return vc->total_ticks;
 }
 
+/* Preemption and notification accounting.  Only MCPs have vc_stats, so these
+ * return 0 for SCPs.  See struct vcore_stats for the locking. */
+static struct vcore_stats *get_vcore_stats(struct proc *p, uint32_t vcoreid)
+{
+	return p->vc_stats ? &p->vc_stats[vcoreid] : 0;
+}
+
+/* Prints p's accounting for #proc/PID/vcores: the totals and histograms over
+ * all vcores, then a line for each vcore that ever ran, plus its histograms if
+ * it has samples.  This doesn't lock, so the numbers might be a little off. */
+char *proc_seprint_vcores(struct proc *p, char *s, char *e)
+{
+	struct lat_hist warn_to_yield = {0}, notif_lat = {0};
+	uint64_t nr_preempts = 0, nr_warns = 0, nr_notifs = 0;
+	struct vcore_stats *vcs;
+	struct vcore *vc;
+
+	if (!p->vc_stats)
+		return seprintf(s, e, "not an MCP\n");
+	for (int i = 0; i < p->procinfo->max_vcores; i++) {
+		vc = &p->procinfo->vcoremap[i];
+		vcs = &p->vc_stats[i];
+		nr_preempts += vc->nr_preempts_sent;
+		nr_warns += vcs->nr_warns;
+		nr_notifs += vcs->nr_notifs;
+		lat_hist_merge(&warn_to_yield, &vcs->warn_to_yield);
+		lat_hist_merge(&notif_lat, &vcs->notif_lat);
+	}
+	s = seprintf(s, e, "preempts %llu warns %llu notifs %llu\n", nr_preempts,
+	             nr_warns, nr_notifs);
+	s = seprint_lat_hist(s, e, "grant", &p->ksched_data.grant_lat);
+	s = seprint_lat_hist(s, e, "warn_to_yield", &warn_to_yield);
+	s = seprint_lat_hist(s, e, "notif", &notif_lat);
+	for (int i = 0; i < p->procinfo->max_vcores; i++) {
+		vc = &p->procinfo->vcoremap[i];
+		vcs = &p->vc_stats[i];
+		if (!vc->valid && !vc->total_ticks)
+			continue;
+		s = seprintf(s, e, "vcore %d: ", i);
+		if (vc->valid)
+			s = seprintf(s, e, "pcore %d", vc->pcoreid);
+		else
+			s = seprintf(s, e, "offline");
+		s = seprintf(s, e, " runtime %llu usec preempts %u warns %llu "
+		             "notifs %llu\n", tsc2usec(vcore_account_gettotal(p, i)),
+		             vc->nr_preempts_sent, vcs->nr_warns, vcs->nr_notifs);
+		if (vcs->warn_to_yield.nr)
+			s = seprint_lat_hist(s, e, "\twarn_to_yield",
+			                     &vcs->warn_to_yield);
+		if (vcs->notif_lat.nr)
+			s = seprint_lat_hist(s, e, "\tnotif", &vcs->notif_lat);
+	}
+	return s;
+}
+
 /* While this could be done with just an assignment, this gives us the
  * opportunity to check for bad transitions.  Might compile these out later, so
  * we shouldn't rely on them for sanity checking from userspace.  */
@@ -406,6 +461,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
 	p->vmr_history = 0;
+	p->vm_nr_jumbos = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
 	 * procinfo. */
@@ -516,6 +572,7 @@ static void __proc_free(struct kref *kref)
 		kref_put(&p->strace->procs);
 		kref_put(&p->strace->users);
 	}
+	kfree(p->vc_stats);
 	__vmm_struct_cleanup(p);
 	p->progname[0] = 0;
 	free_path(p, p->binary_path);
@@ -591,7 +648,7 @@ static void __set_proc_current(struct proc *p)
 	/* If the process wasn't here, then we need to load its address space. */
 	if (p != pcpui->cur_proc) {
 		proc_incref(p, 1);
-		lcr3(p->env_cr3);
+		proc_load_cr3(p);
 		/* This is "leaving the process context" of the previous proc.  The
 		 * previous lcr3 unloaded the previous proc's context.  This should
 		 * rarely happen, since we usually proactively leave process context,
@@ -966,6 +1023,10 @@ int __proc_disown_child(struct proc *parent, struct proc *child)
 int proc_change_to_m(struct proc *p)
 {
 	int retval = 0;
+	/* Can't block with the lock held.  We'll toss it if we don't change. */
+	struct vcore_stats *vc_stats = kzmalloc(sizeof(struct vcore_stats) *
+	                                        p->procinfo->max_vcores, MEM_WAIT);
+
 	spin_lock(&p->proc_lock);
 	/* in case userspace erroneously tries to change more than once */
 	if (__proc_is_mcp(p))
@@ -1001,6 +1062,7 @@ int proc_change_to_m(struct proc *p)
 			/* change to runnable_m (it's TF is already saved) */
 			__proc_set_state(p, PROC_RUNNABLE_M);
 			p->procinfo->is_mcp = TRUE;
+			p->vc_stats = vc_stats;
 			spin_unlock(&p->proc_lock);
 			/* Tell the ksched that we're a real MCP now! */
 			__sched_proc_change_to_m(p);
@@ -1021,6 +1083,7 @@ int proc_change_to_m(struct proc *p)
 	}
 error_out:
 	spin_unlock(&p->proc_lock);
+	kfree(vc_stats);
 	return -EINVAL;
 }
 
@@ -1158,6 +1221,7 @@ void proc_yield(struct proc *p, bool being_nice)
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
 	struct vcore *vc;
 	struct preempt_data *vcpd;
+	struct vcore_stats *vcs;
 	/* Need to lock to prevent concurrent vcore changes (online, inactive, the
 	 * mapping, etc).  This plus checking the nr_preempts is enough to tell if
 	 * our vcoreid and cur_ctx ought to be here still or if we should abort */
@@ -1270,6 +1334,10 @@ void proc_yield(struct proc *p, bool being_nice)
 	/* Note this protects stuff userspace should look at, which doesn't
 	 * include the TAILQs. */
 	__seq_start_write(&p->procinfo->coremap_seqctr);
+	/* If they were warned, this is them heeding it */
+	vcs = get_vcore_stats(p, vcoreid);
+	if (vcs && vcs->warn_tsc)
+		lat_hist_add(&vcs->warn_to_yield, read_tsc() - vcs->warn_tsc);
 	/* Next time the vcore starts, it starts fresh */
 	vcpd->notif_disabled = FALSE;
 	__unmap_vcore(p, vcoreid);
@@ -1312,6 +1380,7 @@ out_yield_core:				/* successfully yielded the core */
 void proc_notify(struct proc *p, uint32_t vcoreid)
 {
 	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[vcoreid];
+	struct vcore_stats *vcs;
 
 	/* If you're thinking about checking notif_pending and then returning if it
 	 * is already set, note that some callers (e.g. the event system) set
@@ -1331,6 +1400,9 @@ void proc_notify(struct proc *p, uint32_t vcoreid)
 		 * is current). */
 		if (vcore_is_mapped(p, vcoreid)) {
 			printd("[kernel] sending notif to vcore %d\n", vcoreid);
+			vcs = get_vcore_stats(p, vcoreid);
+			if (vcs && !vcs->notif_tsc)
+				vcs->notif_tsc = read_tsc();
 			/* This use of try_get_pcoreid is racy, might be unmapped */
 			send_kernel_message(try_get_pcoreid(p, vcoreid), __notify, (long)p,
 			                    0, 0, KMSG_ROUTINE);
@@ -1415,9 +1487,16 @@ bool proc_is_vcctx_ready(struct proc *p)
 void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when)
 {
 	struct event_msg local_msg = {0};
+	struct vcore_stats *vcs = get_vcore_stats(p, vcoreid);
 	/* danger with doing this unlocked: preempt_pending is set, but never 0'd,
 	 * since it is unmapped and not dealt with (TODO)*/
 	p->procinfo->vcoremap[vcoreid].preempt_pending = when;
+	if (vcs) {
+		vcs->nr_warns++;
+		/* Latency is from the first of repeated warnings */
+		if (!vcs->warn_tsc)
+			vcs->warn_tsc = read_tsc();
+	}
 
 	/* Send the event (which internally checks to see how they want it) */
 	local_msg.ev_type = EV_PREEMPT_PENDING;
@@ -1478,6 +1557,21 @@ uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr)
 	return __proc_take_allcores(p, pc_arr, TRUE);
 }
 
+/* Warns the vcore on pcoreid that it will be preempted at 'when' (TSC), without
+ * preempting it.  Returns TRUE if p still had the core (and was warned). */
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t when)
+{
+	bool retval = FALSE;
+
+	spin_lock(&p->proc_lock);
+	if ((p->state == PROC_RUNNING_M) && is_mapped_vcore(p, pcoreid)) {
+		__proc_preempt_warn(p, get_vcoreid(p, pcoreid), when);
+		retval = TRUE;
+	}
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+
 /* Warns and preempts a vcore from p.  No delaying / alarming, or anything.  The
  * warning will be for u usec from now.  Returns TRUE if the core belonged to
  * the proc (and thus preempted), False if the proc no longer has the core. */
@@ -1799,8 +1893,15 @@ void __map_vcore(struct proc *p, uint32_t vcoreid, uint32_t pcoreid)
  * calling. */
 void __unmap_vcore(struct proc *p, uint32_t vcoreid)
 {
+	struct vcore_stats *vcs = get_vcore_stats(p, vcoreid);
+
 	p->procinfo->pcoremap[p->procinfo->vcoremap[vcoreid].pcoreid].valid = FALSE;
 	p->procinfo->vcoremap[vcoreid].valid = FALSE;
+	/* Whatever was outstanding won't be answered on this core */
+	if (vcs) {
+		vcs->warn_tsc = 0;
+		vcs->notif_tsc = 0;
+	}
 }
 
 /* Stop running whatever context is on this core and load a known-good cr3.
@@ -1851,7 +1952,7 @@ uintptr_t switch_to(struct proc *new_p)
 	if (old_proc != new_p) {
 		pcpui->cur_proc = new_p;				/* uncounted ref */
 		if (new_p)
-			lcr3(new_p->env_cr3);
+			proc_load_cr3(new_p);
 		else
 			lcr3(boot_cr3);
 	}
@@ -1885,53 +1986,144 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	if (old_proc != new_p) {
 		pcpui->cur_proc = old_proc;
 		if (old_proc)
-			lcr3(old_proc->env_cr3);
+			proc_load_cr3(old_proc);
 		else
 			lcr3(boot_cr3);
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Loads p's address space on this core.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
-void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
+ * p->tlb_cores tracks every core that might have p's translations cached: we
+ * set our bit before loading the cr3, and a shootdown clears it once it sees
+ * we've moved on to another address space (which flushed p's entries).  IRQs
+ * are off so a shootdown can't clear our bit between the two steps. */
+void proc_load_cr3(struct proc *p)
 {
-	/* TODO: need a better way to find cores running our address space.  we can
-	 * have kthreads running syscalls, async calls, processes being created. */
-	struct vcore *vc_i;
-	/* TODO: we might be able to avoid locking here in the future (we must hit
-	 * all online, and we can check __mapped).  it'll be complicated. */
-	spin_lock(&p->proc_lock);
-	switch (p->state) {
-		case (PROC_RUNNING_S):
-			tlbflush();
-			break;
-		case (PROC_RUNNING_M):
-			/* TODO: (TLB) sanity checks and rounding on the ranges.
-			 *
-			 * We need to make sure that once a core that was online has been
-			 * removed from the online list, then it must receive a TLB flush
-			 * (abandon_core()) before running the process again.  Either that,
-			 * or make other decisions about who to TLB-shootdown. */
-			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-				send_kernel_message(vc_i->pcoreid, __tlbshootdown, start, end,
-				                    0, KMSG_IMMEDIATE);
-			}
-			break;
-		default:
-			/* TODO: til we fix shootdowns, there are some odd cases where we
-			 * have the address space loaded, but the state is in transition. */
-			if (p == current)
-				tlbflush();
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	SET_BITMASK_BIT_ATOMIC(p->tlb_cores, core_id());
+	lcr3(p->env_cr3);
+	enable_irqsave(&irq_state);
+}
+
+void tlb_batch_init(struct tlb_batch *tb, struct proc *p)
+{
+	tb->p = p;
+	tb->flush_all = FALSE;
+	tb->nr_ranges = 0;
+	tb->nr_pgs = 0;
+	atomic_init(&tb->nr_pending, 0);
+}
+
+/* Adds [start, end) to the batch.  Callers usually walk their PTEs in order, so
+ * we only try to merge with the most recent range. */
+void tlb_batch_add(struct tlb_batch *tb, uintptr_t start, uintptr_t end)
+{
+	struct tlb_range *last;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	if (tb->flush_all || start >= end)
+		return;
+	tb->nr_pgs += (end - start) >> PGSHIFT;
+	if (tb->nr_pgs > TLB_FLUSH_ALL_PGS) {
+		tb->flush_all = TRUE;
+		return;
 	}
-	spin_unlock(&p->proc_lock);
+	if (tb->nr_ranges) {
+		last = &tb->ranges[tb->nr_ranges - 1];
+		if (start <= last->end && last->start <= end) {
+			last->start = MIN(last->start, start);
+			last->end = MAX(last->end, end);
+			return;
+		}
+	}
+	if (tb->nr_ranges == TLB_BATCH_MAX_RANGES) {
+		tb->flush_all = TRUE;
+		return;
+	}
+	tb->ranges[tb->nr_ranges].start = start;
+	tb->ranges[tb->nr_ranges].end = end;
+	tb->nr_ranges++;
+}
+
+/* Flushes the batch's ranges from this core's TLB, if we have the address space
+ * loaded.  If not, we have no stale entries, and we no longer need shootdowns
+ * for this proc.  Call with IRQs disabled (see proc_load_cr3()). */
+static void __tlb_batch_flush_local(struct tlb_batch *tb)
+{
+	struct tlb_range *r;
+
+	if (rcr3() != tb->p->env_cr3) {
+		CLR_BITMASK_BIT_ATOMIC(tb->p->tlb_cores, core_id());
+		return;
+	}
+	if (tb->flush_all) {
+		tlbflush();
+		return;
+	}
+	for (int i = 0; i < tb->nr_ranges; i++) {
+		r = &tb->ranges[i];
+		for (uintptr_t va = r->start; va < r->end; va += PGSIZE)
+			invlpg((void*)va);
+	}
+}
+
+/* Shoots down the batch on every core that might have the address space
+ * loaded, including kthreads working on the proc's behalf, with one message per
+ * core.  This waits until every core has flushed, since callers tend to free
+ * the pages right after.  Call this with IRQs enabled, so we can handle other
+ * cores' shootdowns while we wait on them.
+ *
+ * Callers spin here holding p->vmr_lock (mprotect, munmap) or a pm_lock
+ * (pm_remove_contig()), and they need to: the PTEs still hold the pages until
+ * the flush is done.  That's safe since the ack comes from __tlbshootdown(), an
+ * IMMEDIATE handler that takes no locks, as long as no one spins on those locks
+ * with IRQs disabled.  The page fault handlers turn IRQs on before they take
+ * vmr_lock, including for kernel faults on user memory. */
+void tlb_batch_flush(struct tlb_batch *tb)
+{
+	struct proc *p = tb->p;
+	int coreid = core_id();
+	int8_t irq_state = 0;
+
+	assert(irq_is_enabled());
+	if (!tb->nr_ranges && !tb->flush_all)
+		return;
+	/* Our PTE changes must be visible before we look at tlb_cores.  Pairs with
+	 * the atomic in proc_load_cr3(): either we see a core's bit, or it loads
+	 * the cr3 after our changes. */
+	mb();
+	/* Our own ref keeps the waiters from finishing while we send. */
+	atomic_set(&tb->nr_pending, 1);
+	for (int i = 0; i < num_cores; i++) {
+		if (i == coreid || !GET_BITMASK_BIT(p->tlb_cores, i))
+			continue;
+		atomic_inc(&tb->nr_pending);
+		send_kernel_message(i, __tlbshootdown, (long)tb, 0, 0, KMSG_IMMEDIATE);
+	}
+	disable_irqsave(&irq_state);
+	__tlb_batch_flush_local(tb);
+	enable_irqsave(&irq_state);
+	atomic_dec(&tb->nr_pending);
+	while (atomic_read(&tb->nr_pending))
+		cpu_relax();
+}
+
+/* Shoots down [start, end) for every core running p's address space.  If start
+ * == end, this flushes everything. */
+void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
+{
+	struct tlb_batch tb;
+
+	tlb_batch_init(&tb, p);
+	if (start == end)
+		tb.flush_all = TRUE;
+	else
+		tlb_batch_add(&tb, start, end);
+	tlb_batch_flush(&tb);
 }
 
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
@@ -2161,7 +2353,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * with __proc_give_cores() and __proc_run_m(). */
 	if (!pcpui->cur_proc) {
 		pcpui->cur_proc = p_to_run;	/* install the ref to cur_proc */
-		lcr3(p_to_run->env_cr3);	/* load the page tables to match cur_proc */
+		proc_load_cr3(p_to_run);	/* load the page tables to match cur_proc */
 	} else {
 		proc_decref(p_to_run);		/* can't install, decref the extra one */
 	}
@@ -2190,6 +2382,7 @@ void __notify(uint32_t srcid, long a0, long a1, long a2)
 	uint32_t vcoreid, coreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
 	struct preempt_data *vcpd;
+	struct vcore_stats *vcs;
 	struct proc *p = (struct proc*)a0;
 
 	/* Not the right proc */
@@ -2208,10 +2401,21 @@ void __notify(uint32_t srcid, long a0, long a1, long a2)
 		return;
 	printd("received active notification for proc %d's vcore %d on pcore %d\n",
 	       p->procinfo->pid, vcoreid, coreid);
+	vcs = get_vcore_stats(p, vcoreid);
 	/* sort signals.  notifs are now masked, like an interrupt gate */
-	if (vcpd->notif_disabled)
+	if (vcpd->notif_disabled) {
+		/* vcore context will see the message; no latency to measure */
+		if (vcs)
+			vcs->notif_tsc = 0;
 		return;
+	}
 	vcpd->notif_disabled = TRUE;
+	if (vcs) {
+		vcs->nr_notifs++;
+		if (vcs->notif_tsc)
+			lat_hist_add(&vcs->notif_lat, read_tsc() - vcs->notif_tsc);
+		vcs->notif_tsc = 0;
+	}
 	/* save the old ctx in the uthread slot, build and pop a new one.  Note that
 	 * silly state isn't our business for a notification. */
 	copy_current_ctx_to(&vcpd->uthread_ctx);
@@ -2295,12 +2499,16 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 	}
 }
 
-/* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+/* Kernel message handler, sent IMMEDIATE by tlb_batch_flush(), to shoot down
+ * the tlb_batch in a0.  The sender might be spinning on us with the proc's
+ * vmr_lock or a pm_lock held, so this must never take a lock. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	struct tlb_batch *tb = (struct tlb_batch*)a0;
+
+	__tlb_batch_flush_local(tb);
+	/* The batch is on the sender's stack; it's gone once we decrement. */
+	atomic_dec(&tb->nr_pending);
 }
 
 void print_allpids(void)
@@ -16,26 +16,98 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
+#include <kmalloc.h>
+#include <bitmap.h>
 
-/* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
-struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
-/* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
- * I'm expecting to want the flexibility of the pointers later. */
-struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
-struct proc_list all_mcps_2 = TAILQ_HEAD_INITIALIZER(all_mcps_2);
-struct proc_list *primary_mcps = &all_mcps_1;
-struct proc_list *secondary_mcps = &all_mcps_2;
+/* SCP run queues, one per core.  Only cores that run SCPs (is_scp_core()) get
+ * procs put on their runq.  An SCP is on a runq only while it is RUNNABLE_S,
+ * and the runq holds a ref on it: whoever pulls a proc off a runq gets that
+ * ref.  Runq locks nest inside the sched_lock, never the other way around, and
+ * the SCP paths never need the sched_lock at all. */
+struct scp_runq {
+	spinlock_t					lock;
+	struct proc_list			runnable;
+	unsigned int				nr_runnable;
+	bool						enabled;
+	struct alarm_waiter			tick;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* Static, since idle APs check is_scp_core() before schedule_init() runs.
+ * Until then, no runq is enabled. */
+static struct scp_runq scp_runqs[MAX_NUM_CORES];
+
+/* All MCPs.  The ksched doesn't walk this; it is for membership and debugging.
+ * What the ksched works off of are:
+ * - the demand queue: MCPs whose needs might have changed since the ksched
+ *   last looked, because they poked, woke up, yielded, or lost a core.  It has
+ *   its own lock, so posting never waits on the sched_lock, and it holds a ref
+ *   on each proc.
+ * - the needy tree: MCPs that want more cores than they have, best first.  It
+ *   is protected by the sched_lock, and destroy takes procs out of it. */
+struct proc_list all_mcps = TAILQ_HEAD_INITIALIZER(all_mcps);
+static struct proc_list mcp_demand = TAILQ_HEAD_INITIALIZER(mcp_demand);
+static spinlock_t demand_lock = SPINLOCK_INITIALIZER;
+static struct rb_root needy_mcps = RB_ROOT;
+static unsigned int nr_needy_mcps;
+static uint64_t needy_seq;
+static uint64_t ksched_gen;
+
+/* QoS totals, under the sched_lock: the shares of all MCPs, and the minimums
+ * promised to all procs. */
+static unsigned int qos_total_shares;
+static unsigned int qos_total_min;
+
+/* A core we warned its owner we'll take, to give to a proc whose QoS says it is
+ * owed cores.  There's one per pcore, and victim is 0 if there is no reclaim
+ * pending.  Pending reclaims are on qos_pending in deadline order.  Most go on
+ * the end, but the lead time can change (ks qoswarn), so we insert in order.
+ * Each holds refs on the victim and for_proc. */
+struct qos_reclaim {
+	struct proc					*victim;
+	struct proc					*for_proc;
+	uint64_t					deadline;
+	bool						warned;
+	TAILQ_ENTRY(qos_reclaim)	link;
+};
+TAILQ_HEAD(qos_reclaim_list, qos_reclaim);
+
+static struct qos_reclaim *qos_reclaims;
+static struct qos_reclaim_list qos_pending =
+                               TAILQ_HEAD_INITIALIZER(qos_pending);
+static struct alarm_waiter qos_waiter;
+static bool qos_alarm_armed;
+static uint64_t qos_warn_usec = CONFIG_KSCHED_QOS_WARN_USEC;
+static struct sched_qos_stats qos_stats;
+
+static const char *qos_class_names[] = {
+	[SCHED_QOS_BATCH] = "batch",
+	[SCHED_QOS_NORMAL] = "normal",
+	[SCHED_QOS_LATENCY] = "latency",
+};
+
+#define QOS_DEFAULT_SHARES		100
+#define QOS_MAX_SHARES			10000
+#define QOS_USAGE_SCALE			1024
+
+/* How a reclaim ended */
+enum {
+	QOS_HONOURED,
+	QOS_FORCED,
+	QOS_CANCELLED,
+};
 
 /* Helper, defined below */
 static void __core_request(struct proc *p, uint32_t amt_needed);
 static void add_to_list(struct proc *p, struct proc_list *list);
-static void remove_from_list(struct proc *p, struct proc_list *list);
-static void switch_lists(struct proc *p, struct proc_list *old,
-                         struct proc_list *new);
 static void __run_mcp_ksched(void *arg);	/* don't call directly */
 static uint32_t get_cores_needed(struct proc *p);
+static void __scp_tick(struct alarm_waiter *waiter);
+static bool __schedule_scp(void);
+static void __qos_alarm(struct alarm_waiter *waiter);
+static void __qos_core_left(struct proc *p, uint32_t pcoreid, int how);
+static void __qos_proc_gone(struct proc *p);
+static void __qos_expire(void);
+static void __qos_reclaim(struct proc *p);
 
 /* Locks / sync tools */
 
@@ -103,12 +175,31 @@ static void __ksched_tick(struct alarm_waiter *waiter)
 
 void schedule_init(void)
 {
+	struct scp_runq *rq;
+	int nr_scp_cores = 1;
+
+	for (int i = 0; i < num_cores; i++) {
+		rq = &scp_runqs[i];
+		spinlock_init(&rq->lock);
+		TAILQ_INIT(&rq->runnable);
+		init_awaiter(&rq->tick, __scp_tick);
+	}
 	spin_lock(&sched_lock);
 	assert(!core_id());		/* want the alarm on core0 for now */
 	init_awaiter(&ksched_waiter, __ksched_tick);
 	set_ksched_alarm();
 	corealloc_init();
+	qos_reclaims = kzmalloc(sizeof(struct qos_reclaim) * num_cores, MEM_WAIT);
+	init_awaiter(&qos_waiter, __qos_alarm);
+	/* The LL core always runs SCPs, off the ksched tick */
+	scp_runqs[0].enabled = TRUE;
 	spin_unlock(&sched_lock);
+	for (int i = 1; i < num_cores && nr_scp_cores < CONFIG_SCP_CORES; i++) {
+		if (!sched_add_scp_core(i))
+			nr_scp_cores++;
+	}
+	if (nr_scp_cores > 1)
+		printk("Using %d cores for SCPs\n", nr_scp_cores);
 
 #ifdef CONFIG_ARSC_SERVER
 	int arsc_coreid = get_any_idle_core();
@@ -126,27 +217,718 @@ static void add_to_list(struct proc *p, struct proc_list *new)
 	p->ksched_data.cur_list = new;
 }
 
-static void remove_from_list(struct proc *p, struct proc_list *old)
+/* Removes from whatever list p is on */
+static void remove_from_any_list(struct proc *p)
 {
-	assert(p->ksched_data.cur_list == old);
-	TAILQ_REMOVE(old, p, ksched_data.proc_link);
-	p->ksched_data.cur_list = 0;
+	if (p->ksched_data.cur_list) {
+		TAILQ_REMOVE(p->ksched_data.cur_list, p, ksched_data.proc_link);
+		p->ksched_data.cur_list = 0;
+	}
 }
 
-static void switch_lists(struct proc *p, struct proc_list *old,
-                         struct proc_list *new)
+/************** MCP Demand **************/
+/* Tells the ksched to look at p's needs the next time it runs.  Callers poke
+ * the ksched afterwards, if they can. */
+static void mcp_post_demand(struct proc *p)
 {
-	remove_from_list(p, old);
-	add_to_list(p, new);
+	spin_lock(&demand_lock);
+	if (!p->ksched_data.demand_posted) {
+		p->ksched_data.demand_posted = TRUE;
+		proc_incref(p, 1);
+		TAILQ_INSERT_TAIL(&mcp_demand, p, ksched_data.demand_link);
+	}
+	spin_unlock(&demand_lock);
 }
 
-/* Removes from whatever list p is on */
-static void remove_from_any_list(struct proc *p)
+/* Pulls the next MCP off the demand queue, and the caller gets the queue's ref.
+ * Once it is off, p can be posted again. */
+static struct proc *mcp_demand_pop(void)
 {
-	if (p->ksched_data.cur_list) {
-		TAILQ_REMOVE(p->ksched_data.cur_list, p, ksched_data.proc_link);
-		p->ksched_data.cur_list = 0;
+	struct proc *p;
+
+	spin_lock(&demand_lock);
+	p = TAILQ_FIRST(&mcp_demand);
+	if (p) {
+		TAILQ_REMOVE(&mcp_demand, p, ksched_data.demand_link);
+		p->ksched_data.demand_posted = FALSE;
+	}
+	spin_unlock(&demand_lock);
+	return p;
+}
+
+/* How many cores MCPs could have, at most: everything but the LL and SCP
+ * cores. */
+static unsigned int __mcp_pool_size(void)
+{
+	unsigned int nr = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		nr += !is_ll_core(i) && !is_scp_core(i);
+	return nr;
+}
+
+/* How many cores p's QoS says it is owed: its minimum, or for latency MCPs,
+ * its weighted share of the pool if that is more. */
+static uint32_t __qos_target(struct proc *p)
+{
+	struct sched_qos *qos = &p->ksched_data.qos;
+	uint32_t share = 0;
+
+	if ((qos->class == SCHED_QOS_LATENCY) && qos_total_shares)
+		share = (uint64_t)__mcp_pool_size() * qos->shares / qos_total_shares;
+	return MAX(qos->min_cores, share);
+}
+
+/* Needy MCPs with provisioned cores they don't have go first, since they can
+ * take those back from whoever has them.  Then come the ones that are owed
+ * cores by their QoS, since they can preempt others.  Then it's by QoS class,
+ * then whoever has the fewest cores for their shares, and then FIFO.
+ *
+ * Anyone that is neither prov'd nor owed can only get idle cores, so the
+ * ksched can stop at the first of them that comes up empty. */
+static int needy_key_cmp(struct mcp_needy_key *a, struct mcp_needy_key *b)
+{
+	if (a->prov != b->prov)
+		return a->prov ? -1 : 1;
+	if (a->claim != b->claim)
+		return a->claim ? -1 : 1;
+	if (a->class != b->class)
+		return a->class > b->class ? -1 : 1;
+	if (a->usage != b->usage)
+		return a->usage < b->usage ? -1 : 1;
+	if (a->seq != b->seq)
+		return a->seq < b->seq ? -1 : 1;
+	return 0;
+}
+
+static struct proc *needy_node2proc(struct rb_node *node)
+{
+	return node ? container_of(node, struct proc, ksched_data.needy_node) : 0;
+}
+
+static void __needy_insert(struct proc *p)
+{
+	struct rb_node **new = &needy_mcps.rb_node, *parent = NULL;
+
+	while (*new) {
+		parent = *new;
+		if (needy_key_cmp(&p->ksched_data.needy_key,
+		                  &needy_node2proc(parent)->ksched_data.needy_key) < 0)
+			new = &parent->rb_left;
+		else
+			new = &parent->rb_right;
+	}
+	rb_link_node(&p->ksched_data.needy_node, parent, new);
+	rb_insert_color(&p->ksched_data.needy_node, &needy_mcps);
+	p->ksched_data.needy = TRUE;
+	nr_needy_mcps++;
+}
+
+static void __needy_remove(struct proc *p)
+{
+	if (!p->ksched_data.needy)
+		return;
+	rb_erase(&p->ksched_data.needy_node, &needy_mcps);
+	p->ksched_data.needy = FALSE;
+	nr_needy_mcps--;
+}
+
+/* Returns the first needy MCP that sorts after key, which need not be in the
+ * tree anymore. */
+static struct proc *__needy_after(struct mcp_needy_key *key)
+{
+	struct rb_node *node = needy_mcps.rb_node, *ret = NULL;
+
+	while (node) {
+		if (needy_key_cmp(key, &needy_node2proc(node)->ksched_data.needy_key)
+		    < 0) {
+			ret = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return needy_node2proc(ret);
+}
+
+/* Looks at what p wants, and if it wants more cores than it has, (re)queues it
+ * in the needy tree.  Requeuing puts p behind its equals.  Caller holds the
+ * sched_lock and a ref on p. */
+static void __mcp_update_need(struct proc *p)
+{
+	struct mcp_needy_key *key = &p->ksched_data.needy_key;
+
+	__needy_remove(p);
+	/* Destroy took p off all_mcps.  It also might never have been an MCP. */
+	if (p->ksched_data.cur_list != &all_mcps)
+		goto not_needy;
+	if (proc_is_dying(p) || (p->state == PROC_WAITING))
+		goto not_needy;
+	if (!get_cores_needed(p))
+		goto not_needy;
+	/* Request-to-grant latency runs from when p first wants cores */
+	if (!p->ksched_data.need_tsc)
+		p->ksched_data.need_tsc = read_tsc();
+	key->prov = !TAILQ_EMPTY(&p->ksched_data.crd.prov_not_alloc_me);
+	key->granted = p->procinfo->res_grant[RES_CORES];
+	key->claim = key->granted < __qos_target(p);
+	key->class = p->ksched_data.qos.class;
+	key->usage = key->granted * QOS_USAGE_SCALE / p->ksched_data.qos.shares;
+	key->seq = needy_seq++;
+	__needy_insert(p);
+	return;
+not_needy:
+	p->ksched_data.need_tsc = 0;
+}
+
+/* For places that can't poke the ksched directly, e.g. with a proc_lock held */
+static void __kick_mcp_ksched(uint32_t srcid, long a0, long a1, long a2)
+{
+	poke(&ksched_poker, 0);
+}
+
+/* Cores were freed up.  If anyone is waiting on cores, have the ksched run
+ * soon.  Caller holds the sched_lock. */
+static void __mcp_cores_freed(void)
+{
+	if (nr_needy_mcps)
+		send_kernel_message(core_id(), __kick_mcp_ksched, 0, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+/* The ksched's calls into the proc code to hand out and take back MCP cores */
+static int __mcp_give_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
+{
+	int ret;
+
+	spin_lock(&p->proc_lock);
+	/* at some point after giving cores, call proc_run_m() (harmless on
+	 * RUNNING_Ms).  You can give small groups of cores, then run them (which
+	 * is more efficient than interleaving runs with the gives for bulk
+	 * preempted processes). */
+	ret = __proc_give_cores(p, pc_arr, num);
+	if (!ret)
+		__proc_run_m(p);
+	spin_unlock(&p->proc_lock);
+	return ret;
+}
+
+static bool __mcp_preempt_core(struct proc *p, uint32_t pcoreid)
+{
+	return (p->state == PROC_RUNNING_M) && proc_preempt_core(p, pcoreid, 0);
+}
+
+static struct sched_mcp_ops default_mcp_ops = {
+	.give_cores = __mcp_give_cores,
+	.warn_core = proc_preempt_warn_core,
+	.preempt_core = __mcp_preempt_core,
+};
+
+static struct sched_mcp_ops *mcp_ops(struct proc *p)
+{
+	return p->ksched_data.mcp_ops ? p->ksched_data.mcp_ops : &default_mcp_ops;
+}
+
+/************** QoS **************/
+/* Ends the reclaim of pcoreid, however it went. */
+static void __qos_reclaim_done(uint32_t pcoreid, int how)
+{
+	struct qos_reclaim *rc = &qos_reclaims[pcoreid];
+	struct sched_qos_stats *vstats = &rc->victim->ksched_data.qos_stats;
+
+	/* Only count the ones the victim heard about */
+	if (rc->warned) {
+		switch (how) {
+		case QOS_HONOURED:
+			vstats->honoured++;
+			qos_stats.honoured++;
+			break;
+		case QOS_FORCED:
+			vstats->forced++;
+			qos_stats.forced++;
+			break;
+		default:
+			vstats->cancelled++;
+			qos_stats.cancelled++;
+			break;
+		}
+	}
+	TAILQ_REMOVE(&qos_pending, rc, link);
+	rc->victim->ksched_data.qos_losing--;
+	rc->for_proc->ksched_data.qos_gaining--;
+	proc_decref(rc->victim);
+	proc_decref(rc->for_proc);
+	rc->victim = 0;
+	rc->for_proc = 0;
+}
+
+/* p no longer has pcoreid.  If we were reclaiming it, we're done. */
+static void __qos_core_left(struct proc *p, uint32_t pcoreid, int how)
+{
+	if (qos_reclaims[pcoreid].victim == p)
+		__qos_reclaim_done(pcoreid, how);
+}
+
+/* p is dying: call off any reclaims from it or for it. */
+static void __qos_proc_gone(struct proc *p)
+{
+	struct qos_reclaim *rc, *temp;
+
+	TAILQ_FOREACH_SAFE(rc, &qos_pending, link, temp) {
+		if ((rc->victim == p) || (rc->for_proc == p))
+			__qos_reclaim_done(rc - qos_reclaims, QOS_CANCELLED);
+	}
+}
+
+/* Puts rc on qos_pending in deadline order.  New ones usually go last. */
+static void __qos_pending_insert(struct qos_reclaim *rc)
+{
+	struct qos_reclaim *pos;
+
+	TAILQ_FOREACH_REVERSE(pos, &qos_pending, qos_reclaim_list, link) {
+		if (pos->deadline <= rc->deadline)
+			break;
+	}
+	if (pos)
+		TAILQ_INSERT_AFTER(&qos_pending, pos, rc, link);
+	else
+		TAILQ_INSERT_HEAD(&qos_pending, rc, link);
+}
+
+/* The alarm just pokes: only the ksched preempts, so it does the work. */
+static void __qos_alarm(struct alarm_waiter *waiter)
+{
+	spin_lock(&sched_lock);
+	qos_alarm_armed = FALSE;
+	spin_unlock(&sched_lock);
+	poke(&ksched_poker, 0);
+}
+
+/* Sets the alarm for the earliest deadline, on the LL core.  Once set, we
+ * leave it alone: if those reclaims are done by then, it is a spurious poke.  If
+ * an earlier deadline shows up in the meantime, the ksched tick catches it. */
+static void __qos_arm_alarm(void)
+{
+	struct qos_reclaim *rc = TAILQ_FIRST(&qos_pending);
+
+	if (!rc || qos_alarm_armed)
+		return;
+	qos_alarm_armed = TRUE;
+	set_awaiter_abs(&qos_waiter, rc->deadline);
+	set_alarm(&per_cpu_info[0].tchain, &qos_waiter);
+}
+
+/* Picks a core to take from someone else for p, or returns -1.  We won't take
+ * hard provisioned cores, cores we are already taking, or cores that would
+ * drop their owner below its minimum.  Unless p is short of its own minimum
+ * (any_class), the owner must also be of a lower class.  Lowest class goes
+ * first, then whoever has the most cores for their shares. */
+static int __qos_victim_core(struct proc *p, bool any_class)
+{
+	struct proc *q;
+	struct sched_qos *q_qos;
+	int best = -1, held;
+	uint64_t score, best_score = 0;
+
+	for (int i = 0; i < num_cores; i++) {
+		q = get_alloc_proc(i);
+		if (!q || (q == p) || qos_reclaims[i].victim ||
+		    (get_prov_proc(i) == q))
+			continue;
+		q_qos = &q->ksched_data.qos;
+		if (!any_class && (q_qos->class >= p->ksched_data.qos.class))
+			continue;
+		held = (int)q->procinfo->res_grant[RES_CORES] -
+		       (int)q->ksched_data.qos_losing;
+		if (held <= (int)q_qos->min_cores)
+			continue;
+		score = (uint64_t)q_qos->class << 32 |
+		        (UINT32_MAX - held * QOS_USAGE_SCALE / q_qos->shares);
+		if ((best < 0) || (score < best_score)) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Warns pcoreid's owner that we'll take it for p in qos_warn_usec.  Like
+ * __core_request(), this unlocks the sched_lock for a bit. */
+static void __qos_warn(struct proc *p, uint32_t pcoreid)
+{
+	struct qos_reclaim *rc = &qos_reclaims[pcoreid];
+	struct proc *victim = get_alloc_proc(pcoreid);
+	uint64_t deadline = read_tsc() + usec2tsc(qos_warn_usec);
+	bool warned;
+
+	proc_incref(victim, 1);
+	proc_incref(p, 1);
+	rc->victim = victim;
+	rc->for_proc = p;
+	rc->deadline = deadline;
+	rc->warned = FALSE;
+	__qos_pending_insert(rc);
+	victim->ksched_data.qos_losing++;
+	p->ksched_data.qos_gaining++;
+	__qos_arm_alarm();
+	/* our own ref: the reclaim's goes away if the core leaves while unlocked */
+	proc_incref(victim, 1);
+	spin_unlock(&sched_lock);
+	warned = mcp_ops(victim)->warn_core(victim, pcoreid, deadline);
+	spin_lock(&sched_lock);
+	/* If it wasn't warned, the core is already on its way out, and whoever is
+	 * giving it up will end the reclaim. */
+	if (warned && (rc->victim == victim)) {
+		rc->warned = TRUE;
+		victim->ksched_data.qos_stats.warned++;
+		qos_stats.warned++;
+	}
+	proc_decref(victim);
+}
+
+/* Takes the cores whose owners didn't give them back in time.  Like
+ * __core_request(), this unlocks the sched_lock for a bit, and relies on the
+ * ksched being the only one that preempts. */
+static void __qos_expire(void)
+{
+	struct qos_reclaim *rc;
+	struct proc *victim;
+	uint32_t pcoreid;
+	bool success;
+
+	while ((rc = TAILQ_FIRST(&qos_pending)) && (rc->deadline <= read_tsc())) {
+		pcoreid = rc - qos_reclaims;
+		victim = rc->victim;
+		proc_incref(victim, 1);
+		spin_unlock(&sched_lock);
+		success = mcp_ops(victim)->preempt_core(victim, pcoreid);
+		spin_lock(&sched_lock);
+		if (success) {
+			/* Same as in __core_request: the core is still alloc'd to the
+			 * victim, and it's on us to note the dealloc. */
+			__track_core_dealloc(victim, pcoreid);
+			__mcp_update_need(victim);
+			__mcp_cores_freed();
+			if (rc->victim == victim)
+				__qos_reclaim_done(pcoreid, QOS_FORCED);
+		} else if (rc->victim == victim) {
+			/* It is being yielded or the victim is dying, and it'll be idle
+			 * soon.  We can't wait for that here, and we didn't get to take
+			 * it, so the reclaim is off. */
+			__qos_reclaim_done(pcoreid, QOS_CANCELLED);
+		}
+		proc_decref(victim);
+	}
+	__qos_arm_alarm();
+}
+
+/* There are no idle cores, but p's QoS says it is owed some.  Warn whoever has
+ * them.  This unlocks the sched_lock for a bit. */
+static void __qos_reclaim(struct proc *p)
+{
+	struct sched_proc_data *sd = &p->ksched_data;
+	uint32_t granted, target;
+	int pcoreid;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (proc_is_dying(p))
+			return;
+		granted = p->procinfo->res_grant[RES_CORES];
+		target = MIN(__qos_target(p), granted + get_cores_needed(p));
+		if (granted + sd->qos_gaining >= target)
+			return;
+		pcoreid = __qos_victim_core(p, granted + sd->qos_gaining <
+		                               sd->qos.min_cores);
+		if (pcoreid < 0)
+			return;
+		__qos_warn(p, pcoreid);
+	}
+}
+
+/************** SCP Run Queues **************/
+bool is_scp_core(uint32_t pcoreid)
+{
+	return scp_runqs[pcoreid].enabled;
+}
+
+/* Rough cache distance between two cores: SMT siblings share the L1/L2, and
+ * cores on a socket share the LLC. */
+static int core_cache_dist(uint32_t a, uint32_t b)
+{
+	struct core_info *ci_a = &cpu_topology_info.core_list[a];
+	struct core_info *ci_b = &cpu_topology_info.core_list[b];
+
+	if (a == b)
+		return 0;
+	if (ci_a->socket_id != ci_b->socket_id)
+		return ci_a->numa_id == ci_b->numa_id ? 3 : 4;
+	if (ci_a->cpu_id != ci_b->cpu_id)
+		return 2;
+	return 1;
+}
+
+/* How many SCPs want pcoreid: the ones waiting, plus the one running.  Unlocked
+ * peeks, so this is only a hint. */
+static unsigned int scp_core_load(uint32_t pcoreid)
+{
+	return READ_ONCE(scp_runqs[pcoreid].nr_runnable) +
+	       (per_cpu_info[pcoreid].owning_proc ? 1 : 0);
+}
+
+/* Picks the SCP core for p: the least loaded one, breaking ties by cache
+ * distance from where p last ran (or from us, if it never ran).  Thus p stays
+ * put unless there is a less busy core around. */
+static uint32_t scp_pick_core(struct proc *p)
+{
+	int home = p->ksched_data.scp_core;
+	int best = -1, best_dist = 0, dist;
+	unsigned int best_load = 0, load;
+
+	if (home < 0)
+		home = core_id();
+	for (int i = 0; i < num_cores; i++) {
+		if (!is_scp_core(i))
+			continue;
+		load = scp_core_load(i);
+		dist = core_cache_dist(home, i);
+		if ((best < 0) || (load < best_load) ||
+		    ((load == best_load) && (dist < best_dist))) {
+			best = i;
+			best_load = load;
+			best_dist = dist;
+		}
+	}
+	/* The LL core can't stop running SCPs */
+	assert(best >= 0);
+	return best;
+}
+
+/* Puts p on pcoreid's runq, which takes the caller's ref.  Fails if pcoreid
+ * stopped running SCPs. */
+static bool scp_runq_add(struct proc *p, uint32_t pcoreid)
+{
+	struct scp_runq *rq = &scp_runqs[pcoreid];
+
+	spin_lock(&rq->lock);
+	if (!rq->enabled) {
+		spin_unlock(&rq->lock);
+		return FALSE;
+	}
+	assert(!p->ksched_data.runq);
+	TAILQ_INSERT_TAIL(&rq->runnable, p, ksched_data.proc_link);
+	p->ksched_data.runq = rq;
+	rq->nr_runnable++;
+	spin_unlock(&rq->lock);
+	return TRUE;
+}
+
+/* Pulls an SCP off pcoreid's runq, and the caller gets the runq's ref.  The
+ * owner runs its queue in order; thieves take from the tail, which is the proc
+ * that would wait the longest. */
+static struct proc *scp_runq_pull(uint32_t pcoreid, bool steal)
+{
+	struct scp_runq *rq = &scp_runqs[pcoreid];
+	struct proc *p;
+
+	spin_lock(&rq->lock);
+	if (steal)
+		p = TAILQ_LAST(&rq->runnable, proc_list);
+	else
+		p = TAILQ_FIRST(&rq->runnable);
+	if (p) {
+		TAILQ_REMOVE(&rq->runnable, p, ksched_data.proc_link);
+		p->ksched_data.runq = 0;
+		rq->nr_runnable--;
+	}
+	spin_unlock(&rq->lock);
+	return p;
+}
+
+/* Yanks p off whatever runq it is on, if any, dropping the runq's ref. */
+static void scp_runq_remove(struct proc *p)
+{
+	struct scp_runq *rq;
+
+	while ((rq = READ_ONCE(p->ksched_data.runq))) {
+		spin_lock(&rq->lock);
+		if (p->ksched_data.runq == rq) {
+			TAILQ_REMOVE(&rq->runnable, p, ksched_data.proc_link);
+			p->ksched_data.runq = 0;
+			rq->nr_runnable--;
+			spin_unlock(&rq->lock);
+			proc_decref(p);
+			return;
+		}
+		/* someone pulled it, and it may already be on another runq */
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* Queues the RUNNABLE_S p on some SCP core, taking the caller's ref.  That
+ * core might be halted, so we poke it.  If it is running another SCP, the poke
+ * is harmless and it will get to p by its next tick, unless an idle core steals
+ * p first. */
+static void scp_enqueue(struct proc *p)
+{
+	uint32_t pcoreid;
+
+	do {
+		pcoreid = scp_pick_core(p);
+	} while (!scp_runq_add(p, pcoreid));
+	if (pcoreid != core_id())
+		send_ipi(pcoreid, I_POKE_CORE);
+}
+
+/* Finds an SCP for pcoreid, whose runq is empty, on the closest core that has
+ * more SCPs than it can run right now.  Among equally close cores, we steal
+ * from the longest runq. */
+static struct proc *scp_steal(uint32_t pcoreid)
+{
+	int victim = -1, victim_dist = 0, dist;
+	unsigned int victim_nr = 0, nr;
+
+	for (int i = 0; i < num_cores; i++) {
+		if ((i == pcoreid) || !is_scp_core(i))
+			continue;
+		nr = READ_ONCE(scp_runqs[i].nr_runnable);
+		/* An idle core will run its only SCP soon, and it is cache-hot there */
+		if (!nr || ((nr == 1) && !per_cpu_info[i].owning_proc))
+			continue;
+		dist = core_cache_dist(pcoreid, i);
+		if ((victim < 0) || (dist < victim_dist) ||
+		    ((dist == victim_dist) && (nr > victim_nr))) {
+			victim = i;
+			victim_dist = dist;
+			victim_nr = nr;
+		}
+	}
+	if (victim < 0)
+		return 0;
+	return scp_runq_pull(victim, TRUE);
+}
+
+/* Takes the SCP that owns the calling core off the core, leaving it
+ * RUNNABLE_S, and returns a ref for it.  Returns 0 if it is dying: there's
+ * probably a KMSG to clean it up waiting on this core, so we leave it be. */
+static struct proc *__scp_deschedule(void)
+{
+	uint32_t pcoreid = core_id();
+	struct proc *p = per_cpu_info[pcoreid].owning_proc;
+
+	spin_lock(&p->proc_lock);
+	if (proc_is_dying(p)) {
+		spin_unlock(&p->proc_lock);
+		return 0;
+	}
+	__proc_set_state(p, PROC_RUNNABLE_S);
+	/* Saving FP state aggressively.  Odds are, the SCP was hit by an IRQ and
+	 * has a HW ctx, in which case we must save. */
+	__proc_save_fpu_s(p);
+	__proc_save_context_s(p);
+	vcore_account_offline(p, 0);
+	__seq_start_write(&p->procinfo->coremap_seqctr);
+	__unmap_vcore(p, 0);
+	__seq_end_write(&p->procinfo->coremap_seqctr);
+	spin_unlock(&p->proc_lock);
+	/* clear_owning_proc drops the core's ref */
+	proc_incref(p, 1);
+	clear_owning_proc(pcoreid);
+	/* Note we abandon core.  It's not strictly necessary.  If we didn't, the
+	 * TLB would still be loaded with the old one, til we proc_run_s, and the
+	 * various paths in proc_run_s would pick it up.  This way is a bit safer
+	 * for future changes, but has an extra (empty) TLB flush.  */
+	abandon_core();
+	return p;
+}
+
+/* SCP cores other than the LL core get their own tick, to round-robin their
+ * runq.  It is an RKM alarm, so we can deschedule from it.  It only schedules
+ * this core: the MCP ksched runs off the LL core's tick, not once per SCP
+ * core. */
+static void __scp_tick(struct alarm_waiter *waiter)
+{
+	struct scp_runq *rq = container_of(waiter, struct scp_runq, tick);
+
+	__schedule_scp();
+	if (READ_ONCE(rq->enabled)) {
+		set_awaiter_rel(waiter, TIMER_TICK_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+	}
+}
+
+int sched_add_scp_core(uint32_t pcoreid)
+{
+	struct scp_runq *rq;
+
+	if (!(pcoreid < num_cores)) {
+		set_errno(ENXIO);
+		return -1;
 	}
+	rq = &scp_runqs[pcoreid];
+	spin_lock(&sched_lock);
+	if (rq->enabled) {
+		spin_unlock(&sched_lock);
+		return 0;
+	}
+	/* This fails for cores that are allocated or provisioned to an MCP, as
+	 * well as for cores someone else took out of the idle pool. */
+	if (__get_specific_idle_core(pcoreid) < 0) {
+		spin_unlock(&sched_lock);
+		set_errno(EBUSY);
+		return -1;
+	}
+	spin_lock(&rq->lock);
+	rq->enabled = TRUE;
+	spin_unlock(&rq->lock);
+	spin_unlock(&sched_lock);
+	set_awaiter_rel(&rq->tick, TIMER_TICK_USEC);
+	set_alarm(&per_cpu_info[pcoreid].tchain, &rq->tick);
+	return 0;
+}
+
+/* Runs on the core that is no longer an SCP core.  Moves its SCPs elsewhere,
+ * then hands the core back to the idle pool. */
+static void __scp_core_stop(uint32_t srcid, long a0, long a1, long a2)
+{
+	uint32_t pcoreid = core_id();
+	struct scp_runq *rq = &scp_runqs[pcoreid];
+	struct proc *p;
+
+	unset_alarm(&per_cpu_info[pcoreid].tchain, &rq->tick);
+	if (per_cpu_info[pcoreid].owning_proc) {
+		p = __scp_deschedule();
+		if (p)
+			scp_enqueue(p);
+	}
+	while ((p = scp_runq_pull(pcoreid, FALSE)))
+		scp_enqueue(p);
+	put_idle_core(pcoreid);
+}
+
+int sched_del_scp_core(uint32_t pcoreid)
+{
+	struct scp_runq *rq;
+
+	if (!(pcoreid < num_cores)) {
+		set_errno(ENXIO);
+		return -1;
+	}
+	if (is_ll_core(pcoreid)) {
+		set_errno(EBUSY);
+		return -1;
+	}
+	rq = &scp_runqs[pcoreid];
+	spin_lock(&rq->lock);
+	if (!rq->enabled) {
+		spin_unlock(&rq->lock);
+		set_errno(EINVAL);
+		return -1;
+	}
+	/* No one will add to the runq after this.  The core drains it. */
+	rq->enabled = FALSE;
+	spin_unlock(&rq->lock);
+	send_kernel_message(pcoreid, __scp_core_stop, 0, 0, 0, KMSG_ROUTINE);
+	return 0;
 }
 
 /************** Process Management Callbacks **************/
@@ -164,9 +946,18 @@ void __sched_proc_register(struct proc *p)
 	assert(!proc_is_dying(p));		/* shouldn't be able to happen yet */
 	/* one ref for the proc's existence, cradle-to-grave */
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
+	p->ksched_data.runq = 0;
+	p->ksched_data.scp_core = -1;
+	p->ksched_data.qos.class = SCHED_QOS_NORMAL;
+	p->ksched_data.qos.shares = QOS_DEFAULT_SHARES;
+	p->ksched_data.qos.min_cores = 0;
+	p->ksched_data.qos.max_cores = 0;
+	memset(&p->ksched_data.qos_stats, 0, sizeof(struct sched_qos_stats));
+	p->ksched_data.qos_gaining = 0;
+	p->ksched_data.qos_losing = 0;
+	p->ksched_data.mcp_ops = NULL;
 	spin_lock(&sched_lock);
 	corealloc_proc_init(p);
-	add_to_list(p, &unrunnable_scps);
 	spin_unlock(&sched_lock);
 }
 
@@ -186,13 +977,15 @@ void __sched_proc_change_to_m(struct proc *p)
 		printk("[kernel] process needs to specify amt_wanted\n");
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 	}
-	/* For now, this should only ever be called on an unrunnable.  It's
-	 * probably a bug, at this stage in development, to do o/w. */
-	remove_from_list(p, &unrunnable_scps);
-	//remove_from_any_list(p); 	/* ^^ instead of this */
-	add_to_list(p, primary_mcps);
+	/* For now, this should only ever be called on a running SCP, which isn't
+	 * on a runq or any of our lists.  It's probably a bug, at this stage in
+	 * development, to do o/w. */
+	assert(!p->ksched_data.runq);
+	add_to_list(p, &all_mcps);
+	qos_total_shares += p->ksched_data.qos.shares;
+	/* We're in p's syscall, so we don't poke.  The next poke will see it. */
+	mcp_post_demand(p);
 	spin_unlock(&sched_lock);
-	//poke_ksched(p, RES_CORES);
 }
 
 /* Sched callback called when the proc dies.  pc_arr holds the cores the proc
@@ -207,12 +1000,22 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 	 * The latter does bookkeeping when an allocation changes.  This is a
 	 * bulk *provisioning* change. */
 	__unprovision_all_cores(p);
+	if (p->ksched_data.cur_list == &all_mcps)
+		qos_total_shares -= p->ksched_data.qos.shares;
+	qos_total_min -= p->ksched_data.qos.min_cores;
 	/* Remove from whatever list we are on (if any - might not be on one if it
 	 * was in the middle of __run_mcp_sched) */
 	remove_from_any_list(p);
-	if (nr_cores)
+	__needy_remove(p);
+	__qos_proc_gone(p);
+	if (nr_cores) {
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
+		__mcp_cores_freed();
+	}
 	spin_unlock(&sched_lock);
+	/* A dying SCP could still be queued.  If we race with a core pulling it,
+	 * that core will see it's DYING and drop the runq's ref instead. */
+	scp_runq_remove(p);
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
 }
@@ -220,42 +1023,21 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_mcp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (proc_is_dying(p)) {
-		spin_unlock(&sched_lock);
+	if (proc_is_dying(p))
 		return;
-	}
-	/* could try and prioritize p somehow (move it to the front of the list). */
-	spin_unlock(&sched_lock);
-	/* note they could be dying at this point too. */
+	/* note they could be dying at this point too.  The ksched will check. */
+	mcp_post_demand(p);
 	poke(&ksched_poker, p);
 }
 
-/* ksched callbacks.  p just woke up and is UNLOCKED. */
+/* ksched callbacks.  p just woke up and is UNLOCKED.  proc_wakeup() only
+ * calls this once per trip through WAITING, so p isn't on a runq yet. */
 void __sched_scp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (proc_is_dying(p)) {
-		spin_unlock(&sched_lock);
+	if (proc_is_dying(p))
 		return;
-	}
-	/* might not be on a list if it is new.  o/w, it should be unrunnable */
-	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
-	spin_unlock(&sched_lock);
-	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
-	 * don't tell one of them about the new proc, they will sleep until the
-	 * timer tick goes off. */
-	if (!management_core()) {
-		/* TODO: pick a better core and only send if halted.
-		 *
-		 * ideally, we'd know if a specific mgmt core is sleeping and wake it
-		 * up.  o/w, we could interrupt an already-running mgmt core that won't
-		 * get to our new proc anytime soon.  also, by poking core 0, a
-		 * different mgmt core could remain idle (and this process would sleep)
-		 * until its tick goes off */
-		send_ipi(0, I_POKE_CORE);
-	}
+	proc_incref(p, 1);	/* for the runq */
+	scp_enqueue(p);
 }
 
 /* Callback to return a core to the ksched, which tracks it as idle and
@@ -267,6 +1049,10 @@ void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 {
 	spin_lock(&sched_lock);
 	__track_core_dealloc(p, coreid);
+	__qos_core_left(p, coreid, QOS_HONOURED);
+	/* p might have yielded due to a preempt warning, and still want cores */
+	__mcp_update_need(p);
+	__mcp_cores_freed();
 	spin_unlock(&sched_lock);
 }
 
@@ -275,62 +1061,52 @@ void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
 	spin_lock(&sched_lock);
 	__track_core_dealloc_bulk(p, pc_arr, num);
+	for (int i = 0; i < num; i++)
+		__qos_core_left(p, pc_arr[i], QOS_HONOURED);
+	__mcp_update_need(p);
+	__mcp_cores_freed();
 	spin_unlock(&sched_lock);
-	/* could trigger a sched decision here */
 }
 
-/* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
+/* SCP cores call this to schedule the calling core and give it to an SCP: the
+ * next one on our runq, or one stolen from another core if ours is empty.  Any
+ * SCP currently running here goes back on a runq.  Returns TRUE if it
+ * scheduled a proc. */
 static bool __schedule_scp(void)
 {
-	// TODO: sort out lock ordering (proc_run_s also locks)
-	struct proc *p;
+	struct proc *p, *old = 0;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
-	/* if there are any runnables, run them here and put any currently running
-	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
-		/* someone is currently running, dequeue them */
-		if (pcpui->owning_proc) {
-			spin_lock(&pcpui->owning_proc->proc_lock);
-			/* process might be dying, with a KMSG to clean it up waiting on
-			 * this core.  can't do much, so we'll attempt to restart */
-			if (proc_is_dying(pcpui->owning_proc)) {
-				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
-				                    KMSG_ROUTINE);
-				spin_unlock(&pcpui->owning_proc->proc_lock);
-				return FALSE;
-			}
-			printd("Descheduled %d in favor of %d\n", pcpui->owning_proc->pid,
-			       p->pid);
-			__proc_set_state(pcpui->owning_proc, PROC_RUNNABLE_S);
-			/* Saving FP state aggressively.  Odds are, the SCP was hit by an
-			 * IRQ and has a HW ctx, in which case we must save. */
-			__proc_save_fpu_s(pcpui->owning_proc);
-			__proc_save_context_s(pcpui->owning_proc);
-			vcore_account_offline(pcpui->owning_proc, 0);
-			__seq_start_write(&p->procinfo->coremap_seqctr);
-			__unmap_vcore(p, 0);
-			__seq_end_write(&p->procinfo->coremap_seqctr);
-			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
-			clear_owning_proc(pcoreid);
-			/* Note we abandon core.  It's not strictly necessary.  If
-			 * we didn't, the TLB would still be loaded with the old
-			 * one, til we proc_run_s, and the various paths in
-			 * proc_run_s would pick it up.  This way is a bit safer for
-			 * future changes, but has an extra (empty) TLB flush.  */
-			abandon_core();
+
+	p = scp_runq_pull(pcoreid, FALSE);
+	if (!p)
+		p = scp_steal(pcoreid);
+	if (!p)
+		return FALSE;
+	/* someone is currently running, dequeue them */
+	if (pcpui->owning_proc) {
+		printd("Descheduling %d in favor of %d\n", pcpui->owning_proc->pid,
+		       p->pid);
+		old = __scp_deschedule();
+		if (!old) {
+			/* can't do much, so we'll attempt to restart.  p was at the head
+			 * of a runq; the tail will do. */
+			if (!scp_runq_add(p, pcoreid))
+				scp_enqueue(p);
+			send_kernel_message(pcoreid, __just_sched, 0, 0, 0, KMSG_ROUTINE);
+			return FALSE;
 		}
-		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
-		printd("PID of the SCP i'm running: %d\n", p->pid);
-		proc_run_s(p);	/* gives it core we're running on */
-		return TRUE;
 	}
-	return FALSE;
+	/* Run the new proc */
+	printd("PID of the SCP i'm running: %d\n", p->pid);
+	p->ksched_data.scp_core = pcoreid;
+	proc_run_s(p);	/* gives it core we're running on */
+	proc_decref(p);	/* the runq's ref; proc_run_s took its own */
+	/* round-robin: old goes to the back of a runq, usually ours.  We do this
+	 * once p owns our core, so that an idle SCP core looks better to old. */
+	if (old)
+		scp_enqueue(old);
+	return TRUE;
 }
 
 /* Returns how many new cores p needs.  This doesn't lock the proc, so your
@@ -347,6 +1123,9 @@ static uint32_t get_cores_needed(struct proc *p)
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 		amt_wanted = 1;
 	}
+	/* The QoS burst cap.  Leave amt_wanted alone, the cap might go up. */
+	if (p->ksched_data.qos.max_cores)
+		amt_wanted = MIN(amt_wanted, p->ksched_data.qos.max_cores);
 	/* There are a few cases where amt_wanted is 0, but they are still RUNNABLE
 	 * (involving yields, events, and preemptions).  In these cases, give them
 	 * at least 1, so they can make progress and yield properly.  If they are
@@ -370,66 +1149,71 @@ static uint32_t get_cores_needed(struct proc *p)
 }
 
 /* Actual work of the MCP kscheduler.  if we were called by poke_ksched, *arg
- * might be the process who wanted special service.  this would be the case if
- * we weren't already running the ksched.  Sort of a ghetto way to "post work",
- * such that it's an optimization. */
+ * might be the process who wanted special service.  That proc, and anyone else
+ * whose needs changed, is on the demand queue, so we don't need arg.
+ *
+ * We first sort the posted MCPs into (or out of) the needy tree, and take any
+ * cores whose QoS reclaim deadline passed.  Then we hand out cores to the
+ * needy, best first, and warn the owners of cores that QoS says should go to
+ * someone else.  Each run only looks at posted procs and at
+ * needy procs we can actually give cores to, not at every MCP. */
 static void __run_mcp_ksched(void *arg)
 {
-	struct proc *p, *temp;
+	struct proc *p;
+	struct mcp_needy_key key;
 	uint32_t amt_needed;
-	struct proc_list *temp_mcp_list;
+
 	/* locking to protect the MCP lists' integrity and membership */
 	spin_lock(&sched_lock);
-	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
-	 * nothing, put them on the secondary list.  if they need something, rip
-	 * them off the list, service them, and if they are still not dying, put
-	 * them on the secondary list.  We cull the entire primary list, so that
-	 * when we start from the beginning each time, we aren't repeatedly checking
-	 * procs we looked at on previous waves.
-	 *
-	 * TODO: we could modify this such that procs that we failed to service move
-	 * to yet another list or something.  We can also move the WAITINGs to
-	 * another list and have wakeup move them back, etc. */
-	while (!TAILQ_EMPTY(primary_mcps)) {
-		TAILQ_FOREACH_SAFE(p, primary_mcps, ksched_data.proc_link, temp) {
-			if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
-				switch_lists(p, primary_mcps, secondary_mcps);
-				continue;
-			}
-			amt_needed = get_cores_needed(p);
-			if (!amt_needed) {
-				switch_lists(p, primary_mcps, secondary_mcps);
+	ksched_gen++;
+	while ((p = mcp_demand_pop())) {
+		__mcp_update_need(p);
+		proc_decref(p);			/* fyi, this may trigger __proc_free */
+	}
+	__qos_expire();
+	p = needy_node2proc(rb_first(&needy_mcps));
+	while (p) {
+		key = p->ksched_data.needy_key;
+		/* Procs we serve go back in the tree if they still want more.  Don't
+		 * serve them again on this pass. */
+		if (p->ksched_data.needy_gen == ksched_gen) {
+			p = __needy_after(&key);
+			continue;
+		}
+		if (__find_best_core_to_alloc(p) == -1) {
+			/* If p is owed cores, it can take them from someone else.  Note
+			 * __qos_reclaim() unlocks, just like __core_req. */
+			if (key.claim) {
+				p->ksched_data.needy_gen = ksched_gen;
+				proc_incref(p, 1);
+				__qos_reclaim(p);
+				proc_decref(p);
+				p = __needy_after(&key);
 				continue;
 			}
-			/* o/w, we want to give cores to this proc */
-			remove_from_list(p, primary_mcps);
-			/* now it won't die, but it could get removed from lists and have
-			 * its stuff unprov'd when we unlock */
-			proc_incref(p, 1);
-			/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
-			 * It will return with it locked still.  We could unlock before we
-			 * pass in, but they will relock right away. */
-			// notionally_unlock(&ksched_lock);	/* for mouse-eyed viewers */
-			__core_request(p, amt_needed);
-			// notionally_lock(&ksched_lock);
-			/* Peeking at the state is okay, since we hold a ref.  Once it is
-			 * DYING, it'll remain DYING until we decref.  And if there is a
-			 * concurrent death, that will spin on the ksched lock (which we
-			 * hold, and which protects the proc lists). */
-			if (!proc_is_dying(p))
-				add_to_list(p, secondary_mcps);
-			proc_decref(p);			/* fyi, this may trigger __proc_free */
-			/* need to break: the proc lists may have changed when we unlocked
-			 * in core_req in ways that the FOREACH_SAFE can't handle. */
-			break;
+			/* Procs without provisioned cores all draw from the idle pool, so
+			 * once one of them comes up empty, so will everyone after it.
+			 * Unless it was just avoiding SMT siblings. */
+			if (!key.prov && !__corealloc_proc_avoids_smt(p))
+				break;
+			p = __needy_after(&key);
+			continue;
 		}
+		amt_needed = get_cores_needed(p);
+		p->ksched_data.needy_gen = ksched_gen;
+		/* now it won't die, but it could get removed from lists and have
+		 * its stuff unprov'd when we unlock */
+		proc_incref(p, 1);
+		/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
+		 * It will return with it locked still.  We could unlock before we
+		 * pass in, but they will relock right away.  The tree might change
+		 * while unlocked, so we find our place again by key. */
+		if (amt_needed)
+			__core_request(p, amt_needed);
+		__mcp_update_need(p);
+		proc_decref(p);			/* fyi, this may trigger __proc_free */
+		p = __needy_after(&key);
 	}
-	/* at this point, we moved all the procs over to the secondary list, and
-	 * attempted to service the ones that wanted something.  now just swap the
-	 * lists for the next invocation of the ksched. */
-	temp_mcp_list = primary_mcps;
-	primary_mcps = secondary_mcps;
-	secondary_mcps = temp_mcp_list;
 	spin_unlock(&sched_lock);
 }
 
@@ -445,11 +1229,8 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
-		spin_lock(&sched_lock);
+	if (is_scp_core(core_id()))
 		__schedule_scp();
-		spin_unlock(&sched_lock);
-	}
 }
 
 /* A process is asking the ksched to look at its resource desires.  The
@@ -461,6 +1242,7 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	 * other structs/flags) */
 	if (!__proc_is_mcp(p))
 		return;
+	mcp_post_demand(p);
 	poke(&ksched_poker, p);
 }
 
@@ -471,11 +1253,9 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 void cpu_bored(void)
 {
 	bool new_proc = FALSE;
-	if (!management_core())
+	if (!is_scp_core(core_id()))
 		return;
-	spin_lock(&sched_lock);
 	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
@@ -574,6 +1354,9 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 				 * to note its dealloc.  we are doing some excessive checking of
 				 * p == prov_proc, but using this helper is a lot clearer. */
 				__track_core_dealloc(proc_to_preempt, pcoreid);
+				__qos_core_left(proc_to_preempt, pcoreid, QOS_CANCELLED);
+				/* the victim now has fewer cores than it wanted */
+				__mcp_update_need(proc_to_preempt);
 			} else {
 				/* the preempt failed, which should only happen if the pcore was
 				 * unmapped (could be dying, could be yielding, but NOT
@@ -626,28 +1409,27 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * and could be trying to give them out (and assuming they are already
 		 * on the idle list). */
 		spin_unlock(&sched_lock);
-		/* give them the cores.  this will start up the extras if RUNNING_M. */
-		spin_lock(&p->proc_lock);
-		/* if they fail, it is because they are WAITING or DYING.  we could give
+		/* give them the cores.  this will start up the extras if RUNNING_M.
+		 * if they fail, it is because they are WAITING or DYING.  we could give
 		 * the cores to another proc or whatever.  for the current type of
 		 * ksched, we'll just put them back on the pile and return.  Note, the
 		 * ksched could check the states after locking, but it isn't necessary:
 		 * just need to check at some point in the ksched loop. */
-		if (__proc_give_cores(p, corelist, nr_to_grant)) {
-			spin_unlock(&p->proc_lock);
+		if (mcp_ops(p)->give_cores(p, corelist, nr_to_grant)) {
 			/* we failed, put the cores and track their dealloc.  lock is
 			 * protecting those structures. */
 			spin_lock(&sched_lock);
 			__track_core_dealloc_bulk(p, corelist, nr_to_grant);
 		} else {
-			/* at some point after giving cores, call proc_run_m() (harmless on
-			 * RUNNING_Ms).  You can give small groups of cores, then run them
-			 * (which is more efficient than interleaving runs with the gives
-			 * for bulk preempted processes). */
-			__proc_run_m(p);
-			spin_unlock(&p->proc_lock);
 			/* main mcp_ksched wants this held (it came to __core_req held) */
 			spin_lock(&sched_lock);
+			/* Any grant ends the wait; if p still wants more, the next
+			 * update_need starts a new one. */
+			if (p->ksched_data.need_tsc) {
+				lat_hist_add(&p->ksched_data.grant_lat,
+				             read_tsc() - p->ksched_data.need_tsc);
+				p->ksched_data.need_tsc = 0;
+			}
 		}
 	}
 	/* note the ksched lock is still held */
@@ -672,24 +1454,184 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 	 * If we need a finer grained sched lock, this is one place where we could
 	 * have a different lock */
 	spin_lock(&sched_lock);
+	/* SCP cores are out of the idle pool, much like LL cores.  The sched_lock
+	 * keeps them from changing. */
+	if (is_scp_core(pcoreid)) {
+		spin_unlock(&sched_lock);
+		set_errno(EBUSY);
+		return -1;
+	}
 	__provision_core(p, pcoreid);
+	/* p might be able to claim this core now */
+	__mcp_update_need(p);
+	spin_unlock(&sched_lock);
+	poke(&ksched_poker, p);
+	return 0;
+}
+
+int sched_proc_avoid_smt(struct proc *p, bool avoid)
+{
+	int ret;
+
+	spin_lock(&sched_lock);
+	ret = __corealloc_proc_avoid_smt(p, avoid);
+	spin_unlock(&sched_lock);
+	if (ret) {
+		set_errno(ENOTSUP);
+		return -1;
+	}
+	return 0;
+}
+
+/************** QoS **************/
+void sched_proc_get_qos(struct proc *p, struct sched_qos *qos)
+{
+	spin_lock(&sched_lock);
+	*qos = p->ksched_data.qos;
 	spin_unlock(&sched_lock);
+}
+
+int sched_proc_set_qos(struct proc *p, struct sched_qos *qos)
+{
+	struct sched_qos *old = &p->ksched_data.qos;
+
+	if ((qos->class < 0) || (qos->class >= NR_SCHED_QOS) || !qos->shares ||
+	    (qos->shares > QOS_MAX_SHARES) ||
+	    (qos->max_cores && (qos->max_cores < qos->min_cores))) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&sched_lock);
+	/* Destroy already took p out of the totals */
+	if (proc_is_dying(p)) {
+		spin_unlock(&sched_lock);
+		set_errno(ESRCH);
+		return -1;
+	}
+	if (qos_total_min - old->min_cores + qos->min_cores > __mcp_pool_size()) {
+		spin_unlock(&sched_lock);
+		set_errno(EBUSY);
+		return -1;
+	}
+	qos_total_min += qos->min_cores - old->min_cores;
+	if (p->ksched_data.cur_list == &all_mcps)
+		qos_total_shares += qos->shares - old->shares;
+	*old = *qos;
+	/* p's place in line changed, and it might be owed cores now */
+	__mcp_update_need(p);
+	spin_unlock(&sched_lock);
+	poke(&ksched_poker, p);
 	return 0;
 }
 
+void sched_set_qos_warn_usec(uint64_t usec)
+{
+	spin_lock(&sched_lock);
+	qos_warn_usec = usec;
+	spin_unlock(&sched_lock);
+}
+
 /************** Debugging **************/
+/* Prints the cores p is allocated and provisioned, and how well its allocated
+ * cores are placed: the sockets and NUMA nodes they span, how many have an SMT
+ * sibling that is also p's, and how many share a physical core with another
+ * proc. */
+char *sched_seprint_cores(struct proc *p, char *s, char *e)
+{
+	DECLARE_BITMAP(sockets, MAX_NUM_CORES);
+	DECLARE_BITMAP(numas, MAX_NUM_CORES);
+	struct core_info *ci;
+	struct proc *sib;
+	unsigned int nr_prov = 0, nr_prov_held = 0, smt_self = 0, smt_shared = 0;
+
+	bitmap_zero(sockets, MAX_NUM_CORES);
+	bitmap_zero(numas, MAX_NUM_CORES);
+	spin_lock(&sched_lock);
+	s = seprintf(s, e, "policy %s avoid_smt %d\nalloc",
+	             corealloc_policy_name, __corealloc_proc_avoids_smt(p));
+	for (int i = 0; i < num_cores; i++) {
+		if (get_alloc_proc(i) != p)
+			continue;
+		s = seprintf(s, e, " %d", i);
+		ci = &cpu_topology_info.core_list[i];
+		set_bit(ci->socket_id, sockets);
+		set_bit(ci->numa_id, numas);
+		for (int j = 0; j < num_cores; j++) {
+			if (!core_smt_siblings(i, j))
+				continue;
+			sib = get_alloc_proc(j);
+			if (sib == p)
+				smt_self++;
+			else if (sib)
+				smt_shared++;
+		}
+	}
+	s = seprintf(s, e, "\nprov");
+	for (int i = 0; i < num_cores; i++) {
+		if (get_prov_proc(i) != p)
+			continue;
+		s = seprintf(s, e, " %d", i);
+		nr_prov++;
+		if (get_alloc_proc(i) == p)
+			nr_prov_held++;
+	}
+	s = seprintf(s, e, "\nqos %s shares %u min %u max %u owed %u\n",
+	             qos_class_names[p->ksched_data.qos.class],
+	             p->ksched_data.qos.shares, p->ksched_data.qos.min_cores,
+	             p->ksched_data.qos.max_cores, __qos_target(p));
+	s = seprintf(s, e, "reclaims warned %llu honoured %llu forced %llu",
+	             p->ksched_data.qos_stats.warned,
+	             p->ksched_data.qos_stats.honoured,
+	             p->ksched_data.qos_stats.forced);
+	s = seprintf(s, e, " cancelled %llu\n", p->ksched_data.qos_stats.cancelled);
+	spin_unlock(&sched_lock);
+	s = seprintf(s, e, "sockets %d numa %d smt_self %u smt_shared %u",
+	             bitmap_weight(sockets, MAX_NUM_CORES),
+	             bitmap_weight(numas, MAX_NUM_CORES), smt_self, smt_shared);
+	s = seprintf(s, e, " prov_held %u/%u\n", nr_prov_held, nr_prov);
+	return s;
+}
+
 void sched_diag(void)
 {
 	struct proc *p;
+	struct scp_runq *rq;
+	struct qos_reclaim *rc;
+
+	for (int i = 0; i < num_cores; i++) {
+		rq = &scp_runqs[i];
+		if (!rq->enabled && !rq->nr_runnable)
+			continue;
+		spin_lock(&rq->lock);
+		printk("SCP core %d%s, running %d, %d runnable\n", i,
+		       rq->enabled ? "" : " (stopping)",
+		       per_cpu_info[i].owning_proc ? per_cpu_info[i].owning_proc->pid
+		                                   : 0,
+		       rq->nr_runnable);
+		TAILQ_FOREACH(p, &rq->runnable, ksched_data.proc_link)
+			printk("\tRunnable _S PID: %d\n", p->pid);
+		spin_unlock(&rq->lock);
+	}
 	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
-		printk("Unrunnable _S PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
-		printk("Primary MCP PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
-		printk("Secondary MCP PID: %d\n", p->pid);
+	TAILQ_FOREACH(p, &all_mcps, ksched_data.proc_link)
+		printk("MCP PID: %d%s\n", p->pid,
+		       p->ksched_data.needy ? ", wants cores" : "");
+	printk("%d MCPs want cores\n", nr_needy_mcps);
+	for (p = needy_node2proc(rb_first(&needy_mcps)); p;
+	     p = needy_node2proc(rb_next(&p->ksched_data.needy_node)))
+		printk("\tNeedy MCP PID: %d, had %d cores, %s%s%s\n", p->pid,
+		       p->ksched_data.needy_key.granted,
+		       qos_class_names[p->ksched_data.needy_key.class],
+		       p->ksched_data.needy_key.prov ? ", has prov'd cores" : "",
+		       p->ksched_data.needy_key.claim ? ", owed cores" : "");
+	printk("QoS: %u shares, %u min cores, warn %llu usec\n",
+	       qos_total_shares, qos_total_min, qos_warn_usec);
+	printk("QoS reclaims: warned %llu honoured %llu forced %llu",
+	       qos_stats.warned, qos_stats.honoured, qos_stats.forced);
+	printk(" cancelled %llu\n", qos_stats.cancelled);
+	TAILQ_FOREACH(rc, &qos_pending, link)
+		printk("\tPending: core %d from PID %d for PID %d\n",
+		       rc - qos_reclaims, rc->victim->pid, rc->for_proc->pid);
 	spin_unlock(&sched_lock);
 	return;
 }
@@ -729,3 +1671,13 @@ void sort_idle_cores(void)
 	__sort_idle_cores();
 	spin_unlock(&sched_lock);
 }
+
+int sched_peek_core(struct proc *p)
+{
+	int ret;
+
+	spin_lock(&sched_lock);
+	ret = __find_best_core_to_alloc(p);
+	spin_unlock(&sched_lock);
+	return ret;
+}
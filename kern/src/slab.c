@@ -39,13 +39,13 @@
  *   have this dependency between kpages and mags.
  * - The paper talks about full and empty magazines.  Why does our code talk
  *   about not_empty and empty?  The way we'll do our magazine resizing is to
- *   just() increment the pcpu_cache's magsize.  Then we'll eventually start
- *   filling the magazines to their new capacity (during frees, btw).  During
- *   this time, a mag that was previously full will technically be not-empty,
- *   but not full.  The correctness of the magazine code is still OK, I think,
- *   since when they say 'full', they require 'not empty' in most cases.  In
- *   short, 'not empty' is more accurate, though it makes sense to say 'full'
- *   when explaining the basic idea for their paper.
+ *   just() increment (or decrement) the pcpu_cache's magsize.  Then we'll
+ *   eventually start filling the magazines to their new capacity (during
+ *   frees, btw).  During this time, a mag that was previously full will
+ *   technically be not-empty, but not full.  The correctness of the magazine
+ *   code is still OK, I think, since when they say 'full', they require 'not
+ *   empty' in most cases.  In short, 'not empty' is more accurate, though it
+ *   makes sense to say 'full' when explaining the basic idea for their paper.
  * - Due to a resize, what happens when the depot gives a pcpu cache a magazine
  *   with *more* rounds than ppc->magsize?  The allocation path doesn't care
  *   about magsize - it just looks at nr_rounds.  So that's fine.  On the free
@@ -70,7 +70,6 @@
  *   grab a pcc lock.
  *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
@@ -90,9 +89,13 @@
 #define SLAB_POISON ((void*)0xdead1111)
 
 /* Tunables.  I don't know which numbers to pick yet.  Maybe we play with it at
- * runtime.  Though once a mag increases, it'll never decrease. */
+ * runtime.  Magazines grow when the depot sees more than resize_threshold
+ * contended locks within resize_timeout_ns.  They shrink by one round each time
+ * the cache is reaped, if the depot hasn't been contended for
+ * shrink_timeout_ns.  Only the contended path reads the clock. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
+uint64_t shrink_timeout_ns = 10000000000;
 
 /* Protected by the arenas_and_slabs_lock. */
 struct kmem_cache_tailq all_kmem_caches =
@@ -100,7 +103,7 @@ struct kmem_cache_tailq all_kmem_caches =
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
-static bool kmem_cache_grow(struct kmem_cache *cp);
+static bool kmem_cache_grow(struct kmem_cache *cp, int flags);
 static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags);
 static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
 
@@ -141,6 +144,18 @@ static void unlock_pcu_cache(struct kmem_pcpu_cache *pcc)
 	enable_irqsave(&pcc->irq_state);
 }
 
+/* Helper, shrinks the magazines if the depot hasn't been contended since
+ * shrink_timeout_ns before @now.  Hold the depot lock. */
+static void __depot_maybe_shrink(struct kmem_depot *depot, uint64_t now)
+{
+	if (depot->magsize == KMC_MAG_MIN_SZ)
+		return;
+	if (now - depot->last_contended < shrink_timeout_ns)
+		return;
+	depot->magsize--;
+	depot->nr_shrinks++;
+}
+
 static void lock_depot(struct kmem_depot *depot)
 {
 	uint64_t time;
@@ -162,6 +177,10 @@ static void lock_depot(struct kmem_depot *depot)
 	 * might then think the burst wasn't big enough. */
 	time = nsec();
 	spin_lock_irqsave(&depot->lock);
+	depot->last_contended = time;
+	depot->nr_contended++;
+	get_my_pcpu_cache(container_of(depot, struct kmem_cache, depot))
+		->nr_depot_contended++;
 	/* If there are no not-empty mags, we're probably fighting for the lock not
 	 * because the magazines aren't big enough, but because there aren't enough
 	 * mags in the system yet. */
@@ -174,7 +193,10 @@ static void lock_depot(struct kmem_depot *depot)
 	depot->busy_count++;
 	if (depot->busy_count > resize_threshold) {
 		depot->busy_count = 0;
-		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		if (depot->magsize < KMC_MAG_MAX_SZ) {
+			depot->magsize++;
+			depot->nr_grows++;
+		}
 		/* That's all we do - the pccs will eventually notice and up their
 		 * magazine sizes. */
 	}
@@ -195,6 +217,10 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->last_contended = 0;
+	depot->nr_contended = 0;
+	depot->nr_grows = 0;
+	depot->nr_shrinks = 0;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -251,6 +277,10 @@ static struct kmem_pcpu_cache *build_pcpu_caches(void)
 		pcc[i].loaded = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
 		pcc[i].prev = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
 		pcc[i].nr_allocs_ever = 0;
+		pcc[i].nr_depot_allocs = 0;
+		pcc[i].nr_slab_allocs = 0;
+		pcc[i].nr_imports = 0;
+		pcc[i].nr_depot_contended = 0;
 	}
 	return pcc;
 }
@@ -296,6 +326,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	if ((obj_size > SLAB_LARGE_CUTOFF) || (flags & KMC_NOTOUCH))
 		kc->flags |= __KMC_USE_BUFCTL;
 	depot_init(&kc->depot);
+	kc->pcpu_caches = NULL;
 	/* We do this last, since this will all into the magazine cache - which we
 	 * could be creating on this call! */
 	kc->pcpu_caches = build_pcpu_caches();
@@ -386,10 +417,36 @@ static void depot_destroy(struct kmem_cache *kc)
 	unlock_depot(depot);
 }
 
+/* Caches that import from the generic kpages_arena get their slabs from the
+ * calling core's NUMA node, via kpages_alloc().  kpages_arena's own qcaches
+ * must use the arena directly. */
+static bool __use_kpages(struct kmem_cache *cp)
+{
+	return cp->source == kpages_arena && !(cp->flags & KMC_QCACHE);
+}
+
+/* We grow slabs while holding the cache lock, so the source allocation can't
+ * block.  @flags may ask for ARENA_NO_RESERVE, though. */
+static void *kmem_source_alloc(struct kmem_cache *cp, size_t size, int flags)
+{
+	flags = (flags & ARENA_NO_RESERVE) | MEM_ATOMIC;
+	if (__use_kpages(cp))
+		return kpages_alloc(size, flags);
+	return arena_alloc(cp->source, size, flags);
+}
+
+static void kmem_source_free(struct kmem_cache *cp, void *buf, size_t size)
+{
+	if (__use_kpages(cp))
+		kpages_free(buf, size);
+	else
+		arena_free(cp->source, buf, size);
+}
+
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (!__use_bufctls(cp)) {
-		arena_free(cp->source, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		kmem_source_free(cp, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
 	} else {
 		struct kmem_bufctl *i, *temp;
 		void *buf_start = (void*)SIZE_MAX;
@@ -401,7 +458,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			 * init the freelist when we reuse the slab. */
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
-		arena_free(cp->source, buf_start, cp->import_amt);
+		kmem_source_free(cp, buf_start, cp->import_amt);
 		kmem_cache_free(kmem_slab_cache, a_slab);
 	}
 }
@@ -503,17 +560,32 @@ static struct kmem_bufctl *__yank_bufctl(struct kmem_cache *cp, void *buf)
 static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 {
 	void *retval = NULL;
+	/* Callers that can block stay out of the low-memory reserve.  If growing
+	 * fails, they wait for the reclaimer and try again.  If even the reclaimer
+	 * can't help, they get one last try with the reserve.  Atomic callers that
+	 * asked for ARENA_NO_RESERVE just fail. */
+	int grow_flags = arena_can_block(flags) || (flags & ARENA_NO_RESERVE) ?
+	                 ARENA_NO_RESERVE : 0;
+
+retry:
 	spin_lock_irqsave(&cp->cache_lock);
 	// look at partial list
 	struct kmem_slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
 	// 	if none, go to empty list and get an empty and make it partial
 	if (!a_slab) {
-		// TODO: think about non-sleeping flags
 		if (TAILQ_EMPTY(&cp->empty_slab_list) &&
-			!kmem_cache_grow(cp)) {
+			!kmem_cache_grow(cp, grow_flags)) {
 			spin_unlock_irqsave(&cp->cache_lock);
+			if ((grow_flags & ARENA_NO_RESERVE) && arena_can_block(flags)) {
+				if (!arena_wait_for_memory(__use_bufctls(cp) ?
+				                           cp->import_amt : PGSIZE))
+					grow_flags &= ~ARENA_NO_RESERVE;
+				goto retry;
+			}
 			if (flags & MEM_ERROR)
 				error(ENOMEM, ERROR_FIXME);
+			else if (flags & MEM_ATOMIC)
+				return NULL;
 			else
 				panic("[German Accent]: OOM for a small slab growth!!!");
 		}
@@ -585,9 +657,11 @@ try_alloc:
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
+		pcc->nr_depot_allocs++;
 		goto try_alloc;
 	}
 	unlock_depot(depot);
+	pcc->nr_slab_allocs++;
 	unlock_pcu_cache(pcc);
 	return __kmem_alloc_from_slab(kc, flags);
 }
@@ -688,10 +762,11 @@ try_free:
  * page_alloc fails, there are some serious issues.  This only grows by one slab
  * at a time.
  *
- * Grab the cache lock before calling this.
+ * Grab the cache lock before calling this.  We won't block, but we'll honor
+ * ARENA_NO_RESERVE in @flags.
  *
  * TODO: think about page colouring issues with kernel memory allocation. */
-static bool kmem_cache_grow(struct kmem_cache *cp)
+static bool kmem_cache_grow(struct kmem_cache *cp, int flags)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -702,7 +777,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		/* Careful, this assumes our source is a PGSIZE-aligned allocator.  We
 		 * could use xalloc to enforce the alignment, but that'll bypass the
 		 * qcaches, which we don't want.  Caller beware. */
-		a_page = arena_alloc(cp->source, PGSIZE, MEM_ATOMIC);
+		a_page = kmem_source_alloc(cp, PGSIZE, flags);
 		if (!a_page)
 			return FALSE;
 		// the slab struct is stored at the end of the page
@@ -727,7 +802,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
 			return FALSE;
-		buf = arena_alloc(cp->source, cp->import_amt, MEM_ATOMIC);
+		buf = kmem_source_alloc(cp, cp->import_amt, flags);
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
 			return FALSE;
@@ -746,24 +821,58 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	}
 	// add a_slab to the empty_list
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	/* The magazine cache grows before its pcpu caches exist. */
+	if (cp->pcpu_caches)
+		cp->pcpu_caches[core_id_early()].nr_imports++;
 
 	return TRUE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+/* Gives back the memory the cache is holding on to, but isn't using: the
+ * objects in the depot's magazines, the magazines themselves, and then every
+ * empty slab.  We don't touch the per-core magazines; those are the working
+ * set, though a depot that has been quiet for a while gets smaller magazines.
+ * The arena reclaim ktask calls this, under arenas_and_slabs_lock.  We don't
+ * hold the cache or depot locks while we free, since freeing to our source can
+ * call back into the slab layer. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_mag_slist not_empty, empty;
+	struct kmem_slab_list empty_slabs;
+	struct kmem_magazine *mag_i;
 	struct kmem_slab *a_slab, *next;
+	uint64_t now = nsec();
+
+	spin_lock_irqsave(&depot->lock);
+	__depot_maybe_shrink(depot, now);
+	not_empty = depot->not_empty;
+	empty = depot->empty;
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	spin_unlock_irqsave(&depot->lock);
+	while ((mag_i = SLIST_FIRST(&not_empty))) {
+		SLIST_REMOVE_HEAD(&not_empty, link);
+		drain_mag(cp, mag_i);
+		kmem_cache_free(kmem_magazine_cache, mag_i);
+	}
+	while ((mag_i = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		kmem_cache_free(kmem_magazine_cache, mag_i);
+	}
 
-	// Destroy all empty slabs.  Refer to the notes about the while loop
+	TAILQ_INIT(&empty_slabs);
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
+	TAILQ_SWAP(&empty_slabs, &cp->empty_slab_list, kmem_slab, link);
+	spin_unlock_irqsave(&cp->cache_lock);
+	/* Can't use a regular FOREACH, since the link element may be on the page
+	 * that we are freeing. */
+	a_slab = TAILQ_FIRST(&empty_slabs);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
 		kmem_slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
-	spin_unlock_irqsave(&cp->cache_lock);
 }
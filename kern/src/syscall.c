@@ -1697,6 +1697,56 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 	return ret;
 }
 
+/* Sends count bytes of the VFS file in_fd to the chan out_fd straight from the
+ * page cache.  If u_off is set, we start there and write back the new offset,
+ * leaving the file's offset alone.  Otherwise we use and advance f_pos. */
+static intreg_t sys_sendfile(struct proc *p, int out_fd, int in_fd,
+                             int64_t *u_off, size_t count)
+{
+	struct file *file = get_file_from_fd(&p->open_files, in_fd);
+	int64_t off;
+	long ret;
+
+	sysc_save_str("sendfile %d to %d", in_fd, out_fd);
+	if (!file) {
+		set_error(EINVAL, "sendfile needs a page cache backed in_fd");
+		return -1;
+	}
+	if (!S_ISREG(file->f_dentry->d_inode->i_mode) || !file->f_mapping) {
+		kref_put(&file->f_kref);
+		set_error(EINVAL, "sendfile needs a regular file with a page map");
+		return -1;
+	}
+	if (!(file->f_flags & O_READ)) {
+		kref_put(&file->f_kref);
+		set_errno(EBADF);
+		return -1;
+	}
+	if (u_off) {
+		if (memcpy_from_user_errno(p, &off, u_off, sizeof(off))) {
+			kref_put(&file->f_kref);
+			return -1;
+		}
+	} else {
+		off = file->f_pos;
+	}
+	if (off >= file->f_dentry->d_inode->i_size) {
+		kref_put(&file->f_kref);
+		return 0;
+	}
+	count = MIN(count, file->f_dentry->d_inode->i_size - off);
+	ret = syssendpm(out_fd, file->f_mapping, off, count);
+	if (ret > 0) {
+		off += ret;
+		if (!u_off)
+			file->f_pos = off;
+		else if (memcpy_to_user_errno(p, u_off, &off, sizeof(off)))
+			ret = -1;
+	}
+	kref_put(&file->f_kref);
+	return ret;
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -2722,6 +2772,7 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
 	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
 	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_sendfile] = {(syscall_t)sys_sendfile, "sendfile"},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
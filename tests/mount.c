@@ -24,15 +24,17 @@ int main(int argc, char *argv[])
 			break;
 			case 'c': flag |= 4;
 			break;
+			case 'C': flag |= 0x10;
+			break;
 			default: 
-				printf("-a or -b and/or -c for now\n");
+				printf("-a or -b and/or -c and/or -C for now\n");
 				exit(-1);
 		}
 		argc--, argv++;
 	}
 
 	if (argc < 2) {
-		fprintf(stderr, "usage: mount [-a|-b|-c] channel onto_path\n");
+		fprintf(stderr, "usage: mount [-a|-b|-c|-C] channel onto_path\n");
 		exit(-1);
 	}
 	fd = open(argv[0], O_RDWR);
@@ -0,0 +1,141 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * sys_sendfile() test.  Writes a patterned file, sendfiles it (in a few
+ * pieces, from an odd offset) over a loopback TCP connection, and checks that
+ * the other side got exactly those bytes and that the offsets moved.  Also
+ * checks that in_fds without a page map are rejected with EINVAL. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/common.h>
+#include <iplib/iplib.h>
+
+#define FILE_SZ		(256 * 1024 + 123)
+#define START_OFF	1000
+
+static char *test_file = "/dir1/sendfile_test";
+static char sent_buf[FILE_SZ];
+static char recv_buf[FILE_SZ];
+
+struct sink {
+	char adir[40];
+	long received;
+};
+
+static void *sink_thread(void *arg)
+{
+	struct sink *sink = arg;
+	char ldir[40];
+	int lcfd, dfd, ret;
+
+	sink->received = -1;
+	lcfd = listen9(sink->adir, ldir, 0);
+	if (lcfd < 0)
+		return 0;
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0) {
+		close(lcfd);
+		return 0;
+	}
+	sink->received = 0;
+	while (sink->received < sizeof(recv_buf)) {
+		ret = read(dfd, recv_buf + sink->received,
+		           sizeof(recv_buf) - sink->received);
+		if (ret <= 0)
+			break;
+		sink->received += ret;
+	}
+	close(dfd);
+	close(lcfd);
+	return 0;
+}
+
+static void fail(char *msg)
+{
+	printf("sendfile: FAILED, %s (%s)\n", msg, errstr());
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sink sink;
+	pthread_t sink_pth;
+	char dir[40];
+	int file_fd, dir_fd, afd, dfd, cfd;
+	int64_t off;
+	long amt, ret, expected = FILE_SZ - START_OFF;
+
+	if (argc > 1)
+		test_file = argv[1];
+	for (int i = 0; i < FILE_SZ; i++)
+		sent_buf[i] = i % 251;
+	file_fd = open(test_file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (file_fd < 0)
+		fail("couldn't create the test file");
+	if (write(file_fd, sent_buf, FILE_SZ) != FILE_SZ)
+		fail("couldn't write the test file");
+
+	afd = announce9("tcp!127.0.0.1!5002", sink.adir, 0);
+	if (afd < 0)
+		fail("announce");
+	pthread_create(&sink_pth, NULL, sink_thread, &sink);
+	dfd = dial9("tcp!127.0.0.1!5002", NULL, dir, &cfd, 0);
+	if (dfd < 0)
+		fail("dial");
+
+	/* Neither a directory nor a 9ns chan has a page map */
+	dir_fd = open("/dir1", O_RDONLY);
+	if (dir_fd >= 0) {
+		off = 0;
+		if (sys_sendfile(dfd, dir_fd, &off, 10) != -1 || errno != EINVAL)
+			fail("sendfile from a directory should be EINVAL");
+		close(dir_fd);
+	}
+	off = 0;
+	if (sys_sendfile(dfd, afd, &off, 10) != -1 || errno != EINVAL)
+		fail("sendfile from a chan should be EINVAL");
+
+	/* First piece with an explicit offset, the rest from the file position */
+	off = START_OFF;
+	ret = sys_sendfile(dfd, file_fd, &off, 4096 + 17);
+	if (ret <= 0)
+		fail("sendfile with an offset");
+	if (off != START_OFF + ret)
+		fail("sendfile didn't advance the offset");
+	if (lseek(file_fd, off, SEEK_SET) != off)
+		fail("lseek");
+	amt = ret;
+	while (amt < expected) {
+		ret = sys_sendfile(dfd, file_fd, NULL, expected);
+		if (ret <= 0)
+			break;
+		amt += ret;
+	}
+	if (amt != expected)
+		fail("short sendfile");
+	if (lseek(file_fd, 0, SEEK_CUR) != FILE_SZ)
+		fail("sendfile didn't advance the file position");
+	if (sys_sendfile(dfd, file_fd, NULL, 100) != 0)
+		fail("sendfile at EOF should send nothing");
+
+	close(dfd);
+	close(cfd);
+	pthread_join(sink_pth, NULL);
+	close(afd);
+	close(file_fd);
+	unlink(test_file);
+
+	if (sink.received != expected)
+		fail("the receiver got the wrong amount");
+	if (memcmp(recv_buf, sent_buf + START_OFF, expected))
+		fail("the receiver got the wrong bytes");
+	printf("sendfile: passed, %ld bytes\n", expected);
+	return 0;
+}
@@ -114,6 +114,7 @@ static struct trace_set fd_trace_set = { "fd",
 	 SYS_fwstat,
 	 SYS_dup_fds_to,
 	 SYS_tap_fds,
+	 SYS_sendfile,
 	 SYS_abort_sysc_fd,
 	 0}
 };
@@ -156,6 +157,7 @@ static struct trace_set file_trace_set = { "file",
 	 SYS_fwstat,
 	 SYS_dup_fds_to,
 	 SYS_tap_fds,
+	 SYS_sendfile,
 	 SYS_abort_sysc_fd,
 	 0}
 };
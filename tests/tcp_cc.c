@@ -0,0 +1,249 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * TCP congestion control test/benchmark.  Makes the loopback interface look
+ * like a slow, lossy path (delay, rate and loss on its ipifc ctl), then pushes
+ * a stream over 127.0.0.1 with each algorithm in turn.  Checks that the
+ * algorithm took (from the conv's status) and that every byte arrived, and
+ * prints the goodput.
+ *
+ * e.g. tcp_cc -d 10000 -r 100 -l 200 cubic bbr */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <parlib/common.h>
+#include <iplib/iplib.h>
+#include <parlib/tsc-compat.h>
+
+static char *default_ccs[] = {"reno", "cubic", "bbr"};
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-d delay_usec] [-r rate_mbps] [-l loss_every_n]\n"
+	        "\t[-s size_mb] [-p port] [-i ipifc] [cc ...]\n", prog);
+	exit(-1);
+}
+
+static int write_ctl(char *path, char *msg)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, msg, strlen(msg));
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+/* Returns the number of the ipifc with 127.0.0.1 on it, or -1. */
+static int find_loopback_ifc(void)
+{
+	char path[64], buf[1024];
+	int fd, ret;
+
+	for (int i = 0; i < 32; i++) {
+		snprintf(path, sizeof(path), "/net/ipifc/%d/status", i);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		ret = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (ret <= 0)
+			continue;
+		buf[ret] = 0;
+		if (strstr(buf, "127.0.0.1"))
+			return i;
+	}
+	return -1;
+}
+
+static int set_link(int ifc, char *knob, unsigned long val)
+{
+	char path[64], msg[64];
+
+	snprintf(path, sizeof(path), "/net/ipifc/%d/ctl", ifc);
+	snprintf(msg, sizeof(msg), "%s %lu", knob, val);
+	return write_ctl(path, msg);
+}
+
+struct sink {
+	char adir[40];
+	long received;
+};
+
+/* Accepts one connection on the announced conv and reads until EOF. */
+static void *sink_thread(void *arg)
+{
+	struct sink *sink = arg;
+	char ldir[40];
+	static char buf[64 * 1024];
+	int lcfd, dfd, ret;
+
+	sink->received = -1;
+	lcfd = listen9(sink->adir, ldir, 0);
+	if (lcfd < 0)
+		return 0;
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0) {
+		close(lcfd);
+		return 0;
+	}
+	sink->received = 0;
+	while ((ret = read(dfd, buf, sizeof(buf))) > 0)
+		sink->received += ret;
+	close(dfd);
+	close(lcfd);
+	return 0;
+}
+
+/* Returns TRUE if the conv in dir is running congestion control cc. */
+static bool conv_uses_cc(char *dir, char *cc)
+{
+	char path[64], buf[512], want[32];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/status", dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return FALSE;
+	buf[ret] = 0;
+	snprintf(want, sizeof(want), "cc %s\n", cc);
+	return strstr(buf, want) != NULL;
+}
+
+/* Sends size bytes over loopback with cc.  Returns 0 on success. */
+static int run_one(char *cc, int port, long size)
+{
+	struct sink sink;
+	pthread_t sink_pth;
+	char addr[64], dir[40], msg[32];
+	static char buf[64 * 1024];
+	int afd, dfd, cfd, ret;
+	long sent = 0;
+	uint64_t start, usec;
+	bool cc_ok;
+
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%d", port);
+	afd = announce9(addr, sink.adir, 0);
+	if (afd < 0) {
+		perror("announce");
+		return -1;
+	}
+	pthread_create(&sink_pth, NULL, sink_thread, &sink);
+	dfd = dial9(addr, NULL, dir, &cfd, 0);
+	if (dfd < 0) {
+		perror("dial");
+		close(afd);
+		return -1;
+	}
+	/* The sender's algorithm is the one that matters */
+	snprintf(msg, sizeof(msg), "cc %s", cc);
+	if (write(cfd, msg, strlen(msg)) < 0) {
+		perror(msg);
+		close(dfd);
+		close(cfd);
+		close(afd);
+		return -1;
+	}
+	cc_ok = conv_uses_cc(dir, cc);
+	start = read_tsc();
+	while (sent < size) {
+		ret = write(dfd, buf, size - sent < sizeof(buf) ? size - sent
+		                                               : sizeof(buf));
+		if (ret <= 0)
+			break;
+		sent += ret;
+	}
+	close(dfd);
+	close(cfd);
+	pthread_join(sink_pth, NULL);
+	usec = tsc2usec(read_tsc() - start);
+	close(afd);
+
+	printf("%-6s sent %ld received %ld in %lu ms, %lu Mbps\n", cc, sent,
+	       sink.received, usec / 1000, usec ? sent * 8 / usec : 0);
+	if (!cc_ok) {
+		printf("%s: FAILED, conv status doesn't show cc %s\n", cc, cc);
+		return -1;
+	}
+	if (sent != size || sink.received != size) {
+		printf("%s: FAILED, short transfer\n", cc);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long delay = 0, rate = 0, loss = 0;
+	long size = 16;
+	int port = 5001, ifc = -1, c, nr_ccs, failed = 0;
+	char **ccs;
+
+	while ((c = getopt(argc, argv, "d:r:l:s:p:i:")) != -1) {
+		switch (c) {
+		case 'd':
+			delay = strtoul(optarg, 0, 0);
+			break;
+		case 'r':
+			rate = strtoul(optarg, 0, 0);
+			break;
+		case 'l':
+			loss = strtoul(optarg, 0, 0);
+			break;
+		case 's':
+			size = strtol(optarg, 0, 0);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'i':
+			ifc = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc) {
+		ccs = &argv[optind];
+		nr_ccs = argc - optind;
+	} else {
+		ccs = default_ccs;
+		nr_ccs = COUNT_OF(default_ccs);
+	}
+	if (ifc < 0)
+		ifc = find_loopback_ifc();
+	if (ifc < 0) {
+		fprintf(stderr, "No loopback ipifc, try -i\n");
+		exit(-1);
+	}
+	if (set_link(ifc, "delay", delay) || set_link(ifc, "rate", rate) ||
+	    set_link(ifc, "loss", loss)) {
+		perror("Setting up the loopback link");
+		exit(-1);
+	}
+	printf("ipifc %d: delay %lu usec, rate %lu Mbps, loss 1/%lu, %ld MB\n",
+	       ifc, delay, rate, loss, size);
+	for (int i = 0; i < nr_ccs; i++)
+		failed += run_one(ccs[i], port + i, size << 20) ? 1 : 0;
+	set_link(ifc, "delay", 0);
+	set_link(ifc, "rate", 0);
+	set_link(ifc, "loss", 0);
+	if (failed) {
+		printf("%d of %d FAILED\n", failed, nr_ccs);
+		exit(-1);
+	}
+	printf("All passed\n");
+	return 0;
+}
@@ -57,6 +57,7 @@ int         sys_poke_ksched(int pid, unsigned int res_type);
 int         sys_abort_sysc(struct syscall *sysc);
 int         sys_abort_sysc_fd(int fd);
 int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
+ssize_t     sys_sendfile(int out_fd, int in_fd, int64_t *off, size_t count);
 
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
 void        syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
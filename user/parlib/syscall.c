@@ -178,6 +178,11 @@ int sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs)
 	return ros_syscall(SYS_tap_fds, tap_reqs, nr_reqs, 0, 0, 0, 0);
 }
 
+ssize_t sys_sendfile(int out_fd, int in_fd, int64_t *off, size_t count)
+{
+	return ros_syscall(SYS_sendfile, out_fd, in_fd, off, count, 0, 0);
+}
+
 void syscall_async(struct syscall *sysc, unsigned long num, ...)
 {
 	va_list args;
@@ -474,29 +474,22 @@ static uint16_t ones_comp(uint16_t x)
  * sensible nhgets() (just byte accesses, not assuming u16 alignment).
  *
  * See RFC 1624 for the math.  I opted for Eqn 3, instead of 4, since I didn't
- * want to deal with subtraction underflow / carry / etc.  Also note that we
- * need to do the intermediate carry before doing the one's comp.  That wasn't
- * clear from the RFC either.  RFC 1141 didn't need to do that, since they
- * didn't complement the intermediate HC (xsum). */
+ * want to deal with subtraction underflow / carry / etc.  Eqn 3 works on the
+ * whole change at once, HC' = ~(~HC + sum(~m) + sum(m')), so we only need to
+ * fold the carries and complement once at the end, not per short. */
 static void xsum_update(struct iovec *iov, int iovcnt, size_t xsum_off,
                         uint8_t *old, uint8_t *new, size_t amt)
 {
 	uint32_t xsum;
 
 	assert(amt % 2 == 0);
-	xsum = iov_get_be16(iov, iovcnt, xsum_off);
-	/* for each short: HC' = ~(~HC + ~m + m') (' == new, ~ == ones-comp) */
-	for (int i = 0; i < amt / 2; i++, old += 2, new += 2) {
-		xsum = ones_comp(xsum) + ones_comp(nhgets(old)) + nhgets(new);
-		/* Need to deal with the carry for any additions, before the outer ~()
-		 * operation.  (Not mentioned in the RFC, determined manually...) */
-		while (xsum >> 16)
-			xsum = (xsum & 0xffff) + (xsum >> 16);
-		/* Yes, next time around the loop we ones comp right back.  Not worth
-		 * optimizing. */
-		xsum = ones_comp(xsum);
-	}
-	iov_put_be16(iov, iovcnt, xsum_off, xsum);
+	xsum = ones_comp(iov_get_be16(iov, iovcnt, xsum_off));
+	/* amt is a handful of bytes (addrs and ports), so this can't overflow */
+	for (int i = 0; i < amt / 2; i++, old += 2, new += 2)
+		xsum += ones_comp(nhgets(old)) + nhgets(new);
+	while (xsum >> 16)
+		xsum = (xsum & 0xffff) + (xsum >> 16);
+	iov_put_be16(iov, iovcnt, xsum_off, ones_comp(xsum));
 }
 
 static void snoop_on_virtio(void)